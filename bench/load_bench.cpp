@@ -0,0 +1,94 @@
+// Measures how fast MapWav()'s loader threads deinterleave a file, build its
+// LUTs and compress it, in MB of WAV data per second, for 1 to 16 threads.
+//
+// The file is read once before timing, so it comes from the OS's file cache
+// and the numbers show the CPU side. Loading should go up with the number of
+// threads until it runs out of cores, and from a cold cache until the disk
+// can't keep up. Its peak file is removed before each run, so every run builds
+// the LUTs rather than reading them from there.
+
+// Project headers
+#include "block_store.h"
+#include "sample_kernels.h"
+#include "sound.h"
+#include "../tests/test_utils.h"
+#include "df_lib_plus_plus/threading.h"
+
+// Contrib headers
+#include "df_time.h"
+
+// Standard headers
+#include <stdio.h>
+
+
+static char const *WAV_FILENAME = "load_bench.wav";
+static char const *PEAKS_FILENAME = "load_bench.wav.peaks";
+static int64_t const NUM_GROUPS = 128 * 1024 * 1024;   // 512 MB of 16 bit stereo
+static int const NUM_RUNS = 3;
+
+
+// Returns the seconds from opening the file to every block being loaded, or
+// a negative number if it couldn't be opened.
+static double TimeLoad(int numThreads)
+{
+    remove(PEAKS_FILENAME);
+
+    double startTime = GetRealTime();
+    Sound *sound = new Sound;
+    if (!sound->MapWav(WAV_FILENAME, numThreads))
+    {
+        delete sound;
+        return -1.0;
+    }
+
+    // What SoundWidget::Advance() does while a file loads.
+    while (sound->IsLoading())
+    {
+        if (!g_blockStore.EnforceBudget())
+            SleepMillisec(1);
+    }
+
+    double seconds = GetRealTime() - startTime;
+    delete sound;
+    return seconds;
+}
+
+
+int main()
+{
+    SampleKernelsInit();
+
+    printf("Writing %s\n", WAV_FILENAME);
+    if (!WriteTestToneWavFile(WAV_FILENAME, NUM_GROUPS) || TimeLoad(0) < 0.0)
+    {
+        printf("Couldn't write or open %s\n", WAV_FILENAME);
+        remove(WAV_FILENAME);
+        return 1;
+    }
+
+    double const numMegabytes = NUM_GROUPS * 2 * sizeof(int16_t) / (1024.0 * 1024.0);
+    printf("%.0f MB, best of %d runs, %d cores\n", numMegabytes, NUM_RUNS, GetNumCores());
+    printf("%8s %10s %10s\n", "threads", "seconds", "MB/s");
+
+    int const threadCounts[] = { 1, 2, 4, 8, 16 };
+    int const numThreadCounts = sizeof(threadCounts) / sizeof(threadCounts[0]);
+    bool ok = true;
+    for (int i = 0; i < numThreadCounts; i++)
+    {
+        double best = -1.0;
+        for (int j = 0; j < NUM_RUNS; j++)
+        {
+            double seconds = TimeLoad(threadCounts[i]);
+            if (best < 0.0 || (seconds >= 0.0 && seconds < best))
+                best = seconds;
+        }
+
+        ok = ok && best > 0.0;
+        printf("%8d %10.2f %10.1f\n", threadCounts[i], best, numMegabytes / best);
+    }
+
+    remove(WAV_FILENAME);
+    remove(PEAKS_FILENAME);
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,95 @@
+// Times opening a two hour file with MapWav() until the whole waveform has
+// been drawn, and until every block has loaded. It opens the file cold,
+// without a peak file, and then warm, with the peak file the cold open wrote.
+// The warm open should draw the waveform straight away, while the cold open
+// has to wait for the loader to get through the whole file.
+//
+// Both opens find the WAV in the OS's file cache, because it has just been
+// written, so the difference is down to the peak file alone.
+
+// Project headers
+#include "block_store.h"
+#include "display_cache.h"
+#include "sample_kernels.h"
+#include "sound.h"
+#include "../tests/test_utils.h"
+
+// Contrib headers
+#include "df_time.h"
+
+// Standard headers
+#include <stdio.h>
+
+
+static char const *WAV_FILENAME = "peak_file_bench.wav";
+static char const *PEAKS_FILENAME = "peak_file_bench.wav.peaks";
+static int const SAMPLE_RATE = 44100;
+static int64_t const NUM_GROUPS = (int64_t)SAMPLE_RATE * 60 * 60 * 2;
+static unsigned const NUM_COLUMNS = 1920;
+
+
+// Does what SoundWidget::Advance() does each frame while a file loads, and
+// returns false if the file couldn't be opened.
+static bool TimeOpen(double *drawnSeconds, double *loadedSeconds)
+{
+    double startTime = GetRealTime();
+    Sound *sound = new Sound;
+    if (!sound->MapWav(WAV_FILENAME))
+    {
+        delete sound;
+        return false;
+    }
+
+    DisplayCache cache;
+    double samplesPerColumn = (double)sound->GetLength() / NUM_COLUMNS;
+    *drawnSeconds = -1.0;
+    while (*drawnSeconds < 0.0 || sound->IsLoading())
+    {
+        if (*drawnSeconds < 0.0 && cache.Update(sound, 0, NUM_COLUMNS, samplesPerColumn))
+            *drawnSeconds = GetRealTime() - startTime;
+
+        if (!g_blockStore.EnforceBudget())
+            SleepMillisec(1);
+    }
+
+    *loadedSeconds = GetRealTime() - startTime;
+
+    // Only now does a cold open's peak file get its final name.
+    delete sound;
+    return true;
+}
+
+
+int main()
+{
+    SampleKernelsInit();
+
+    printf("Writing %s\n", WAV_FILENAME);
+    remove(PEAKS_FILENAME);
+    double coldDrawn, coldLoaded;
+    if (!WriteTestToneWavFile(WAV_FILENAME, NUM_GROUPS, SAMPLE_RATE) || !TimeOpen(&coldDrawn, &coldLoaded))
+    {
+        printf("Couldn't write or open %s\n", WAV_FILENAME);
+        remove(WAV_FILENAME);
+        remove(PEAKS_FILENAME);
+        return 1;
+    }
+
+    double warmDrawn, warmLoaded;
+    bool ok = TimeOpen(&warmDrawn, &warmLoaded);
+
+    printf("Two hours of stereo, a full view of %u columns\n", NUM_COLUMNS);
+    printf("%6s %12s %12s\n", "open", "drawn ms", "loaded ms");
+    printf("%6s %12.1f %12.1f\n", "cold", coldDrawn * 1000.0, coldLoaded * 1000.0);
+    printf("%6s %12.1f %12.1f\n", "warm", warmDrawn * 1000.0, warmLoaded * 1000.0);
+
+    remove(WAV_FILENAME);
+    remove(PEAKS_FILENAME);
+
+    // A warm open that doesn't draw much faster than a cold one means the
+    // peak file was rejected or not used.
+    ok = ok && warmDrawn * 10.0 < coldDrawn;
+    if (!ok)
+        printf("The warm open wasn't at least 10 times faster to draw\n");
+    return ok ? 0 : 1;
+}
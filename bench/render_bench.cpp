@@ -0,0 +1,113 @@
+// Times drawing a whole file's waveform, for files from a minute to ten hours
+// long. The min/max pyramid and the block directory's summaries should keep
+// the time per frame about the same whatever the length.
+//
+// The long Sounds are made by copying and pasting the first minute, so the
+// blocks are shared and ten hours fits in the memory of one minute.
+
+// Project headers
+#include "display_cache.h"
+#include "sample_kernels.h"
+#include "sound.h"
+#include "sound_channel.h"
+#include "../tests/test_utils.h"
+
+// Contrib headers
+#include "df_time.h"
+
+// Standard headers
+#include <math.h>
+#include <stdio.h>
+
+
+static int const SAMPLE_RATE = 44100;
+static unsigned const NUM_COLUMNS = 1920;
+static int const NUM_FRAMES = 50;
+
+
+static Sound *MakeMinute()
+{
+    int64_t const numGroups = SAMPLE_RATE * 60;
+    int16_t *samples = new int16_t[numGroups * 2];
+    TestRandom random(1);
+    for (int64_t i = 0; i < numGroups; i++)
+    {
+        double tone = 12000.0 * sin(i * 0.003);
+        samples[i * 2] = (int16_t)(tone + random.Below(2000));
+        samples[i * 2 + 1] = random.Sample();
+    }
+
+    Sound *sound = MakeTestSound(samples, 2, numGroups, SAMPLE_RATE);
+    delete[] samples;
+    return sound;
+}
+
+
+// Pastes copies of the start of the Sound onto its end until it is
+// numGroups long.
+static void Extend(Sound *sound, int64_t numGroups)
+{
+    while (sound->GetLength() < numGroups)
+    {
+        int64_t len = sound->GetLength();
+        int64_t numToCopy = numGroups - len < len ? numGroups - len : len;
+        sound->Insert(len, sound->Copy(0, numToCopy - 1));
+    }
+
+    while (sound->UpdateDirtyLuts())
+        ;
+}
+
+
+// Returns the milliseconds per frame.
+static double TimeFullView(Sound *sound)
+{
+    DisplayCache cache;
+    double samplesPerColumn = (double)sound->GetLength() / NUM_COLUMNS;
+
+    double startTime = GetRealTime();
+    for (int i = 0; i < NUM_FRAMES; i++)
+    {
+        // Clearing makes every frame calculate every column, as the first
+        // frame after opening a file or changing the zoom does.
+        cache.Clear();
+        cache.Update(sound, 0, NUM_COLUMNS, samplesPerColumn);
+    }
+
+    return (GetRealTime() - startTime) * 1000.0 / NUM_FRAMES;
+}
+
+
+int main()
+{
+    SampleKernelsInit();
+
+    int const lengthsInMinutes[] = { 1, 10, 60, 180, 600 };
+    int const numLengths = sizeof(lengthsInMinutes) / sizeof(lengthsInMinutes[0]);
+
+    printf("Full view of %u columns, %d frames per length\n", NUM_COLUMNS, NUM_FRAMES);
+    printf("%10s %10s %12s\n", "length", "blocks", "ms/frame");
+
+    Sound *sound = MakeMinute();
+    double firstMs = 0.0;
+    double lastMs = 0.0;
+    for (int i = 0; i < numLengths; i++)
+    {
+        Extend(sound, (int64_t)lengthsInMinutes[i] * 60 * SAMPLE_RATE);
+        double ms = TimeFullView(sound);
+        printf("%8d m %10d %12.3f\n", lengthsInMinutes[i], sound->m_channels[0]->m_blocks.Size(), ms);
+
+        if (i == 0)
+            firstMs = ms;
+        lastMs = ms;
+    }
+
+    delete sound;
+
+    double ratio = lastMs / firstMs;
+    printf("%d minutes takes %.2f times as long as 1 minute\n", lengthsInMinutes[numLengths - 1], ratio);
+
+    // Flat is what matters. Timings wander, so allow some slack before
+    // calling it a failure.
+    return ratio < 4.0 ? 0 : 1;
+}
@@ -0,0 +1,159 @@
+// Times undo and redo of edits to a 2 GB file, first with the history in
+// memory and then read back from the journal. Undoing a step swaps back the
+// blocks the edit replaced, so it should take about the same time however
+// long the file is and however much the edit covered.
+//
+// The file is opened with MapWav(), the same as the GUI does, and written
+// to the current folder first. It and its peak file are removed at the end.
+
+// Project headers
+#include "block_store.h"
+#include "sample_kernels.h"
+#include "sound.h"
+#include "undo_history.h"
+#include "../tests/test_utils.h"
+
+// Contrib headers
+#include "df_time.h"
+
+// Standard headers
+#include <stdio.h>
+
+
+static char const *WAV_FILENAME = "undo_bench.wav";
+static char const *PEAKS_FILENAME = "undo_bench.wav.peaks";
+static int const SAMPLE_RATE = 44100;
+static int64_t const NUM_GROUPS = 512 * 1024 * 1024 - 1000;    // Just under 2 GB of 16 bit stereo
+static double const MAX_IN_MEMORY_MS = 100.0;
+
+enum
+{
+    EDIT_DELETE_SECOND,
+    EDIT_PASTE_10_SECONDS,
+    EDIT_FADE_IN_10_SECONDS,
+    EDIT_NORMALIZE_MINUTE,
+    EDIT_DELETE_HOUR,
+    NUM_EDITS
+};
+
+static char const *EDIT_NAMES[NUM_EDITS] =
+{
+    "delete 1 s",
+    "paste 10 s",
+    "fade in 10 s",
+    "normalize 1 min",
+    "delete 1 h"
+};
+
+
+// A tone with a little noise on it, so that the blocks compress about as
+// well as music does.
+// Does what SoundWidget::Advance() does while a file loads.
+static void WaitForLoad(Sound *sound)
+{
+    while (sound->IsLoading())
+    {
+        if (!g_blockStore.EnforceBudget())
+            SleepMillisec(20);
+    }
+
+    while (g_blockStore.EnforceBudget())
+        ;
+}
+
+
+static void DoEdit(Sound *sound, int edit)
+{
+    int64_t const second = SAMPLE_RATE;
+    int64_t mid = sound->GetLength() / 2;
+    switch (edit)
+    {
+    case EDIT_DELETE_SECOND:      sound->Delete(mid, mid + second - 1); break;
+    case EDIT_PASTE_10_SECONDS:   sound->Insert(mid, sound->Copy(0, second * 10 - 1)); break;
+    case EDIT_FADE_IN_10_SECONDS: sound->FadeIn(mid, mid + second * 10 - 1); break;
+    case EDIT_NORMALIZE_MINUTE:   sound->Normalize(mid, mid + second * 60 - 1); break;
+    case EDIT_DELETE_HOUR:        sound->Delete(mid, mid + second * 3600 - 1); break;
+    }
+}
+
+
+int main()
+{
+    SampleKernelsInit();
+
+    printf("Writing %s\n", WAV_FILENAME);
+    double startTime = GetRealTime();
+    if (!WriteTestToneWavFile(WAV_FILENAME, NUM_GROUPS, SAMPLE_RATE))
+    {
+        printf("Couldn't write %s\n", WAV_FILENAME);
+        remove(WAV_FILENAME);
+        return 1;
+    }
+    printf("Took %.1f s\n", GetRealTime() - startTime);
+
+    startTime = GetRealTime();
+    Sound *sound = new Sound;
+    if (!sound->MapWav(WAV_FILENAME))
+    {
+        printf("Couldn't open %s\n", WAV_FILENAME);
+        delete sound;
+        remove(WAV_FILENAME);
+        return 1;
+    }
+    WaitForLoad(sound);
+    printf("Loading took %.1f s\n\n", GetRealTime() - startTime);
+
+    // Enough for the history to hold every block the edits replace, even
+    // the hour that is deleted.
+    sound->m_undoHistory->SetMemoryBudget((size_t)NUM_GROUPS * 2 * sizeof(int16_t));
+
+    bool ok = true;
+    printf("In memory\n");
+    printf("%16s %10s %10s %10s\n", "edit", "edit ms", "undo ms", "redo ms");
+    for (int i = 0; i < NUM_EDITS; i++)
+    {
+        double t0 = GetRealTime();
+        DoEdit(sound, i);
+        double t1 = GetRealTime();
+        bool undone = sound->Undo();
+        double t2 = GetRealTime();
+        bool redone = sound->Redo();
+        double t3 = GetRealTime();
+
+        double undoMs = (t2 - t1) * 1000.0;
+        double redoMs = (t3 - t2) * 1000.0;
+        printf("%16s %10.2f %10.2f %10.2f\n", EDIT_NAMES[i], (t1 - t0) * 1000.0, undoMs, redoMs);
+        ok = ok && undone && redone && undoMs < MAX_IN_MEMORY_MS && redoMs < MAX_IN_MEMORY_MS;
+    }
+
+    printf("\nHistory holds %.1f MB\n", sound->m_undoHistory->GetMemoryUsed() / (1024.0 * 1024.0));
+    double t0 = GetRealTime();
+    sound->m_undoHistory->SetMemoryBudget(0);
+    printf("Moving it all to the journal took %.2f ms\n\n", (GetRealTime() - t0) * 1000.0);
+
+    // Undone newest first, the order they come off the journal.
+    printf("From the journal\n");
+    printf("%16s %10s\n", "edit", "undo ms");
+    for (int i = NUM_EDITS - 1; i >= 0; i--)
+    {
+        t0 = GetRealTime();
+        ok = sound->Undo() && ok;
+        printf("%16s %10.2f\n", EDIT_NAMES[i], (GetRealTime() - t0) * 1000.0);
+    }
+
+    printf("%16s %10s\n", "edit", "redo ms");
+    for (int i = 0; i < NUM_EDITS; i++)
+    {
+        t0 = GetRealTime();
+        ok = sound->Redo() && ok;
+        printf("%16s %10.2f\n", EDIT_NAMES[i], (GetRealTime() - t0) * 1000.0);
+    }
+
+    delete sound;
+    remove(WAV_FILENAME);
+    remove(PEAKS_FILENAME);
+
+    if (!ok)
+        printf("\nAn in-memory undo or redo took %.0f ms or more, or failed\n", MAX_IN_MEMORY_MS);
+    return ok ? 0 : 1;
+}
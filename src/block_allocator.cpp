@@ -0,0 +1,175 @@
+// Own header
+#include "block_allocator.h"
+
+// Project headers
+#include "sample_block.h"
+#include "df_lib_plus_plus/mutex.h"
+
+// Contrib headers
+#include "df_common.h"
+
+// Standard headers
+#include <stdlib.h>
+#include <string.h>
+
+
+BlockAllocator g_blockAllocator(SampleBlock::GetSamplesStorageSize(sizeof(int16_t)));
+BlockAllocator g_wideBlockAllocator(SampleBlock::GetSamplesStorageSize(sizeof(int32_t)));
+BlockAllocator g_lutAllocator(SampleBlock::LUT_STORAGE_SIZE);
+
+
+// ****************************************************************************
+// Private Functions
+// ****************************************************************************
+
+void BlockAllocator::AddSlab()
+{
+    size_t const itemSize = m_itemSize;
+
+    Slab slab;
+    slab.m_mem = malloc(itemSize * ITEMS_PER_SLAB + ALIGNMENT - 1);
+    ReleaseAssert(slab.m_mem, "Ran out of memory for sample blocks");
+    slab.m_items = (char *)(((uintptr_t)slab.m_mem + ALIGNMENT - 1) & ~(uintptr_t)(ALIGNMENT - 1));
+    slab.m_numItemsInUse = 0;
+
+    // Keep m_slabs in address order for FindSlab().
+    unsigned idx = m_slabs.Push(slab);
+    for (; idx > 0 && m_slabs[idx - 1].m_items > slab.m_items; idx--)
+        m_slabs[idx] = m_slabs[idx - 1];
+    m_slabs[idx] = slab;
+
+    // Push them in reverse, so that they get used in address order.
+    for (int i = ITEMS_PER_SLAB - 1; i >= 0; i--)
+    {
+        FreeItem *item = (FreeItem *)(slab.m_items + i * itemSize);
+        item->m_next = m_freeList;
+        m_freeList = item;
+    }
+}
+
+
+// Returns the index of the slab that item came from. A binary search for the
+// last slab that starts at or before item.
+int BlockAllocator::FindSlab(void *item)
+{
+    int lo = 0;
+    int hi = m_slabs.Size();
+    while (hi - lo > 1)
+    {
+        int mid = (lo + hi) / 2;
+        if (m_slabs[mid].m_items <= (char *)item)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    size_t const slabSize = m_itemSize * ITEMS_PER_SLAB;
+    char *items = m_slabs.Size() ? m_slabs[lo].m_items : NULL;
+    ReleaseAssert(items && (char *)item >= items && (char *)item < items + slabSize,
+        "Freed a sample block that BlockAllocator didn't allocate");
+    return lo;
+}
+
+
+// ****************************************************************************
+// Public Functions
+// ****************************************************************************
+
+BlockAllocator::BlockAllocator(size_t itemSize)
+{
+    m_itemSize = itemSize;
+    m_mutex = new Mutex;
+    m_freeList = NULL;
+    m_numItemsInUse = 0;
+    m_highWaterMark = 0;
+}
+
+
+void *BlockAllocator::Alloc()
+{
+    MutexLocker lock(m_mutex);
+
+    if (!m_freeList)
+        AddSlab();
+
+    FreeItem *item = m_freeList;
+    m_freeList = item->m_next;
+    m_slabs[FindSlab(item)].m_numItemsInUse++;
+
+    m_numItemsInUse++;
+    if (m_numItemsInUse > m_highWaterMark)
+        m_highWaterMark = m_numItemsInUse;
+
+    return item;
+}
+
+
+void BlockAllocator::Free(void *item)
+{
+    if (!item)
+        return;
+
+#ifdef _DEBUG
+    // Anything still reading the item after this gets plainly wrong samples.
+    memset(item, FREED_ITEM_FILL, m_itemSize);
+#endif
+
+    MutexLocker lock(m_mutex);
+
+    m_slabs[FindSlab(item)].m_numItemsInUse--;
+    m_numItemsInUse--;
+
+    FreeItem *freeItem = (FreeItem *)item;
+    freeItem->m_next = m_freeList;
+    m_freeList = freeItem;
+}
+
+
+void BlockAllocator::Trim()
+{
+    MutexLocker lock(m_mutex);
+
+    // Take the items in empty slabs off the free list.
+    FreeItem **link = &m_freeList;
+    while (*link)
+    {
+        Slab *slab = &m_slabs[FindSlab(*link)];
+        if (slab->m_numItemsInUse == 0)
+            *link = (*link)->m_next;
+        else
+            link = &(*link)->m_next;
+    }
+
+    // Compact the slabs that are still in use, which keeps them in address
+    // order.
+    unsigned numSlabsInUse = 0;
+    for (unsigned i = 0; i < m_slabs.Size(); i++)
+    {
+        if (m_slabs[i].m_numItemsInUse == 0)
+            free(m_slabs[i].m_mem);
+        else
+            m_slabs[numSlabsInUse++] = m_slabs[i];
+    }
+
+    m_slabs.Resize(numSlabsInUse);
+}
+
+
+void BlockAllocator::GetStats(Stats *stats)
+{
+    MutexLocker lock(m_mutex);
+
+    int numItems = m_slabs.Size() * ITEMS_PER_SLAB;
+    stats->m_numItemsInUse = m_numItemsInUse;
+    stats->m_numItemsFree = numItems - m_numItemsInUse;
+    stats->m_highWaterMark = m_highWaterMark;
+    stats->m_numSlabs = m_slabs.Size();
+    stats->m_fragmentation = numItems ? (float)stats->m_numItemsFree / (float)numItems : 0.0f;
+}
+
+
+BlockAllocator *GetBlockAllocator(unsigned sampleSize)
+{
+    DebugAssert(sampleSize == sizeof(int16_t) || sampleSize == sizeof(int32_t));
+    return sampleSize == sizeof(int16_t) ? &g_blockAllocator : &g_wideBlockAllocator;
+}
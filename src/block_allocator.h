@@ -0,0 +1,79 @@
+#pragma once
+
+// Contrib headers
+#include "containers/darray.h"
+
+// Standard headers
+#include <stddef.h>
+#include <stdint.h>
+
+
+class Mutex;
+
+
+// Hands out the storage for SampleBlocks' samples and LUTs. Every item an
+// allocator hands out is the same size, so freed items go on a free list and
+// are given to the next block that needs one, instead of going back to the
+// heap. Items come from slabs of ITEMS_PER_SLAB, allocated as needed, and are
+// aligned for the SIMD kernels.
+// Slabs are only given back to the heap by Trim().
+//
+// Any thread may call any of the functions.
+class BlockAllocator
+{
+private:
+    struct FreeItem
+    {
+        FreeItem    *m_next;
+    };
+
+    struct Slab
+    {
+        void        *m_mem;         // As returned by malloc()
+        char        *m_items;       // The first item, aligned
+        int         m_numItemsInUse;
+    };
+
+    size_t          m_itemSize;
+    Mutex           *m_mutex;
+    FreeItem        *m_freeList;
+    DArray <Slab>   m_slabs;        // In address order, so that FindSlab() can binary search them
+    int             m_numItemsInUse;
+    int             m_highWaterMark;    // Most items in use at once
+
+    void AddSlab();
+    int FindSlab(void *item);
+
+public:
+    enum { ALIGNMENT = 64 };
+    enum { ITEMS_PER_SLAB = 16 };
+    enum { FREED_ITEM_FILL = 0xdd };    // Debug builds fill freed items with this byte
+
+    struct Stats
+    {
+        int     m_numItemsInUse;
+        int     m_numItemsFree;     // In slabs, waiting to be reused
+        int     m_highWaterMark;
+        int     m_numSlabs;
+        float   m_fragmentation;    // Fraction of the slabs' memory that is free, 0 to 1
+    };
+
+    BlockAllocator(size_t itemSize);
+
+    void *Alloc();
+    void Free(void *item);
+
+    void Trim();    // Gives slabs that have no items in use back to the heap.
+    void GetStats(Stats *stats);
+    size_t GetItemSize() { return m_itemSize; }
+};
+
+
+// The samples of blocks of 16 bit samples come from the first. Those of blocks
+// of 32 bit samples come from the second. The LUTs of every block come from
+// the third, since they stay put when the samples are compressed.
+extern BlockAllocator g_blockAllocator;
+extern BlockAllocator g_wideBlockAllocator;
+extern BlockAllocator g_lutAllocator;
+
+BlockAllocator *GetBlockAllocator(unsigned sampleSize);
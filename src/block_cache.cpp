@@ -0,0 +1,100 @@
+// Own header
+#include "block_cache.h"
+
+// Project headers
+#include "sample_block.h"
+#include "sample_compressor.h"
+
+// Contrib headers
+#include "df_common.h"
+
+
+DecodedBlockCache g_decodedBlockCache;
+
+
+// ****************************************************************************
+// Private Functions
+// ****************************************************************************
+
+void DecodedBlockCache::Unlink(SampleBlock *block)
+{
+    if (block->m_cachePrev)
+        block->m_cachePrev->m_cacheNext = block->m_cacheNext;
+    else
+        m_mostRecent = block->m_cacheNext;
+
+    if (block->m_cacheNext)
+        block->m_cacheNext->m_cachePrev = block->m_cachePrev;
+    else
+        m_leastRecent = block->m_cachePrev;
+
+    block->m_cachePrev = NULL;
+    block->m_cacheNext = NULL;
+    block->m_isInCache = false;
+    m_numBytes -= SampleBlock::GetSamplesStorageSize(block->GetSampleSize());
+    m_numBlocks--;
+}
+
+
+// Frees the least recently used copies, other than keep's, until the total
+// is within budget.
+void DecodedBlockCache::Evict(SampleBlock *keep)
+{
+    while (m_numBytes > m_budget && m_leastRecent && m_leastRecent != keep)
+    {
+        SampleBlock *block = m_leastRecent;
+        Unlink(block);
+        block->FreeSamples();
+    }
+}
+
+
+// ****************************************************************************
+// Public Functions
+// ****************************************************************************
+
+DecodedBlockCache::DecodedBlockCache()
+{
+    m_mostRecent = NULL;
+    m_leastRecent = NULL;
+    m_numBytes = 0;
+    m_budget = DEFAULT_BUDGET;
+    m_numBlocks = 0;
+}
+
+
+void DecodedBlockCache::Fetch(SampleBlock *block)
+{
+    DebugAssert(block->m_compressed);
+
+    MutexLocker lock(&m_mutex);
+    if (block->m_isInCache)
+    {
+        Unlink(block);
+    }
+    else
+    {
+        block->AllocSamples();
+        block->m_compressed->Decode(block->m_samples, 0, block->m_len);
+    }
+
+    block->m_cacheNext = m_mostRecent;
+    if (m_mostRecent)
+        m_mostRecent->m_cachePrev = block;
+    else
+        m_leastRecent = block;
+    m_mostRecent = block;
+    block->m_isInCache = true;
+    m_numBytes += SampleBlock::GetSamplesStorageSize(block->GetSampleSize());
+    m_numBlocks++;
+
+    Evict(block);
+}
+
+
+void DecodedBlockCache::Remove(SampleBlock *block)
+{
+    MutexLocker lock(&m_mutex);
+    if (block->m_isInCache)
+        Unlink(block);
+}
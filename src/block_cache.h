@@ -0,0 +1,47 @@
+#pragma once
+
+// Project headers
+#include "df_lib_plus_plus/mutex.h"
+
+// Standard headers
+#include <stddef.h>
+
+
+struct SampleBlock;
+
+
+// Holds the decoded samples of the compressed blocks that have been used most
+// recently, so that playback and redraws don't decode the same block over and
+// over. A block's copy lives in its m_samples. When the total goes over the
+// budget, the copies of the blocks that were used least recently are freed.
+//
+// Fetch() is only called from the GUI thread, but Remove() is called when a
+// block is deleted, which can happen on any thread.
+class DecodedBlockCache
+{
+private:
+    Mutex           m_mutex;
+    SampleBlock     *m_mostRecent;
+    SampleBlock     *m_leastRecent;
+    size_t          m_numBytes;
+    size_t          m_budget;
+    int             m_numBlocks;
+
+    void Unlink(SampleBlock *block);
+    void Evict(SampleBlock *keep);
+
+public:
+    enum { DEFAULT_BUDGET = 64 * 1024 * 1024 };
+
+    DecodedBlockCache();
+
+    void Fetch(SampleBlock *block);     // Makes sure block->m_samples is valid
+    void Remove(SampleBlock *block);    // Leaves block->m_samples to the caller
+
+    size_t GetBudget() { return m_budget; }
+    size_t GetNumBytes() { return m_numBytes; }
+    int GetNumBlocks() { return m_numBlocks; }
+};
+
+
+extern DecodedBlockCache g_decodedBlockCache;
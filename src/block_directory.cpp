@@ -0,0 +1,720 @@
+// Own header
+#include "block_directory.h"
+
+// Project headers
+#include "sample_block.h"
+
+// Contrib headers
+#include "df_common.h"
+
+// Standard headers
+#include <stdlib.h>
+
+
+// ****************************************************************************
+// Private Functions
+// ****************************************************************************
+
+// Xorshift. Treap priorities only need to be well spread, not high quality.
+static unsigned NextPriority()
+{
+    static unsigned s_state = 2463534242u;
+    s_state ^= s_state << 13;
+    s_state ^= s_state >> 17;
+    s_state ^= s_state << 5;
+    return s_state;
+}
+
+
+BlockDirectory::Node *BlockDirectory::NewNode(SampleBlock *block)
+{
+    Node *node = new Node;
+    node->m_block = block;
+    node->m_left = NULL;
+    node->m_right = NULL;
+    node->m_priority = NextPriority();
+    node->m_refCount = 1;
+    node->m_blockLen = block->m_len;
+    UpdateBlockSummary(node);
+    UpdateTotals(node);
+    return node;
+}
+
+
+// Returns node, or a copy of it if anything else refers to it, so that the
+// caller can change the result. Either way, the caller's reference to node is
+// now its reference to the result.
+BlockDirectory::Node *BlockDirectory::Own(Node *node)
+{
+    if (!node || node->m_refCount == 1)
+        return node;
+
+    Node *copy = new Node(*node);
+    copy->m_refCount = 1;
+    copy->m_block->AddRef();
+    if (copy->m_left)
+        copy->m_left->m_refCount++;
+    if (copy->m_right)
+        copy->m_right->m_refCount++;
+
+    node->m_refCount--;
+    return copy;
+}
+
+
+void BlockDirectory::ReleaseTree(Node *node)
+{
+    if (!node)
+        return;
+
+    node->m_refCount--;
+    if (node->m_refCount > 0)
+        return;
+
+    ReleaseTree(node->m_left);
+    ReleaseTree(node->m_right);
+    node->m_block->Release();
+    delete node;
+}
+
+
+// Doesn't change m_blockLen, which other directories sharing the node might
+// be reading.
+void BlockDirectory::UpdateBlockSummary(Node *node)
+{
+    SampleBlock *block = node->m_block;
+    node->m_blockLoaded = block->IsLoaded();
+    node->m_blockLutsDirty = block->LutsAreDirty();
+    node->m_blockNeedsCompressing = block->NeedsCompressing();
+    node->m_blockMin = INT16_MAX;
+    node->m_blockMax = INT16_MIN;
+    node->m_blockSumSq = 0.0;
+    if (node->m_blockLoaded)
+    {
+        node->m_blockSummaryValid = !node->m_blockLutsDirty;
+        if (node->m_blockSummaryValid)
+            block->CalcMinMax(0, block->m_len, &node->m_blockMin, &node->m_blockMax, &node->m_blockSumSq);
+    }
+    else
+    {
+        node->m_blockSummaryValid = block->CalcMinMaxFromPeaks(0, block->m_len, &node->m_blockMin, &node->m_blockMax,
+                                                               &node->m_blockSumSq);
+    }
+}
+
+
+// Only the summary, not the counts, so it can be used on a shared node.
+void BlockDirectory::UpdateSummaryTotals(Node *node)
+{
+    node->m_min = node->m_blockMin;
+    node->m_max = node->m_blockMax;
+    node->m_sumSq = node->m_blockSumSq;
+    node->m_summaryValid = node->m_blockSummaryValid;
+    node->m_lutsDirty = node->m_blockLutsDirty;
+    node->m_allLoaded = node->m_blockLoaded;
+    node->m_needsCompressing = node->m_blockNeedsCompressing;
+
+    Node *children[2] = { node->m_left, node->m_right };
+    for (int i = 0; i < 2; i++)
+    {
+        Node *child = children[i];
+        if (!child)
+            continue;
+
+        node->m_min = SAMPLE_MIN(node->m_min, child->m_min);
+        node->m_max = SAMPLE_MAX(node->m_max, child->m_max);
+        node->m_sumSq += child->m_sumSq;
+        node->m_summaryValid = node->m_summaryValid && child->m_summaryValid;
+        node->m_lutsDirty = node->m_lutsDirty || child->m_lutsDirty;
+        node->m_allLoaded = node->m_allLoaded && child->m_allLoaded;
+        node->m_needsCompressing = node->m_needsCompressing || child->m_needsCompressing;
+    }
+}
+
+
+void BlockDirectory::UpdateTotals(Node *node)
+{
+    node->m_numBlocks = 1 + NumBlocks(node->m_left) + NumBlocks(node->m_right);
+    node->m_numSamples = node->m_blockLen + NumSamples(node->m_left) + NumSamples(node->m_right);
+    UpdateSummaryTotals(node);
+}
+
+
+// Puts the first idx blocks of the subtree into *left and the rest into *right.
+void BlockDirectory::Split(Node *node, int idx, Node **left, Node **right)
+{
+    if (!node)
+    {
+        *left = NULL;
+        *right = NULL;
+        return;
+    }
+
+    node = Own(node);
+    int numLeftBlocks = NumBlocks(node->m_left);
+    if (idx <= numLeftBlocks)
+    {
+        Split(node->m_left, idx, left, &node->m_left);
+        *right = node;
+    }
+    else
+    {
+        Split(node->m_right, idx - numLeftBlocks - 1, &node->m_right, right);
+        *left = node;
+    }
+
+    UpdateTotals(node);
+}
+
+
+BlockDirectory::Node *BlockDirectory::Concat(Node *left, Node *right)
+{
+    if (!left)
+        return right;
+    if (!right)
+        return left;
+
+    if (left->m_priority > right->m_priority)
+    {
+        left = Own(left);
+        left->m_right = Concat(left->m_right, right);
+        UpdateTotals(left);
+        return left;
+    }
+
+    right = Own(right);
+    right->m_left = Concat(left, right->m_left);
+    UpdateTotals(right);
+    return right;
+}
+
+
+// Returns the node to use in place of node.
+BlockDirectory::Node *BlockDirectory::BlockChanged(Node *node, int idx)
+{
+    node = Own(node);
+
+    int numLeftBlocks = NumBlocks(node->m_left);
+    if (idx < numLeftBlocks)
+    {
+        node->m_left = BlockChanged(node->m_left, idx);
+    }
+    else if (idx > numLeftBlocks)
+    {
+        node->m_right = BlockChanged(node->m_right, idx - numLeftBlocks - 1);
+    }
+    else
+    {
+        node->m_blockLen = node->m_block->m_len;
+        UpdateBlockSummary(node);
+    }
+
+    UpdateTotals(node);
+    return node;
+}
+
+
+// Skips subtrees that were all loaded when they were last summarized.
+void BlockDirectory::ListUnloadedBlocks(Node *node, DArray <SampleBlock *> *blocks)
+{
+    if (!node || node->m_allLoaded)
+        return;
+
+    ListUnloadedBlocks(node->m_left, blocks);
+    if (!node->m_block->IsLoaded())
+        blocks->Push(node->m_block);
+    ListUnloadedBlocks(node->m_right, blocks);
+}
+
+
+// Updates the summaries of any blocks it loads on the way back up.
+bool BlockDirectory::CalcMinMax(Node *node, int64_t nodeStartIdx, int64_t startIdx, int64_t endIdx, int16_t *resultMin, int16_t *resultMax,
+                                double *resultSumSq, int *numBlocksToLoad)
+{
+    if (!node)
+        return true;
+
+    int64_t nodeEndIdx = nodeStartIdx + node->m_numSamples;
+    if (endIdx <= nodeStartIdx || startIdx >= nodeEndIdx)
+        return true;
+
+    if (startIdx <= nodeStartIdx && endIdx >= nodeEndIdx && node->m_summaryValid)
+    {
+        *resultMin = SAMPLE_MIN(*resultMin, node->m_min);
+        *resultMax = SAMPLE_MAX(*resultMax, node->m_max);
+        *resultSumSq += node->m_sumSq;
+        return true;
+    }
+
+    bool complete = CalcMinMax(node->m_left, nodeStartIdx, startIdx, endIdx, resultMin, resultMax, resultSumSq, numBlocksToLoad);
+
+    int64_t blockStartIdx = nodeStartIdx + NumSamples(node->m_left);
+    int64_t blockEndIdx = blockStartIdx + node->m_blockLen;
+    if (startIdx <= blockStartIdx && endIdx >= blockEndIdx && node->m_blockSummaryValid)
+    {
+        *resultMin = SAMPLE_MIN(*resultMin, node->m_blockMin);
+        *resultMax = SAMPLE_MAX(*resultMax, node->m_blockMax);
+        *resultSumSq += node->m_blockSumSq;
+    }
+    else if (endIdx > blockStartIdx && startIdx < blockEndIdx)
+    {
+        SampleBlock *block = node->m_block;
+        unsigned first = SAMPLE_MAX(startIdx, blockStartIdx) - blockStartIdx;
+        unsigned last = SAMPLE_MIN(endIdx, blockEndIdx) - blockStartIdx;
+        // For wide ranges, the peak file is good enough until a loader thread
+        // gets to the block.
+        bool isWide = endIdx - startIdx >= SampleBlock::MIN_ROUGH_RANGE;
+        if (block->IsLoaded() || !isWide || !block->CalcMinMaxFromPeaks(first, last, resultMin, resultMax, resultSumSq))
+        {
+            if (!block->IsLoaded() && *numBlocksToLoad > 0)
+            {
+                (*numBlocksToLoad)--;
+                block->Load();
+            }
+
+            if (block->IsLoaded() && !node->m_blockLoaded)
+                UpdateBlockSummary(node);
+
+            if (block->IsLoaded())
+                block->CalcMinMax(first, last, resultMin, resultMax, resultSumSq);
+            else
+                complete = false;
+        }
+    }
+
+    if (!CalcMinMax(node->m_right, blockEndIdx, startIdx, endIdx, resultMin, resultMax, resultSumSq, numBlocksToLoad))
+        complete = false;
+
+    UpdateSummaryTotals(node);
+    return complete;
+}
+
+
+// Returns the first column in [firstColumn, endColumn) that ends after
+// sampleIdx, or endColumn if there isn't one.
+static unsigned FindColumnEndingAfter(int64_t const *columnStarts, unsigned firstColumn, unsigned endColumn, int64_t sampleIdx)
+{
+    while (firstColumn < endColumn)
+    {
+        unsigned mid = firstColumn + (endColumn - firstColumn) / 2;
+        if (columnStarts[mid + 1] > sampleIdx)
+            endColumn = mid;
+        else
+            firstColumn = mid + 1;
+    }
+
+    return firstColumn;
+}
+
+
+// Returns the first column in [firstColumn, endColumn) that starts at or after
+// sampleIdx, or endColumn if there isn't one.
+static unsigned FindColumnStartingFrom(int64_t const *columnStarts, unsigned firstColumn, unsigned endColumn, int64_t sampleIdx)
+{
+    while (firstColumn < endColumn)
+    {
+        unsigned mid = firstColumn + (endColumn - firstColumn) / 2;
+        if (columnStarts[mid] >= sampleIdx)
+            endColumn = mid;
+        else
+            firstColumn = mid + 1;
+    }
+
+    return firstColumn;
+}
+
+
+// Columns [firstColumn, endColumn) are the ones that overlap the subtree.
+// Makes the same choices as CalcMinMax() for each column, except that it
+// gives up on columns that need blocks loading or samples decoding.
+void BlockDirectory::CalcColumnMinMaxes(Node const *node, int64_t nodeStartIdx, int64_t const *columnStarts, unsigned firstColumn,
+                                        unsigned endColumn, int16_t *mins, int16_t *maxes, double *sumSqs, bool *isComplete)
+{
+    if (!node || firstColumn >= endColumn)
+        return;
+
+    int64_t nodeEndIdx = nodeStartIdx + node->m_numSamples;
+    if (endColumn - firstColumn == 1 && node->m_summaryValid &&
+        columnStarts[firstColumn] <= nodeStartIdx && columnStarts[firstColumn + 1] >= nodeEndIdx)
+    {
+        mins[firstColumn] = SAMPLE_MIN(mins[firstColumn], node->m_min);
+        maxes[firstColumn] = SAMPLE_MAX(maxes[firstColumn], node->m_max);
+        sumSqs[firstColumn] += node->m_sumSq;
+        return;
+    }
+
+    int64_t blockStartIdx = nodeStartIdx + NumSamples(node->m_left);
+    int64_t blockEndIdx = blockStartIdx + node->m_blockLen;
+
+    unsigned leftEndColumn = FindColumnStartingFrom(columnStarts, firstColumn, endColumn, blockStartIdx);
+    CalcColumnMinMaxes(node->m_left, nodeStartIdx, columnStarts, firstColumn, leftEndColumn, mins, maxes, sumSqs, isComplete);
+
+    unsigned blockFirstColumn = FindColumnEndingAfter(columnStarts, firstColumn, endColumn, blockStartIdx);
+    unsigned blockEndColumn = FindColumnStartingFrom(columnStarts, blockFirstColumn, endColumn, blockEndIdx);
+    SampleBlock *block = node->m_block;
+    for (unsigned i = blockFirstColumn; i < blockEndColumn; i++)
+    {
+        int64_t startIdx = columnStarts[i];
+        int64_t endIdx = columnStarts[i + 1];
+        if (startIdx == endIdx)
+            continue;
+
+        if (startIdx <= blockStartIdx && endIdx >= blockEndIdx && node->m_blockSummaryValid)
+        {
+            mins[i] = SAMPLE_MIN(mins[i], node->m_blockMin);
+            maxes[i] = SAMPLE_MAX(maxes[i], node->m_blockMax);
+            sumSqs[i] += node->m_blockSumSq;
+            continue;
+        }
+
+        unsigned first = SAMPLE_MAX(startIdx, blockStartIdx) - blockStartIdx;
+        unsigned last = SAMPLE_MIN(endIdx, blockEndIdx) - blockStartIdx;
+        bool isWide = endIdx - startIdx >= SampleBlock::MIN_ROUGH_RANGE;
+        if (block->IsLoaded())
+        {
+            if (!block->TryCalcMinMax(first, last, mins + i, maxes + i, sumSqs + i))
+                isComplete[i] = false;
+        }
+        else if (!isWide || !block->CalcMinMaxFromPeaks(first, last, mins + i, maxes + i, sumSqs + i))
+            isComplete[i] = false;
+    }
+
+    unsigned rightFirstColumn = FindColumnEndingAfter(columnStarts, blockFirstColumn, endColumn, blockEndIdx);
+    CalcColumnMinMaxes(node->m_right, blockEndIdx, columnStarts, rightFirstColumn, endColumn, mins, maxes, sumSqs, isComplete);
+}
+
+
+BlockDirectory::Node *BlockDirectory::FindNode(int idx)
+{
+    DebugAssert(idx >= 0 && idx < Size());
+
+    Node *node = m_root;
+    while (1)
+    {
+        int numLeftBlocks = NumBlocks(node->m_left);
+        if (idx < numLeftBlocks)
+        {
+            node = node->m_left;
+        }
+        else if (idx > numLeftBlocks)
+        {
+            idx -= numLeftBlocks + 1;
+            node = node->m_right;
+        }
+        else
+        {
+            return node;
+        }
+    }
+}
+
+
+// The same, but copies any shared nodes on the way, so that the node and the
+// path to it can be changed.
+BlockDirectory::Node *BlockDirectory::FindOwnedNode(int idx)
+{
+    DebugAssert(idx >= 0 && idx < Size());
+
+    m_root = Own(m_root);
+    Node *node = m_root;
+    while (1)
+    {
+        int numLeftBlocks = NumBlocks(node->m_left);
+        if (idx < numLeftBlocks)
+        {
+            node->m_left = Own(node->m_left);
+            node = node->m_left;
+        }
+        else if (idx > numLeftBlocks)
+        {
+            idx -= numLeftBlocks + 1;
+            node->m_right = Own(node->m_right);
+            node = node->m_right;
+        }
+        else
+        {
+            return node;
+        }
+    }
+}
+
+
+// ****************************************************************************
+// Public Functions
+// ****************************************************************************
+
+BlockDirectory::BlockDirectory()
+{
+    m_root = NULL;
+}
+
+
+BlockDirectory::~BlockDirectory()
+{
+    ReleaseTree(m_root);
+}
+
+
+int64_t BlockDirectory::GetStartIdx(int idx)
+{
+    DebugAssert(idx >= 0 && idx < Size());
+
+    int64_t startIdx = 0;
+    Node *node = m_root;
+    while (1)
+    {
+        int numLeftBlocks = NumBlocks(node->m_left);
+        if (idx < numLeftBlocks)
+        {
+            node = node->m_left;
+        }
+        else
+        {
+            startIdx += NumSamples(node->m_left);
+            if (idx == numLeftBlocks)
+                return startIdx;
+
+            startIdx += node->m_blockLen;
+            idx -= numLeftBlocks + 1;
+            node = node->m_right;
+        }
+    }
+}
+
+
+int BlockDirectory::FindBlock(int64_t sampleIdx, int64_t *blockStartIdx)
+{
+    if (sampleIdx < 0 || sampleIdx >= GetLength())
+    {
+        *blockStartIdx = GetLength();
+        return Size();
+    }
+
+    int idx = 0;
+    int64_t startIdx = 0;
+    Node *node = m_root;
+    while (1)
+    {
+        int64_t numLeftSamples = NumSamples(node->m_left);
+        if (sampleIdx < startIdx + numLeftSamples)
+        {
+            node = node->m_left;
+            continue;
+        }
+
+        idx += NumBlocks(node->m_left);
+        startIdx += numLeftSamples;
+        if (sampleIdx < startIdx + node->m_blockLen)
+        {
+            *blockStartIdx = startIdx;
+            return idx;
+        }
+
+        idx++;
+        startIdx += node->m_blockLen;
+        node = node->m_right;
+    }
+}
+
+
+int BlockDirectory::FindFirstDirtyBlock()
+{
+    if (!m_root || !m_root->m_lutsDirty)
+        return Size();
+
+    int idx = 0;
+    Node *node = m_root;
+    while (1)
+    {
+        if (node->m_left && node->m_left->m_lutsDirty)
+        {
+            node = node->m_left;
+            continue;
+        }
+
+        idx += NumBlocks(node->m_left);
+        if (node->m_blockLutsDirty)
+            return idx;
+
+        idx++;
+        node = node->m_right;
+    }
+}
+
+
+int BlockDirectory::FindFirstUnloadedBlock()
+{
+    while (m_root && !m_root->m_allLoaded)
+    {
+        int idx = 0;
+        Node *node = m_root;
+        while (1)
+        {
+            if (node->m_left && !node->m_left->m_allLoaded)
+            {
+                node = node->m_left;
+                continue;
+            }
+
+            idx += NumBlocks(node->m_left);
+            if (!node->m_blockLoaded)
+                break;
+
+            idx++;
+            node = node->m_right;
+        }
+
+        if (!node->m_block->IsLoaded())
+            return idx;
+
+        // Another thread loaded it since we last looked.
+        BlockChanged(idx);
+    }
+
+    return Size();
+}
+
+
+int BlockDirectory::FindFirstUncompressedBlock()
+{
+    if (!m_root || !m_root->m_needsCompressing)
+        return Size();
+
+    int idx = 0;
+    Node *node = m_root;
+    while (1)
+    {
+        if (node->m_left && node->m_left->m_needsCompressing)
+        {
+            node = node->m_left;
+            continue;
+        }
+
+        idx += NumBlocks(node->m_left);
+        if (node->m_blockNeedsCompressing)
+            return idx;
+
+        idx++;
+        node = node->m_right;
+    }
+}
+
+
+bool BlockDirectory::CalcMinMax(int64_t startIdx, int64_t endIdx, int16_t *resultMin, int16_t *resultMax, double *resultSumSq, int *numBlocksToLoad)
+{
+    return CalcMinMax(m_root, 0, startIdx, endIdx, resultMin, resultMax, resultSumSq, numBlocksToLoad);
+}
+
+
+void BlockDirectory::CalcColumnMinMaxes(int64_t const *columnStarts, unsigned numColumns, int16_t *mins, int16_t *maxes, double *sumSqs,
+                                        bool *isComplete) const
+{
+    unsigned firstColumn = FindColumnEndingAfter(columnStarts, 0, numColumns, 0);
+    unsigned endColumn = FindColumnStartingFrom(columnStarts, firstColumn, numColumns, GetLength());
+    CalcColumnMinMaxes(m_root, 0, columnStarts, firstColumn, endColumn, mins, maxes, sumSqs, isComplete);
+}
+
+
+// Owning the path first means that a block in a node another directory
+// shares counts as shared, so it gets copied.
+SampleBlock *BlockDirectory::GetWritableBlock(int idx)
+{
+    Node *node = FindOwnedNode(idx);
+    if (!node->m_block->IsLoaded())
+    {
+        // Loading it first means the copy doesn't refer to the source either.
+        node->m_block->Load();
+        BlockChanged(idx);
+    }
+
+    if (node->m_block->IsShared())
+    {
+        // The copy has the same contents, so the summaries are still valid.
+        SampleBlock *copy = node->m_block->Clone();
+        node->m_block->Release();
+        node->m_block = copy;
+    }
+    else
+    {
+        node->m_block->Decompress();
+    }
+
+    return node->m_block;
+}
+
+
+void BlockDirectory::Push(SampleBlock *block)
+{
+    m_root = Concat(m_root, NewNode(block));
+}
+
+
+void BlockDirectory::Insert(int idx, SampleBlock *block)
+{
+    Node *left, *right;
+    Split(m_root, idx, &left, &right);
+    m_root = Concat(Concat(left, NewNode(block)), right);
+}
+
+
+void BlockDirectory::Insert(int idx, BlockDirectory *src)
+{
+    Node *left, *right;
+    Split(m_root, idx, &left, &right);
+    m_root = Concat(Concat(left, src->m_root), right);
+    src->m_root = NULL;
+}
+
+
+void BlockDirectory::Remove(int idx, int numBlocks)
+{
+    Node *left, *middle, *right;
+    Split(m_root, idx, &left, &right);
+    Split(right, numBlocks, &middle, &right);
+    ReleaseTree(middle);
+    m_root = Concat(left, right);
+}
+
+
+void BlockDirectory::Extract(int idx, int numBlocks, BlockDirectory *dst)
+{
+    DebugAssert(dst->m_root == NULL);
+
+    Node *left, *right;
+    Split(m_root, idx, &left, &right);
+    Split(right, numBlocks, &dst->m_root, &right);
+    m_root = Concat(left, right);
+}
+
+
+void BlockDirectory::CopyTo(int idx, int numBlocks, BlockDirectory *dst)
+{
+    for (int i = idx; i < idx + numBlocks; i++)
+    {
+        SampleBlock *block = FindNode(i)->m_block;
+        block->AddRef();
+        dst->Push(block);
+    }
+}
+
+
+void BlockDirectory::Share(BlockDirectory *dst)
+{
+    DebugAssert(dst->m_root == NULL);
+    if (m_root)
+        m_root->m_refCount++;
+    dst->m_root = m_root;
+}
+
+
+void BlockDirectory::BlockChanged(int idx)
+{
+    DebugAssert(idx >= 0 && idx < Size());
+    m_root = BlockChanged(m_root, idx);
+}
+
+
+void BlockDirectory::ListUnloadedBlocks(DArray <SampleBlock *> *blocks)
+{
+    ListUnloadedBlocks(m_root, blocks);
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+// Contrib headers
+#include "containers/darray.h"
+
+// Standard headers
+#include <stdint.h>
+
+
+struct SampleBlock;
+
+
+// The ordered list of blocks that make up a SoundChannel, stored as a rope.
+// It is a treap ordered by position, where each node holds one block and
+// each node's totals describe its whole subtree: block count, sample count,
+// min/max and sum of squares. That makes these O(log n) however many blocks there are:
+//  * Finding a block by block index or sample index.
+//  * Inserting or removing any number of contiguous blocks.
+//  * Moving all the blocks of another BlockDirectory in.
+//  * Calculating the min/max and sum of squares of any range of samples.
+//    Nodes that are entirely inside the range use their subtree totals, so
+//    zoomed out views don't touch the blocks at all.
+//
+// Blocks that haven't been loaded from their SampleSource have no summary,
+// unless the source has a peak file. CalcMinMax() loads a limited number of
+// the others per call, so that the first frame of a big file can be drawn
+// without loading the whole thing. Blocks can also be loaded by another
+// thread, in which case their summaries are brought up to date the next time
+// CalcMinMax() or FindFirstUnloadedBlock() comes across them.
+//
+// CalcColumnMinMaxes() does the same job for a whole row of display columns
+// in one walk of the tree. It doesn't load or decode anything, or update any
+// summaries, so several threads can run it on the same directory at once, as
+// long as nothing changes the directory meanwhile.
+//
+// The directory holds a reference to each of its blocks. Blocks may be shared
+// with other directories, so anything that wants to change a block's length or
+// samples must get it from GetWritableBlock(), and call BlockChanged()
+// afterwards.
+//
+// The tree is persistent. Share() makes a copy of a directory in O(1) by
+// sharing its root, and each node counts the parents and directories that
+// refer to it. Anything that changes the shape of the tree, or a block, copies
+// the shared nodes on the path to what it changes first, so the other
+// directories never see the change. Those are O(log n) copies. A node's
+// summary describes the same blocks whoever else shares it, so
+// CalcMinMax() brings summaries up to date in place. Threads
+// that read a shared copy while the directory changes must only look at the
+// blocks and the counts. Only one thread may create or delete directories
+// that share nodes, because the node counts aren't atomic.
+class BlockDirectory
+{
+private:
+    struct Node
+    {
+        SampleBlock *m_block;
+        Node        *m_left;
+        Node        *m_right;
+        unsigned    m_priority;     // Parents have higher priority than their children
+        int         m_refCount;     // Parents and directories that refer to this node
+
+        unsigned    m_blockLen;     // Copy of m_block->m_len
+        int16_t     m_blockMin;     // \  Summary of m_block. Only valid
+        int16_t     m_blockMax;     //  > if m_blockSummaryValid.
+        double      m_blockSumSq;   // /
+        bool        m_blockSummaryValid;    // False while the block's LUTs are dirty or it isn't loaded
+        bool        m_blockLutsDirty;
+        bool        m_blockLoaded;
+        bool        m_blockNeedsCompressing;
+
+        // Totals for the subtree rooted at this node
+        int         m_numBlocks;
+        int64_t     m_numSamples;
+        int16_t     m_min;
+        int16_t     m_max;
+        double      m_sumSq;
+        bool        m_summaryValid; // False if any block in the subtree has no valid summary
+        bool        m_lutsDirty;    // True if any block in the subtree has dirty LUTs
+        bool        m_allLoaded;    // False if any block in the subtree wasn't loaded when last summarized
+        bool        m_needsCompressing; // True if any block in the subtree needed compressing when last summarized
+    };
+
+    Node *m_root;
+
+    static int NumBlocks(Node *node) { return node ? node->m_numBlocks : 0; }
+    static int64_t NumSamples(Node *node) { return node ? node->m_numSamples : 0; }
+
+    static Node *NewNode(SampleBlock *block);
+    static Node *Own(Node *node);
+    static void ReleaseTree(Node *node);
+    static void UpdateBlockSummary(Node *node);
+    static void UpdateSummaryTotals(Node *node);
+    static void UpdateTotals(Node *node);
+    static void Split(Node *node, int idx, Node **left, Node **right);
+    static Node *Concat(Node *left, Node *right);
+    static Node *BlockChanged(Node *node, int idx);
+    static void ListUnloadedBlocks(Node *node, DArray <SampleBlock *> *blocks);
+    static bool CalcMinMax(Node *node, int64_t nodeStartIdx, int64_t startIdx, int64_t endIdx, int16_t *resultMin, int16_t *resultMax,
+                           double *resultSumSq, int *numBlocksToLoad);
+    static void CalcColumnMinMaxes(Node const *node, int64_t nodeStartIdx, int64_t const *columnStarts, unsigned firstColumn,
+                                   unsigned endColumn, int16_t *mins, int16_t *maxes, double *sumSqs, bool *isComplete);
+
+    Node *FindNode(int idx);
+    Node *FindOwnedNode(int idx);
+
+public:
+    BlockDirectory();
+    ~BlockDirectory();
+
+    int Size() const { return NumBlocks(m_root); }
+    SampleBlock *operator[] (int idx) { return FindNode(idx)->m_block; }
+    SampleBlock *GetWritableBlock(int idx);   // Loads the block and replaces it with a private, uncompressed copy if it is shared.
+                                              // Otherwise decompresses it.
+    int64_t GetStartIdx(int idx);
+    int64_t GetLength() const { return NumSamples(m_root); }
+
+    // Returns the index of the block that contains sampleIdx and sets
+    // *blockStartIdx to the index of that block's first sample. Returns Size()
+    // if sampleIdx is outside the channel.
+    int FindBlock(int64_t sampleIdx, int64_t *blockStartIdx);
+
+    // Returns the index of the first block with dirty LUTs, or Size() if there
+    // isn't one.
+    int FindFirstDirtyBlock();
+
+    // Returns the index of the first block that hasn't been loaded yet, or
+    // Size() if they all have.
+    int FindFirstUnloadedBlock();
+
+    // Returns the index of the first block that needed compressing when it was
+    // last summarized, or Size() if there isn't one.
+    int FindFirstUncompressedBlock();
+
+    // Combines the min and max of samples startIdx to endIdx-1 with the values
+    // already in *resultMin and *resultMax, and adds the sum of their squares
+    // to *resultSumSq. Loads at most *numBlocksToLoad blocks, and decrements
+    // it for each one. Returns false if it had to skip blocks that weren't
+    // loaded.
+    bool CalcMinMax(int64_t startIdx, int64_t endIdx, int16_t *resultMin, int16_t *resultMax, double *resultSumSq, int *numBlocksToLoad);
+
+    // Column i covers samples columnStarts[i] to columnStarts[i + 1] - 1.
+    // Combines the min and max of each of numColumns columns with the values
+    // already in mins and maxes, and adds to sumSqs, as CalcMinMax() would.
+    // Sets isComplete[i] to false if column i needs blocks loading or samples
+    // decoding.
+    void CalcColumnMinMaxes(int64_t const *columnStarts, unsigned numColumns, int16_t *mins, int16_t *maxes, double *sumSqs,
+                            bool *isComplete) const;
+
+    // These take over the caller's reference to the block.
+    void Push(SampleBlock *block);
+    void Insert(int idx, SampleBlock *block);
+    void Insert(int idx, BlockDirectory *src);  // Moves all of src's blocks in, leaving src empty.
+    void Remove(int idx, int numBlocks);        // Releases the blocks.
+    void Extract(int idx, int numBlocks, BlockDirectory *dst);  // Moves the blocks into dst, which must be empty.
+    void CopyTo(int idx, int numBlocks, BlockDirectory *dst);   // Appends the blocks to dst, sharing them.
+    void Share(BlockDirectory *dst);    // Makes dst, which must be empty, a copy in O(1).
+    void BlockChanged(int idx);
+    void ListUnloadedBlocks(DArray <SampleBlock *> *blocks);    // Appends the blocks that haven't been loaded yet.
+};
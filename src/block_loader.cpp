@@ -0,0 +1,118 @@
+// Own header
+#include "block_loader.h"
+
+// Project headers
+#include "block_store.h"
+#include "sample_block.h"
+#include "df_lib_plus_plus/threading.h"
+
+// Contrib headers
+#include "df_time.h"
+
+
+// ****************************************************************************
+// Private Functions
+// ****************************************************************************
+
+unsigned long __stdcall BlockLoader::ThreadProc(void *data)
+{
+    BlockLoader *loader = (BlockLoader *)data;
+    loader->Run();
+    loader->Release();
+    return 0;
+}
+
+
+void BlockLoader::Run()
+{
+    while (1)
+    {
+        unsigned i = m_nextBlockIdx++;
+        if (i >= m_blocks.Size())
+            break;
+
+        // Give the GUI thread a chance to page blocks out, rather than run
+        // through the budget.
+        while (!m_cancelled && g_blockStore.IsOverBudget())
+            SleepMillisec(1);
+
+        // Keep going after a cancel, to release the rest of the blocks.
+        if (!m_cancelled)
+            m_blocks[i]->Load();
+        m_blocks[i]->Release();
+        m_numBlocksDone++;
+    }
+}
+
+
+// ****************************************************************************
+// Public Functions
+// ****************************************************************************
+
+BlockLoader::BlockLoader()
+{
+    m_nextBlockIdx = 0;
+    m_numBlocksDone = 0;
+    m_cancelled = false;
+    m_refCount = 1;
+}
+
+
+BlockLoader::~BlockLoader()
+{
+    // Only does anything if Start() was never called.
+    for (unsigned i = m_nextBlockIdx; i < m_blocks.Size(); i++)
+        m_blocks[i]->Release();
+}
+
+
+void BlockLoader::AddBlock(SampleBlock *block)
+{
+    block->AddRef();
+    m_blocks.Push(block);
+}
+
+
+void BlockLoader::Start(int numThreads)
+{
+    // Leave a core for the GUI thread.
+    if (numThreads <= 0)
+        numThreads = GetNumCores() - 1;
+    if (numThreads < 1)
+        numThreads = 1;
+    if (numThreads > (int)m_blocks.Size())
+        numThreads = m_blocks.Size();
+
+    int numThreadsStarted = 0;
+    for (int i = 0; i < numThreads; i++)
+    {
+        AddRef();
+        if (!StartThread(ThreadProc, this))
+        {
+            Release();
+            break;
+        }
+        numThreadsStarted++;
+    }
+
+    if (numThreadsStarted == 0)
+    {
+        // Leave the blocks to be loaded when they are needed.
+        m_cancelled = true;
+        Run();
+    }
+}
+
+
+void BlockLoader::Cancel()
+{
+    m_cancelled = true;
+}
+
+
+float BlockLoader::GetProgress()
+{
+    if (m_blocks.Size() == 0)
+        return 1.0f;
+    return (float)m_numBlocksDone / (float)m_blocks.Size();
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+// Project headers
+#include "df_lib_plus_plus/threading.h"
+
+// Contrib headers
+#include "containers/darray.h"
+
+// Standard headers
+#include <atomic>
+
+
+struct SampleBlock;
+
+
+// Loads a list of blocks, roughly in order, on a pool of worker threads. Used
+// after mapping a file, so that the whole file ends up loaded without the GUI
+// thread having to wait for it. Each worker takes the next block in the list
+// and deinterleaves it and builds its LUTs, so loading uses every core but
+// one. Workers wait while g_blockStore is over budget. The GUI thread loads
+// the blocks it needs straight away, so they are skipped when a worker gets
+// to them.
+//
+// Each worker thread holds a reference to the loader, and the loader holds a
+// reference to each block no worker has finished with. That means the owner
+// can Cancel() and Release() it at any time, without waiting for the threads
+// to finish.
+class BlockLoader
+{
+private:
+    DArray <SampleBlock *> m_blocks;
+    std::atomic<int> m_nextBlockIdx;    // The next block for a worker to take
+    std::atomic<int> m_numBlocksDone;
+    std::atomic<bool> m_cancelled;
+    std::atomic<int> m_refCount;
+
+    static unsigned long __stdcall ThreadProc(void *data);
+    void Run();
+
+public:
+    BlockLoader();
+    ~BlockLoader();
+
+    void AddRef() { m_refCount++; }
+    void Release() { if (--m_refCount == 0) delete this; }
+
+    void AddBlock(SampleBlock *block);  // Call before Start()
+    void Start(int numThreads = 0);     // 0 for one per core but one
+    void Cancel();
+
+    bool IsFinished() { return m_numBlocksDone == (int)m_blocks.Size(); }
+    float GetProgress();    // 0 to 1
+};
@@ -0,0 +1,417 @@
+// Own header
+#include "block_store.h"
+
+// Project headers
+#include "block_cache.h"
+#include "sample_block.h"
+#include "sample_compressor.h"
+#include "df_lib_plus_plus/threading.h"
+
+// Contrib headers
+#include "df_common.h"
+#include "df_time.h"
+
+// Standard headers
+#include <memory.h>
+
+
+BlockStore g_blockStore;
+
+
+// ****************************************************************************
+// Private Functions
+// ****************************************************************************
+
+// Adds the block just behind the clock hand, so it is the last to be looked at.
+void BlockStore::Link(SampleBlock *block)
+{
+    if (m_clockHand)
+    {
+        block->m_storeNext = m_clockHand;
+        block->m_storePrev = m_clockHand->m_storePrev;
+        block->m_storePrev->m_storeNext = block;
+        m_clockHand->m_storePrev = block;
+    }
+    else
+    {
+        block->m_storeNext = block;
+        block->m_storePrev = block;
+        m_clockHand = block;
+    }
+
+    block->m_isInStore = true;
+    block->m_storeBytes = block->GetPayloadSize();
+    m_stats.m_numResidentBytes += block->m_storeBytes;
+    m_stats.m_numResidentBlocks++;
+}
+
+
+void BlockStore::Unlink(SampleBlock *block)
+{
+    if (block->m_storeNext == block)
+    {
+        m_clockHand = NULL;
+    }
+    else
+    {
+        if (m_clockHand == block)
+            m_clockHand = block->m_storeNext;
+        block->m_storePrev->m_storeNext = block->m_storeNext;
+        block->m_storeNext->m_storePrev = block->m_storePrev;
+    }
+
+    block->m_storePrev = NULL;
+    block->m_storeNext = NULL;
+    block->m_isInStore = false;
+    m_stats.m_numResidentBytes -= block->m_storeBytes;
+    m_stats.m_numResidentBlocks--;
+}
+
+
+// Extents are a whole number of EXTENT_UNITs, and freed ones are only reused
+// for payloads that round up to the same size.
+int64_t BlockStore::AllocExtent(unsigned numBytes)
+{
+    unsigned numUnits = (numBytes + EXTENT_UNIT - 1) / EXTENT_UNIT;
+    DebugAssert(numUnits <= MAX_EXTENT_UNITS);
+
+    if (m_freeExtents[numUnits].Size() > 0)
+        return m_freeExtents[numUnits].Pop();
+
+    int64_t offset = m_stats.m_fileSize;
+    m_stats.m_fileSize += numUnits * EXTENT_UNIT;
+    return offset;
+}
+
+
+void BlockStore::FreeExtent(SampleBlock *block)
+{
+    if (block->m_pageOffset < 0)
+        return;
+
+    unsigned numUnits = (block->m_pageSize + EXTENT_UNIT - 1) / EXTENT_UNIT;
+    m_freeExtents[numUnits].Push(block->m_pageOffset);
+    block->m_pageOffset = -1;
+}
+
+
+void BlockStore::Seek(int64_t offset)
+{
+    if (!m_file)
+    {
+        m_file = tmpfile();
+        ReleaseAssert(m_file, "Couldn't create the block scratch file");
+    }
+
+#ifdef _MSC_VER
+    _fseeki64(m_file, offset, SEEK_SET);
+#else
+    fseeko(m_file, offset, SEEK_SET);
+#endif
+}
+
+
+// Returns the number of bytes it had to write to the file.
+size_t BlockStore::PageOut(SampleBlock *block)
+{
+    // The decoded copy would just be evicted later.
+    if (block->m_compressed)
+    {
+        g_decodedBlockCache.Remove(block);
+        if (block->m_samples)
+            block->FreeSamples();
+    }
+
+    size_t numBytesWritten = 0;
+    if (block->m_pageOffset < 0)
+    {
+        void const *payload;
+        if (block->m_compressed)
+        {
+            payload = block->m_compressed->GetData();
+            block->m_pageSize = block->m_compressed->GetNumBytes();
+        }
+        else
+        {
+            payload = block->m_samples;
+            block->m_pageSize = block->m_len * block->GetSampleSize();
+        }
+
+        block->m_pageOffset = AllocExtent(block->m_pageSize);
+        block->m_pageIsCompressed = block->m_compressed != NULL;
+        Seek(block->m_pageOffset);
+        fwrite(payload, 1, block->m_pageSize, m_file);
+        ReleaseAssert(!ferror(m_file), "Couldn't write the block scratch file");
+        numBytesWritten = block->m_pageSize;
+        m_stats.m_numPageOutBytes += numBytesWritten;
+    }
+
+    if (block->m_compressed)
+    {
+        delete block->m_compressed;
+        block->m_compressed = NULL;
+    }
+    else
+    {
+        block->FreeSamples();
+    }
+
+    Unlink(block);
+    block->m_isPagedOut = true;
+    m_stats.m_numPageOuts++;
+    m_stats.m_numPagedOutBlocks++;
+    return numBytesWritten;
+}
+
+
+// Returns false if another thread paged the block in first.
+bool BlockStore::DoPageIn(SampleBlock *block)
+{
+    if (!block->m_isPagedOut)
+        return false;
+
+    bool ok;
+    Seek(block->m_pageOffset);
+    if (block->m_pageIsCompressed)
+    {
+        uint8_t *data = new uint8_t [block->m_pageSize];
+        ok = fread(data, 1, block->m_pageSize, m_file) == block->m_pageSize;
+        block->m_compressed = CompressedSamples::FromData(block->m_sampleType, block->m_len, data, block->m_pageSize);
+    }
+    else
+    {
+        block->AllocSamples();
+        ok = fread(block->m_samples, 1, block->m_pageSize, m_file) == block->m_pageSize;
+    }
+
+    ReleaseAssert(ok, "Couldn't read the block scratch file");
+
+    Link(block);
+    block->m_recentlyUsed = true;
+    block->m_isPagedOut = false;
+    m_stats.m_numPageInBytes += block->m_pageSize;
+    m_stats.m_numPagedOutBlocks--;
+    return true;
+}
+
+
+unsigned long __stdcall BlockStore::PrefetchThreadProc(void *data)
+{
+    BlockStore *store = (BlockStore *)data;
+    store->RunPrefetchThread();
+    return 0;
+}
+
+
+void BlockStore::RunPrefetchThread()
+{
+    while (!m_stopPrefetchThread)
+    {
+        SampleBlock *block = NULL;
+        {
+            MutexLocker lock(&m_mutex);
+            if (m_prefetchQueue.Size() > 0)
+            {
+                block = m_prefetchQueue.Pop();
+                if (DoPageIn(block))
+                    m_stats.m_numPrefetches++;
+            }
+        }
+
+        // Outside the lock, since it might delete the block.
+        if (block)
+            block->Release();
+        else
+            SleepMillisec(5);
+    }
+
+    m_prefetchThreadRunning = false;
+}
+
+
+// ****************************************************************************
+// Public Functions
+// ****************************************************************************
+
+BlockStore::BlockStore()
+{
+    m_clockHand = NULL;
+    m_budget = (int64_t)DEFAULT_BUDGET_MB * 1024 * 1024;
+    m_file = NULL;
+    memset(&m_stats, 0, sizeof(m_stats));
+    m_prefetchThreadStarted = false;
+    m_prefetchThreadRunning = false;
+    m_stopPrefetchThread = false;
+}
+
+
+BlockStore::~BlockStore()
+{
+    m_stopPrefetchThread = true;
+    while (m_prefetchThreadRunning)
+        SleepMillisec(1);
+
+    if (m_file)
+        fclose(m_file);
+}
+
+
+void BlockStore::AddBlock(SampleBlock *block)
+{
+    MutexLocker lock(&m_mutex);
+    Link(block);
+}
+
+
+void BlockStore::RemoveBlock(SampleBlock *block)
+{
+    MutexLocker lock(&m_mutex);
+    if (block->m_isInStore)
+        Unlink(block);
+    if (block->m_isPagedOut)
+        m_stats.m_numPagedOutBlocks--;
+    FreeExtent(block);
+}
+
+
+void BlockStore::BlockChanged(SampleBlock *block)
+{
+    MutexLocker lock(&m_mutex);
+    FreeExtent(block);
+    if (block->m_isInStore)
+    {
+        m_stats.m_numResidentBytes -= block->m_storeBytes;
+        block->m_storeBytes = block->GetPayloadSize();
+        m_stats.m_numResidentBytes += block->m_storeBytes;
+    }
+}
+
+
+void BlockStore::PageIn(SampleBlock *block)
+{
+    double startTime = GetRealTime();
+
+    MutexLocker lock(&m_mutex);
+    if (!DoPageIn(block))
+        return;
+
+    double stallSeconds = GetRealTime() - startTime;
+    m_stats.m_numPageIns++;
+    m_stats.m_stallSeconds += stallSeconds;
+    if (stallSeconds > m_stats.m_maxStallSeconds)
+        m_stats.m_maxStallSeconds = stallSeconds;
+}
+
+
+bool BlockStore::ReadPagedOut(SampleBlock *block, unsigned startIdx, unsigned len, void *dst)
+{
+    MutexLocker lock(&m_mutex);
+    if (!block->m_isPagedOut)
+        return false;
+
+    bool ok;
+    unsigned sampleSize = block->GetSampleSize();
+    if (block->m_pageIsCompressed)
+    {
+        Seek(block->m_pageOffset);
+        uint8_t *data = new uint8_t [block->m_pageSize];
+        ok = fread(data, 1, block->m_pageSize, m_file) == block->m_pageSize;
+        CompressedSamples *compressed = CompressedSamples::FromData(block->m_sampleType, block->m_len, data, block->m_pageSize);
+        if (ok)
+            compressed->Decode(dst, startIdx, len);
+        delete compressed;
+    }
+    else
+    {
+        Seek(block->m_pageOffset + startIdx * sampleSize);
+        ok = fread(dst, sampleSize, len, m_file) == len;
+    }
+
+    ReleaseAssert(ok, "Couldn't read the block scratch file");
+    m_stats.m_numReadThroughs++;
+    return true;
+}
+
+
+bool BlockStore::EnforceBudget()
+{
+    // Enough to keep up with the loader threads without making the frame
+    // time noticeably worse.
+    size_t const MAX_BYTES_PER_CALL = 32 * 1024 * 1024;
+
+    MutexLocker lock(&m_mutex);
+
+    // Two laps of the clock clear every flag, so after that there is nothing
+    // left that could be paged out.
+    int numBlocksToVisit = m_stats.m_numResidentBlocks * 2;
+    size_t numBytesWritten = 0;
+    bool madeProgress = false;
+    while (m_stats.m_numResidentBytes > m_budget && m_clockHand &&
+           numBlocksToVisit > 0 && numBytesWritten < MAX_BYTES_PER_CALL)
+    {
+        numBlocksToVisit--;
+        SampleBlock *block = m_clockHand;
+        m_clockHand = block->m_storeNext;
+        if (block->m_recentlyUsed.exchange(false))
+            continue;
+        if (!block->IsLoaded())
+            continue;   // Load() adds blocks just before it finishes with them
+        if (block->LutsAreDirty())
+            continue;   // Updating them needs the samples
+
+        numBytesWritten += PageOut(block);
+        madeProgress = true;
+    }
+
+    return madeProgress && m_stats.m_numResidentBytes > m_budget;
+}
+
+
+bool BlockStore::IsOverBudget()
+{
+    MutexLocker lock(&m_mutex);
+    return m_stats.m_numResidentBytes > m_budget;
+}
+
+
+void BlockStore::Prefetch(SampleBlock **blocks, int numBlocks)
+{
+    DArray <SampleBlock *> oldQueue;
+    {
+        MutexLocker lock(&m_mutex);
+        for (unsigned i = 0; i < m_prefetchQueue.Size(); i++)
+            oldQueue.Push(m_prefetchQueue[i]);
+        m_prefetchQueue.Empty();
+
+        for (int i = numBlocks - 1; i >= 0; i--)
+        {
+            blocks[i]->AddRef();
+            m_prefetchQueue.Push(blocks[i]);
+        }
+
+        if (numBlocks > 0 && !m_prefetchThreadStarted)
+        {
+            m_prefetchThreadStarted = true;
+            m_prefetchThreadRunning = true;
+            StartThread(PrefetchThreadProc, this);
+        }
+    }
+
+    // Outside the lock, since releasing might delete them.
+    for (unsigned i = 0; i < oldQueue.Size(); i++)
+        oldQueue[i]->Release();
+}
+
+
+void BlockStore::SetBudget(int64_t numBytes)
+{
+    MutexLocker lock(&m_mutex);
+    m_budget = numBytes;
+}
+
+
+void BlockStore::GetStats(Stats *stats)
+{
+    MutexLocker lock(&m_mutex);
+    *stats = m_stats;
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+// Project headers
+#include "df_lib_plus_plus/mutex.h"
+#include "df_lib_plus_plus/threading.h"
+
+// Contrib headers
+#include "containers/darray.h"
+
+// Standard headers
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+
+
+struct SampleBlock;
+
+
+// Keeps the samples of all the loaded blocks in the process within a memory
+// budget, by paging the coldest out to a scratch file. Only the samples count
+// towards the budget, whether compressed or not. A paged out block keeps its
+// LUTs, so drawing it doesn't page it back in. Its samples come back the next
+// time something asks for them. A block that hasn't changed since it was last
+// paged out keeps its copy in the file, so paging it out again is free.
+//
+// Coldness is tracked with the clock algorithm. Accessing a block sets its
+// m_recentlyUsed flag. EnforceBudget() sweeps round the resident blocks,
+// clearing the flags and paging out blocks that didn't have one.
+//
+// Paging out changes how a block's samples are held, so it has the same rule
+// as compressing: EnforceBudget() must only be called from the GUI thread
+// while no other thread is reading blocks. Paging in is safe from any thread.
+// A prefetch thread pages in the blocks passed to Prefetch(), so that
+// playback doesn't have to wait for the disk.
+class BlockStore
+{
+public:
+    struct Stats
+    {
+        int64_t     m_numResidentBytes;
+        int         m_numResidentBlocks;
+        int         m_numPagedOutBlocks;
+        int64_t     m_fileSize;
+        int64_t     m_numPageOuts;
+        int64_t     m_numPageOutBytes;      // Written to the file. Blocks that already had a copy there write nothing.
+        int64_t     m_numPageIns;           // On demand, so something waited for them
+        int64_t     m_numPrefetches;        // Page ins done by the prefetch thread
+        int64_t     m_numPageInBytes;
+        int64_t     m_numReadThroughs;      // Reads of paged out blocks that didn't page them in
+        double      m_stallSeconds;         // Total time spent waiting for page ins on demand
+        double      m_maxStallSeconds;
+    };
+
+private:
+    enum { EXTENT_UNIT = 16384 };
+    enum { MAX_EXTENT_UNITS = 32 };         // Enough for the uncompressed samples of a block of 32 bit samples
+
+    Mutex           m_mutex;
+    SampleBlock     *m_clockHand;           // The resident blocks form a circular list. NULL if there are none.
+    int64_t         m_budget;
+    FILE            *m_file;
+    DArray <int64_t> m_freeExtents[MAX_EXTENT_UNITS + 1];  // Indexed by size in EXTENT_UNITs
+    Stats           m_stats;
+
+    DArray <SampleBlock *> m_prefetchQueue; // Holds a reference to each block. Most urgent last.
+    bool            m_prefetchThreadStarted;
+    std::atomic<bool> m_prefetchThreadRunning;
+    std::atomic<bool> m_stopPrefetchThread;
+
+    void Link(SampleBlock *block);
+    void Unlink(SampleBlock *block);
+    int64_t AllocExtent(unsigned numBytes);
+    void FreeExtent(SampleBlock *block);
+    void Seek(int64_t offset);
+    size_t PageOut(SampleBlock *block);
+    bool DoPageIn(SampleBlock *block);
+
+    static unsigned long __stdcall PrefetchThreadProc(void *data);
+    void RunPrefetchThread();
+
+public:
+    enum { DEFAULT_BUDGET_MB = 2048 };
+
+    BlockStore();
+    ~BlockStore();
+
+    void AddBlock(SampleBlock *block);      // When the block gets its samples
+    void RemoveBlock(SampleBlock *block);   // From the block's destructor
+    void BlockChanged(SampleBlock *block);  // After its samples changed size, or before they change
+
+    void PageIn(SampleBlock *block);
+
+    // Copies samples [startIdx, startIdx + len) of a paged out block to dst
+    // without paging it in. Returns false if it isn't paged out any more.
+    bool ReadPagedOut(SampleBlock *block, unsigned startIdx, unsigned len, void *dst);
+
+    // Pages out a bounded number of blocks. Returns true if it made progress
+    // but is still over budget.
+    bool EnforceBudget();
+    bool IsOverBudget();
+
+    // Replaces the list of blocks for the prefetch thread to page in. The
+    // first block is the most urgent.
+    void Prefetch(SampleBlock **blocks, int numBlocks);
+
+    void SetBudget(int64_t numBytes);
+    int64_t GetBudget() { return m_budget; }
+    void GetStats(Stats *stats);
+};
+
+
+extern BlockStore g_blockStore;
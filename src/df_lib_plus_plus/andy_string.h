@@ -18,7 +18,13 @@ typedef std::string String;
 
 #else
 
+#include <stddef.h>
+
+#ifdef _MSC_VER
 #define noinl __declspec(noinline)
+#else
+#define noinl __attribute__((noinline))
+#endif
 
 
 class String
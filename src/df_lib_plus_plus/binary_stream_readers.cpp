@@ -28,6 +28,14 @@ BinaryStreamReader::~BinaryStreamReader()
 }
 
 
+uint64_t BinaryStreamReader::ReadU64()
+{
+	uint64_t low = ReadU32();
+	uint64_t high = ReadU32();
+	return (high << 32) | low;
+}
+
+
 
 // ****************************************************************************
 // BinaryFileReader
@@ -122,15 +130,23 @@ unsigned int BinaryFileReader::ReadBytes(unsigned int _count, unsigned char *_bu
 }
 
 
-int BinaryFileReader::Seek(int _offset, int _origin)
+int BinaryFileReader::Seek(int64_t _offset, int _origin)
 {
-	return fseek(m_file, _offset, _origin);
+#ifdef _MSC_VER
+	return _fseeki64(m_file, _offset, _origin);
+#else
+	return fseeko(m_file, _offset, _origin);
+#endif
 }
 
 
-int BinaryFileReader::Tell()
+int64_t BinaryFileReader::Tell()
 {
-	return ftell(m_file);
+#ifdef _MSC_VER
+	return _ftelli64(m_file);
+#else
+	return ftello(m_file);
+#endif
 }
 
 
@@ -138,12 +154,12 @@ int BinaryFileReader::Tell()
 // BinaryDataReader
 // ****************************************************************************
 
-BinaryDataReader::BinaryDataReader(unsigned char const *_data, unsigned int _dataSize, 
+BinaryDataReader::BinaryDataReader(unsigned char const *_data, int64_t _dataSize, 
 								   char const *_filename)
 :	BinaryStreamReader(),
+	m_offset(0),
 	m_data(_data),
-	m_dataSize(_dataSize),
-	m_offset(0)
+	m_dataSize(_dataSize)
 {
 	strncpy(m_filename, _filename, sizeof(m_filename) - 1);
 }
@@ -242,7 +258,7 @@ unsigned int BinaryDataReader::ReadBytes(unsigned int _count, unsigned char *_bu
 }
 
 
-int BinaryDataReader::Seek(int _offset, int _origin)
+int BinaryDataReader::Seek(int64_t _offset, int _origin)
 {
 	switch (_origin)
 	{
@@ -270,7 +286,7 @@ int BinaryDataReader::Seek(int _offset, int _origin)
 }
 
 
-int BinaryDataReader::Tell()
+int64_t BinaryDataReader::Tell()
 {
 	return m_offset;
 }
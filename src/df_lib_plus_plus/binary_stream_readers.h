@@ -22,11 +22,12 @@ public:
 	virtual uint8_t ReadU8() = 0;
 	virtual uint16_t ReadU16() = 0;
 	virtual uint32_t ReadU32() = 0;
+	uint64_t ReadU64();
 
 	virtual unsigned int	ReadBytes(unsigned int _count, unsigned char *_buffer) = 0;
 
-	virtual int				Seek	(int _offset, int _origin) = 0;
-	virtual int				Tell	() = 0;
+	virtual int				Seek	(int64_t _offset, int _origin) = 0;
+	virtual int64_t			Tell	() = 0;
 };
 
 
@@ -50,8 +51,8 @@ public:
 
 	unsigned int	ReadBytes	(unsigned int _count, unsigned char *_buffer);
 
-	int				Seek		(int _offset, int _origin);
-	int				Tell		();
+	int				Seek		(int64_t _offset, int _origin);
+	int64_t			Tell		();
 };
 
 
@@ -60,13 +61,13 @@ public:
 class BinaryDataReader: public BinaryStreamReader
 {
 protected:
-	unsigned int		m_offset;
+	int64_t				m_offset;
 
 public:
 	unsigned char const *m_data;
-	unsigned int		m_dataSize;
+	int64_t				m_dataSize;
 
-	BinaryDataReader			(unsigned char const *_data, unsigned int _dataSize, 
+	BinaryDataReader			(unsigned char const *_data, int64_t _dataSize, 
 								 char const *_filename);
 	~BinaryDataReader			();
 
@@ -79,6 +80,6 @@ public:
 
 	unsigned int	ReadBytes	(unsigned int _count, unsigned char *_buffer);
 
-	int				Seek		(int _offset, int _origin);
-	int				Tell		();
+	int				Seek		(int64_t _offset, int _origin);
+	int64_t			Tell		();
 };
@@ -11,6 +11,16 @@
 #include <string.h>
 
 
+// ***************************************************************************
+// BinaryStreamWriter
+// ***************************************************************************
+
+bool BinaryStreamWriter::WriteU64(uint64_t val)
+{
+    return WriteU32((uint32_t)val) && WriteU32((uint32_t)(val >> 32));
+}
+
+
 // ***************************************************************************
 // BinaryFileWriter
 // ***************************************************************************
@@ -48,7 +58,7 @@ bool BinaryFileWriter::WriteU32(uint32_t val)
 
 bool BinaryFileWriter::WriteBytes(char const *buf, int64_t count)
 {
-    return fwrite(buf, 1, count, m_file) == count;
+    return (int64_t)fwrite(buf, 1, count, m_file) == count;
 }
 
 
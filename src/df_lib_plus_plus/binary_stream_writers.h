@@ -8,11 +8,14 @@
 class BinaryStreamWriter
 {
 public:
-	virtual void Reserve(int64_t numBytes) {}
+	virtual ~BinaryStreamWriter() {}
+
+	virtual void Reserve(int64_t /* numBytes */) {}
 
     virtual bool WriteU8(uint8_t val) = 0;
     virtual bool WriteU16(uint16_t val) = 0;
     virtual bool WriteU32(uint32_t val) = 0;
+    bool WriteU64(uint64_t val);
 
     virtual bool WriteBytes(char const *buf, int64_t count) = 0;
 };
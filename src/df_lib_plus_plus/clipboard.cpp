@@ -14,6 +14,72 @@ Clipboard g_clipboard;
 static int s_types[]{ CF_TEXT, CF_WAVE };
 
 
+// A hidden window owns the data that SetDelayedData() promises, because
+// Windows asks the owner for it with WM_RENDERFORMAT. Its messages are
+// dispatched by the GUI thread's normal message loop.
+static HWND s_ownerWindow = NULL;
+static Clipboard::RenderFunc *s_renderFuncs[Clipboard::TYPE_NUM_TYPES];
+
+
+static void RenderType(UINT format)
+{
+    for (int i = 0; i < Clipboard::TYPE_NUM_TYPES; i++)
+    {
+        if (s_types[i] == (int)format && s_renderFuncs[i])
+            s_renderFuncs[i](i);
+    }
+}
+
+
+static LRESULT CALLBACK OwnerWindowProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
+{
+    switch (message)
+    {
+    case WM_RENDERFORMAT:
+        // The clipboard is already open for us.
+        RenderType((UINT)wParam);
+        return 0;
+
+    case WM_RENDERALLFORMATS:
+        // Sent when the window is destroyed while it still owns the
+        // clipboard.
+        if (OpenClipboard(hwnd))
+        {
+            if (GetClipboardOwner() == hwnd)
+            {
+                for (int i = 0; i < Clipboard::TYPE_NUM_TYPES; i++)
+                    RenderType(s_types[i]);
+            }
+            CloseClipboard();
+        }
+        return 0;
+
+    case WM_DESTROYCLIPBOARD:
+        // Someone emptied the clipboard, so our promises are void.
+        memset(s_renderFuncs, 0, sizeof(s_renderFuncs));
+        return 0;
+    }
+
+    return DefWindowProc(hwnd, message, wParam, lParam);
+}
+
+
+static HWND GetOwnerWindow()
+{
+    if (!s_ownerWindow)
+    {
+        WNDCLASSA wc = { 0 };
+        wc.lpfnWndProc = OwnerWindowProc;
+        wc.hInstance = GetModuleHandle(NULL);
+        wc.lpszClassName = "ClipboardOwner";
+        RegisterClassA(&wc);
+        s_ownerWindow = CreateWindowA("ClipboardOwner", "", 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, wc.hInstance, NULL);
+    }
+
+    return s_ownerWindow;
+}
+
+
 void *Clipboard::GetData(int type)
 {
     DebugAssert(type < TYPE_NUM_TYPES);
@@ -23,7 +89,10 @@ void *Clipboard::GetData(int type)
 
     HANDLE clipboardData = GetClipboardData(s_types[type]);
     if (!clipboardData)
+    {
+        CloseClipboard();
         return NULL;
+    }
 
     // Return a pointer to the data associated with the handle returned from 
     // GetClipboardData.
@@ -74,3 +143,69 @@ void Clipboard::SetData(int type, void *data, int dataSize)
     // examine or modify its contents.
 	CloseClipboard();
 }
+
+
+void Clipboard::Empty()
+{
+    if (!OpenClipboard(NULL))
+        return;
+
+    EmptyClipboard();
+    CloseClipboard();
+}
+
+
+void Clipboard::SetDelayedData(int type, RenderFunc *render)
+{
+    DebugAssert(type < TYPE_NUM_TYPES);
+
+    HWND owner = GetOwnerWindow();
+    if (!owner || !OpenClipboard(owner))
+        return;
+
+    // Emptying sends WM_DESTROYCLIPBOARD to the old owner, which might be us,
+    // so only record the new promise after it.
+    EmptyClipboard();
+    s_renderFuncs[type] = render;
+    SetClipboardData(s_types[type], NULL);
+    CloseClipboard();
+}
+
+
+void Clipboard::RenderData(int type, void const *data, int dataSize)
+{
+    HGLOBAL clipboardHandle = GlobalAlloc(GMEM_MOVEABLE, dataSize);
+    if (!clipboardHandle)
+        return;
+
+    void *windowsData = GlobalLock(clipboardHandle);
+    if (!windowsData)
+    {
+        GlobalFree(clipboardHandle);
+        return;
+    }
+
+    memcpy(windowsData, data, dataSize);
+    GlobalUnlock(clipboardHandle);
+
+    // Windows owns the memory once this succeeds.
+    if (!SetClipboardData(s_types[type], clipboardHandle))
+        GlobalFree(clipboardHandle);
+}
+
+
+bool Clipboard::OwnsDelayedData()
+{
+    return s_ownerWindow && GetClipboardOwner() == s_ownerWindow;
+}
+
+
+void Clipboard::Flush()
+{
+    if (!s_ownerWindow)
+        return;
+
+    // Destroying the owner sends it WM_RENDERALLFORMATS.
+    DestroyWindow(s_ownerWindow);
+    s_ownerWindow = NULL;
+}
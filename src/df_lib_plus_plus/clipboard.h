@@ -11,10 +11,22 @@ public:
         TYPE_NUM_TYPES
     };
 	
+    // Called when another program asks for data that SetDelayedData()
+    // promised. It must pass the data to RenderData().
+    typedef void RenderFunc(int type);
+
     void *GetData(int type);
     void ReleaseData(void *data);
 
 	void SetData(int type, void *data, int dataSize);
+    void Empty();
+
+    // Delayed rendering. SetDelayedData() puts a promise of data of the type
+    // on the clipboard, and render is only called if someone pastes it.
+    void SetDelayedData(int type, RenderFunc *render);
+    void RenderData(int type, void const *data, int dataSize);  // Only from a RenderFunc
+    bool OwnsDelayedData();     // False once another program, or SetData(), replaces it
+    void Flush();               // Renders any promised data, so that it outlives the program
 };
 
 
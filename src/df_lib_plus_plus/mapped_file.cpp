@@ -0,0 +1,88 @@
+// Own header
+#include "mapped_file.h"
+
+// Platform headers
+#ifdef _MSC_VER
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Standard headers
+#include <stddef.h>
+
+
+#ifdef _MSC_VER
+
+MappedFile::MappedFile(char const *filename)
+{
+    m_data = NULL;
+    m_size = 0;
+    m_mappingHandle = NULL;
+
+    m_fileHandle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL);
+    if (m_fileHandle == INVALID_HANDLE_VALUE)
+        return;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_fileHandle, &size) || size.QuadPart == 0)
+        return;
+
+    m_mappingHandle = CreateFileMappingA(m_fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!m_mappingHandle)
+        return;
+
+    m_data = (unsigned char const *)MapViewOfFile(m_mappingHandle, FILE_MAP_READ, 0, 0, 0);
+    if (m_data)
+        m_size = size.QuadPart;
+}
+
+
+MappedFile::~MappedFile()
+{
+    if (m_data)
+        UnmapViewOfFile(m_data);
+    if (m_mappingHandle)
+        CloseHandle(m_mappingHandle);
+    if (m_fileHandle != INVALID_HANDLE_VALUE)
+        CloseHandle(m_fileHandle);
+}
+
+#else
+
+MappedFile::MappedFile(char const *filename)
+{
+    m_data = NULL;
+    m_size = 0;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            m_data = (unsigned char const *)data;
+            m_size = st.st_size;
+        }
+    }
+
+    // The mapping keeps the file open.
+    close(fd);
+}
+
+
+MappedFile::~MappedFile()
+{
+    if (m_data)
+        munmap((void *)m_data, m_size);
+}
+
+#endif
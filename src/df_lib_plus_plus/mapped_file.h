@@ -0,0 +1,24 @@
+#pragma once
+
+
+// Standard headers
+#include <stdint.h>
+
+
+// A read-only memory mapping of a whole file. Check m_data to see if the
+// constructor succeeded.
+class MappedFile
+{
+private:
+#ifdef _MSC_VER
+    void            *m_fileHandle;
+    void            *m_mappingHandle;
+#endif
+
+public:
+    unsigned char const *m_data;    // NULL if the file couldn't be mapped
+    int64_t         m_size;
+
+    MappedFile(char const *filename);
+    ~MappedFile();
+};
@@ -2,7 +2,11 @@
 #include "mutex.h"
 
 // Platform headers
+#ifdef _MSC_VER
 #include <windows.h>
+#else
+#include <pthread.h>
+#endif
 
 
 #ifdef _MSC_VER
@@ -19,6 +23,7 @@ Mutex::Mutex()
 Mutex::~Mutex()
 {
     DeleteCriticalSection((CRITICAL_SECTION*)m_mutexData);
+    delete (CRITICAL_SECTION*)m_mutexData;
 }
 
 
@@ -34,4 +39,34 @@ void Mutex::Leave()
 }
 
 
+#else
+
+
+Mutex::Mutex()
+{
+    pthread_mutex_t *mutex = new pthread_mutex_t;
+    m_mutexData = (void*)mutex;
+    pthread_mutex_init(mutex, NULL);
+}
+
+
+Mutex::~Mutex()
+{
+    pthread_mutex_destroy((pthread_mutex_t*)m_mutexData);
+    delete (pthread_mutex_t*)m_mutexData;
+}
+
+
+void Mutex::Enter()
+{
+    pthread_mutex_lock((pthread_mutex_t*)m_mutexData);
+}
+
+
+void Mutex::Leave()
+{
+    pthread_mutex_unlock((pthread_mutex_t*)m_mutexData);
+}
+
+
 #endif
@@ -0,0 +1,137 @@
+// Own header
+#include "null_sound_device.h"
+
+// Project headers
+#include "binary_stream_writers.h"
+
+// Contrib headers
+#include "df_time.h"
+
+// Standard headers
+#include <stdio.h>
+
+
+
+//*****************************************************************************
+// Class NullSoundDevice
+//*****************************************************************************
+
+NullSoundDevice::NullSoundDevice(double speed)
+{
+	m_buffer = new StereoSample[MAX_SAMPLES_PER_BUFFER];
+	m_speed = speed;
+	m_samplesPerSecond = m_freq * speed;
+	m_clockStartTime = -1.0;
+	m_numSamplesPulled = 0;
+}
+
+
+NullSoundDevice::~NullSoundDevice()
+{
+	delete [] m_buffer;
+}
+
+
+void NullSoundDevice::TopupBuffer()
+{
+	int64_t numSamplesPulled = m_numSamplesPulled;
+	if (m_speed <= 0.0)
+	{
+		unsigned numSamples = m_samplesPerBuffer;
+		Fill(m_buffer, numSamples, -1);
+		Consume(m_buffer, numSamples);
+		m_numSamplesPulled = numSamplesPulled + numSamples;
+		return;
+	}
+
+	double now = GetRealTime();
+	if (m_clockStartTime < 0.0)
+		m_clockStartTime = now;
+
+	// A real device that got to the end of what it had been given would
+	// have played silence since. Start the clock again from there.
+	int64_t playIdx = (int64_t)((now - m_clockStartTime) * m_samplesPerSecond);
+	if (playIdx > numSamplesPulled)
+	{
+		NoteUnderrun();
+		m_clockStartTime += (playIdx - numSamplesPulled) / m_samplesPerSecond;
+		playIdx = numSamplesPulled;
+	}
+
+	while (1)
+	{
+		unsigned numSamples = m_samplesPerBuffer;
+		if (numSamplesPulled + numSamples > playIdx + (int64_t)m_numBuffers * numSamples)
+			break;
+
+		Fill(m_buffer, numSamples, numSamplesPulled - playIdx);
+		Consume(m_buffer, numSamples);
+		numSamplesPulled += numSamples;
+		m_numSamplesPulled = numSamplesPulled;
+	}
+}
+
+
+
+//*****************************************************************************
+// Class WavFileSoundDevice
+//*****************************************************************************
+
+void WavFileSoundDevice::WriteHeader()
+{
+	unsigned const BYTES_PER_GROUP = sizeof(StereoSample);
+
+	m_file->WriteBytes("RIFF", 4);
+	m_file->WriteU32(4 + (8 + 16) + 8 + m_dataSize);	// Chunk size
+	m_file->WriteBytes("WAVE", 4);
+
+	m_file->WriteBytes("fmt ", 4);
+	m_file->WriteU32(16);								// Chunk size
+	m_file->WriteU16(1);								// PCM
+	m_file->WriteU16(2);								// Num channels
+	m_file->WriteU32(m_freq);
+	m_file->WriteU32(m_freq * BYTES_PER_GROUP);		// Bytes per second
+	m_file->WriteU16(BYTES_PER_GROUP);
+	m_file->WriteU16(16);								// Bits per sample
+
+	m_file->WriteBytes("data", 4);
+	m_file->WriteU32(m_dataSize);
+}
+
+
+void WavFileSoundDevice::Consume(StereoSample const *buf, unsigned int numSamples)
+{
+	uint32_t numBytes = numSamples * sizeof(StereoSample);
+	if (!m_file->m_file || m_dataSize > UINT32_MAX - 44 - numBytes)
+		return;
+
+	m_file->WriteBytes((char const *)buf, numBytes);
+	m_dataSize += numBytes;
+
+	fseek(m_file->m_file, 0, SEEK_SET);
+	WriteHeader();
+	fseek(m_file->m_file, 0, SEEK_END);
+	fflush(m_file->m_file);
+}
+
+
+WavFileSoundDevice::WavFileSoundDevice(char const *filename, double speed)
+:	NullSoundDevice(speed)
+{
+	m_file = new BinaryFileWriter(filename);
+	m_dataSize = 0;
+	if (m_file->m_file)
+		WriteHeader();
+}
+
+
+WavFileSoundDevice::~WavFileSoundDevice()
+{
+	delete m_file;
+}
+
+
+bool WavFileSoundDevice::IsOpen()
+{
+	return m_file->m_file != NULL;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+
+// Project headers
+#include "sound_device.h"
+
+// Standard headers
+#include <atomic>
+#include <stdint.h>
+
+
+class BinaryFileWriter;
+
+
+//*****************************************************************************
+// Class NullSoundDevice
+//*****************************************************************************
+
+// Plays to nowhere, so that playback can run without sound hardware. It pulls
+// buffers on a simulated clock. At a speed of 1 the clock keeps pace with
+// real time, including running dry if TopupBuffer() isn't called for too
+// long, so callers see what they would with a real device. Other speeds run
+// the clock that many times faster. A speed of 0 means there's no clock, and
+// each TopupBuffer() pulls one buffer, so it is as fast and as repeatable as
+// the caller makes it.
+class NullSoundDevice: public SoundDevice
+{
+private:
+	StereoSample	*m_buffer;
+	double			m_speed;
+	double			m_clockStartTime;	// Real time of sample 0. Negative until the first TopupBuffer().
+	std::atomic<int64_t> m_numSamplesPulled;
+
+protected:
+	virtual void	Consume(StereoSample const * /* buf */, unsigned int /* numSamples */) {}
+
+public:
+	NullSoundDevice(double speed);
+	~NullSoundDevice();
+
+	int64_t			GetNumSamplesPulled() { return m_numSamplesPulled; }	// Any thread
+
+	bool			HasClock() { return m_speed > 0.0; }
+	void			TopupBuffer();
+};
+
+
+
+//*****************************************************************************
+// Class WavFileSoundDevice
+//*****************************************************************************
+
+// A NullSoundDevice that writes what it pulls to a 16-bit stereo WAV. The
+// header is brought up to date after each buffer, so the file can be read
+// while the device is still running. Stops writing once the file reaches the
+// 4 GB that RIFF allows.
+class WavFileSoundDevice: public NullSoundDevice
+{
+private:
+	BinaryFileWriter *m_file;
+	uint32_t		m_dataSize;			// In bytes
+
+	void			WriteHeader();
+
+protected:
+	void			Consume(StereoSample const *buf, unsigned int numSamples);
+
+public:
+	WavFileSoundDevice(char const *filename, double speed);
+	~WavFileSoundDevice();
+
+	bool			IsOpen();
+};
@@ -1,20 +1,183 @@
 // Own header
 #include "sound_device.h"
 
+// Project headers
+#include "null_sound_device.h"
+
 // Contrib headers
 #include "df_common.h"
+#include "df_time.h"
 
 // Platform headers
+#ifdef _MSC_VER
 #include <windows.h>
 #include <MMSystem.h>
+#elif defined(__linux__)
+#include <alsa/asoundlib.h>
+#include <errno.h>
+#endif
 
 // Standard headers
+#include <atomic>
+#include <limits.h>
 #include <memory.h>
+#include <stdint.h>
 
 
-static HWAVEOUT	s_device;
-SoundDevice *g_soundDevice = NULL;
 
+//*****************************************************************************
+// Class SoundDevice
+//*****************************************************************************
+
+// Called after the device has run dry, or nearly.
+void SoundDevice::Grow()
+{
+	if (!m_isAdaptive)
+		return;
+
+	unsigned samplesPerBuffer = m_samplesPerBuffer;
+	if (m_minSafeSamplesPerBuffer <= samplesPerBuffer)
+		m_minSafeSamplesPerBuffer = samplesPerBuffer + 1;
+
+	samplesPerBuffer *= 2;
+	if (samplesPerBuffer > MAX_SAMPLES_PER_BUFFER)
+		samplesPerBuffer = MAX_SAMPLES_PER_BUFFER;
+	m_samplesPerBuffer = samplesPerBuffer;
+
+	m_numSamplesSinceAdapt = 0;
+	m_minSpareSinceAdapt = INT_MAX;
+}
+
+
+void SoundDevice::Fill(StereoSample *buf, unsigned int numSamples, int numSamplesQueued)
+{
+	double startTime = GetRealTime();
+	m_callback(buf, numSamples);
+	double seconds = GetRealTime() - startTime;
+
+	int64_t nanosec = (int64_t)(seconds * 1e9);
+	int bucket = 0;
+	while (bucket < HISTOGRAM_SIZE - 1 && nanosec / 1000 >= (2 << bucket))
+		bucket++;
+	m_callbackHistogram[bucket]++;
+	m_numCallbacks++;
+	if (nanosec > m_maxCallbackNanosec)
+		m_maxCallbackNanosec = nanosec;
+
+	// Nothing is queued when the device starts, or starts again after
+	// running dry, so there's no deadline.
+	if (numSamplesQueued <= 0)
+		return;
+
+	if (m_restartAdapting)
+	{
+		m_restartAdapting = false;
+		m_numSamplesSinceAdapt = 0;
+		m_minSpareSinceAdapt = INT_MAX;
+	}
+
+	// What the device still had to play when the buffer was ready. If there
+	// was nothing, it will have played a gap.
+	int numSamplesSpare = numSamplesQueued - (int)(seconds * m_samplesPerSecond);
+	if (numSamplesSpare < 0)
+	{
+		m_numDeadlineMisses++;
+		Grow();
+		return;
+	}
+
+	if (!m_isAdaptive)
+		return;
+
+	if (numSamplesSpare < m_minSpareSinceAdapt)
+		m_minSpareSinceAdapt = numSamplesSpare;
+	m_numSamplesSinceAdapt += numSamples;
+	if (m_numSamplesSinceAdapt < ADAPT_SECONDS * m_freq)
+		return;
+
+	unsigned samplesPerBuffer = m_samplesPerBuffer;
+	if (m_minSpareSinceAdapt >= (int)samplesPerBuffer)
+	{
+		samplesPerBuffer -= samplesPerBuffer / 8;
+		if (samplesPerBuffer < m_minSafeSamplesPerBuffer)
+			samplesPerBuffer = m_minSafeSamplesPerBuffer;
+		m_samplesPerBuffer = samplesPerBuffer;
+	}
+
+	m_numSamplesSinceAdapt = 0;
+	m_minSpareSinceAdapt = INT_MAX;
+}
+
+
+void SoundDevice::NoteUnderrun()
+{
+	m_numUnderruns++;
+	Grow();
+}
+
+
+SoundDevice::SoundDevice()
+{
+    m_callback = NULL;
+    m_freq = 44100;
+    m_samplesPerSecond = m_freq;
+    m_samplesPerBuffer = DEFAULT_SAMPLES_PER_BUFFER;
+    m_numBuffers = DEFAULT_BUFFERS;
+    m_isAdaptive = false;
+    m_minSafeSamplesPerBuffer = MIN_SAMPLES_PER_BUFFER;
+    m_restartAdapting = false;
+    m_numSamplesSinceAdapt = 0;
+    m_minSpareSinceAdapt = INT_MAX;
+
+    m_numCallbacks = 0;
+    m_numUnderruns = 0;
+    m_numDeadlineMisses = 0;
+    for (int i = 0; i < HISTOGRAM_SIZE; i++)
+        m_callbackHistogram[i] = 0;
+    m_maxCallbackNanosec = 0;
+}
+
+
+void SoundDevice::SetCallback(void (*_callback)(StereoSample *, unsigned int))
+{
+	m_callback = _callback;
+}
+
+
+void SoundDevice::SetBufferSizes(unsigned numBuffers, unsigned samplesPerBuffer, bool isAdaptive)
+{
+	if (numBuffers < MIN_BUFFERS)
+		numBuffers = MIN_BUFFERS;
+	if (numBuffers > MAX_BUFFERS)
+		numBuffers = MAX_BUFFERS;
+	if (samplesPerBuffer < MIN_SAMPLES_PER_BUFFER)
+		samplesPerBuffer = MIN_SAMPLES_PER_BUFFER;
+	if (samplesPerBuffer > MAX_SAMPLES_PER_BUFFER)
+		samplesPerBuffer = MAX_SAMPLES_PER_BUFFER;
+
+	m_numBuffers = numBuffers;
+	m_samplesPerBuffer = samplesPerBuffer;
+	m_isAdaptive = isAdaptive;
+	m_minSafeSamplesPerBuffer = MIN_SAMPLES_PER_BUFFER;
+	m_restartAdapting = true;
+}
+
+
+void SoundDevice::GetStats(Stats *stats)
+{
+	stats->m_numCallbacks = m_numCallbacks;
+	stats->m_numUnderruns = m_numUnderruns;
+	stats->m_numDeadlineMisses = m_numDeadlineMisses;
+	for (int i = 0; i < HISTOGRAM_SIZE; i++)
+		stats->m_callbackHistogram[i] = m_callbackHistogram[i];
+	stats->m_maxCallbackSeconds = m_maxCallbackNanosec * 1e-9;
+}
+
+
+
+#ifdef _MSC_VER
+
+static HWAVEOUT	s_device;
 
 
 //*****************************************************************************
@@ -25,18 +188,22 @@ class StereoSampleBuf
 {
 public:
     StereoSample	*m_buffer;
+    unsigned int	m_numSamples;		// In the last write
     WAVEHDR			m_header;
 
     StereoSampleBuf();
     ~StereoSampleBuf();
+
+    bool Write(unsigned int numSamples);
 };
 
 
 StereoSampleBuf::StereoSampleBuf()
 {
 	// Allocate the buffer
-	int num_samples = 2000;
+	int num_samples = SoundDevice::MAX_SAMPLES_PER_BUFFER;
 	m_buffer = new StereoSample[num_samples];
+	m_numSamples = 0;
 
 	// Clear the buffer
 	memset(m_buffer, 0, num_samples * sizeof(StereoSample));
@@ -46,54 +213,75 @@ StereoSampleBuf::StereoSampleBuf()
 	m_header.lpData = (char*)m_buffer;
 	int block_align = 4;		// 2 channels * 2 bytes per sample
 	m_header.dwBufferLength = num_samples * block_align;
-	m_header.dwFlags = WHDR_DONE;
 	int result = waveOutPrepareHeader(s_device, &m_header, sizeof(WAVEHDR));
 	ReleaseAssert(result == MMSYSERR_NOERROR, "Couldn't init buffer");
-
-	// Play the buffer
-	result = waveOutWrite(s_device, &m_header, sizeof(WAVEHDR));
-	ReleaseAssert(result == MMSYSERR_NOERROR, "Couldn't send sound data");
 }
 
 
 StereoSampleBuf::~StereoSampleBuf()
 {
 	waveOutUnprepareHeader(s_device, &m_header, sizeof(WAVEHDR));
-	delete [] m_buffer;			
+	delete [] m_buffer;
 	m_buffer = NULL;
 }
 
 
+// The length of a prepared header mustn't change, so it is prepared again
+// for the new length.
+bool StereoSampleBuf::Write(unsigned int numSamples)
+{
+	int block_align = 4;		// 2 channels * 2 bytes per sample
+	if (numSamples != m_numSamples)
+	{
+		waveOutUnprepareHeader(s_device, &m_header, sizeof(WAVEHDR));
+		m_header.dwBufferLength = numSamples * block_align;
+		m_header.dwFlags = 0;
+		if (waveOutPrepareHeader(s_device, &m_header, sizeof(WAVEHDR)) != MMSYSERR_NOERROR)
+			return false;
+		m_numSamples = numSamples;
+	}
+
+	return waveOutWrite(s_device, &m_header, sizeof(WAVEHDR)) == MMSYSERR_NOERROR;
+}
+
+
 
 //*****************************************************************************
-// Class SoundDevice
+// Class WaveOutSoundDevice
 //*****************************************************************************
 
-#include "df_time.h"
-void CALLBACK WaveOutProc(HWAVEOUT dev, UINT msg, DWORD user_data, DWORD param1, DWORD param2)
+class WaveOutSoundDevice: public SoundDevice
 {
-	if (msg != WOM_DONE) 
-		return;
-	if (!s_device)	
+private:
+	StereoSampleBuf	*m_buffers;				// MAX_BUFFERS of them, sent in turn
+	unsigned int	m_nextBuffer;			// Index of next buffer to send to sound card
+	unsigned int	m_numBuffersWritten;
+
+public:
+	std::atomic<unsigned> m_numBuffersDone;	// Windows increments it on its own thread as each buffer finishes playing
+
+	WaveOutSoundDevice();
+	void TopupBuffer();
+};
+
+
+void CALLBACK WaveOutProc(HWAVEOUT dev, UINT msg, DWORD_PTR user_data, DWORD param1, DWORD param2)
+{
+	if (msg != WOM_DONE)
 		return;
-	if (!g_soundDevice || !g_soundDevice->m_callback) 
+	if (!s_device)
 		return;
 
-    g_soundDevice->m_fillsRequested++;
+	WaveOutSoundDevice *device = (WaveOutSoundDevice *)user_data;
+    device->m_numBuffersDone++;
 }
 
 
-SoundDevice::SoundDevice()
-{   
-    m_callback = NULL;
-    m_numBuffers = 4;
+WaveOutSoundDevice::WaveOutSoundDevice()
+{
     m_nextBuffer = 0;
-    m_fillsRequested = 0;
-
-    DebugAssert(!g_soundDevice);
-
-    m_freq = 44100;
-    m_samplesPerBuffer = 2000;
+    m_numBuffersWritten = 0;
+    m_numBuffersDone = 0;
 
 
     //
@@ -106,7 +294,7 @@ SoundDevice::SoundDevice()
 	format.wBitsPerSample = 16;
 	format.nBlockAlign = 4;		// 2 channels * 2 bytes per sample
 	format.nAvgBytesPerSec = format.nSamplesPerSec * format.nBlockAlign;
-	int result = waveOutOpen(&s_device, WAVE_MAPPER, &format, (DWORD)&WaveOutProc, 0, CALLBACK_FUNCTION);
+	int result = waveOutOpen(&s_device, WAVE_MAPPER, &format, (DWORD_PTR)&WaveOutProc, (DWORD_PTR)this, CALLBACK_FUNCTION);
 	char const *errString = NULL;
 	switch (result)
 	{
@@ -117,41 +305,159 @@ SoundDevice::SoundDevice()
 		case WAVERR_BADFORMAT:		errString = "Attempted to open with an unsupported waveform-audio format";	break;
 		case WAVERR_SYNC:			errString = "Device is synchronous but waveOutOpen called without WAVE_ALLOWSYNC flag";	break;
 	}
-	
+
 	ReleaseAssert(result == MMSYSERR_NOERROR, "Failed to open audio output device: \"%s\"", errString);
 
 
-	// 
+	//
 	// Create the sound buffers
 
-	m_buffers = new StereoSampleBuf[m_numBuffers];
+	m_buffers = new StereoSampleBuf[MAX_BUFFERS];
 }
 
 
-void SoundDevice::SetCallback(void (*_callback)(StereoSample *, unsigned int))
+void WaveOutSoundDevice::TopupBuffer()
 {
-	m_callback = _callback;
+	// Once every buffer sent has been played, the device has run dry.
+	unsigned numInFlight = m_numBuffersWritten - m_numBuffersDone;
+	if (numInFlight == 0 && m_numBuffersWritten > 0)
+		NoteUnderrun();
+
+	while (numInFlight < m_numBuffers)
+	{
+		// Counts all of the buffer playing now, because waveOut doesn't say
+		// how far through it is.
+		int numSamplesQueued = 0;
+		for (unsigned i = 1; i <= numInFlight; i++)
+			numSamplesQueued += m_buffers[(m_nextBuffer + MAX_BUFFERS - i) % MAX_BUFFERS].m_numSamples;
+
+		StereoSampleBuf *buf = &m_buffers[m_nextBuffer];
+		unsigned numSamples = m_samplesPerBuffer;
+		Fill(buf->m_buffer, numSamples, numSamplesQueued);
+		if (!buf->Write(numSamples))
+			break;
+
+		m_nextBuffer++;
+		m_nextBuffer %= MAX_BUFFERS;
+		m_numBuffersWritten++;
+		numInFlight++;
+	}
 }
 
 
-void SoundDevice::TopupBuffer()
+SoundDevice *CreatePlatformSoundDevice()
 {
-	while (m_fillsRequested)
-	{
-		StereoSampleBuf *buf = &m_buffers[m_nextBuffer];
+	return new WaveOutSoundDevice;
+}
+
+
+#elif defined(__linux__)
+
+
+//*****************************************************************************
+// Class AlsaSoundDevice
+//*****************************************************************************
 
-		g_soundDevice->m_callback(buf->m_buffer, g_soundDevice->m_samplesPerBuffer);
+// Writes to ALSA's default device without blocking. ALSA keeps its own ring
+// of samples, which is made big enough for the most latency there can be.
+// TopupBuffer() only keeps m_numBuffers buffers in it.
+class AlsaSoundDevice: public SoundDevice
+{
+private:
+	snd_pcm_t		*m_pcm;
+	snd_pcm_uframes_t m_ringSize;		// In samples
+	StereoSample	*m_buffer;
+
+public:
+	AlsaSoundDevice();
+	~AlsaSoundDevice();
+
+	void TopupBuffer();
+};
+
+
+AlsaSoundDevice::AlsaSoundDevice()
+{
+	m_buffer = new StereoSample[MAX_SAMPLES_PER_BUFFER];
+
+	int result = snd_pcm_open(&m_pcm, "default", SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK);
+	ReleaseAssert(result >= 0, "Failed to open audio output device: \"%s\"", snd_strerror(result));
 
-		int result = waveOutWrite(s_device, &buf->m_header, sizeof(WAVEHDR));
-		if (result != MMSYSERR_NOERROR)
+	// Let ALSA resample if the hardware can't do m_freq.
+	unsigned latencyMicrosec = (uint64_t)MAX_BUFFERS * MAX_SAMPLES_PER_BUFFER * 1000000 / m_freq;
+	result = snd_pcm_set_params(m_pcm, SND_PCM_FORMAT_S16, SND_PCM_ACCESS_RW_INTERLEAVED,
+		2, m_freq, 1, latencyMicrosec);
+	ReleaseAssert(result >= 0, "Failed to set up audio output device: \"%s\"", snd_strerror(result));
+
+	snd_pcm_uframes_t periodSize;
+	result = snd_pcm_get_params(m_pcm, &m_ringSize, &periodSize);
+	ReleaseAssert(result >= 0, "Failed to set up audio output device: \"%s\"", snd_strerror(result));
+}
+
+
+AlsaSoundDevice::~AlsaSoundDevice()
+{
+	snd_pcm_close(m_pcm);
+	delete [] m_buffer;
+}
+
+
+void AlsaSoundDevice::TopupBuffer()
+{
+	while (1)
+	{
+		// A negative count means the device has run dry, or was suspended.
+		// Recovering starts it again, after which there is room.
+		snd_pcm_sframes_t numFree = snd_pcm_avail_update(m_pcm);
+		if (numFree < 0)
 		{
-			break;
+			if (numFree == -EPIPE)
+				NoteUnderrun();
+			if (snd_pcm_recover(m_pcm, numFree, 1) < 0)
+				return;
+			continue;
 		}
-		else
+
+		unsigned numSamples = m_samplesPerBuffer;
+		int numSamplesQueued = m_ringSize - numFree;
+		int64_t maxQueued = (int64_t)m_numBuffers * numSamples;
+		if (maxQueued > (int64_t)m_ringSize)
+			maxQueued = m_ringSize;
+		if (numSamplesQueued + numSamples > maxQueued)
+			return;
+
+		Fill(m_buffer, numSamples, numSamplesQueued);
+
+		snd_pcm_sframes_t numWritten = snd_pcm_writei(m_pcm, m_buffer, numSamples);
+		if (numWritten < 0)
 		{
-			m_nextBuffer++;
-			m_nextBuffer %= m_numBuffers;
-			m_fillsRequested--;
+			if (numWritten == -EPIPE)
+				NoteUnderrun();
+			if (snd_pcm_recover(m_pcm, numWritten, 1) < 0)
+				return;
+			continue;
 		}
+
+		// Otherwise ALSA waits for its whole ring to fill before it starts.
+		if (snd_pcm_state(m_pcm) == SND_PCM_STATE_PREPARED)
+			snd_pcm_start(m_pcm);
 	}
 }
+
+
+SoundDevice *CreatePlatformSoundDevice()
+{
+	return new AlsaSoundDevice;
+}
+
+
+#else
+
+
+SoundDevice *CreatePlatformSoundDevice()
+{
+	return new NullSoundDevice(1.0);
+}
+
+
+#endif
@@ -1,6 +1,11 @@
 #pragma once
 
 
+// Standard headers
+#include <atomic>
+#include <stdint.h>
+
+
 //*****************************************************************************
 // Class StereoSample
 //*****************************************************************************
@@ -15,33 +20,90 @@ public:
 };
 
 
-class StereoSampleBuf;
-
 
 //*****************************************************************************
 // Class SoundDevice
 //*****************************************************************************
 
+// Somewhere to send 16-bit stereo samples. The device pulls them a buffer at
+// a time from the callback, from inside TopupBuffer(), which must be called
+// every millisecond or so from one thread.
+//
+// The device keeps m_numBuffers buffers of m_samplesPerBuffer queued, which
+// is its latency. Either can be changed at any time, from any thread. If it
+// is adaptive, the device also changes the buffer size itself. It doubles it
+// whenever it runs dry or a callback misses its deadline, and never goes back
+// down to a size that did. If it has a whole buffer to spare every time it
+// fills one, for ADAPT_SECONDS, it shrinks the buffers by an eighth.
 class SoundDevice
 {
-protected:
-	StereoSampleBuf	*m_buffers;
-	unsigned int	m_numBuffers;
-	unsigned int	m_nextBuffer;		// Index of next buffer to send to sound card
-
 public:
-	unsigned int	m_fillsRequested;	// Number of outstanding requests for more sound data that Windows has issued
+	enum { MIN_SAMPLES_PER_BUFFER = 256 };
+	enum { MAX_SAMPLES_PER_BUFFER = 4096 };
+	enum { DEFAULT_SAMPLES_PER_BUFFER = 2000 };
+	enum { MIN_BUFFERS = 2 };
+	enum { MAX_BUFFERS = 8 };
+	enum { DEFAULT_BUFFERS = 4 };
+	enum { ADAPT_SECONDS = 2 };
+	enum { HISTOGRAM_SIZE = 16 };
+
+	struct Stats
+	{
+		int64_t		m_numCallbacks;
+		int64_t		m_numUnderruns;			// Times the device ran dry
+		int64_t		m_numDeadlineMisses;	// Callbacks that took longer than the device had left to play
+		int64_t		m_callbackHistogram[HISTOGRAM_SIZE];	// Bucket i counts callbacks that took under 2^(i+1) microseconds. The last bucket counts the rest.
+		double		m_maxCallbackSeconds;
+	};
+
+protected:
 	unsigned int	m_freq;
-	unsigned int	m_samplesPerBuffer;
+	double			m_samplesPerSecond;		// How fast the device plays. m_freq unless its clock is simulated.
+	std::atomic<unsigned> m_samplesPerBuffer;
+	std::atomic<unsigned> m_numBuffers;
+	std::atomic<bool> m_isAdaptive;
+	std::atomic<unsigned> m_minSafeSamplesPerBuffer;	// Adapting never goes below this
+	std::atomic<bool> m_restartAdapting;	// Set by SetBufferSizes()
     void			(*m_callback) (StereoSample *buf, unsigned int numSamples);
 
+	// Only the thread calling TopupBuffer() uses these.
+	unsigned		m_numSamplesSinceAdapt;
+	int				m_minSpareSinceAdapt;	// Fewest samples the device had left when a fill finished
+
+	std::atomic<int64_t> m_numCallbacks;
+	std::atomic<int64_t> m_numUnderruns;
+	std::atomic<int64_t> m_numDeadlineMisses;
+	std::atomic<int64_t> m_callbackHistogram[HISTOGRAM_SIZE];
+	std::atomic<int64_t> m_maxCallbackNanosec;
+
+	// TopupBuffer() calls these. numSamplesQueued is how many the device had
+	// left to play when the fill began, or -1 if it has no clock.
+	void			Fill(StereoSample *buf, unsigned int numSamples, int numSamplesQueued);
+	void			NoteUnderrun();
+	void			Grow();
+
 public:
 	SoundDevice();
+	virtual ~SoundDevice() {}
 
-	int				GetSamplesPerChunk() { return m_samplesPerBuffer; }	// Max num samples that the callback will ask for in a single call
+	unsigned int	GetFreq() { return m_freq; }
+	int				GetSamplesPerChunk() { return m_samplesPerBuffer; }	// Num samples that the callback will next be asked for
+	int				GetNumBuffers() { return m_numBuffers; }
+	bool			IsAdaptive() { return m_isAdaptive; }
     void			SetCallback(void (*_callback) (StereoSample *, unsigned int));
-	void			TopupBuffer();
+
+	// Both are clamped to the limits above. Starts adapting afresh, from
+	// samplesPerBuffer, if isAdaptive.
+	void			SetBufferSizes(unsigned numBuffers, unsigned samplesPerBuffer, bool isAdaptive);
+	void			GetStats(Stats *stats);
+
+	// A device without a clock of its own never runs dry, so whatever calls
+	// TopupBuffer() can wait for samples instead of letting it play a gap.
+	virtual bool	HasClock() { return true; }
+	virtual void	TopupBuffer() = 0;
 };
 
 
-extern SoundDevice *g_soundDevice;
+// The platform's own sound output: waveOut on Windows, ALSA on Linux. Other
+// platforms get a NullSoundDevice running in real time.
+SoundDevice *CreatePlatformSoundDevice();
@@ -0,0 +1,71 @@
+// Own header
+#include "stereo_sample_ring.h"
+
+// Contrib headers
+#include "df_common.h"
+
+// Standard headers
+#include <memory.h>
+
+
+StereoSampleRing::StereoSampleRing(unsigned capacity)
+{
+    ReleaseAssert(capacity > 0 && (capacity & (capacity - 1)) == 0, "Ring capacity must be a power of two");
+    m_samples = new StereoSample [capacity];
+    m_capacity = capacity;
+    m_readIdx = 0;
+    m_writeIdx = 0;
+}
+
+
+StereoSampleRing::~StereoSampleRing()
+{
+    delete[] m_samples;
+}
+
+
+unsigned StereoSampleRing::Write(StereoSample const *src, unsigned numSamples)
+{
+    unsigned writeIdx = m_writeIdx;
+    unsigned numFree = m_capacity - (writeIdx - m_readIdx);
+    if (numSamples > numFree)
+        numSamples = numFree;
+
+    // In two parts if it wraps round the end of the buffer
+    unsigned offset = writeIdx & (m_capacity - 1);
+    unsigned firstLen = m_capacity - offset;
+    if (firstLen > numSamples)
+        firstLen = numSamples;
+    memcpy(m_samples + offset, src, firstLen * sizeof(StereoSample));
+    memcpy(m_samples, src + firstLen, (numSamples - firstLen) * sizeof(StereoSample));
+
+    // Publish the samples only once they are all there.
+    m_writeIdx = writeIdx + numSamples;
+    return numSamples;
+}
+
+
+unsigned StereoSampleRing::Read(StereoSample *dst, unsigned numSamples)
+{
+    unsigned readIdx = m_readIdx;
+    unsigned numQueued = m_writeIdx - readIdx;
+    if (numSamples > numQueued)
+        numSamples = numQueued;
+
+    unsigned offset = readIdx & (m_capacity - 1);
+    unsigned firstLen = m_capacity - offset;
+    if (firstLen > numSamples)
+        firstLen = numSamples;
+    memcpy(dst, m_samples + offset, firstLen * sizeof(StereoSample));
+    memcpy(dst + firstLen, m_samples, (numSamples - firstLen) * sizeof(StereoSample));
+
+    // The writer can reuse the space once we're done with it.
+    m_readIdx = readIdx + numSamples;
+    return numSamples;
+}
+
+
+void StereoSampleRing::Discard()
+{
+    m_readIdx = m_writeIdx.load();
+}
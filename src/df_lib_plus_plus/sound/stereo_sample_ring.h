@@ -0,0 +1,39 @@
+#pragma once
+
+
+// Project headers
+#include "sound_device.h"
+
+// Standard headers
+#include <atomic>
+
+
+// A fixed size queue of StereoSamples that one thread writes and another
+// reads, without either of them ever waiting for the other. The indices only
+// ever go up, wrapping at 2^32, and the capacity is a power of two, so the
+// number of samples queued is always m_writeIdx - m_readIdx.
+//
+// Only the reader can Discard() what's queued. A writer that wants the queue
+// emptied has to ask the reader to do it.
+class StereoSampleRing
+{
+private:
+    StereoSample *m_samples;
+    unsigned m_capacity;
+    std::atomic<unsigned> m_readIdx;    // Only the reader changes this
+    std::atomic<unsigned> m_writeIdx;   // Only the writer changes this
+
+public:
+    StereoSampleRing(unsigned capacity);    // Must be a power of two
+    ~StereoSampleRing();
+
+    unsigned GetNumQueued() { return m_writeIdx - m_readIdx; }
+    unsigned GetNumFree() { return m_capacity - GetNumQueued(); }
+
+    // These return the number of samples copied, which is less than
+    // numSamples if the queue fills up or runs out.
+    unsigned Write(StereoSample const *src, unsigned numSamples);
+    unsigned Read(StereoSample *dst, unsigned numSamples);
+
+    void Discard();
+};
@@ -30,7 +30,7 @@ char *StringDuplicate(char const *theString)
 
 	int len = strlen(theString) + 1;
 	char *rv = new char[len];
-	ReleaseAssert((int)rv, "Ran out of memory trying to duplicate a string");
+	ReleaseAssert(rv != NULL, "Ran out of memory trying to duplicate a string");
 	memcpy(rv, theString, len);
 	return rv;
 }
@@ -1,30 +1,73 @@
 // Own header
 #include "threading.h"
 
+// Platform headers
+#ifdef _MSC_VER
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+// Standard headers
+#include <atomic>
+
+
+#ifdef _MSC_VER
 
 CriticalSection::CriticalSection()
 {
-	InitializeCriticalSection(&m_criticalSectionWin32);
+	CRITICAL_SECTION *cs = new CRITICAL_SECTION;
+	m_criticalSectionData = (void*)cs;
+	InitializeCriticalSection(cs);
+    m_owner = NULL;
 }
 
 
 CriticalSection::~CriticalSection()
 {
-	DeleteCriticalSection(&m_criticalSectionWin32);
+	DeleteCriticalSection((CRITICAL_SECTION*)m_criticalSectionData);
+	delete (CRITICAL_SECTION*)m_criticalSectionData;
 }
 
 
 void CriticalSection::Enter(char const *owner)
 {
-	EnterCriticalSection(&m_criticalSectionWin32);
+	EnterCriticalSection((CRITICAL_SECTION*)m_criticalSectionData);
     m_owner = owner;
 }
 
 
 void CriticalSection::Leave()
 {
-	LeaveCriticalSection(&m_criticalSectionWin32);
     m_owner = NULL;
+	LeaveCriticalSection((CRITICAL_SECTION*)m_criticalSectionData);
+}
+
+
+Semaphore::Semaphore()
+{
+	m_semaphoreData = (void*)CreateSemaphore(NULL, 0, MAXLONG, NULL);
+}
+
+
+Semaphore::~Semaphore()
+{
+	CloseHandle((HANDLE)m_semaphoreData);
+}
+
+
+void Semaphore::Signal(int count)
+{
+	if (count > 0)
+		ReleaseSemaphore((HANDLE)m_semaphoreData, count, NULL);
+}
+
+
+void Semaphore::Wait()
+{
+	WaitForSingleObject((HANDLE)m_semaphoreData, INFINITE);
 }
 
 
@@ -49,3 +92,180 @@ bool MyResumeThread(unsigned threadHandle)
 	return result != 0xFFFFFFFF;
 }
 
+
+bool MyRaiseThreadPriority(unsigned threadHandle, bool timeCritical)
+{
+	int priority = timeCritical ? THREAD_PRIORITY_TIME_CRITICAL : THREAD_PRIORITY_HIGHEST;
+	return SetThreadPriority((HANDLE)threadHandle, priority) != 0;
+}
+
+
+int GetNumCores()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+}
+
+#else
+
+CriticalSection::CriticalSection()
+{
+	pthread_mutex_t *mutex = new pthread_mutex_t;
+	m_criticalSectionData = (void*)mutex;
+	pthread_mutex_init(mutex, NULL);
+    m_owner = NULL;
+}
+
+
+CriticalSection::~CriticalSection()
+{
+	pthread_mutex_destroy((pthread_mutex_t*)m_criticalSectionData);
+	delete (pthread_mutex_t*)m_criticalSectionData;
+}
+
+
+void CriticalSection::Enter(char const *owner)
+{
+	pthread_mutex_lock((pthread_mutex_t*)m_criticalSectionData);
+    m_owner = owner;
+}
+
+
+void CriticalSection::Leave()
+{
+    m_owner = NULL;
+	pthread_mutex_unlock((pthread_mutex_t*)m_criticalSectionData);
+}
+
+
+struct SemaphoreData
+{
+	pthread_mutex_t	m_mutex;
+	pthread_cond_t	m_cond;
+	int				m_count;
+};
+
+
+Semaphore::Semaphore()
+{
+	SemaphoreData *data = new SemaphoreData;
+	pthread_mutex_init(&data->m_mutex, NULL);
+	pthread_cond_init(&data->m_cond, NULL);
+	data->m_count = 0;
+	m_semaphoreData = (void*)data;
+}
+
+
+Semaphore::~Semaphore()
+{
+	SemaphoreData *data = (SemaphoreData*)m_semaphoreData;
+	pthread_cond_destroy(&data->m_cond);
+	pthread_mutex_destroy(&data->m_mutex);
+	delete data;
+}
+
+
+void Semaphore::Signal(int count)
+{
+	if (count <= 0)
+		return;
+
+	SemaphoreData *data = (SemaphoreData*)m_semaphoreData;
+	pthread_mutex_lock(&data->m_mutex);
+	data->m_count += count;
+	if (count == 1)
+		pthread_cond_signal(&data->m_cond);
+	else
+		pthread_cond_broadcast(&data->m_cond);
+	pthread_mutex_unlock(&data->m_mutex);
+}
+
+
+void Semaphore::Wait()
+{
+	SemaphoreData *data = (SemaphoreData*)m_semaphoreData;
+	pthread_mutex_lock(&data->m_mutex);
+	while (data->m_count == 0)
+		pthread_cond_wait(&data->m_cond, &data->m_mutex);
+	data->m_count--;
+	pthread_mutex_unlock(&data->m_mutex);
+}
+
+
+// A pthread_t doesn't fit in the unsigned that callers keep, so handles are
+// indices into s_threads, plus one so that zero can mean failure. The slots
+// are reused after MAX_THREAD_HANDLES threads, so a handle is only good for
+// a while after StartThread() returns it.
+enum { MAX_THREAD_HANDLES = 256 };
+static pthread_t s_threads[MAX_THREAD_HANDLES];
+static std::atomic<unsigned> s_numThreadsStarted(0);
+
+
+struct ThreadStart
+{
+	ThreadProc	m_func;
+	void		*m_data;
+};
+
+
+static void *ThreadStartProc(void *data)
+{
+	ThreadStart start = *(ThreadStart *)data;
+	delete (ThreadStart *)data;
+	start.m_func(start.m_data);
+	return NULL;
+}
+
+
+unsigned StartThread(ThreadProc threadFunc, void *threadData)
+{
+	ThreadStart *start = new ThreadStart;
+	start->m_func = threadFunc;
+	start->m_data = threadData;
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, ThreadStartProc, start) != 0)
+	{
+		delete start;
+		return 0;
+	}
+	pthread_detach(thread);
+
+	unsigned slot = s_numThreadsStarted++ % MAX_THREAD_HANDLES;
+	s_threads[slot] = thread;
+	return slot + 1;
+}
+
+
+bool MySuspendThread(unsigned)
+{
+	return false;
+}
+
+
+bool MyResumeThread(unsigned)
+{
+	return false;
+}
+
+
+bool MyRaiseThreadPriority(unsigned threadHandle, bool timeCritical)
+{
+	if (threadHandle == 0)
+		return false;
+
+	int policy = SCHED_FIFO;
+	sched_param param;
+	param.sched_priority = timeCritical ? sched_get_priority_max(policy) : sched_get_priority_min(policy);
+	return pthread_setschedparam(s_threads[threadHandle - 1], policy, &param) == 0;
+}
+
+
+int GetNumCores()
+{
+	long numCores = sysconf(_SC_NPROCESSORS_ONLN);
+	return numCores > 0 ? (int)numCores : 1;
+}
+
+#endif
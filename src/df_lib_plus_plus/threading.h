@@ -1,13 +1,17 @@
 #pragma once
 
 
-#include <windows.h>    // TODO make this not needed in the header by making m_criticalSectionWin32 be a pointer
+// Thread procs are __stdcall on Windows. Other platforms only have the one
+// calling convention.
+#ifndef _MSC_VER
+#define __stdcall
+#endif
 
 
 class CriticalSection
 {
 private:
-	CRITICAL_SECTION m_criticalSectionWin32;
+	void *m_criticalSectionData;	// A CRITICAL_SECTION on Windows, a pthread_mutex_t elsewhere
     char const *m_owner;
 
 public:
@@ -20,9 +24,33 @@ public:
 };
 
 
+// Counts signals, so that one sent before anything waits isn't lost. Wait()
+// blocks until there is one, then takes it.
+class Semaphore
+{
+private:
+	void *m_semaphoreData;	// A semaphore HANDLE on Windows, a mutex, condition and count elsewhere
+
+public:
+	Semaphore();
+	~Semaphore();
+
+	void Signal(int count = 1);
+	void Wait();
+};
+
+
 typedef unsigned long (__stdcall *ThreadProc)(void *data);
 
 // Returns a thread handle, or zero on failure
 unsigned StartThread(ThreadProc threadFunc, void *threadData);
-bool MySuspendThread(unsigned threadHandle);	// Returns true on success
-bool MyResumeThread(unsigned threadHandle);		// Returns true on success
+bool MySuspendThread(unsigned threadHandle);	// Returns true on success. Always fails except on Windows.
+bool MyResumeThread(unsigned threadHandle);		// Returns true on success. Always fails except on Windows.
+
+// Returns true on success. A time critical thread runs ahead of everything
+// else in the process, so it must only ever do a little work at a time.
+// Other than on Windows, this needs the privilege to use real time
+// scheduling, and fails without it.
+bool MyRaiseThreadPriority(unsigned threadHandle, bool timeCritical);
+
+int GetNumCores();  // Number of logical processors
@@ -0,0 +1,330 @@
+// Own header
+#include "display_cache.h"
+
+// Project headers
+#include "sound.h"
+#include "sound_channel.h"
+#include "df_lib_plus_plus/threading.h"
+
+// Contrib headers
+#include "df_time.h"
+
+// Standard headers
+#include <memory.h>
+
+
+// ****************************************************************************
+// Private Functions
+// ****************************************************************************
+
+// Marks the columns that include any of samples startIdx to endIdx as needing
+// to be calculated again.
+void DisplayCache::Invalidate(int64_t startIdx, int64_t endIdx)
+{
+    for (unsigned i = 0; i < m_numColumns; i++)
+    {
+        int64_t column = m_firstColumn + i;
+        int64_t columnStartIdx = (int64_t)(column * m_samplesPerColumn);
+        int64_t columnEndIdx = (int64_t)((column + 1) * m_samplesPerColumn);
+        if (columnEndIdx <= startIdx || columnStartIdx > endIdx)
+            continue;
+
+        for (int j = 0; j < m_numChannels; j++)
+            m_isComplete[j * m_capacity + i] = false;
+    }
+}
+
+
+// Moves the columns that are in both the old and new ranges to where they
+// belong in the new one. The rest need calculating.
+void DisplayCache::Scroll(int64_t firstColumn, unsigned numColumns)
+{
+    int64_t overlapStart = firstColumn > m_firstColumn ? firstColumn : m_firstColumn;
+    int64_t overlapEnd = firstColumn + numColumns;
+    if (m_firstColumn + m_numColumns < overlapEnd)
+        overlapEnd = m_firstColumn + m_numColumns;
+
+    unsigned numKept = 0;
+    unsigned dstIdx = 0;
+    if (overlapStart < overlapEnd)
+    {
+        numKept = overlapEnd - overlapStart;
+        dstIdx = overlapStart - firstColumn;
+        unsigned srcIdx = overlapStart - m_firstColumn;
+        for (int i = 0; i < m_numChannels; i++)
+        {
+            unsigned offset = i * m_capacity;
+            memmove(m_mins + offset + dstIdx, m_mins + offset + srcIdx, numKept * sizeof(int16_t));
+            memmove(m_maxes + offset + dstIdx, m_maxes + offset + srcIdx, numKept * sizeof(int16_t));
+            memmove(m_rmses + offset + dstIdx, m_rmses + offset + srcIdx, numKept * sizeof(double));
+            memmove(m_isComplete + offset + dstIdx, m_isComplete + offset + srcIdx, numKept * sizeof(bool));
+        }
+    }
+
+    for (int i = 0; i < m_numChannels; i++)
+    {
+        bool *isComplete = m_isComplete + i * m_capacity;
+        for (unsigned j = 0; j < numColumns; j++)
+        {
+            if (j < dstIdx || j >= dstIdx + numKept)
+                isComplete[j] = false;
+        }
+    }
+
+    m_firstColumn = firstColumn;
+    m_numColumns = numColumns;
+}
+
+
+void DisplayCache::DoTask(Task const &task)
+{
+    SoundChannel *chan = m_sound->m_channels[task.m_channelIdx];
+    unsigned offset = task.m_channelIdx * m_capacity + task.m_firstColumn;
+    chan->CalcDisplayColumns(m_columnStarts + task.m_firstColumn, task.m_numColumns,
+                             m_mins + offset, m_maxes + offset, m_rmses + offset, m_isComplete + offset);
+}
+
+
+// Does tasks until there are none left. The GUI thread and the workers all
+// call this.
+void DisplayCache::DoTasks()
+{
+    m_numWorkersBusy++;
+
+    int numTasks = m_numTasks;
+    while (numTasks > 0)
+    {
+        int taskIdx = m_nextTaskIdx++;
+        if (taskIdx >= numTasks)
+            break;
+
+        DoTask(m_tasks[taskIdx]);
+        m_numTasksDone++;
+    }
+
+    m_numWorkersBusy--;
+}
+
+
+void DisplayCache::RunTasks()
+{
+    int numColumns = 0;
+    for (unsigned i = 0; i < m_tasks.Size(); i++)
+        numColumns += m_tasks[i].m_numColumns;
+
+    if (numColumns < MIN_PARALLEL_COLUMNS)
+    {
+        for (unsigned i = 0; i < m_tasks.Size(); i++)
+            DoTask(m_tasks[i]);
+        return;
+    }
+
+    StartWorkers();
+
+    m_nextTaskIdx = 0;
+    m_numTasksDone = 0;
+    m_numTasks = m_tasks.Size();
+    m_tasksReady.Signal(m_numWorkersRunning);
+    DoTasks();
+
+    // Wait for the tasks the workers took, then make sure none of them is
+    // still looking at m_tasks before it changes.
+    while (m_numTasksDone < m_numTasks)
+        SleepMillisec(0);
+    m_numTasks = 0;
+    while (m_numWorkersBusy > 0)
+        SleepMillisec(0);
+}
+
+
+void DisplayCache::StartWorkers()
+{
+    if (m_workersStarted)
+        return;
+    m_workersStarted = true;
+
+    // The GUI thread does tasks too.
+    int numThreads = GetNumCores() - 1;
+    for (int i = 0; i < numThreads; i++)
+    {
+        m_numWorkersRunning++;
+        if (!StartThread(WorkerThreadProc, this))
+        {
+            m_numWorkersRunning--;
+            break;
+        }
+    }
+}
+
+
+unsigned long __stdcall DisplayCache::WorkerThreadProc(void *data)
+{
+    DisplayCache *cache = (DisplayCache *)data;
+    cache->RunWorker();
+    return 0;
+}
+
+
+// A worker that wakes too late to get a task finds none, and goes back to
+// sleep.
+void DisplayCache::RunWorker()
+{
+    while (1)
+    {
+        m_tasksReady.Wait();
+        if (m_stopWorkers)
+            break;
+        DoTasks();
+    }
+
+    m_numWorkersRunning--;
+}
+
+
+// ****************************************************************************
+// Public Functions
+// ****************************************************************************
+
+DisplayCache::DisplayCache()
+{
+    m_capacity = 0;
+    m_columnStarts = NULL;
+    m_mins = NULL;
+    m_maxes = NULL;
+    m_rmses = NULL;
+    m_isComplete = NULL;
+    m_numTasks = 0;
+    m_nextTaskIdx = 0;
+    m_numTasksDone = 0;
+    m_numWorkersBusy = 0;
+    m_workersStarted = false;
+    m_numWorkersRunning = 0;
+    m_stopWorkers = false;
+    Clear();
+}
+
+
+DisplayCache::~DisplayCache()
+{
+    m_stopWorkers = true;
+    m_tasksReady.Signal(m_numWorkersRunning);
+    while (m_numWorkersRunning > 0)
+        SleepMillisec(1);
+
+    delete[] m_columnStarts;
+    delete[] m_mins;
+    delete[] m_maxes;
+    delete[] m_rmses;
+    delete[] m_isComplete;
+}
+
+
+void DisplayCache::Clear()
+{
+    m_sound = NULL;
+    m_numChannels = 0;
+    m_editGeneration = 0;
+    m_samplesPerColumn = 0.0;
+    m_firstColumn = 0;
+    m_numColumns = 0;
+}
+
+
+bool DisplayCache::Update(Sound *sound, int64_t firstColumn, unsigned numColumns, double samplesPerColumn)
+{
+    // Loading a block takes about as long as drawing a frame, so only do a
+    // few per channel per call.
+    int const MAX_BLOCKS_TO_LOAD = 4;
+
+    if (sound != m_sound || sound->m_numChannels != m_numChannels ||
+        samplesPerColumn != m_samplesPerColumn || numColumns > m_capacity)
+    {
+        if (numColumns > m_capacity || numColumns * sound->m_numChannels > m_capacity * m_numChannels)
+        {
+            delete[] m_columnStarts;
+            delete[] m_mins;
+            delete[] m_maxes;
+            delete[] m_rmses;
+            delete[] m_isComplete;
+            m_columnStarts = new int64_t [numColumns + 1];
+            m_mins = new int16_t [numColumns * sound->m_numChannels];
+            m_maxes = new int16_t [numColumns * sound->m_numChannels];
+            m_rmses = new double [numColumns * sound->m_numChannels];
+            m_isComplete = new bool [numColumns * sound->m_numChannels];
+        }
+
+        m_sound = sound;
+        m_numChannels = sound->m_numChannels;
+        m_capacity = numColumns;
+        m_editGeneration = sound->GetEditGeneration();
+        m_samplesPerColumn = samplesPerColumn;
+        m_numColumns = 0;
+    }
+    else if (sound->GetEditGeneration() != m_editGeneration)
+    {
+        // Only the last edit's range is known. Any more than that and
+        // everything has to go.
+        int64_t startIdx = 0;
+        int64_t endIdx = INT64_MAX;
+        if (sound->GetEditGeneration() == m_editGeneration + 1)
+            sound->GetLastEdit(&startIdx, &endIdx);
+        Invalidate(startIdx, endIdx);
+        m_editGeneration = sound->GetEditGeneration();
+    }
+
+    Scroll(firstColumn, numColumns);
+
+    int64_t length = sound->GetLength();
+    for (unsigned i = 0; i <= numColumns; i++)
+    {
+        int64_t startIdx = (int64_t)((firstColumn + i) * samplesPerColumn);
+        m_columnStarts[i] = startIdx < length ? startIdx : length;
+    }
+
+    // A task for each run of columns that needs calculating, cut up so that
+    // the workers can share them.
+    m_tasks.Empty();
+    for (int i = 0; i < m_numChannels; i++)
+    {
+        bool *isComplete = m_isComplete + i * m_capacity;
+        unsigned runStart = 0;
+        while (runStart < numColumns)
+        {
+            if (isComplete[runStart])
+            {
+                runStart++;
+                continue;
+            }
+
+            unsigned runEnd = runStart + 1;
+            while (runEnd < numColumns && runEnd - runStart < COLUMNS_PER_TASK && !isComplete[runEnd])
+                runEnd++;
+
+            Task task;
+            task.m_channelIdx = i;
+            task.m_firstColumn = runStart;
+            task.m_numColumns = runEnd - runStart;
+            m_tasks.Push(task);
+            runStart = runEnd;
+        }
+    }
+
+    RunTasks();
+
+    // Only the GUI thread can load blocks.
+    bool complete = true;
+    for (int i = 0; i < m_numChannels; i++)
+    {
+        unsigned offset = i * m_capacity;
+        int numBlocksToLoad = MAX_BLOCKS_TO_LOAD;
+        sound->m_channels[i]->CompleteDisplayColumns(m_columnStarts, numColumns, m_mins + offset, m_maxes + offset,
+                                                     m_rmses + offset, m_isComplete + offset, &numBlocksToLoad);
+        for (unsigned j = 0; j < numColumns; j++)
+        {
+            if (!m_isComplete[offset + j])
+                complete = false;
+        }
+    }
+
+    return complete;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+// Project headers
+#include "df_lib_plus_plus/threading.h"
+
+// Contrib headers
+#include "containers/darray.h"
+
+// Standard headers
+#include <atomic>
+#include <stdint.h>
+
+
+class Sound;
+
+
+// Remembers the min, max and RMS of each column of the waveform display, so
+// that a frame only calculates the columns that have just scrolled into view,
+// or that an edit or a block load has changed since the last frame.
+//
+// Columns are on a fixed grid. Column i covers samples
+// [i * samplesPerColumn, (i + 1) * samplesPerColumn), each end rounded down,
+// so scrolling moves the view along the grid and the columns that stay on
+// screen are still right. Changing the zoom starts again. The Sound's edit
+// generation says when something has changed, and the range of the last edit
+// says which columns. Columns that skipped unloaded blocks are calculated
+// again every frame until they are complete.
+//
+// Every channel uses the same column boundaries, and each channel's columns
+// are calculated in one walk of its blocks. When there are a lot of columns
+// to calculate, they are cut into tasks of up to COLUMNS_PER_TASK columns of
+// one channel, and a pool of worker threads shares them with the GUI thread.
+// The workers sleep on m_tasksReady until RunTasks() has some for them. The
+// walks don't load blocks, so the columns that need unloaded blocks are
+// finished on the GUI thread afterwards.
+class DisplayCache
+{
+private:
+    struct Task
+    {
+        int         m_channelIdx;
+        unsigned    m_firstColumn;      // Index into the cached columns
+        unsigned    m_numColumns;
+    };
+
+    enum { COLUMNS_PER_TASK = 128 };
+    enum { MIN_PARALLEL_COLUMNS = 512 };    // Fewer than this aren't worth waking the workers for
+
+    Sound       *m_sound;
+    int         m_numChannels;
+    unsigned    m_editGeneration;
+    double      m_samplesPerColumn;
+    int64_t     m_firstColumn;
+    unsigned    m_numColumns;
+    unsigned    m_capacity;         // Columns allocated per channel
+
+    int64_t     *m_columnStarts;    // m_numColumns + 1 of them
+    int16_t     *m_mins;            // m_capacity per channel
+    int16_t     *m_maxes;
+    double      *m_rmses;
+    bool        *m_isComplete;
+
+    DArray <Task> m_tasks;
+    std::atomic<int> m_numTasks;    // Zero while the workers must leave m_tasks alone
+    std::atomic<int> m_nextTaskIdx;
+    std::atomic<int> m_numTasksDone;
+    std::atomic<int> m_numWorkersBusy;
+    bool        m_workersStarted;
+    std::atomic<int> m_numWorkersRunning;
+    std::atomic<bool> m_stopWorkers;
+    Semaphore   m_tasksReady;       // Signalled once per worker when there are tasks, or when they should stop
+
+    void Invalidate(int64_t startIdx, int64_t endIdx);
+    void Scroll(int64_t firstColumn, unsigned numColumns);
+
+    void DoTask(Task const &task);
+    void DoTasks();
+    void RunTasks();
+    void StartWorkers();
+    static unsigned long __stdcall WorkerThreadProc(void *data);
+    void RunWorker();
+
+public:
+    DisplayCache();
+    ~DisplayCache();
+
+    // Call when the Sound is replaced, even by one at the same address.
+    void Clear();
+
+    // Brings columns [firstColumn, firstColumn + numColumns) up to date for
+    // every channel. Returns false if some of them had to skip blocks that
+    // weren't loaded yet. Call again next frame to load more of them.
+    bool Update(Sound *sound, int64_t firstColumn, unsigned numColumns, double samplesPerColumn);
+
+    int16_t const *GetMins(int channelIdx) { return m_mins + channelIdx * m_capacity; }
+    int16_t const *GetMaxes(int channelIdx) { return m_maxes + channelIdx * m_capacity; }
+    double const *GetRmses(int channelIdx) { return m_rmses + channelIdx * m_capacity; }
+};
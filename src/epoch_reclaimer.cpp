@@ -0,0 +1,140 @@
+// Own header
+#include "epoch_reclaimer.h"
+
+// Contrib headers
+#include "df_common.h"
+
+
+EpochReclaimer g_epochReclaimer;
+
+
+EpochReclaimer::EpochReclaimer()
+{
+    m_epoch = 1;
+    for (int i = 0; i < MAX_READERS; i++)
+    {
+        m_readerEpochs[i] = 0;
+        m_readerSlotsUsed[i] = false;
+    }
+    m_readersExcluded = false;
+}
+
+
+int EpochReclaimer::AddReader()
+{
+    for (int i = 0; i < MAX_READERS; i++)
+    {
+        if (!m_readerSlotsUsed[i].exchange(true))
+            return i;
+    }
+
+    ReleaseAssert(0, "Too many epoch readers");
+    return -1;
+}
+
+
+void EpochReclaimer::RemoveReader(int readerIdx)
+{
+    DebugAssert(m_readerEpochs[readerIdx] == 0);
+    m_readerSlotsUsed[readerIdx] = false;
+}
+
+
+bool EpochReclaimer::BeginRead(int readerIdx)
+{
+    // Zero means not reading, so skip it when the epoch wraps.
+    unsigned epoch = m_epoch;
+    m_readerEpochs[readerIdx] = epoch ? epoch : 1;
+
+    if (m_readersExcluded)
+    {
+        m_readerEpochs[readerIdx] = 0;
+        return false;
+    }
+
+    return true;
+}
+
+
+void EpochReclaimer::EndRead(int readerIdx)
+{
+    m_readerEpochs[readerIdx] = 0;
+}
+
+
+void EpochReclaimer::Retire(void (*deleteFunc)(void *data), void *data)
+{
+    Retired retired;
+    retired.m_deleteFunc = deleteFunc;
+    retired.m_data = data;
+    retired.m_epoch = ++m_epoch;
+    m_retired.Push(retired);
+}
+
+
+bool EpochReclaimer::Reclaim()
+{
+    if (m_retired.Size() == 0)
+        return false;
+
+    // Find the earliest epoch a reader is still reading in. The comparisons
+    // are of differences, so that they survive the epoch wrapping.
+    unsigned epoch = m_epoch;
+    unsigned oldestEpoch = epoch;
+    for (int i = 0; i < MAX_READERS; i++)
+    {
+        unsigned readerEpoch = m_readerEpochs[i];
+        if (readerEpoch != 0 && (int)(readerEpoch - oldestEpoch) < 0)
+            oldestEpoch = readerEpoch;
+    }
+
+    // Versions retired at or before the oldest epoch being read in were
+    // swapped out before any current reader began.
+    unsigned numKept = 0;
+    for (unsigned i = 0; i < m_retired.Size(); i++)
+    {
+        Retired retired = m_retired[i];
+        if ((int)(oldestEpoch - retired.m_epoch) >= 0)
+            retired.m_deleteFunc(retired.m_data);
+        else
+            m_retired[numKept++] = retired;
+    }
+
+    m_retired.Resize(numKept);
+    return numKept > 0;
+}
+
+
+bool EpochReclaimer::IsWaiting(unsigned epoch)
+{
+    for (unsigned i = 0; i < m_retired.Size(); i++)
+    {
+        if ((int)(epoch - m_retired[i].m_epoch) >= 0)
+            return true;
+    }
+
+    return false;
+}
+
+
+bool EpochReclaimer::TryExcludeReaders()
+{
+    m_readersExcluded = true;
+
+    for (int i = 0; i < MAX_READERS; i++)
+    {
+        if (m_readerEpochs[i] != 0)
+        {
+            m_readersExcluded = false;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+void EpochReclaimer::AllowReaders()
+{
+    m_readersExcluded = false;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+// Contrib headers
+#include "containers/darray.h"
+
+// Standard headers
+#include <atomic>
+
+
+// Lets threads read data that the GUI thread replaces, without either side
+// taking a lock. The GUI thread publishes a new version by swapping a pointer,
+// then passes the old one to Retire(). Reclaim() deletes it once every reader
+// that might have picked it up has finished reading.
+//
+// Each reader thread calls AddReader() once, then brackets each read with
+// BeginRead() and EndRead(). A thread that stops reading for good calls
+// RemoveReader(), so that its slot can be reused. BeginRead() notes the current epoch in the
+// reader's slot. Retire() advances the epoch and stamps the old version with
+// it. A reader whose slot holds an earlier epoch could have loaded the
+// pointer before it was swapped, so the version waits until that reader has
+// ended its read. Readers must not hold on to what they read after
+// EndRead().
+//
+// The same slots tell the GUI thread when no reader is reading blocks, so
+// that it can compress them or page them out. TryExcludeReaders() fails if
+// a reader is part way through a read. Otherwise BeginRead() fails until
+// AllowReaders(). Neither side ever waits for the other.
+class EpochReclaimer
+{
+private:
+    enum { MAX_READERS = 32 };
+
+    struct Retired
+    {
+        void        (*m_deleteFunc)(void *data);
+        void        *m_data;
+        unsigned    m_epoch;
+    };
+
+    std::atomic<unsigned> m_epoch;
+    std::atomic<unsigned> m_readerEpochs[MAX_READERS];  // 0 while the reader isn't reading
+    std::atomic<bool> m_readerSlotsUsed[MAX_READERS];
+    std::atomic<bool> m_readersExcluded;
+    DArray <Retired> m_retired;     // Only the GUI thread uses this
+
+public:
+    EpochReclaimer();
+
+    // Any thread. AddReader() returns the reader's index.
+    int AddReader();
+    void RemoveReader(int readerIdx);
+
+    // The reader's thread.
+    bool BeginRead(int readerIdx);  // Returns false if the readers are excluded.
+    void EndRead(int readerIdx);
+
+    // The GUI thread. Reclaim() returns true if some versions are still
+    // waiting for readers. IsWaiting() returns true if a version retired at
+    // or before epoch is.
+    void Retire(void (*deleteFunc)(void *data), void *data);
+    bool Reclaim();
+    unsigned GetEpoch() { return m_epoch; }
+    bool IsWaiting(unsigned epoch);
+
+    bool TryExcludeReaders();
+    void AllowReaders();
+};
+
+
+extern EpochReclaimer g_epochReclaimer;
@@ -5,6 +5,7 @@
 #include "main.h"
 #include "sound.h"
 #include "sound_widget.h"
+#include "wav_saver.h"
 
 // Contrib headers
 #include "gui/container_vert.h"
@@ -65,7 +66,14 @@ void AppGui::Advance()
         sv->GetSelectionBlock(&startIdx, &endIdx);
         g_statusBar->SetLeftString("Pos: %.0f   Selection Size: %.0f", 
             (double)startIdx, (double)endIdx - startIdx + 1);
-        g_statusBar->SetRightString("Zoom: %.0f", sv->m_hZoomRatio);
+        if (sv->m_saver)
+            g_statusBar->SetRightString("Saving %.0f%%   Zoom: %.0f",
+                sv->m_saver->GetProgress() * 100.0, sv->m_hZoomRatio);
+        else if (sv->m_sound && sv->m_sound->IsLoading())
+            g_statusBar->SetRightString("Loading %.0f%% (Esc to cancel)   Zoom: %.0f",
+                sv->m_sound->GetLoadProgress() * 100.0, sv->m_hZoomRatio);
+        else
+            g_statusBar->SetRightString("Zoom: %.0f", sv->m_hZoomRatio);
     }
 
     GuiBase::Advance();
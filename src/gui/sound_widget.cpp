@@ -3,10 +3,20 @@
 
 // Project headers
 #include "app_gui.h"
+#include "block_allocator.h"
+#include "block_cache.h"
+#include "block_loader.h"
+#include "block_store.h"
+#include "display_cache.h"
+#include "epoch_reclaimer.h"
 #include "main.h"
+#include "sample_block.h"
+#include "sample_compressor.h"
 #include "sound.h"
 #include "sound_channel.h"
 #include "sound_system.h"
+#include "undo_history.h"
+#include "wav_saver.h"
 
 #include "df_lib_plus_plus/binary_stream_readers.h"
 #include "df_lib_plus_plus/binary_stream_writers.h"
@@ -14,6 +24,8 @@
 #include "df_lib_plus_plus/gui/mouse_cursor.h"
 #include "df_lib_plus_plus/gui/file_dialog.h"
 #include "df_lib_plus_plus/gui/status_bar.h"
+#include "df_lib_plus_plus/gui/widget_history.h"
+#include "df_lib_plus_plus/sound/sound_device.h"
 
 // Contrib headers
 #include "df_bitmap.h"
@@ -33,6 +45,40 @@
 // Private Methods
 // ***************************************************************************
 
+// Copy() puts a Sound that shares blocks with the original here. Pasting
+// within the program uses it directly. Other programs get a WAV of it, which
+// is only made if they ask for it.
+static Sound *s_clipboardSound = NULL;
+
+
+// Called by g_clipboard when another program pastes what Copy() promised.
+static void RenderClipboardWav(int type)
+{
+    if (!s_clipboardSound)
+        return;
+
+    int64_t const numGroups = s_clipboardSound->GetLength();
+    unsigned const bytesPerGroup = s_clipboardSound->GetBytesPerGroup();
+    if (numGroups * bytesPerGroup > INT_MAX - 1024)
+        return;     // Too big for Clipboard::RenderData()
+
+    BinaryDataWriter writer;
+    s_clipboardSound->WriteWavHeader(&writer, numGroups, Sound::FILE_FORMAT_WAV);
+
+    uint8_t *buf = new uint8_t[SampleBlock::MAX_SAMPLES * bytesPerGroup];
+    for (int64_t idx = 0; idx < numGroups; idx += SampleBlock::MAX_SAMPLES)
+    {
+        unsigned len = (unsigned)SAMPLE_MIN(numGroups - idx, (int64_t)SampleBlock::MAX_SAMPLES);
+        s_clipboardSound->InterleaveRange(buf, idx, len);
+        writer.WriteBytes((char const *)buf, len * bytesPerGroup);
+    }
+    delete[] buf;
+
+    s_clipboardSound->WriteWavTrailer(&writer, numGroups, Sound::FILE_FORMAT_WAV);
+    g_clipboard.RenderData(type, writer.m_data, (int)writer.m_dataLen);
+}
+
+
 static bool NearlyEqual(double a, double b)
 {
     double diff = fabs(a - b);
@@ -64,6 +110,33 @@ void SoundWidget::AdvanceSelection()
 }
 
 
+// While RMB is held, playback chases the mouse. The speed is what would catch
+// up with it in SCRUB_CHASE_SECONDS, so playback slows to a stop as it gets
+// there, and goes backwards if the mouse is behind it.
+void SoundWidget::AdvanceScrubbing()
+{
+    double const SCRUB_CHASE_SECONDS = 0.2;
+
+    if (g_gui->m_focussedWidget == this && IsMouseInBounds() && g_input.rmbClicked)
+        m_scrubbing = true;
+
+    if (!m_scrubbing)
+        return;
+
+    if (!g_input.rmb)
+    {
+        m_scrubbing = false;
+        g_soundSystem->StopScrubbing();
+        return;
+    }
+
+    double targetIdx = GetSampleIndexFromScreenPos(g_input.mouseX);
+    double speed = (targetIdx - m_playbackIdx) / (SCRUB_CHASE_SECONDS * m_sound->m_sampleRate);
+    g_soundSystem->Scrub(speed);
+    g_gui->m_canSleep = false;
+}
+
+
 void SoundWidget::AdvancePlaybackPos()
 {
     if (m_playbackIdx < 0)
@@ -106,13 +179,35 @@ void SoundWidget::RenderMarker(DfBitmap *bmp, int64_t sampleIdx, DfColour col)
 void SoundWidget::RenderWaveform(DfBitmap *bmp, double vZoomRatio)
 {
     DfColour soundColour = Colour(52, 152, 219);
+    DfColour rmsColour = Colour(133, 193, 233);
     int channelHeight = m_height / m_sound->m_numChannels;
 
+    // The columns are on a grid that doesn't move as the view scrolls, so
+    // the view snaps to the nearest one.
+    int64_t firstColumn = (int64_t)floor(m_hOffset / m_hZoomRatio + 0.5);
+    m_waveformIncomplete = !m_displayCache->Update(m_sound, firstColumn, m_width, m_hZoomRatio);
+    int64_t length = m_sound->GetLength();
+
     for (int chanIdx = 0; chanIdx < m_sound->m_numChannels; chanIdx++)
     {
-        SoundChannel *chan = m_sound->m_channels[chanIdx];
-
-        chan->CalcDisplayData(m_hOffset, m_displayMins, m_displayMaxes, m_width, m_hZoomRatio);
+        int16_t const *mins = m_displayCache->GetMins(chanIdx);
+        int16_t const *maxes = m_displayCache->GetMaxes(chanIdx);
+        double const *rmses = m_displayCache->GetRmses(chanIdx);
+        for (unsigned x = 0; x < m_width; x++)
+        {
+            m_displayMins[x] = mins[x];
+            m_displayMaxes[x] = maxes[x];
+
+            // Make each vline join onto the previous, so no gaps are visible.
+            bool isInSound = (int64_t)((firstColumn + x) * m_hZoomRatio) < length;
+            if (x > 0 && isInSound)
+            {
+                if (m_displayMins[x] > m_displayMaxes[x - 1])
+                    m_displayMins[x] = m_displayMaxes[x - 1] + 1;
+                if (m_displayMaxes[x] < m_displayMins[x - 1])
+                    m_displayMaxes[x] = m_displayMins[x - 1] - 1;
+            }
+        }
 
         int yMid = m_top + channelHeight * chanIdx + channelHeight / 2;
 
@@ -124,6 +219,14 @@ void SoundWidget::RenderWaveform(DfBitmap *bmp, double vZoomRatio)
                 PutPix(bmp, m_left + x, y, soundColour);
             else
                 VLine(bmp, m_left + x, y, vline_len, soundColour);
+
+            // The RMS is drawn inside the min/max as a band either side of
+            // zero, clipped to the column's own min and max.
+            double rmsTop = ClampDouble(rmses[x], mins[x], maxes[x]);
+            double rmsBottom = ClampDouble(-rmses[x], mins[x], maxes[x]);
+            int rmsLen = ceil((rmsTop - rmsBottom) * vZoomRatio);
+            if (rmsLen > 0)
+                VLine(bmp, m_left + x, ceil(yMid - rmsTop * vZoomRatio), rmsLen, rmsColour);
         }
 
         HLine(bmp, m_left, yMid, m_width, Colour(255, 255, 255, 60));
@@ -149,6 +252,23 @@ void SoundWidget::RenderWaveform(DfBitmap *bmp, double vZoomRatio)
 }
 
 
+// Shades the part of the Sound that the loader hasn't got to yet. Some of it
+// might have been loaded to draw it, but it's clearer to show the loader's
+// progress as one edge moving across the view.
+void SoundWidget::RenderLoadingOverlay(DfBitmap *bmp)
+{
+    if (!m_sound->IsLoading())
+        return;
+
+    double x = GetScreenPosFromSampleIndex(m_sound->GetLoadedLength());
+    if (x < m_left)
+        x = m_left;
+    int right = m_left + m_width;
+    if (x < right)
+        RectFill(bmp, x, m_top, right - x, m_height, Colour(44, 51, 59, 160));
+}
+
+
 void SoundWidget::RenderSelection(DfBitmap *bmp)
 {
     DfColour col = Colour(255, 40, 59, 63);
@@ -182,8 +302,12 @@ SoundWidget::SoundWidget(Widget *parent)
     : Widget(SOUND_VIEW_NAME, parent)
 {
     m_sound = NULL;
+    m_saver = NULL;
+    m_saveLoader = NULL;
+    m_saveEpoch = 0;
     m_displayMins = NULL;
     m_displayMaxes = NULL;
+    m_displayCache = new DisplayCache;
 
     Close();
 //     Open("c:/users/andy/desktop/andante.wav");
@@ -191,7 +315,13 @@ SoundWidget::SoundWidget(Widget *parent)
 //     m_selectionEnd = 3.3e6;
     m_selecting = false;
 
-    g_soundSystem->PlaySound(this);
+    int budgetMb = g_widgetHistory->GetInt("MemoryBudgetMb", BlockStore::DEFAULT_BUDGET_MB);
+    g_blockStore.SetBudget((int64_t)budgetMb * 1024 * 1024);
+    int undoBudgetMb = g_widgetHistory->GetInt("UndoBudgetMb", UndoHistory::DEFAULT_MEMORY_BUDGET / (1024 * 1024));
+    g_undoMemoryBudget = (size_t)undoBudgetMb * 1024 * 1024;
+    SetPlaybackBufferSize(g_widgetHistory->GetInt("PlaybackBufferSize", 0));
+
+    g_soundSystem->PlaySound(&m_sound);
 }
 
 
@@ -199,8 +329,7 @@ bool SoundWidget::Open(char const *filename)
 {
     Close();
     m_sound = new Sound();
-    BinaryFileReader binFileReader(filename);
-    return m_sound->LoadWav(&binFileReader);
+    return m_sound->MapWav(filename);
 }
 
 
@@ -232,6 +361,9 @@ void SoundWidget::Close()
     {
         delete m_sound;
         m_sound = NULL;
+        g_blockAllocator.Trim();
+        g_wideBlockAllocator.Trim();
+        g_lutAllocator.Trim();
     }
 
     m_hOffset = 0.0;
@@ -239,12 +371,309 @@ void SoundWidget::Close()
     m_hZoomRatio = m_targetHZoomRatio = -1.0;
 
     m_playbackPos = -1.0;
+    m_waveformIncomplete = false;
+    m_displayCache->Clear();
 
     m_selectionStart = -1.0;
     m_selectionEnd = -1.0;
 
     m_playbackIdx = 0;
-    m_isPlaying = false;
+    m_scrubbing = false;
+    g_soundSystem->ForgetSound();
+    g_soundSystem->StopScrubbing();
+    g_soundSystem->Pause();
+    g_soundSystem->Seek(0);
+}
+
+
+void SoundWidget::CancelLoad()
+{
+    if (!m_sound || !m_sound->IsLoading())
+        return;
+
+    g_statusBar->ShowMessage("Cancelled opening %s", m_sound->m_filename);
+    Close();
+}
+
+
+void SoundWidget::ShowMemoryStats()
+{
+    // The peaks of the allocators might not have been at the same time, so
+    // their sum is only an upper bound.
+    BlockAllocator *allocators[] = { &g_blockAllocator, &g_wideBlockAllocator, &g_lutAllocator };
+    double inUseMb = 0.0, peakMb = 0.0, slabMb = 0.0, freeMb = 0.0;
+    int numSlabs = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        BlockAllocator *allocator = allocators[i];
+        BlockAllocator::Stats stats;
+        allocator->GetStats(&stats);
+
+        double const MB_PER_BLOCK = allocator->GetItemSize() / (1024.0 * 1024.0);
+        double const MB_PER_SLAB = BlockAllocator::ITEMS_PER_SLAB * MB_PER_BLOCK;
+        inUseMb += stats.m_numItemsInUse * MB_PER_BLOCK;
+        peakMb += stats.m_highWaterMark * MB_PER_BLOCK;
+        slabMb += stats.m_numSlabs * MB_PER_SLAB;
+        freeMb += stats.m_numSlabs * MB_PER_SLAB * stats.m_fragmentation;
+        numSlabs += stats.m_numSlabs;
+    }
+
+    CompressedSamples::Stats compStats;
+    CompressedSamples::GetStats(&compStats);
+    double ratio = compStats.m_numCompressedBytes > 0 ?
+        (double)compStats.m_numRawBytes / (double)compStats.m_numCompressedBytes : 1.0;
+    double avgKb = compStats.m_numBlocks > 0 ?
+        compStats.m_numCompressedBytes / (1024.0 * compStats.m_numBlocks) : 0.0;
+    double decodeMsamplesPerSec = compStats.m_decodeSeconds > 0.0 ?
+        compStats.m_numSamplesDecoded / compStats.m_decodeSeconds / 1e6 : 0.0;
+    double msPerBlock = decodeMsamplesPerSec > 0.0 ?
+        SampleBlock::MAX_SAMPLES / (decodeMsamplesPerSec * 1e3) : 0.0;
+    double const BYTES_PER_MB = 1024.0 * 1024.0;
+
+    g_statusBar->ShowMessage("Sample blocks: %.0f MB in use, peak %.0f MB, %.0f MB in %d slabs, %.0f%% free. "
+        "Compressed: %d blocks, %.2f:1, %.0f KB each, decode %.0f Msamples/s (%.2f ms per block). "
+        "Decoded cache: %.0f of %.0f MB",
+        inUseMb, peakMb, slabMb, numSlabs, slabMb > 0.0 ? freeMb / slabMb * 100.0 : 0.0,
+        compStats.m_numBlocks, ratio, avgKb, decodeMsamplesPerSec, msPerBlock,
+        g_decodedBlockCache.GetNumBytes() / BYTES_PER_MB, g_decodedBlockCache.GetBudget() / BYTES_PER_MB);
+}
+
+
+void SoundWidget::ShowPagingStats()
+{
+    BlockStore::Stats stats;
+    g_blockStore.GetStats(&stats);
+
+    double const BYTES_PER_MB = 1024.0 * 1024.0;
+    g_statusBar->ShowMessage("Paging: %.0f of %.0f MB budget resident, %d blocks paged out, %.0f MB file. "
+        "%lld page outs (%.0f MB written). %lld page ins (%.0f MB read), %lld prefetched, %lld read through. "
+        "Stalled %.1f ms in total, %.1f ms at most",
+        stats.m_numResidentBytes / BYTES_PER_MB, g_blockStore.GetBudget() / BYTES_PER_MB,
+        stats.m_numPagedOutBlocks, stats.m_fileSize / BYTES_PER_MB,
+        (long long)stats.m_numPageOuts, stats.m_numPageOutBytes / BYTES_PER_MB,
+        (long long)(stats.m_numPageIns + stats.m_numPrefetches), stats.m_numPageInBytes / BYTES_PER_MB,
+        (long long)stats.m_numPrefetches, (long long)stats.m_numReadThroughs,
+        stats.m_stallSeconds * 1000.0, stats.m_maxStallSeconds * 1000.0);
+}
+
+
+// Returns the top of the histogram bucket that the given fraction of
+// callbacks fall within, in microseconds.
+static int GetCallbackPercentile(SoundDevice::Stats *stats, double fraction)
+{
+    int64_t numCallbacksLeft = (int64_t)(stats->m_numCallbacks * fraction);
+    for (int i = 0; i < SoundDevice::HISTOGRAM_SIZE - 1; i++)
+    {
+        numCallbacksLeft -= stats->m_callbackHistogram[i];
+        if (numCallbacksLeft <= 0)
+            return 2 << i;
+    }
+
+    return (int)(stats->m_maxCallbackSeconds * 1e6);
+}
+
+
+void SoundWidget::ShowPlaybackStats()
+{
+    SoundDevice *device = g_soundSystem->GetDevice();
+    SoundDevice::Stats stats;
+    device->GetStats(&stats);
+
+    // Mixing cost is per second of what the device plays, so that it reads
+    // as a share of one core.
+    SoundSystem::Stats mixStats;
+    g_soundSystem->GetStats(&mixStats);
+    double secondsMixed = mixStats.m_numSamplesMixed / (double)device->GetFreq();
+    double mixMsPerSecond = secondsMixed > 0.0 ? mixStats.m_mixSeconds * 1000.0 / secondsMixed : 0.0;
+    double percentResampled = mixStats.m_numSamplesMixed > 0 ?
+        mixStats.m_numSamplesResampled * 100.0 / mixStats.m_numSamplesMixed : 0.0;
+
+    int numBuffers = device->GetNumBuffers();
+    int samplesPerBuffer = device->GetSamplesPerChunk();
+    g_statusBar->ShowMessage("Playback: %d buffers of %d samples (%.0f ms), %s. "
+        "%lld callbacks, half under %d us, 99%% under %d us, longest %.0f us. "
+        "%lld underruns, %lld deadline misses. "
+        "Mixing takes %.2f ms per second, %.0f%% resampled",
+        numBuffers, samplesPerBuffer, numBuffers * samplesPerBuffer * 1000.0 / device->GetFreq(),
+        device->IsAdaptive() ? "adapting" : "fixed",
+        (long long)stats.m_numCallbacks, GetCallbackPercentile(&stats, 0.5), GetCallbackPercentile(&stats, 0.99),
+        stats.m_maxCallbackSeconds * 1e6,
+        (long long)stats.m_numUnderruns, (long long)stats.m_numDeadlineMisses,
+        mixMsPerSecond, percentResampled);
+}
+
+
+// Only affects blocks loaded or edited from now on. Blocks that are already
+// compressed stay that way.
+void SoundWidget::ToggleCompression()
+{
+    g_compressBlocks = !g_compressBlocks;
+    g_statusBar->ShowMessage(g_compressBlocks ? "Sample compression on" : "Sample compression off");
+}
+
+
+// Steps through a range of budgets suitable for different workstations. The
+// choice is remembered in the widget history.
+void SoundWidget::CycleMemoryBudget()
+{
+    static int const BUDGETS_MB[] = { 256, 512, 1024, 2048, 4096, 8192, 16384, 32768 };
+    int const NUM_BUDGETS = sizeof(BUDGETS_MB) / sizeof(BUDGETS_MB[0]);
+
+    int currentMb = (int)(g_blockStore.GetBudget() / (1024 * 1024));
+    int i = 0;
+    while (i < NUM_BUDGETS && BUDGETS_MB[i] <= currentMb)
+        i++;
+    int budgetMb = BUDGETS_MB[i % NUM_BUDGETS];
+
+    g_blockStore.SetBudget((int64_t)budgetMb * 1024 * 1024);
+    g_widgetHistory->SetInt("MemoryBudgetMb", budgetMb);
+    g_statusBar->ShowMessage("Memory budget for samples: %d MB", budgetMb);
+}
+
+
+// The same for the undo history, whose budget is separate. Applies to the
+// open sound straight away, and to sounds opened later. Kept within what a
+// 32-bit size_t can hold.
+void SoundWidget::CycleUndoBudget()
+{
+    static int const BUDGETS_MB[] = { 64, 128, 256, 512, 1024, 2048 };
+    int const NUM_BUDGETS = sizeof(BUDGETS_MB) / sizeof(BUDGETS_MB[0]);
+
+    int currentMb = (int)(g_undoMemoryBudget / (1024 * 1024));
+    int i = 0;
+    while (i < NUM_BUDGETS && BUDGETS_MB[i] <= currentMb)
+        i++;
+    int budgetMb = BUDGETS_MB[i % NUM_BUDGETS];
+
+    g_undoMemoryBudget = (size_t)budgetMb * 1024 * 1024;
+    if (m_sound)
+        m_sound->m_undoHistory->SetMemoryBudget(g_undoMemoryBudget);
+    g_widgetHistory->SetInt("UndoBudgetMb", budgetMb);
+    g_statusBar->ShowMessage("Memory budget for undo: %d MB", budgetMb);
+}
+
+
+// Zero means adapt to the machine, starting from the default size.
+void SoundWidget::SetPlaybackBufferSize(int samplesPerBuffer)
+{
+    SoundDevice *device = g_soundSystem->GetDevice();
+    if (samplesPerBuffer == 0)
+        device->SetBufferSizes(SoundDevice::DEFAULT_BUFFERS, SoundDevice::DEFAULT_SAMPLES_PER_BUFFER, true);
+    else
+        device->SetBufferSizes(SoundDevice::DEFAULT_BUFFERS, samplesPerBuffer, false);
+}
+
+
+// Steps through automatic, then fixed sizes from lowest latency to highest.
+// The choice is remembered in the widget history.
+void SoundWidget::CyclePlaybackLatency()
+{
+    static int const BUFFER_SIZES[] = { 0, 512, 1024, 2048, 4096 };
+    int const NUM_SIZES = sizeof(BUFFER_SIZES) / sizeof(BUFFER_SIZES[0]);
+
+    int current = g_widgetHistory->GetInt("PlaybackBufferSize", 0);
+    int i = 0;
+    while (i < NUM_SIZES && BUFFER_SIZES[i] != current)
+        i++;
+    int samplesPerBuffer = BUFFER_SIZES[(i + 1) % NUM_SIZES];
+
+    SetPlaybackBufferSize(samplesPerBuffer);
+    g_widgetHistory->SetInt("PlaybackBufferSize", samplesPerBuffer);
+
+    SoundDevice *device = g_soundSystem->GetDevice();
+    if (samplesPerBuffer == 0)
+        g_statusBar->ShowMessage("Playback latency: automatic");
+    else
+        g_statusBar->ShowMessage("Playback latency: %.0f ms",
+            device->GetNumBuffers() * samplesPerBuffer * 1000.0 / device->GetFreq());
+}
+
+
+// Starts saving in the background. Advance() calls FinishSave() when the
+// saver's threads are done.
+bool SoundWidget::Save()
+{
+    if (m_saver)
+    {
+        g_statusBar->ShowMessage("Already saving");
+        return false;
+    }
+
+    // The snapshot shares blocks with m_sound, so the user can carry on
+    // editing while it is saved.
+    Sound *snapshot = m_sound->Copy(0, m_sound->GetLength() - 1);
+    m_saver = new WavSaver(snapshot, m_sound->m_filename, m_sound->m_fileFormat);
+
+    // Blocks that haven't been loaded keep the file mapped, so the saver's
+    // threads load the ones the sound, its undo history and the clipboard
+    // hold. Blocks made from now on are loaded already.
+    DArray <SampleBlock *> blocks;
+    m_sound->ListUnloadedBlocks(&blocks);
+    if (s_clipboardSound)
+        s_clipboardSound->ListUnloadedBlocks(&blocks);
+    for (unsigned i = 0; i < blocks.Size(); i++)
+        m_saver->AddBlockToLoad(blocks[i]);
+
+    if (!m_saver->Start())
+    {
+        while (!m_saver->IsFinished())
+            SleepMillisec(1);
+        FinishSave();
+        return false;
+    }
+
+    // The saver does the rest of the loader's job, but the loader's threads
+    // hold references to blocks until they've skipped past them. So do the
+    // mixer's snapshots. Bring the mixer's up to date, so that only the ones
+    // retired before now can hold blocks the saver doesn't know about.
+    m_saveLoader = m_sound->GetLoader();
+    if (m_saveLoader)
+    {
+        m_saveLoader->AddRef();
+        m_sound->CancelLoading();
+    }
+    g_soundSystem->Advance();
+    m_saveEpoch = g_epochReclaimer.GetEpoch();
+
+    return true;
+}
+
+
+// True once the saver's threads are done, and nothing else can still hold
+// blocks that refer to the file it is going to replace.
+bool SoundWidget::IsSaveFinished()
+{
+    if (!m_saver->IsFinished())
+        return false;
+    if (m_saveLoader && !m_saveLoader->IsFinished())
+        return false;
+    return !g_epochReclaimer.IsWaiting(m_saveEpoch);
+}
+
+
+void SoundWidget::FinishSave()
+{
+    if (m_saveLoader)
+    {
+        m_saveLoader->Release();
+        m_saveLoader = NULL;
+    }
+
+    // The prefetch queue holds references to blocks too. PrefetchBlocks()
+    // fills it again next frame.
+    g_blockStore.Prefetch(NULL, 0);
+
+    // Loading made the blocks the undo history refers to bigger.
+    if (m_sound)
+        m_sound->m_undoHistory->BlocksLoaded();
+
+    if (m_saver->Finish())
+        g_statusBar->ShowMessage("Saved %s", m_saver->GetFilename());
+    else
+        g_statusBar->ShowMessage("Couldn't save %s", m_saver->GetFilename());
+
+    delete m_saver;
+    m_saver = NULL;
 }
 
 
@@ -262,15 +691,28 @@ void SoundWidget::Copy()
     int64_t selectionStart, selectionEnd;
     GetSelectionBlock(&selectionStart, &selectionEnd);
     if (selectionEnd > 0) {
-        BinaryDataWriter dataWriter;
-        m_sound->SaveWav(&dataWriter, selectionStart, selectionEnd);
-        g_clipboard.SetData(Clipboard::TYPE_WAV, dataWriter.m_data, dataWriter.m_dataLen);
+        delete s_clipboardSound;
+        s_clipboardSound = m_sound->Copy(selectionStart, selectionEnd);
+        g_clipboard.SetDelayedData(Clipboard::TYPE_WAV, RenderClipboardWav);
     }
 }
 
 
 void SoundWidget::Paste()
 {
+    // If nothing has replaced what Copy() put on the clipboard, skip making
+    // a WAV of it.
+    if (s_clipboardSound && g_clipboard.OwnsDelayedData())
+    {
+        Sound *s = s_clipboardSound->Copy(0, s_clipboardSound->GetLength() - 1);
+        m_sound->Insert(m_selectionStart, s);
+        return;
+    }
+
+    // Otherwise the copy is stale, and holds on to blocks for nothing.
+    delete s_clipboardSound;
+    s_clipboardSound = NULL;
+
     void *wavData = g_clipboard.GetData(Clipboard::TYPE_WAV);
     if (!wavData)
         return;
@@ -282,6 +724,29 @@ void SoundWidget::Paste()
 }
 
 
+void SoundWidget::Duplicate()
+{
+    int64_t selectionStart, selectionEnd;
+    GetSelectionBlock(&selectionStart, &selectionEnd);
+    if (selectionEnd > 0)
+        m_sound->Insert(selectionEnd + 1, m_sound->Copy(selectionStart, selectionEnd));
+}
+
+
+void SoundWidget::Undo()
+{
+    if (m_sound)
+        m_sound->Undo();
+}
+
+
+void SoundWidget::Redo()
+{
+    if (m_sound)
+        m_sound->Redo();
+}
+
+
 void SoundWidget::GetSelectionBlock(int64_t *startIdx, int64_t *endIdx)
 {
     if (m_selectionStart < m_selectionEnd || m_selectionEnd < 0)
@@ -300,21 +765,24 @@ void SoundWidget::GetSelectionBlock(int64_t *startIdx, int64_t *endIdx)
 void SoundWidget::TogglePlayback()
 {
     if (!m_sound) return;
-    m_isPlaying = !m_isPlaying;
+    if (g_soundSystem->IsPlaying())
+        g_soundSystem->Pause();
+    else
+        g_soundSystem->Play();
 }
 
 
 void SoundWidget::Play()
 {
     if (!m_sound) return;
-    m_isPlaying = true;
+    g_soundSystem->Play();
 }
 
 
 void SoundWidget::Pause()
 {
     if (!m_sound) return;
-    m_isPlaying = false;
+    g_soundSystem->Pause();
 }
 
 
@@ -360,14 +828,96 @@ void SoundWidget::SetRect(int x /* = -1 */, int y /* = -1 */, int w /* = -1 */,
 }
 
 
+// Asks g_blockStore to page in the blocks that playback will need in the next
+// few seconds, and, if the view is zoomed in far enough to draw from the
+// samples rather than the LUTs, the blocks in view.
+void SoundWidget::PrefetchBlocks()
+{
+    double const READ_AHEAD_SECONDS = 5.0;
+
+    DArray <SampleBlock *> blocks;
+    int64_t starts[2] = { -1, -1 };
+    int64_t ends[2] = { -1, -1 };
+    if (m_playbackIdx >= 0)
+    {
+        starts[0] = m_playbackIdx;
+        ends[0] = m_playbackIdx + (int64_t)(READ_AHEAD_SECONDS * m_sound->m_sampleRate);
+    }
+    if (m_hZoomRatio > 0.0 && m_hZoomRatio < SampleBlock::MIN_ROUGH_RANGE)
+    {
+        starts[1] = m_hOffset;
+        ends[1] = m_hOffset + m_width * m_hZoomRatio + 1;
+    }
+
+    for (int r = 0; r < 2; r++)
+    {
+        if (starts[r] < 0)
+            continue;
+
+        for (int i = 0; i < m_sound->m_numChannels; i++)
+        {
+            BlockDirectory *dir = &m_sound->m_channels[i]->m_blocks;
+            int64_t blockStartIdx;
+            int blockIdx = dir->FindBlock(starts[r], &blockStartIdx);
+            for (; blockIdx < dir->Size() && blockStartIdx < ends[r]; blockIdx++)
+            {
+                SampleBlock *block = (*dir)[blockIdx];
+                if (block->IsPagedOut())
+                    blocks.Push(block);
+                blockStartIdx += block->m_len;
+            }
+        }
+    }
+
+    g_blockStore.Prefetch(blocks.Size() > 0 ? &blocks[0] : NULL, blocks.Size());
+}
+
+
 void SoundWidget::Advance()
 {
+    if (m_saver)
+    {
+        if (IsSaveFinished())
+            FinishSave();
+        else
+            g_gui->m_canSleep = false;  // Keep the progress display moving
+    }
+
+    // Nothing can be paged out while the mixer or the saver's threads are
+    // reading blocks.
+    if (g_epochReclaimer.TryExcludeReaders())
+    {
+        if (g_blockStore.EnforceBudget())
+            g_gui->m_canSleep = false;
+        g_epochReclaimer.AllowReaders();
+    }
+
     if (!m_sound) return;
 
+    m_playbackIdx = g_soundSystem->GetPlaybackIdx();
+    PrefetchBlocks();
+
     if (m_hZoomRatio < 0.0)
         return;
 
     AdvanceSelection();
+    AdvanceScrubbing();
+
+    if (m_sound->UpdateDirtyLuts())
+        g_gui->m_canSleep = false;
+
+    // The same goes for compressing them.
+    if (g_epochReclaimer.TryExcludeReaders())
+    {
+        if (m_sound->CompressBlocks())
+            g_gui->m_canSleep = false;
+        g_epochReclaimer.AllowReaders();
+    }
+
+    // Keep rendering until all the blocks in view have been loaded, and
+    // while the loader's progress is changing.
+    if (m_waveformIncomplete || m_sound->IsLoading())
+        g_gui->m_canSleep = false;
 
     double hZoomRatioBefore = m_hZoomRatio;
     double maxHOffset = m_sound->GetLength() - m_width * m_hZoomRatio;
@@ -410,6 +960,7 @@ void SoundWidget::Advance()
     { 
         m_playbackIdx = GetSampleIndexFromScreenPos(g_input.mouseX);
         m_playbackPos = m_playbackIdx;
+        g_soundSystem->Seek(m_playbackIdx);
     }
 
 
@@ -443,7 +994,7 @@ void SoundWidget::Advance()
     }
 
     if (g_input.keyDowns[KEY_SPACE])
-        m_isPlaying = !m_isPlaying;
+        TogglePlayback();
 
 
     //
@@ -536,6 +1087,7 @@ void SoundWidget::Render()
     double vZoomRatio = (double)m_height / (65536 * m_sound->m_numChannels);
 
     RenderWaveform(g_window->bmp, vZoomRatio);
+    RenderLoadingOverlay(g_window->bmp);
     RenderSelection(g_window->bmp);
 
     if (m_playbackIdx)
@@ -546,9 +1098,11 @@ void SoundWidget::Render()
 char *SoundWidget::ExecuteCommand(char const *object, char const *command, char const *arguments)
 {
     if (0);
+    else if (COMMAND_IS("CancelLoad"))  CancelLoad();
     else if (COMMAND_IS("Close"))       Close();
     else if (COMMAND_IS("Copy"))        Copy();
     else if (COMMAND_IS("Delete"))      Delete();
+    else if (COMMAND_IS("Duplicate"))   Duplicate();
     else if (COMMAND_IS("FadeIn"))      FadeIn();
     else if (COMMAND_IS("FadeOut"))     FadeOut();
     else if (COMMAND_IS("Normalize"))   Normalize();
@@ -556,8 +1110,17 @@ char *SoundWidget::ExecuteCommand(char const *object, char const *command, char
     else if (COMMAND_IS("Paste"))       Paste();
     else if (COMMAND_IS("Pause"))       Pause();
     else if (COMMAND_IS("Play"))        Play();
-    else if (COMMAND_IS("Save"))        m_sound->SaveWav();
+    else if (COMMAND_IS("Redo"))        Redo();
+    else if (COMMAND_IS("Save"))        Save();
+    else if (COMMAND_IS("ShowMemoryStats")) ShowMemoryStats();
+    else if (COMMAND_IS("ToggleCompression")) ToggleCompression();
+    else if (COMMAND_IS("CycleMemoryBudget")) CycleMemoryBudget();
+    else if (COMMAND_IS("CycleUndoBudget")) CycleUndoBudget();
+    else if (COMMAND_IS("ShowPagingStats")) ShowPagingStats();
+    else if (COMMAND_IS("ShowPlaybackStats")) ShowPlaybackStats();
+    else if (COMMAND_IS("CyclePlaybackLatency")) CyclePlaybackLatency();
     else if (COMMAND_IS("TogglePlay"))  TogglePlayback();
+    else if (COMMAND_IS("Undo"))        Undo();
 
     return NULL;
 }
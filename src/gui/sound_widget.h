@@ -13,7 +13,10 @@
 
 
 typedef struct _DfBitmap DfBitmap;
+class BlockLoader;
+class DisplayCache;
 class Sound;
+class WavSaver;
 
 
 class SoundWidget: public Widget
@@ -26,25 +29,35 @@ private:
     int64_t m_selectionStart;   // These two can be in any order. Call GetSelectionBlock() to get a guarantee of start < end
     int64_t m_selectionEnd;     // Set to -1 if no selection.
     bool m_selecting;           // True if the user is currently has LMB held to create a selection block.
+    bool m_scrubbing;           // True while the user has RMB held to scrub.
+    bool m_waveformIncomplete;  // True if the last render had to skip blocks that weren't loaded yet.
+    DisplayCache *m_displayCache;
+    BlockLoader *m_saveLoader;  // The sound's loader when the save started, if it had one
+    unsigned m_saveEpoch;       // Snapshots retired before the save started might hold blocks it didn't load
 
     void AdvanceSelection();
+    void AdvanceScrubbing();
     void AdvancePlaybackPos();
+    void PrefetchBlocks();
+    bool IsSaveFinished();
+    void FinishSave();
 
     void RenderMarker(DfBitmap *bmp, int64_t sample_idx, DfColour col);
 
     void RenderWaveform(DfBitmap *bmp, double v_zoom_ratio);
+    void RenderLoadingOverlay(DfBitmap *bmp);
     void RenderSelection(DfBitmap *bmp);
 
 public:
     Sound *m_sound;
+    WavSaver *m_saver;          // NULL unless a save is in progress
 
-    int64_t m_playbackIdx;
-    bool m_isPlaying;
+    int64_t m_playbackIdx;      // Where g_soundSystem had got to at the start of this Advance()
 
     double m_hOffset;
     double m_hZoomRatio;
 
-    int16_t *m_displayMins;    // An array of length m_width.
+    int16_t *m_displayMins;    // An array of length m_width. The cached columns, joined up for drawing.
     int16_t *m_displayMaxes;   // An array of length m_width.
 
     SoundWidget(Widget *parent);
@@ -52,10 +65,23 @@ public:
     bool Open(char const *filename);
     bool OpenDialog();
     void Close();
+    void CancelLoad();
+    bool Save();
 
     void Delete();
     void Copy();
     void Paste();
+    void Duplicate();
+    void Undo();
+    void Redo();
+    void ShowMemoryStats();
+    void ShowPagingStats();
+    void ShowPlaybackStats();
+    void ToggleCompression();
+    void CycleMemoryBudget();
+    void CycleUndoBudget();
+    void SetPlaybackBufferSize(int samplesPerBuffer);
+    void CyclePlaybackLatency();
 
     void GetSelectionBlock(int64_t *startIdx, int64_t *endIdx);
 
@@ -3,9 +3,12 @@
 
 // Project headers
 #include "gui/app_gui.h"
+#include "sample_kernels.h"
 #include "sound_system.h"
+#include "sound/sound_device.h"
 
 // Contrib headers
+#include "clipboard.h"
 #include "gui/file_dialog.h"
 #include "gui/widget_history.h"
 #include "df_bitmap.h"
@@ -25,10 +28,12 @@
 
 int WINAPI WinMain(HINSTANCE, HINSTANCE, LPSTR, int)
 {
+    SampleKernelsInit();
+
     CreateWin(1000, 600, WT_WINDOWED, APPLICATION_NAME);
     g_defaultFont = FontCreate("Lucida Console", 10, 4);
 
-    g_soundSystem = new SoundSystem;
+    g_soundSystem = new SoundSystem(CreatePlatformSoundDevice());
 
     g_widgetHistory = new WidgetHistory("widget_history.txt");  // TODO - re-introduce the system_info module and make this filename be in the user's home folder.
     g_gui = new AppGui;
@@ -45,7 +50,11 @@ int WINAPI WinMain(HINSTANCE, HINSTANCE, LPSTR, int)
             g_gui->Advance();
 
             if (g_gui->m_exitAtEndOfFrame)
+            {
+                // Leave a WAV on the clipboard for other programs.
+                g_clipboard.Flush();
                 return 0;
+            }
 
             g_soundSystem->Advance();
         }
@@ -0,0 +1,238 @@
+// Own header
+#include "peak_file.h"
+
+// Project headers
+#include "sample_block.h"
+#include "df_lib_plus_plus/filesys_utils.h"
+#include "df_lib_plus_plus/mapped_file.h"
+
+// Contrib headers
+#include "containers/darray.h"
+#include "df_common.h"
+
+// Standard headers
+#include <memory.h>
+#include <string.h>
+#include <sys/stat.h>
+
+
+static char const PEAK_FILE_MAGIC[8] = "SSPEAKS";
+
+// The PeakFiles that are being written.
+static Mutex s_writersMutex;
+static DArray <PeakFile *> s_writers;
+
+
+// FNV-1a. Only has to notice that a file has changed, not resist attacks.
+static uint64_t HashBytes(uint64_t hash, uint8_t const *data, int64_t numBytes)
+{
+    for (int64_t i = 0; i < numBytes; i++)
+    {
+        hash ^= data[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+
+static char *AddExtension(char const *filename, char const *extension)
+{
+    char *result = new char [strlen(filename) + strlen(extension) + 1];
+    strcpy(result, filename);
+    strcat(result, extension);
+    return result;
+}
+
+
+// ****************************************************************************
+// Private Functions
+// ****************************************************************************
+
+PeakFile::PeakFile(char const *wavFilename, Header const &header)
+{
+    m_filename = AddExtension(wavFilename, ".peaks");
+    m_tempFilename = NULL;
+    m_header = header;
+    m_mapping = NULL;
+    m_file = NULL;
+    m_isWritten = NULL;
+    m_numItemsWritten = 0;
+}
+
+
+int64_t PeakFile::GetNumItems()
+{
+    int64_t numBlocks = (m_header.m_numGroups + SampleBlock::MAX_SAMPLES - 1) / SampleBlock::MAX_SAMPLES;
+    return numBlocks * m_header.m_numChannels;
+}
+
+
+// Returns -1 if the block doesn't match one of the WAV's blocks.
+int64_t PeakFile::GetItemIdx(int64_t firstGroup, unsigned channel, unsigned len)
+{
+    if (firstGroup % SampleBlock::MAX_SAMPLES != 0 || channel >= m_header.m_numChannels)
+        return -1;
+
+    int64_t expectedLen = m_header.m_numGroups - firstGroup;
+    if (expectedLen > SampleBlock::MAX_SAMPLES)
+        expectedLen = SampleBlock::MAX_SAMPLES;
+    if (len != expectedLen)
+        return -1;
+
+    return firstGroup / SampleBlock::MAX_SAMPLES * m_header.m_numChannels + channel;
+}
+
+
+// ****************************************************************************
+// Public Functions
+// ****************************************************************************
+
+PeakFile::~PeakFile()
+{
+    delete m_mapping;
+
+    if (m_file)
+    {
+        bool isComplete = m_numItemsWritten == GetNumItems();
+        if (isComplete)
+        {
+            fseek(m_file, 0, SEEK_SET);
+            fwrite(&m_header, sizeof(m_header), 1, m_file);
+        }
+
+        isComplete = isComplete && !ferror(m_file);
+        fclose(m_file);
+
+        if (!isComplete || !MoveFile_(m_tempFilename, m_filename))
+            RemoveFile(m_tempFilename);
+
+        MutexLocker lock(&s_writersMutex);
+        for (unsigned i = 0; i < s_writers.Size(); i++)
+        {
+            if (s_writers[i] == this)
+            {
+                s_writers[i] = s_writers[s_writers.Size() - 1];
+                s_writers.Pop();
+                break;
+            }
+        }
+    }
+
+    delete[] m_isWritten;
+    delete[] m_filename;
+    delete[] m_tempFilename;
+}
+
+
+PeakFile *PeakFile::Open(char const *wavFilename, MappedFile const *wav, int64_t dataOffset,
+                         int64_t numGroups, unsigned numChannels, int sampleFormat)
+{
+    int const NUM_BYTES_HASHED = 65536;
+
+    struct stat wavStat;
+    if (stat(wavFilename, &wavStat) != 0)
+        return NULL;
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.m_magic, PEAK_FILE_MAGIC, sizeof(header.m_magic));
+    header.m_version = VERSION;
+    header.m_blockLen = SampleBlock::MAX_SAMPLES;
+    header.m_lutStorageSize = SampleBlock::LUT_STORAGE_SIZE;
+    header.m_numChannels = numChannels;
+    header.m_wavSize = wav->m_size;
+    header.m_wavModificationTime = wavStat.st_mtime;
+    header.m_numGroups = numGroups;
+    header.m_sampleFormat = sampleFormat;
+
+    // The WAV's header, and the samples at each end, which is where a tool
+    // that rewrites it in place would most likely have changed it.
+    int64_t firstEnd = SAMPLE_MIN(dataOffset + NUM_BYTES_HASHED, wav->m_size);
+    int64_t lastStart = SAMPLE_MAX(wav->m_size - NUM_BYTES_HASHED, firstEnd);
+    uint64_t hash = 0xcbf29ce484222325ull;
+    hash = HashBytes(hash, wav->m_data, firstEnd);
+    hash = HashBytes(hash, wav->m_data + lastStart, wav->m_size - lastStart);
+    header.m_wavHash = hash;
+
+    PeakFile *peaks = new PeakFile(wavFilename, header);
+
+    int64_t expectedSize = sizeof(Header) + peaks->GetNumItems() * SampleBlock::LUT_STORAGE_SIZE;
+    MappedFile *mapping = new MappedFile(peaks->m_filename);
+    if (mapping->m_data && mapping->m_size == expectedSize &&
+        memcmp(mapping->m_data, &header, sizeof(header)) == 0)
+    {
+        peaks->m_mapping = mapping;
+        return peaks;
+    }
+
+    delete mapping;
+
+    // Blocks from an earlier open of the same WAV might still be writing
+    // its peak file.
+    MutexLocker lock(&s_writersMutex);
+    for (unsigned i = 0; i < s_writers.Size(); i++)
+    {
+        if (strcmp(s_writers[i]->m_filename, peaks->m_filename) == 0)
+        {
+            delete peaks;
+            return NULL;
+        }
+    }
+
+    // A temporary file, rather than writing the peak file in place, means a
+    // mapping of the old one that is still in use doesn't change under it.
+    peaks->m_tempFilename = AddExtension(peaks->m_filename, ".tmp");
+    peaks->m_file = fopen(peaks->m_tempFilename, "wb");
+    if (!peaks->m_file)
+    {
+        delete peaks;
+        return NULL;
+    }
+
+    s_writers.Push(peaks);
+
+    int64_t numItems = peaks->GetNumItems();
+    peaks->m_isWritten = new bool [numItems];
+    memset(peaks->m_isWritten, 0, numItems * sizeof(bool));
+    return peaks;
+}
+
+
+int16_t const *PeakFile::GetLuts(int64_t firstGroup, unsigned channel, unsigned len)
+{
+    if (!m_mapping)
+        return NULL;
+
+    int64_t itemIdx = GetItemIdx(firstGroup, channel, len);
+    if (itemIdx < 0)
+        return NULL;
+
+    return (int16_t const *)(m_mapping->m_data + sizeof(Header) + itemIdx * SampleBlock::LUT_STORAGE_SIZE);
+}
+
+
+void PeakFile::PutLuts(int64_t firstGroup, unsigned channel, unsigned len, int16_t const *luts)
+{
+    if (!m_file)
+        return;
+
+    int64_t itemIdx = GetItemIdx(firstGroup, channel, len);
+    if (itemIdx < 0)
+        return;
+
+    MutexLocker lock(&m_mutex);
+    if (m_isWritten[itemIdx])
+        return;
+
+    // The header is written last, so that an incomplete file never matches.
+    int64_t offset = sizeof(Header) + itemIdx * SampleBlock::LUT_STORAGE_SIZE;
+#ifdef _MSC_VER
+    _fseeki64(m_file, offset, SEEK_SET);
+#else
+    fseeko(m_file, offset, SEEK_SET);
+#endif
+    fwrite(luts, SampleBlock::LUT_STORAGE_SIZE, 1, m_file);
+    m_isWritten[itemIdx] = true;
+    m_numItemsWritten++;
+}
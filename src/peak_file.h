@@ -0,0 +1,82 @@
+#pragma once
+
+// Project headers
+#include "df_lib_plus_plus/mutex.h"
+
+// Standard headers
+#include <stdint.h>
+#include <stdio.h>
+
+
+class MappedFile;
+
+
+// A sidecar file next to a WAV that holds the LUTs of all its blocks, so that
+// reopening the WAV can draw the whole waveform straight away rather than
+// after the blocks have been loaded. Each block and channel has
+// LUT_STORAGE_SIZE bytes, laid out as SampleBlock holds them, so they can be
+// used straight out of a memory mapping.
+//
+// The header records the version, the WAV's size and modification time, and
+// a hash of the WAV's header and of the samples at each end of it. Checking
+// those costs next to nothing, and a peak file that doesn't match is rewritten
+// as if it wasn't there.
+//
+// A PeakFile is either mapped for reading, or being written as the blocks are
+// loaded. Writing goes to a temporary file, which is renamed when the
+// PeakFile is deleted if every block made it in. A cancelled load doesn't
+// leave a partial peak file behind.
+class PeakFile
+{
+private:
+    struct Header
+    {
+        char        m_magic[8];
+        uint32_t    m_version;
+        uint32_t    m_blockLen;         // SampleBlock::MAX_SAMPLES
+        uint32_t    m_lutStorageSize;   // SampleBlock::LUT_STORAGE_SIZE
+        uint32_t    m_numChannels;
+        int64_t     m_wavSize;
+        int64_t     m_wavModificationTime;
+        uint64_t    m_wavHash;
+        int64_t     m_numGroups;
+        uint32_t    m_sampleFormat;
+        uint32_t    m_padding;          // Makes the header 64 bytes, so the LUTs are 64 byte aligned
+    };
+
+    char            *m_filename;
+    char            *m_tempFilename;    // NULL if reading
+    Header          m_header;
+    MappedFile      *m_mapping;         // NULL if writing
+
+    Mutex           m_mutex;            // Held while writing
+    FILE            *m_file;            // NULL if reading
+    bool            *m_isWritten;       // One per item
+    int64_t         m_numItemsWritten;
+
+    PeakFile(char const *wavFilename, Header const &header);
+
+    int64_t GetNumItems();
+    int64_t GetItemIdx(int64_t firstGroup, unsigned channel, unsigned len);
+
+public:
+    enum { VERSION = 2 };
+
+    ~PeakFile();
+
+    // Maps the peak file of the WAV that is mapped in wav, if it has an up to
+    // date one. Otherwise starts writing a new one. Returns NULL if neither is
+    // possible.
+    static PeakFile *Open(char const *wavFilename, MappedFile const *wav, int64_t dataOffset,
+                          int64_t numGroups, unsigned numChannels, int sampleFormat);
+
+    bool IsWriting() { return m_file != NULL; }
+
+    // Returns the LUTs of the block that starts at firstGroup in the WAV and
+    // holds len groups, or NULL if the file doesn't have them.
+    int16_t const *GetLuts(int64_t firstGroup, unsigned channel, unsigned len);
+
+    // Stores the LUTs of a block when writing. Safe from any thread. Blocks
+    // that don't line up with the WAV's blocks are ignored.
+    void PutLuts(int64_t firstGroup, unsigned channel, unsigned len, int16_t const *luts);
+};
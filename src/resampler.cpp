@@ -0,0 +1,79 @@
+// Own header
+#include "resampler.h"
+
+// Project headers
+#include "sample_kernels.h"
+
+// Contrib headers
+#include "df_common.h"
+
+// Standard headers
+#include <math.h>
+
+
+Resampler::Resampler()
+{
+    double const PI = 3.14159265358979323846;
+    int const tableSize = NUM_ZERO_CROSSINGS * TABLE_RESOLUTION;
+    m_table[0] = 1.0f;
+    for (int i = 1; i < tableSize; i++)
+    {
+        double x = PI * i / TABLE_RESOLUTION;
+        double t = PI * i / tableSize;
+        double window = 0.42 + 0.5 * cos(t) + 0.08 * cos(2.0 * t);
+        m_table[i] = (float)(sin(x) / x * window);
+    }
+
+    // Zero at the edge, and one past it for the interpolation to read.
+    m_table[tableSize] = 0.0f;
+    m_table[tableSize + 1] = 0.0f;
+}
+
+
+// Rounded up to even, so that the number of taps is a multiple of 4, as
+// StereoFir() needs.
+int Resampler::GetHalfWidth(double maxStep)
+{
+    if (maxStep < 1.0)
+        maxStep = 1.0;
+    int halfWidth = (int)ceil(NUM_ZERO_CROSSINGS * maxStep);
+    return (halfWidth + 1) & ~1;
+}
+
+
+void Resampler::Resample(int16_t *dst, double const *positions, unsigned numSamples, double maxStep,
+                         float const *frames, int64_t framesStartIdx)
+{
+    DebugAssert(maxStep <= MAX_STEP);
+
+    int halfWidth = GetHalfWidth(maxStep);
+    int numTaps = halfWidth * 2;
+    double scale = maxStep > 1.0 ? 1.0 / maxStep : 1.0;
+    double const tableEnd = NUM_ZERO_CROSSINGS * TABLE_RESOLUTION;
+
+    for (unsigned i = 0; i < numSamples; i++)
+    {
+        int64_t firstTapIdx = (int64_t)floor(positions[i]) - halfWidth + 1;
+        double tableIdx = (firstTapIdx - positions[i]) * scale * TABLE_RESOLUTION;
+        double tableIncrement = scale * TABLE_RESOLUTION;
+        for (int j = 0; j < numTaps; j++)
+        {
+            double f = fabs(tableIdx);
+            float coef = 0.0f;
+            if (f < tableEnd)
+            {
+                int k = (int)f;
+                float frac = (float)(f - k);
+                coef = m_table[k] + (m_table[k + 1] - m_table[k]) * frac;
+            }
+            m_coefs[j] = coef * (float)scale;
+            tableIdx += tableIncrement;
+        }
+
+        float left, right;
+        g_sampleKernels.StereoFir(frames + (firstTapIdx - framesStartIdx) * 2, m_coefs, numTaps, &left, &right);
+
+        dst[i * 2] = (int16_t)ClampDouble(floor(left + 0.5), INT16_MIN, INT16_MAX);
+        dst[i * 2 + 1] = (int16_t)ClampDouble(floor(right + 0.5), INT16_MIN, INT16_MAX);
+    }
+}
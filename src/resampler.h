@@ -0,0 +1,42 @@
+#pragma once
+
+// Standard headers
+#include <stdint.h>
+
+
+// Plays stereo samples at a rate other than their own, by band-limited
+// interpolation. Each output sample is the input filtered by a Blackman
+// windowed sinc centred on where the output sample falls, which is usually
+// between two input samples. When the output steps through the input more
+// than a sample at a time, the sinc is stretched so that it cuts off below
+// the output's Nyquist frequency instead of the input's, so that nothing
+// aliases. That takes proportionally more taps.
+class Resampler
+{
+public:
+    enum { NUM_ZERO_CROSSINGS = 8 };    // Each side of the centre, when stepping a sample at a time or less
+    enum { MAX_STEP = 8 };              // Input samples per output sample
+    enum { MAX_TAPS = 2 * NUM_ZERO_CROSSINGS * MAX_STEP };
+
+private:
+    enum { TABLE_RESOLUTION = 512 };    // Entries per input sample
+
+    float       m_table[NUM_ZERO_CROSSINGS * TABLE_RESOLUTION + 2];    // The windowed sinc, from the centre out
+    float       m_coefs[MAX_TAPS];
+
+public:
+    Resampler();
+
+    // The number of input samples either side of a position that Resample()
+    // reads, when the position moves by up to maxStep per output sample. For
+    // a position p, it reads from floor(p) - halfWidth + 1 to floor(p) +
+    // halfWidth.
+    static int GetHalfWidth(double maxStep);
+
+    // Writes numSamples stereo samples to dst. Output sample i falls at input
+    // position positions[i]. The input is in frames, as interleaved left and
+    // right floats, starting from input sample framesStartIdx. The positions
+    // can go either way, but must not move more than maxStep at a time.
+    void Resample(int16_t *dst, double const *positions, unsigned numSamples, double maxStep,
+                  float const *frames, int64_t framesStartIdx);
+};
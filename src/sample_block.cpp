@@ -1,33 +1,604 @@
 // Own header
 #include "sample_block.h"
 
+// Project headers
+#include "block_allocator.h"
+#include "block_cache.h"
+#include "block_store.h"
+#include "peak_file.h"
+#include "sample_compressor.h"
+#include "sample_format.h"
+#include "sample_kernels.h"
+#include "df_lib_plus_plus/mapped_file.h"
+#include "df_lib_plus_plus/mutex.h"
 
-SampleBlock::SampleBlock()
+// Contrib headers
+#include "df_time.h"
+
+// Standard headers
+#include <memory.h>
+
+
+std::atomic<bool> g_compressBlocks(true);
+
+
+static unsigned const s_lutLevelOffsets[SampleBlock::NUM_LUT_LEVELS] = {
+    0,
+    SampleBlock::MAX_SAMPLES / 16,
+    SampleBlock::MAX_SAMPLES / 16 + SampleBlock::MAX_SAMPLES / 256,
+    SampleBlock::MAX_SAMPLES / 16 + SampleBlock::MAX_SAMPLES / 256 + SampleBlock::MAX_SAMPLES / 4096
+};
+
+
+SampleSource::SampleSource(MappedFile *file, uint8_t const *samples, SampleCodec const *codec, unsigned numChannels, PeakFile *peaks)
+{
+    m_file = file;
+    m_samples = samples;
+    m_codec = codec;
+    m_numChannels = numChannels;
+    m_peaks = peaks;
+    m_refCount = 1;
+}
+
+
+// Deleting the peak file finishes writing it.
+SampleSource::~SampleSource()
+{
+    delete m_peaks;
+    delete m_file;
+}
+
+
+// Held while a block that has just been loaded lets go of its source, or while
+// looking at the source of one that might be being loaded by another thread.
+static Mutex s_loadMutex;
+
+
+void SampleBlock::InitStoreState()
+{
+    m_isPagedOut = false;
+    m_recentlyUsed = true;
+    m_storePrev = NULL;
+    m_storeNext = NULL;
+    m_isInStore = false;
+    m_storeBytes = 0;
+    m_pageOffset = -1;
+    m_pageSize = 0;
+    m_pageIsCompressed = false;
+}
+
+
+void SampleBlock::AllocLuts()
+{
+    m_maxLut = (int16_t *)g_lutAllocator.Alloc();
+    m_minLut = m_maxLut + LUT_STRIDE;
+    m_powerLut = (uint32_t *)(m_minLut + LUT_STRIDE);
+}
+
+
+void SampleBlock::AllocSamples()
+{
+    m_samples = GetBlockAllocator(GetSampleSize())->Alloc();
+}
+
+
+void SampleBlock::FreeSamples()
+{
+    GetBlockAllocator(GetSampleSize())->Free(m_samples);
+    m_samples = NULL;
+}
+
+
+void SampleBlock::FetchSamples()
+{
+    Load();
+    if (m_isPagedOut)
+        g_blockStore.PageIn(this);
+    if (m_compressed)
+        g_decodedBlockCache.Fetch(this);
+}
+
+
+SampleBlock::SampleBlock(int sampleType)
 {
+    m_sampleType = sampleType;
+    AllocLuts();
+    AllocSamples();
     m_len = 0;
+    m_lutDirtyStart = 0;
+    m_lutDirtyEnd = 0;
+    m_refCount = 1;
+    m_isLoaded = true;
+    m_loadClaimed = true;
+    m_source = NULL;
+    m_sourceFirstGroup = 0;
+    m_sourceChannel = 0;
+    m_compressed = NULL;
+    m_isIncompressible = false;
+    m_cachePrev = NULL;
+    m_cacheNext = NULL;
+    m_isInCache = false;
+    InitStoreState();
+    g_blockStore.AddBlock(this);
+}
+
+
+SampleBlock::SampleBlock(SampleSource *source, int64_t firstGroup, unsigned channel, unsigned len)
+{
+    source->AddRef();
+    m_samples = NULL;
+    m_sampleType = source->m_codec->m_sampleType;
+    m_maxLut = NULL;
+    m_minLut = NULL;
+    m_powerLut = NULL;
+    m_len = len;
+    m_lutDirtyStart = 0;
+    m_lutDirtyEnd = 0;
+    m_refCount = 1;
+    m_isLoaded = false;
+    m_loadClaimed = false;
+    m_source = source;
+    m_sourceFirstGroup = firstGroup;
+    m_sourceChannel = channel;
+    m_compressed = NULL;
+    m_isIncompressible = false;
+    m_cachePrev = NULL;
+    m_cacheNext = NULL;
+    m_isInCache = false;
+    InitStoreState();
+}
+
+
+SampleBlock::~SampleBlock()
+{
+    g_blockStore.RemoveBlock(this);
+    if (m_compressed)
+    {
+        g_decodedBlockCache.Remove(this);
+        delete m_compressed;
+    }
+
+    GetBlockAllocator(GetSampleSize())->Free(m_samples);
+    g_lutAllocator.Free(m_maxLut);
+    if (m_source)
+        m_source->Release();
+}
+
+
+SampleBlock *SampleBlock::Clone()
+{
+    if (!IsLoaded())
+    {
+        MutexLocker lock(&s_loadMutex);
+        if (!IsLoaded())
+            return new SampleBlock(m_source, m_sourceFirstGroup, m_sourceChannel, m_len);
+    }
+
+    SampleBlock *clone = new SampleBlock(m_sampleType);
+    clone->m_len = m_len;
+    CopySamples(clone->m_samples, 0, m_len);
+    memcpy(clone->m_maxLut, m_maxLut, LUT_SIZE * sizeof(int16_t));
+    memcpy(clone->m_minLut, m_minLut, LUT_SIZE * sizeof(int16_t));
+    memcpy(clone->m_powerLut, m_powerLut, LUT_SIZE * sizeof(uint32_t));
+    clone->m_lutDirtyStart = m_lutDirtyStart;
+    clone->m_lutDirtyEnd = m_lutDirtyEnd;
+    return clone;
+}
+
+
+// Returns a new block containing len samples from startIdx. If this block
+// isn't loaded, the new one isn't either.
+SampleBlock *SampleBlock::CopyRange(unsigned startIdx, unsigned len)
+{
+    if (!IsLoaded())
+    {
+        MutexLocker lock(&s_loadMutex);
+        if (!IsLoaded())
+            return new SampleBlock(m_source, m_sourceFirstGroup + startIdx, m_sourceChannel, len);
+    }
+
+    SampleBlock *copy = new SampleBlock(m_sampleType);
+    copy->m_len = len;
+    CopySamples(copy->m_samples, startIdx, len);
+    copy->RecalcLuts();
+    return copy;
+}
+
+
+// Copies this block's channel out of the interleaved samples in the source,
+// compresses it if that's enabled, then lets go of the source. Only the last
+// step holds s_loadMutex, so the loader threads can work on different blocks
+// at once.
+void SampleBlock::Load()
+{
+    if (IsLoaded())
+        return;
+
+    if (m_loadClaimed.exchange(true))
+    {
+        // Another thread is loading it.
+        while (!IsLoaded())
+            SleepMillisec(1);
+        return;
+    }
+
+    AllocLuts();
+    AllocSamples();
+
+    SampleCodec const *codec = m_source->m_codec;
+    unsigned numChannels = m_source->m_numChannels;
+    uint8_t const *src = m_source->m_samples +
+        (m_sourceFirstGroup * numChannels + m_sourceChannel) * codec->m_bytesPerSample;
+    codec->DecodeChannel(m_samples, src, numChannels, m_len);
+
+    PeakFile *peaks = m_source->m_peaks;
+    int16_t const *peakLuts = peaks ? peaks->GetLuts(m_sourceFirstGroup, m_sourceChannel, m_len) : NULL;
+    if (peakLuts)
+    {
+        memcpy(m_maxLut, peakLuts, LUT_STORAGE_SIZE);
+    }
+    else
+    {
+        RecalcLuts();
+        if (peaks)
+            peaks->PutLuts(m_sourceFirstGroup, m_sourceChannel, m_len, m_maxLut);
+    }
+
+    if (g_compressBlocks)
+        Compress();
+    g_blockStore.AddBlock(this);
+
+    MutexLocker lock(&s_loadMutex);
+    m_source->Release();
+    m_source = NULL;
+    m_isLoaded = true;
+}
+
+
+size_t SampleBlock::GetMemoryUsed()
+{
+    if (!IsLoaded())
+        return 0;
+    if (m_isPagedOut)
+        return LUT_STORAGE_SIZE;
+    return LUT_STORAGE_SIZE + GetPayloadSize();
+}
+
+
+size_t SampleBlock::GetPayloadSize()
+{
+    if (m_compressed)
+        return m_compressed->GetNumBytes();
+    return GetSamplesStorageSize(GetSampleSize());
+}
+
+
+void const *SampleBlock::ReadSamples(unsigned startIdx, unsigned len, void *scratch)
+{
+    Load();
+    m_recentlyUsed = true;
+    if (m_isPagedOut && g_blockStore.ReadPagedOut(this, startIdx, len, scratch))
+        return scratch;
+    if (!m_compressed)
+        return (char *)m_samples + startIdx * GetSampleSize();
+
+    m_compressed->Decode(scratch, startIdx, len);
+    return scratch;
+}
+
+
+void SampleBlock::CopySamples(void *dst, unsigned startIdx, unsigned len)
+{
+    void const *src = ReadSamples(startIdx, len, dst);
+    if (src != dst)
+        memcpy(dst, src, len * GetSampleSize());
+}
+
+
+// Replaces the samples with a compressed copy, if that saves any memory.
+void SampleBlock::Compress()
+{
+    if (m_isPagedOut || m_compressed || m_isIncompressible)
+        return;
+
+    UpdateLuts();   // They can't be updated without the samples
+    m_compressed = CompressedSamples::Compress(m_sampleType, m_samples, m_len);
+    if (!m_compressed)
+    {
+        m_isIncompressible = true;
+        return;
+    }
+
+    FreeSamples();
+    g_blockStore.BlockChanged(this);
+}
+
+
+void SampleBlock::Decompress()
+{
+    if (m_isPagedOut)
+        g_blockStore.PageIn(this);
+
+    m_isIncompressible = false;
+    if (m_compressed)
+    {
+        // Take over the cache's copy if it has one.
+        g_decodedBlockCache.Remove(this);
+        if (!m_samples)
+        {
+            AllocSamples();
+            m_compressed->Decode(m_samples, 0, m_len);
+        }
+
+        delete m_compressed;
+        m_compressed = NULL;
+    }
+
+    g_blockStore.BlockChanged(this);
+}
+
+
+unsigned SampleBlock::GetSampleSize()
+{
+    return GetSampleTypeKernels(m_sampleType)->m_size;
+}
+
+
+SampleTypeKernels const *SampleBlock::GetKernels()
+{
+    return GetSampleTypeKernels(m_sampleType);
+}
+
+
+unsigned SampleBlock::GetLutLevelOffset(int level)
+{
+    return s_lutLevelOffsets[level];
 }
 
 
 void SampleBlock::RecalcLuts()
 {
-    int16_t *currentSample = m_samples;
-    int16_t *lastSample = m_samples + m_len;
-    for (unsigned i = 0; i < LUT_SIZE; i++)
+    m_lutDirtyStart = 0;
+    m_lutDirtyEnd = MAX_SAMPLES;
+    UpdateLuts();
+}
+
+
+void SampleBlock::InvalidateLuts(unsigned startIdx, unsigned endIdx)
+{
+    if (endIdx > MAX_SAMPLES)
+        endIdx = MAX_SAMPLES;
+    if (startIdx >= endIdx)
+        return;
+
+    if (LutsAreDirty())
+    {
+        m_lutDirtyStart = SAMPLE_MIN(startIdx, m_lutDirtyStart);
+        m_lutDirtyEnd = SAMPLE_MAX(endIdx, m_lutDirtyEnd);
+    }
+    else
+    {
+        m_lutDirtyStart = startIdx;
+        m_lutDirtyEnd = endIdx;
+    }
+
+    // Items beyond m_len are cheap to update, so only count the samples.
+    unsigned numDirtySamples = 0;
+    if (m_lutDirtyStart < m_len)
+        numDirtySamples = SAMPLE_MIN(m_lutDirtyEnd, m_len) - m_lutDirtyStart;
+    if (numDirtySamples <= MAX_IMMEDIATE_LUT_UPDATE)
+        UpdateLuts();
+}
+
+
+void SampleBlock::UpdateLuts()
+{
+    // Load() calls this before the block counts as loaded.
+    if (m_lutDirtyStart >= m_lutDirtyEnd || !m_samples)
+        return;
+
+    // Update the level 0 items from the samples. The kernel can only do whole
+    // items, so the item that straddles m_len is done here. Items that are
+    // beyond m_len end up as INT16_MAX/INT16_MIN with zero power, which means
+    // they never affect a result.
+    SampleTypeKernels const *kernels = GetKernels();
+    unsigned const shift0 = GetLutItemShift(0);
+    unsigned firstItem = m_lutDirtyStart >> shift0;
+    unsigned endItem = ((m_lutDirtyEnd - 1) >> shift0) + 1;
+    unsigned numFullItems = m_len >> shift0;
+    if (firstItem < numFullItems)
+    {
+        unsigned numItems = SAMPLE_MIN(endItem, numFullItems) - firstItem;
+        void const *samples = (char *)m_samples + (firstItem << shift0) * GetSampleSize();
+        kernels->MinMaxLut(samples, numItems, m_minLut + firstItem, m_maxLut + firstItem, m_powerLut + firstItem);
+    }
+
+    for (unsigned i = SAMPLE_MAX(firstItem, numFullItems); i < endItem; i++)
     {
         int16_t _min = INT16_MAX;
         int16_t _max = INT16_MIN;
-        for (unsigned j = 0; j < SAMPLES_PER_LUT_ITEM; j++)
+        double sumSq = 0.0;
+        unsigned startIdx = i << shift0;
+        if (startIdx < m_len)
+            kernels->MinMax((char *)m_samples + startIdx * GetSampleSize(), m_len - startIdx, &_min, &_max, &sumSq);
+        m_minLut[i] = _min;
+        m_maxLut[i] = _max;
+        m_powerLut[i] = (uint32_t)(sumSq / (1 << shift0));
+    }
+
+    // Update each of the other levels from the level below it.
+    unsigned const itemsPerItem = 1 << LUT_LEVEL_SHIFT;
+    for (int level = 1; level < NUM_LUT_LEVELS; level++)
+    {
+        unsigned shift = GetLutItemShift(level);
+        firstItem = m_lutDirtyStart >> shift;
+        endItem = ((m_lutDirtyEnd - 1) >> shift) + 1;
+        unsigned srcOffset = GetLutLevelOffset(level - 1) + firstItem * itemsPerItem;
+        unsigned dstOffset = GetLutLevelOffset(level) + firstItem;
+        g_sampleKernels.MinMaxLut(m_minLut + srcOffset, m_maxLut + srcOffset, m_powerLut + srcOffset, endItem - firstItem,
+            m_minLut + dstOffset, m_maxLut + dstOffset, m_powerLut + dstOffset);
+    }
+
+    m_lutDirtyStart = 0;
+    m_lutDirtyEnd = 0;
+}
+
+
+// Returns false without changing the results if mayFetch is false and it
+// needed samples that aren't resident.
+bool SampleBlock::CalcMinMaxLoaded(unsigned startIdx, unsigned endIdx, int16_t *resultMin, int16_t *resultMax, double *resultSumSq, bool mayFetch)
+{
+    if (endIdx > m_len)
+        endIdx = m_len;
+
+    int16_t _min = *resultMin;
+    int16_t _max = *resultMax;
+    double sumSq = 0.0;
+
+    unsigned idx = startIdx;
+    while (idx < endIdx)
+    {
+        // Find the coarsest LUT item that starts at idx and doesn't extend
+        // beyond endIdx. An item that hangs off the end of the block is fine
+        // if the range extends to the end of the block too, because the
+        // missing part of the item contains no samples. Items that overlap the
+        // dirty range are out of date, so we use finer items or the samples
+        // there instead.
+        int level = NUM_LUT_LEVELS - 1;
+        for (; level >= 0; level--)
         {
-            if (currentSample >= lastSample)
+            unsigned itemSize = 1 << GetLutItemShift(level);
+            bool isDirty = idx < m_lutDirtyEnd && idx + itemSize > m_lutDirtyStart;
+            if ((idx & (itemSize - 1)) == 0 &&
+                (idx + itemSize <= endIdx || endIdx == m_len) &&
+                !isDirty)
                 break;
-            //                _min = std::min(*currentSample, _min);
-            //                _max = std::max(*currentSample, _max);
-            _min = SAMPLE_MIN(*currentSample, _min);
-            _max = SAMPLE_MAX(*currentSample, _max);
-            currentSample++;
         }
 
-        m_maxLut[i] = _max;
-        m_minLut[i] = _min;
+        if (level < 0)
+        {
+            // No LUT item fits. Use the samples up to the next level 0
+            // boundary. If the block is compressed or paged out and the range
+            // is wide, fetching the samples for the few at its ends isn't
+            // worth it. The level 0 item is used instead, even though it covers a
+            // few samples beyond the range.
+            unsigned runEnd = (idx | ((1 << GetLutItemShift(0)) - 1)) + 1;
+            if (runEnd > endIdx)
+                runEnd = endIdx;
+            bool samplesAreResident = !m_isPagedOut && (!m_compressed || m_samples);
+            if (!samplesAreResident && endIdx - startIdx >= MIN_ROUGH_RANGE)
+            {
+                unsigned lutIdx = idx >> GetLutItemShift(0);
+                _min = SAMPLE_MIN(m_minLut[lutIdx], _min);
+                _max = SAMPLE_MAX(m_maxLut[lutIdx], _max);
+                // Its power stands in for the samples in the range. Any part
+                // of it beyond the end of the block counts, as it added zero.
+                unsigned weightEnd = endIdx == m_len ? (lutIdx + 1) << GetLutItemShift(0) : runEnd;
+                sumSq += (double)m_powerLut[lutIdx] * (weightEnd - idx);
+            }
+            else if (mayFetch)
+            {
+                GetKernels()->MinMax(GetSamples(idx), runEnd - idx, &_min, &_max, &sumSq);
+            }
+            else if (samplesAreResident)
+            {
+                // Without GetSamples(), which would touch g_decodedBlockCache.
+                m_recentlyUsed = true;
+                void const *samples = (char const *)m_samples + idx * GetSampleSize();
+                GetKernels()->MinMax(samples, runEnd - idx, &_min, &_max, &sumSq);
+            }
+            else
+            {
+                return false;
+            }
+            idx = runEnd;
+        }
+        else
+        {
+            unsigned shift = GetLutItemShift(level);
+            unsigned lutIdx = GetLutLevelOffset(level) + (idx >> shift);
+            _min = SAMPLE_MIN(m_minLut[lutIdx], _min);
+            _max = SAMPLE_MAX(m_maxLut[lutIdx], _max);
+            sumSq += (double)m_powerLut[lutIdx] * (1 << shift);
+            idx += 1 << shift;
+        }
     }
+
+    *resultMin = _min;
+    *resultMax = _max;
+    *resultSumSq += sumSq;
+    return true;
+}
+
+
+void SampleBlock::CalcMinMax(unsigned startIdx, unsigned endIdx, int16_t *resultMin, int16_t *resultMax, double *resultSumSq)
+{
+    if (!IsLoaded() && endIdx - startIdx >= MIN_ROUGH_RANGE &&
+        CalcMinMaxFromPeaks(startIdx, endIdx, resultMin, resultMax, resultSumSq))
+        return;
+
+    Load();
+    CalcMinMaxLoaded(startIdx, endIdx, resultMin, resultMax, resultSumSq, true);
+}
+
+
+bool SampleBlock::TryCalcMinMax(unsigned startIdx, unsigned endIdx, int16_t *resultMin, int16_t *resultMax, double *resultSumSq)
+{
+    if (!IsLoaded())
+        return false;
+
+    return CalcMinMaxLoaded(startIdx, endIdx, resultMin, resultMax, resultSumSq, false);
+}
+
+
+// The edges of the range are rounded out to whole level 0 items, as
+// CalcMinMax() does for blocks whose samples aren't resident.
+bool SampleBlock::CalcMinMaxFromPeaks(unsigned startIdx, unsigned endIdx, int16_t *resultMin, int16_t *resultMax, double *resultSumSq)
+{
+    if (endIdx > m_len)
+        endIdx = m_len;
+
+    // The source, and the peak file with it, goes away when the block is
+    // loaded.
+    MutexLocker lock(&s_loadMutex);
+    if (IsLoaded() || !m_source->m_peaks)
+        return false;
+
+    int16_t const *maxLut = m_source->m_peaks->GetLuts(m_sourceFirstGroup, m_sourceChannel, m_len);
+    if (!maxLut)
+        return false;
+    int16_t const *minLut = maxLut + LUT_STRIDE;
+    uint32_t const *powerLut = (uint32_t const *)(minLut + LUT_STRIDE);
+
+    int16_t _min = *resultMin;
+    int16_t _max = *resultMax;
+    double sumSq = 0.0;
+
+    unsigned idx = startIdx & ~((1 << GetLutItemShift(0)) - 1);
+    while (idx < endIdx)
+    {
+        int level = NUM_LUT_LEVELS - 1;
+        for (; level > 0; level--)
+        {
+            unsigned itemSize = 1 << GetLutItemShift(level);
+            if ((idx & (itemSize - 1)) == 0 && (idx + itemSize <= endIdx || endIdx == m_len))
+                break;
+        }
+
+        unsigned shift = GetLutItemShift(level);
+        unsigned lutIdx = GetLutLevelOffset(level) + (idx >> shift);
+        _min = SAMPLE_MIN(minLut[lutIdx], _min);
+        _max = SAMPLE_MAX(maxLut[lutIdx], _max);
+        unsigned weightStart = SAMPLE_MAX(idx, startIdx);
+        unsigned weightEnd = idx + (1 << shift);
+        if (endIdx < m_len)
+            weightEnd = SAMPLE_MIN(weightEnd, endIdx);
+        sumSq += (double)powerLut[lutIdx] * (weightEnd - weightStart);
+        idx += 1 << shift;
+    }
+
+    *resultMin = _min;
+    *resultMax = _max;
+    *resultSumSq += sumSq;
+    return true;
 }
@@ -1,6 +1,8 @@
 #pragma once
 
 
+#include <atomic>
+#include <stddef.h>
 #include <stdint.h>
 
 
@@ -8,18 +10,193 @@
 #define SAMPLE_MAX(a,b) ((a) > (b) ? (a) : (b))
 
 
+class CompressedSamples;
+class MappedFile;
+class PeakFile;
+struct SampleCodec;
+struct SampleTypeKernels;
+
+
+// Interleaved samples in a memory mapped file, which blocks can load their
+// samples from the first time they are needed. The file stays mapped until the
+// last block that hasn't been loaded yet lets go of it. So does the peak file,
+// if there is one.
+struct SampleSource
+{
+    MappedFile      *m_file;
+    uint8_t const   *m_samples;     // Points into m_file
+    SampleCodec const *m_codec;     // The format of the samples in the file
+    unsigned        m_numChannels;
+    PeakFile        *m_peaks;       // NULL if the file has no peak file and one can't be written
+    std::atomic<int> m_refCount;
+
+    SampleSource(MappedFile *file, uint8_t const *samples, SampleCodec const *codec, unsigned numChannels, PeakFile *peaks);
+    ~SampleSource();
+
+    void AddRef() { m_refCount++; }
+    void Release() { if (--m_refCount == 0) delete this; }
+};
+
+
+// The LUTs form a pyramid. Each item in level 0 summarizes 16 samples, each
+// item in level 1 summarizes 16 level 0 items (256 samples) and so on, up to
+// 65536 samples per item in level 3. An item holds the min, the max and the
+// power, which is the mean square of the samples it covers, counting any
+// beyond the end of the block as zero. CalcMinMax() walks the pyramid from
+// the coarsest level that fits the range, so the cost of a query is roughly
+// constant however many samples it covers.
+//
+// When samples are modified, only the LUT items that cover them need to be
+// recalculated. InvalidateLuts() does small updates immediately. Bigger ones
+// are left in the dirty range until something calls UpdateLuts(). Until then,
+// CalcMinMax() uses the samples in place of the out of date LUT items.
+//
+// Blocks are reference counted so that copies of a Sound can share them. A
+// shared block must not be modified. BlockDirectory::GetWritableBlock() gives
+// the caller a private copy first. The LUTs are the exception, since bringing
+// them up to date doesn't change what they describe.
+//
+// The samples are held as one of the SAMPLE_TYPE_* types. GetKernels() gives
+// the functions that work on that type. The LUTs are int16 whatever the type,
+// since they only feed the display.
+//
+// A block created from a SampleSource has no samples or LUTs until Load() is
+// called. GetSamples() and CalcMinMax() call it when they need to, so only
+// code that wants to avoid the cost of loading needs to check IsLoaded().
+// Load() may be called from any thread. Nothing else may be called on an
+// unloaded block from a thread other than the GUI thread. If the source has a
+// peak file with the block's LUTs, CalcMinMax() answers wide ranges from it
+// without loading the block, and Load() copies them rather than building them.
+//
+// Compress() swaps the samples for a CompressedSamples when g_compressBlocks
+// is set, which doesn't count as modifying the block. GetSamples() on a
+// compressed block gets a decoded copy from g_decodedBlockCache. That copy
+// can be evicted by the next GetSamples() on any other compressed block, so
+// the pointer mustn't be held across one. Other threads must use
+// ReadSamples() instead, and the GUI thread must not compress a block while
+// another thread is reading it. GetWritableBlock() calls Decompress().
+//
+// g_blockStore can page the samples out to disk under the same rule. The LUTs
+// stay in memory. GetSamples() and ReadSamples() bring the samples back.
 struct SampleBlock
 {
     enum { MAX_SAMPLES = 131072 };
-    enum { SAMPLES_PER_LUT_ITEM = 256 };	// For optimal results, set this to sqrt(sample_len / screen_width_in_pixels), rounded to the nearest power of 2.
-    enum { LUT_SIZE = MAX_SAMPLES / SAMPLES_PER_LUT_ITEM };
+    enum { NUM_LUT_LEVELS = 4 };
+    enum { LUT_LEVEL_SHIFT = 4 };   // log2 of the number of items summarized by each item in the level above.
+    enum { LUT_SIZE = MAX_SAMPLES / 16 + MAX_SAMPLES / 256 + MAX_SAMPLES / 4096 + MAX_SAMPLES / 65536 };
+    enum { LUT_STRIDE = (LUT_SIZE + 31) & ~31 };    // Keeps m_minLut 64 byte aligned
+    enum { LUT_STORAGE_SIZE = 2 * LUT_STRIDE * sizeof(int16_t) + LUT_STRIDE * sizeof(uint32_t) };
+    enum { MAX_IMMEDIATE_LUT_UPDATE = 16384 };  // Dirty ranges longer than this are left for UpdateLuts().
+    enum { MIN_ROUGH_RANGE = 256 }; // CalcMinMax() ranges this long don't decode compressed blocks for their ends.
 
-    int16_t     m_samples[MAX_SAMPLES];
+    void        *m_samples;  // NULL until loaded, and while compressed unless the cache has a copy. Use GetSamples().
+    int         m_sampleType;
     unsigned    m_len;   // Number of valid items in m_samples
-    int16_t     m_maxLut[LUT_SIZE];
-    int16_t     m_minLut[LUT_SIZE];
+    int16_t     *m_maxLut;      // All the levels, finest first. These share
+    int16_t     *m_minLut;      // an allocation from g_lutAllocator.
+    uint32_t    *m_powerLut;
+    unsigned    m_lutDirtyStart;    // The LUT items that cover samples in [m_lutDirtyStart, m_lutDirtyEnd)
+    unsigned    m_lutDirtyEnd;      // are out of date.
+    std::atomic<int> m_refCount;
+
+    std::atomic<bool> m_isLoaded;
+    std::atomic<bool> m_loadClaimed;    // Set by the thread that does the load
+    SampleSource *m_source;     // NULL once loaded
+    int64_t     m_sourceFirstGroup;
+    unsigned    m_sourceChannel;
+
+    CompressedSamples *m_compressed;    // NULL unless compressed
+    bool        m_isIncompressible; // Compress() failed to save anything and the samples haven't changed since
+
+    // Owned by g_decodedBlockCache, which keeps its blocks in an LRU list.
+    SampleBlock *m_cachePrev;
+    SampleBlock *m_cacheNext;
+    bool        m_isInCache;
+
+    // Owned by g_blockStore, which keeps its resident blocks in a circular
+    // list.
+    std::atomic<bool> m_isPagedOut;
+    std::atomic<bool> m_recentlyUsed;
+    SampleBlock *m_storePrev;
+    SampleBlock *m_storeNext;
+    bool        m_isInStore;
+    size_t      m_storeBytes;   // What the store counts for the block
+    int64_t     m_pageOffset;   // -1 unless the scratch file has a copy of the samples
+    unsigned    m_pageSize;
+    bool        m_pageIsCompressed;
 
-    SampleBlock();
+    void InitStoreState();
+    void AllocLuts();
+    void AllocSamples();
+    void FreeSamples();
+    void FetchSamples();
+    bool CalcMinMaxLoaded(unsigned startIdx, unsigned endIdx, int16_t *resultMin, int16_t *resultMax, double *resultSumSq, bool mayFetch);
+
+    SampleBlock(int sampleType);
+    SampleBlock(SampleSource *source, int64_t firstGroup, unsigned channel, unsigned len);
+    ~SampleBlock();
+
+    void AddRef() { m_refCount++; }
+    void Release() { if (--m_refCount == 0) delete this; }
+    bool IsShared() { return m_refCount > 1; }
+    SampleBlock *Clone();   // The clone has a ref count of 1.
+    SampleBlock *CopyRange(unsigned startIdx, unsigned len);
+
+    bool IsLoaded() { return m_isLoaded; }
+    void Load();
+    void *GetSamples(unsigned startIdx = 0)
+    {
+        if (!IsLoaded() || m_isPagedOut || m_compressed)
+            FetchSamples();
+        m_recentlyUsed = true;
+        return (char *)m_samples + startIdx * GetSampleSize();
+    }
+    unsigned GetSampleSize();
+    SampleTypeKernels const *GetKernels();
+    size_t GetMemoryUsed();     // Not counting a copy in g_decodedBlockCache
+    size_t GetPayloadSize();    // Bytes of samples, compressed or not
+
+    // Returns samples [startIdx, startIdx + len). If the block is compressed,
+    // they are decoded to scratch, which must have room for them. Safe from
+    // any thread.
+    void const *ReadSamples(unsigned startIdx, unsigned len, void *scratch);
+    void CopySamples(void *dst, unsigned startIdx, unsigned len);
+
+    bool IsCompressed() { return !m_isPagedOut && m_compressed != NULL; }
+    bool IsPagedOut() { return m_isPagedOut; }
+    bool NeedsCompressing() { return IsLoaded() && !m_isPagedOut && !m_compressed && !m_isIncompressible; }
+    void Compress();
+    void Decompress();  // Call before changing the samples.
+
+    static size_t GetSamplesStorageSize(unsigned sampleSize) { return MAX_SAMPLES * sampleSize; }
+
+    static unsigned GetLutItemShift(int level) { return (level + 1) * LUT_LEVEL_SHIFT; }
+    static unsigned GetLutLevelOffset(int level);
+    static unsigned GetLutLevelSize(int level) { return MAX_SAMPLES >> GetLutItemShift(level); }
 
     void RecalcLuts();
+    void InvalidateLuts(unsigned startIdx, unsigned endIdx);
+    void UpdateLuts();
+    bool LutsAreDirty() { return IsLoaded() && m_lutDirtyStart < m_lutDirtyEnd; }
+
+    // Calculates the min and max of the samples in the range [startIdx, endIdx).
+    // The result is combined with the values already in *resultMin and *resultMax.
+    // The sum of the squares of the samples is added to *resultSumSq.
+    void CalcMinMax(unsigned startIdx, unsigned endIdx, int16_t *resultMin, int16_t *resultMax, double *resultSumSq);
+
+    // Like CalcMinMax(), but returns false without doing anything if it would
+    // have to load, decode or page in samples. Safe from any thread while the
+    // GUI thread isn't changing how the block holds its samples.
+    bool TryCalcMinMax(unsigned startIdx, unsigned endIdx, int16_t *resultMin, int16_t *resultMax, double *resultSumSq);
+
+    // Like CalcMinMax(), but only for a block that hasn't been loaded and has
+    // LUTs in its source's peak file. Returns false without doing anything if
+    // that isn't the case. Unless the range covers the whole block, its edges
+    // are rounded out to level 0 items, so the caller should only use this
+    // for ranges of at least MIN_ROUGH_RANGE.
+    bool CalcMinMaxFromPeaks(unsigned startIdx, unsigned endIdx, int16_t *resultMin, int16_t *resultMax, double *resultSumSq);
 };
+
+
+// Whether loaded and edited blocks get compressed. Set from the GUI thread.
+extern std::atomic<bool> g_compressBlocks;
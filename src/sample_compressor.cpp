@@ -0,0 +1,561 @@
+// Own header
+#include "sample_compressor.h"
+
+// Project headers
+#include "sample_block.h"
+#include "sample_format.h"
+
+// Contrib headers
+#include "df_common.h"
+#include "df_time.h"
+
+// Standard headers
+#include <atomic>
+#include <memory.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+
+// How each frame starts. Anything below FRAME_CONSTANT is the order of the
+// predictor.
+enum
+{
+    FRAME_CONSTANT = 0xfe,  // Every sample is the same. Just that sample follows.
+    FRAME_VERBATIM = 0xff   // The samples follow as they are, because coding them didn't help.
+};
+
+enum { MAX_ORDER = 3 };
+enum { MAX_UNARY = 32 };    // Longer quotients are escaped and written in full
+enum { RICE_PARAM_BITS = 6 };
+
+// Reading runs up to 8 bytes ahead of the data it has used.
+enum { TAIL_PADDING = 8 };
+
+
+static std::atomic<int> s_numBlocks(0);
+static std::atomic<int64_t> s_numRawBytes(0);
+static std::atomic<int64_t> s_numCompressedBytes(0);
+static std::atomic<int64_t> s_numSamplesDecoded(0);
+static std::atomic<int64_t> s_decodeNanoseconds(0);
+
+
+// ****************************************************************************
+// Bit streams
+// ****************************************************************************
+
+static inline unsigned CountLeadingZeros(uint64_t val)
+{
+    if (val == 0)
+        return 64;
+#ifdef _MSC_VER
+    unsigned long idx;
+    if (_BitScanReverse(&idx, (unsigned long)(val >> 32)))
+        return 31 - idx;
+    _BitScanReverse(&idx, (unsigned long)val);
+    return 63 - idx;
+#else
+    return __builtin_clzll(val);
+#endif
+}
+
+
+// Writes bits most significant first.
+class BitWriter
+{
+private:
+    uint8_t     *m_p;
+    uint64_t    m_bits;     // The unwritten bits, at the top
+    unsigned    m_numBits;
+
+    void Flush()
+    {
+        while (m_numBits >= 8)
+        {
+            *m_p++ = (uint8_t)(m_bits >> 56);
+            m_bits <<= 8;
+            m_numBits -= 8;
+        }
+    }
+
+public:
+    BitWriter(uint8_t *dst) { m_p = dst; m_bits = 0; m_numBits = 0; }
+
+    // Writes the bottom numBits of val.
+    void Write(uint64_t val, unsigned numBits)
+    {
+        while (numBits > 32)
+        {
+            numBits -= 32;
+            Write(val >> numBits, 32);
+        }
+
+        if (numBits == 0)
+            return;
+        val &= ((uint64_t)1 << numBits) - 1;
+        m_bits |= val << (64 - m_numBits - numBits);
+        m_numBits += numBits;
+        Flush();
+    }
+
+    void WriteZeros(unsigned numBits)
+    {
+        m_numBits += numBits;
+        Flush();
+    }
+
+    // Pads to a whole number of bytes. Returns where the next byte goes.
+    uint8_t *Finish()
+    {
+        if (m_numBits > 0)
+            WriteZeros(8 - m_numBits);
+        return m_p;
+    }
+};
+
+
+class BitReader
+{
+private:
+    uint8_t const *m_p;
+    uint64_t    m_bits;     // The unread bits, at the top
+    unsigned    m_numBits;
+
+    void Refill()
+    {
+        while (m_numBits <= 56)
+        {
+            m_bits |= (uint64_t)*m_p++ << (56 - m_numBits);
+            m_numBits += 8;
+        }
+    }
+
+public:
+    BitReader(uint8_t const *src) { m_p = src; m_bits = 0; m_numBits = 0; }
+
+    uint64_t Read(unsigned numBits)
+    {
+        if (numBits > 32)
+        {
+            uint64_t high = Read(numBits - 32);
+            return (high << 32) | Read(32);
+        }
+
+        if (numBits == 0)
+            return 0;
+        Refill();
+        uint64_t val = m_bits >> (64 - numBits);
+        m_bits <<= numBits;
+        m_numBits -= numBits;
+        return val;
+    }
+
+    // Reads a Rice coded value with parameter k: the quotient in unary, as
+    // that many zeros and a one, then the bottom k bits. A quotient of
+    // MAX_UNARY or more is escaped, as MAX_UNARY zeros and then the whole
+    // value in escapeBits.
+    uint64_t ReadRice(unsigned k, unsigned escapeBits)
+    {
+        Refill();
+        unsigned numZeros = CountLeadingZeros(m_bits);
+        if (numZeros >= MAX_UNARY)
+        {
+            m_bits <<= MAX_UNARY;
+            m_numBits -= MAX_UNARY;
+            return Read(escapeBits);
+        }
+
+        m_bits <<= numZeros + 1;
+        m_numBits -= numZeros + 1;
+
+        // The refill left enough bits for the usual sizes of k.
+        if (k == 0)
+            return numZeros;
+        if (k > 24)
+            return ((uint64_t)numZeros << k) | Read(k);
+        uint64_t low = m_bits >> (64 - k);
+        m_bits <<= k;
+        m_numBits -= k;
+        return ((uint64_t)numZeros << k) | low;
+    }
+};
+
+
+// ****************************************************************************
+// Frames
+// ****************************************************************************
+
+static inline int64_t Predict(int order, int64_t x1, int64_t x2, int64_t x3)
+{
+    switch (order)
+    {
+    case 0: return 0;
+    case 1: return x1;
+    case 2: return 2 * x1 - x2;
+    default: return 3 * x1 - 3 * x2 + x3;
+    }
+}
+
+
+template <int ORDER>
+static inline int64_t PredictT(int64_t x1, int64_t x2, int64_t x3)
+{
+    return Predict(ORDER, x1, x2, x3);
+}
+
+
+static inline uint64_t ZigZag(int64_t val)
+{
+    return ((uint64_t)val << 1) ^ (uint64_t)(val >> 63);
+}
+
+
+static inline int64_t UnZigZag(uint64_t val)
+{
+    return (int64_t)(val >> 1) ^ -(int64_t)(val & 1);
+}
+
+
+static inline int64_t SignExtend(uint64_t val, unsigned numBits)
+{
+    return (int64_t)(val << (64 - numBits)) >> (64 - numBits);
+}
+
+
+// The largest residual a predictor of MAX_ORDER can make is 8 times the
+// largest sample, so the escaped form needs 3 more bits than a sample.
+template <typename T>
+static unsigned GetEscapeBits()
+{
+    return sizeof(T) * 8 + 3;
+}
+
+
+// Writes one frame to dst and returns the end of it. dst needs room for the
+// worst case, which is about 9 bytes per sample.
+template <typename T>
+static uint8_t *EncodeFrame(uint8_t *dst, T const *s, unsigned len)
+{
+    unsigned const typeBits = sizeof(T) * 8;
+
+    bool isConstant = true;
+    uint64_t allBits = 0;
+    for (unsigned i = 0; i < len; i++)
+    {
+        isConstant = isConstant && s[i] == s[0];
+        allBits |= (uint64_t)(int64_t)s[i];
+    }
+
+    if (isConstant)
+    {
+        dst[0] = FRAME_CONSTANT;
+        memcpy(dst + 1, s, sizeof(T));
+        return dst + 1 + sizeof(T);
+    }
+
+    // Skip the low bits that are zero in every sample.
+    unsigned shift = 0;
+    while (shift < typeBits - 1 && !((allBits >> shift) & 1))
+        shift++;
+    unsigned const valueBits = typeBits - shift;
+
+    // Choose the predictor that leaves the smallest residuals. Frames too
+    // short to judge use order 0.
+    int64_t sums[MAX_ORDER + 1] = { 0 };
+    for (unsigned i = MAX_ORDER; i < len; i++)
+    {
+        int64_t x0 = s[i] >> shift, x1 = s[i - 1] >> shift, x2 = s[i - 2] >> shift, x3 = s[i - 3] >> shift;
+        for (int order = 0; order <= MAX_ORDER; order++)
+        {
+            int64_t r = x0 - Predict(order, x1, x2, x3);
+            sums[order] += r < 0 ? -r : r;
+        }
+    }
+
+    int order = 0;
+    for (int i = 1; i <= MAX_ORDER; i++)
+    {
+        if (sums[i] < sums[order])
+            order = i;
+    }
+
+    dst[0] = order;
+    dst[1] = shift;
+    BitWriter bits(dst + 2);
+
+    int64_t x1 = 0, x2 = 0, x3 = 0;
+    for (int i = 0; i < order; i++)
+    {
+        int64_t x0 = s[i] >> shift;
+        bits.Write((uint64_t)x0, valueBits);
+        x3 = x2; x2 = x1; x1 = x0;
+    }
+
+    unsigned const escapeBits = GetEscapeBits<T>();
+    uint64_t residuals[CompressedSamples::PARTITION_SIZE];
+    for (unsigned partStart = 0; partStart < len; partStart += CompressedSamples::PARTITION_SIZE)
+    {
+        unsigned first = SAMPLE_MAX(partStart, (unsigned)order);
+        unsigned end = SAMPLE_MIN(partStart + CompressedSamples::PARTITION_SIZE, len);
+        if (first >= end)
+            continue;
+
+        uint64_t sum = 0;
+        for (unsigned i = first; i < end; i++)
+        {
+            int64_t x0 = s[i] >> shift;
+            uint64_t u = ZigZag(x0 - Predict(order, x1, x2, x3));
+            residuals[i - first] = u;
+            sum += u;
+            x3 = x2; x2 = x1; x1 = x0;
+        }
+
+        // The best parameter is close to log2 of the mean residual.
+        uint64_t n = end - first;
+        unsigned k = 0;
+        while (k < escapeBits && (n << (k + 1)) < sum)
+            k++;
+
+        bits.Write(k, RICE_PARAM_BITS);
+        for (unsigned i = 0; i < n; i++)
+        {
+            uint64_t u = residuals[i];
+            uint64_t q = u >> k;
+            if (q < MAX_UNARY)
+            {
+                bits.WriteZeros((unsigned)q);
+                bits.Write(1, 1);
+                bits.Write(u, k);
+            }
+            else
+            {
+                bits.WriteZeros(MAX_UNARY);
+                bits.Write(u, escapeBits);
+            }
+        }
+    }
+
+    return bits.Finish();
+}
+
+
+// The predictor's order is a template parameter, so that the inner loop
+// doesn't branch on it.
+template <typename T, int ORDER>
+static void DecodeResiduals(T *dst, BitReader *bits, unsigned len, unsigned shift, int64_t x1, int64_t x2, int64_t x3)
+{
+    unsigned const escapeBits = GetEscapeBits<T>();
+    for (unsigned partStart = 0; partStart < len; partStart += CompressedSamples::PARTITION_SIZE)
+    {
+        unsigned first = SAMPLE_MAX(partStart, (unsigned)ORDER);
+        unsigned end = SAMPLE_MIN(partStart + CompressedSamples::PARTITION_SIZE, len);
+        if (first >= end)
+            continue;
+
+        unsigned k = (unsigned)bits->Read(RICE_PARAM_BITS);
+        for (unsigned i = first; i < end; i++)
+        {
+            uint64_t u = bits->ReadRice(k, escapeBits);
+            int64_t x0 = UnZigZag(u) + PredictT<ORDER>(x1, x2, x3);
+            dst[i] = (T)((uint64_t)x0 << shift);
+            x3 = x2; x2 = x1; x1 = x0;
+        }
+    }
+}
+
+
+template <typename T>
+static void DecodeFrame(T *dst, uint8_t const *src, unsigned len)
+{
+    if (src[0] == FRAME_VERBATIM)
+    {
+        memcpy(dst, src + 1, len * sizeof(T));
+        return;
+    }
+
+    if (src[0] == FRAME_CONSTANT)
+    {
+        T val;
+        memcpy(&val, src + 1, sizeof(T));
+        for (unsigned i = 0; i < len; i++)
+            dst[i] = val;
+        return;
+    }
+
+    int const order = src[0];
+    unsigned const shift = src[1];
+    unsigned const valueBits = sizeof(T) * 8 - shift;
+    BitReader bits(src + 2);
+
+    int64_t x1 = 0, x2 = 0, x3 = 0;
+    for (int i = 0; i < order; i++)
+    {
+        int64_t x0 = SignExtend(bits.Read(valueBits), valueBits);
+        dst[i] = (T)((uint64_t)x0 << shift);
+        x3 = x2; x2 = x1; x1 = x0;
+    }
+
+    switch (order)
+    {
+    case 0: DecodeResiduals<T, 0>(dst, &bits, len, shift, x1, x2, x3); break;
+    case 1: DecodeResiduals<T, 1>(dst, &bits, len, shift, x1, x2, x3); break;
+    case 2: DecodeResiduals<T, 2>(dst, &bits, len, shift, x1, x2, x3); break;
+    default: DecodeResiduals<T, 3>(dst, &bits, len, shift, x1, x2, x3); break;
+    }
+}
+
+
+// Returns the number of bytes used, or 0 if it doesn't save anything. dst
+// needs room for every frame to be verbatim, plus the frame offsets and the
+// padding.
+template <typename T>
+static unsigned CompressT(uint8_t *dst, T const *samples, unsigned numSamples)
+{
+    unsigned const numFrames = (numSamples + CompressedSamples::FRAME_SIZE - 1) / CompressedSamples::FRAME_SIZE;
+    uint32_t *frameOffsets = (uint32_t *)dst;
+    uint8_t *p = dst + numFrames * sizeof(uint32_t);
+    uint8_t *frameBuf = new uint8_t[2 + MAX_ORDER * sizeof(T) + CompressedSamples::FRAME_SIZE * 9 + 64];
+
+    for (unsigned i = 0; i < numFrames; i++)
+    {
+        unsigned startIdx = i * CompressedSamples::FRAME_SIZE;
+        unsigned len = SAMPLE_MIN(numSamples - startIdx, (unsigned)CompressedSamples::FRAME_SIZE);
+        frameOffsets[i] = p - dst;
+
+        uint8_t *frameEnd = EncodeFrame(frameBuf, samples + startIdx, len);
+        size_t frameSize = frameEnd - frameBuf;
+        if (frameSize < 1 + len * sizeof(T))
+        {
+            memcpy(p, frameBuf, frameSize);
+            p += frameSize;
+        }
+        else
+        {
+            *p = FRAME_VERBATIM;
+            memcpy(p + 1, samples + startIdx, len * sizeof(T));
+            p += 1 + len * sizeof(T);
+        }
+    }
+
+    delete[] frameBuf;
+
+    unsigned numBytes = p - dst + TAIL_PADDING;
+    if (numBytes >= numSamples * sizeof(T))
+        return 0;
+
+    memset(p, 0, TAIL_PADDING);
+    return numBytes;
+}
+
+
+template <typename T>
+static void DecodeT(T *dst, uint8_t const *data, unsigned totalNumSamples, unsigned startIdx, unsigned numSamples)
+{
+    uint32_t const *frameOffsets = (uint32_t const *)data;
+    unsigned const endIdx = startIdx + numSamples;
+    T partialFrame[CompressedSamples::FRAME_SIZE];
+
+    for (unsigned frameIdx = startIdx / CompressedSamples::FRAME_SIZE; frameIdx * CompressedSamples::FRAME_SIZE < endIdx; frameIdx++)
+    {
+        unsigned frameStart = frameIdx * CompressedSamples::FRAME_SIZE;
+        unsigned frameLen = SAMPLE_MIN(totalNumSamples - frameStart, (unsigned)CompressedSamples::FRAME_SIZE);
+        unsigned first = SAMPLE_MAX(startIdx, frameStart);
+        unsigned end = SAMPLE_MIN(endIdx, frameStart + frameLen);
+        uint8_t const *frame = data + frameOffsets[frameIdx];
+
+        if (first == frameStart && end == frameStart + frameLen)
+        {
+            DecodeFrame(dst + frameStart - startIdx, frame, frameLen);
+        }
+        else
+        {
+            DecodeFrame(partialFrame, frame, frameLen);
+            memcpy(dst + first - startIdx, partialFrame + first - frameStart, (end - first) * sizeof(T));
+        }
+    }
+}
+
+
+// ****************************************************************************
+// Public Functions
+// ****************************************************************************
+
+CompressedSamples::CompressedSamples(int sampleType, unsigned numSamples, uint8_t *data, unsigned numBytes)
+{
+    m_sampleType = sampleType;
+    m_numSamples = numSamples;
+    m_data = data;
+    m_numBytes = numBytes;
+
+    s_numBlocks++;
+    s_numRawBytes += numSamples * GetSampleTypeKernels(sampleType)->m_size;
+    s_numCompressedBytes += numBytes;
+}
+
+
+CompressedSamples::~CompressedSamples()
+{
+    s_numBlocks--;
+    s_numRawBytes -= m_numSamples * GetSampleTypeKernels(m_sampleType)->m_size;
+    s_numCompressedBytes -= m_numBytes;
+    delete[] m_data;
+}
+
+
+CompressedSamples *CompressedSamples::Compress(int sampleType, void const *samples, unsigned numSamples)
+{
+    if (sampleType == SAMPLE_TYPE_FLOAT || numSamples == 0)
+        return NULL;
+
+    unsigned const sampleSize = GetSampleTypeKernels(sampleType)->m_size;
+    unsigned const numFrames = (numSamples + FRAME_SIZE - 1) / FRAME_SIZE;
+    uint8_t *buf = new uint8_t[numFrames * (sizeof(uint32_t) + 1) + numSamples * sampleSize + TAIL_PADDING];
+
+    unsigned numBytes;
+    if (sampleType == SAMPLE_TYPE_INT16)
+        numBytes = CompressT(buf, (int16_t const *)samples, numSamples);
+    else
+        numBytes = CompressT(buf, (int32_t const *)samples, numSamples);
+
+    if (numBytes == 0)
+    {
+        delete[] buf;
+        return NULL;
+    }
+
+    uint8_t *data = new uint8_t[numBytes];
+    memcpy(data, buf, numBytes);
+    delete[] buf;
+    return new CompressedSamples(sampleType, numSamples, data, numBytes);
+}
+
+
+CompressedSamples *CompressedSamples::FromData(int sampleType, unsigned numSamples, uint8_t *data, unsigned numBytes)
+{
+    return new CompressedSamples(sampleType, numSamples, data, numBytes);
+}
+
+
+void CompressedSamples::Decode(void *dst, unsigned startIdx, unsigned numSamples) const
+{
+    DebugAssert(startIdx + numSamples <= m_numSamples);
+
+    double startTime = GetRealTime();
+    if (m_sampleType == SAMPLE_TYPE_INT16)
+        DecodeT((int16_t *)dst, m_data, m_numSamples, startIdx, numSamples);
+    else
+        DecodeT((int32_t *)dst, m_data, m_numSamples, startIdx, numSamples);
+
+    s_numSamplesDecoded += numSamples;
+    s_decodeNanoseconds += (int64_t)((GetRealTime() - startTime) * 1e9);
+}
+
+
+void CompressedSamples::GetStats(Stats *stats)
+{
+    stats->m_numBlocks = s_numBlocks;
+    stats->m_numRawBytes = s_numRawBytes;
+    stats->m_numCompressedBytes = s_numCompressedBytes;
+    stats->m_numSamplesDecoded = s_numSamplesDecoded;
+    stats->m_decodeSeconds = s_decodeNanoseconds * 1e-9;
+}
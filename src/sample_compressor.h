@@ -0,0 +1,57 @@
+#pragma once
+
+
+#include <stdint.h>
+
+
+// Lossless compression for the samples of a SampleBlock. The samples are cut
+// into frames of FRAME_SIZE that are coded independently, so a range can be
+// decoded without decoding everything before it. Each frame uses whichever
+// fixed polynomial predictor (order 0 to 3) leaves the smallest residuals,
+// and Rice codes them with a parameter chosen per partition of
+// PARTITION_SIZE. Low bits that are zero throughout a frame, like the
+// padding of 8 and 24 bit samples, aren't stored. Float samples aren't
+// compressed.
+//
+// The data never changes once it has been made, so any number of threads may
+// decode it at once.
+class CompressedSamples
+{
+private:
+    uint8_t     *m_data;
+    unsigned    m_numBytes;
+    unsigned    m_numSamples;
+    int         m_sampleType;
+
+    CompressedSamples(int sampleType, unsigned numSamples, uint8_t *data, unsigned numBytes);
+
+public:
+    enum { FRAME_SIZE = 4096 };
+    enum { PARTITION_SIZE = 256 };
+
+    struct Stats
+    {
+        int         m_numBlocks;        // That are compressed at the moment
+        int64_t     m_numRawBytes;      // What those blocks' samples would take uncompressed
+        int64_t     m_numCompressedBytes;
+        int64_t     m_numSamplesDecoded;    // Since the program started
+        double      m_decodeSeconds;
+    };
+
+    ~CompressedSamples();
+
+    // Returns NULL if compressing the samples wouldn't save any memory.
+    static CompressedSamples *Compress(int sampleType, void const *samples, unsigned numSamples);
+
+    // Takes ownership of data, which must have been allocated with new[] and
+    // hold what GetData() returned for the same samples.
+    static CompressedSamples *FromData(int sampleType, unsigned numSamples, uint8_t *data, unsigned numBytes);
+
+    // Decodes samples [startIdx, startIdx + numSamples) to dst.
+    void Decode(void *dst, unsigned startIdx, unsigned numSamples) const;
+
+    uint8_t const *GetData() const { return m_data; }
+    unsigned GetNumBytes() const { return m_numBytes; }
+
+    static void GetStats(Stats *stats);
+};
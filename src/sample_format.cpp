@@ -0,0 +1,298 @@
+// Own header
+#include "sample_format.h"
+
+// Project headers
+#include "sample_block.h"
+#include "sample_kernels.h"
+
+// Contrib headers
+#include "df_common.h"
+
+// Standard headers
+#include <memory.h>
+
+
+// ****************************************************************************
+// Sample types
+// ****************************************************************************
+
+// What the kernel templates need to know about each sample type.
+template <typename T> struct SampleTraits;
+
+template <> struct SampleTraits<int16_t>
+{
+    static int16_t ToInt16(int16_t s) { return s; }
+    static double ToInt16Scale() { return 1.0; }
+};
+
+template <> struct SampleTraits<int32_t>
+{
+    static int16_t ToInt16(int32_t s) { return s >> 16; }
+    static double ToInt16Scale() { return 1.0 / 65536.0; }
+    static int32_t FromDouble(double d) { return (int32_t)ClampDouble(d, INT32_MIN, INT32_MAX); }
+};
+
+template <> struct SampleTraits<float>
+{
+    static int16_t ToInt16(float s)
+    {
+        if (s != s)     // NaN, which ClampDouble() would let through to the cast
+            return 0;
+        return (int16_t)ClampDouble(s * 32768.0, INT16_MIN, INT16_MAX);
+    }
+    static double ToInt16Scale() { return 32768.0; }
+    static float FromDouble(double d) { return (float)d; }
+};
+
+
+template <typename T>
+static void MinMaxT(void const *samples, unsigned numSamples, int16_t *resultMin, int16_t *resultMax, double *resultSumSq)
+{
+    if (numSamples == 0)
+        return;
+
+    T const *s = (T const *)samples;
+    T _min = s[0];
+    T _max = s[0];
+    double sumSq = 0.0;
+    for (unsigned i = 0; i < numSamples; i++)
+    {
+        _min = SAMPLE_MIN(s[i], _min);
+        _max = SAMPLE_MAX(s[i], _max);
+        sumSq += (double)s[i] * (double)s[i];
+    }
+
+    // Scaling preserves the order of samples, so it is enough to scale the
+    // results.
+    double scale = SampleTraits<T>::ToInt16Scale();
+    *resultMin = SAMPLE_MIN(SampleTraits<T>::ToInt16(_min), *resultMin);
+    *resultMax = SAMPLE_MAX(SampleTraits<T>::ToInt16(_max), *resultMax);
+    *resultSumSq += sumSq * scale * scale;
+}
+
+
+template <typename T>
+static void ToInt16T(int16_t *dst, unsigned dstStride, void const *samples, unsigned numSamples)
+{
+    T const *s = (T const *)samples;
+    for (unsigned i = 0; i < numSamples; i++)
+        dst[i * dstStride] = SampleTraits<T>::ToInt16(s[i]);
+}
+
+
+// Converts the samples to int16 a batch at a time, so that the LUT items are
+// the same as an int16 block's would be, and the int16 kernel does the rest.
+template <typename T>
+static void MinMaxLutT(void const *samples, unsigned numDstItems, int16_t *dstMins, int16_t *dstMaxes, uint32_t *dstPowers)
+{
+    unsigned const samplesPerItem = 1 << SampleBlock::GetLutItemShift(0);
+    unsigned const BATCH_SIZE = 1024;
+    int16_t batch[BATCH_SIZE];
+    DebugAssert(samplesPerItem <= BATCH_SIZE);
+    unsigned const itemsPerBatch = BATCH_SIZE / samplesPerItem;
+
+    T const *s = (T const *)samples;
+    for (unsigned i = 0; i < numDstItems; i += itemsPerBatch)
+    {
+        unsigned numItems = SAMPLE_MIN(numDstItems - i, itemsPerBatch);
+        ToInt16T<T>(batch, 1, s + i * samplesPerItem, numItems * samplesPerItem);
+        g_sampleKernels.MinMaxLut(batch, batch, NULL, numItems, dstMins + i, dstMaxes + i, dstPowers + i);
+    }
+}
+
+
+template <typename T>
+static double AbsMaxT(void const *samples, unsigned numSamples)
+{
+    T const *s = (T const *)samples;
+    double result = 0.0;
+    for (unsigned i = 0; i < numSamples; i++)
+    {
+        double val = s[i];
+        result = SAMPLE_MAX(val, result);
+        result = SAMPLE_MAX(-val, result);
+    }
+
+    return result;
+}
+
+
+template <typename T>
+static void GainT(void *samples, unsigned numSamples, double startVol, double volIncrement)
+{
+    T *s = (T *)samples;
+    for (unsigned i = 0; i < numSamples; i++)
+    {
+        double vol = startVol + (double)i * volIncrement;
+        s[i] = SampleTraits<T>::FromDouble(s[i] * vol);
+    }
+}
+
+
+// The int16 versions use the SIMD kernels.
+
+static void MinMaxInt16(void const *samples, unsigned numSamples, int16_t *resultMin, int16_t *resultMax, double *resultSumSq)
+{
+    uint64_t sumSq = 0;
+    g_sampleKernels.MinMax((int16_t const *)samples, numSamples, resultMin, resultMax, &sumSq);
+    *resultSumSq += (double)sumSq;
+}
+
+
+static void MinMaxLutInt16(void const *samples, unsigned numDstItems, int16_t *dstMins, int16_t *dstMaxes, uint32_t *dstPowers)
+{
+    int16_t const *s = (int16_t const *)samples;
+    g_sampleKernels.MinMaxLut(s, s, NULL, numDstItems, dstMins, dstMaxes, dstPowers);
+}
+
+
+static double AbsMaxInt16(void const *samples, unsigned numSamples)
+{
+    return g_sampleKernels.AbsMax((int16_t const *)samples, numSamples);
+}
+
+
+static void GainInt16(void *samples, unsigned numSamples, double startVol, double volIncrement)
+{
+    g_sampleKernels.Gain((int16_t *)samples, numSamples, startVol, volIncrement);
+}
+
+
+static SampleTypeKernels const s_sampleTypeKernels[SAMPLE_TYPE_NUM_TYPES] = {
+    { 2, INT16_MAX, MinMaxInt16, MinMaxLutInt16, AbsMaxInt16, GainInt16, ToInt16T<int16_t> },
+    { 4, INT32_MAX, MinMaxT<int32_t>, MinMaxLutT<int32_t>, AbsMaxT<int32_t>, GainT<int32_t>, ToInt16T<int32_t> },
+    { 4, 1.0, MinMaxT<float>, MinMaxLutT<float>, AbsMaxT<float>, GainT<float>, ToInt16T<float> }
+};
+
+
+// ****************************************************************************
+// File formats
+// ****************************************************************************
+
+// What the codec templates need to know about each file format. WAVs are
+// little endian, like the machines we run on.
+
+struct U8Sample
+{
+    typedef int16_t Type;
+    enum { SIZE = 1 };
+    static int16_t Read(uint8_t const *p) { return (p[0] - 128) << 8; }
+    static void Write(uint8_t *p, int16_t s) { p[0] = (s >> 8) + 128; }
+};
+
+struct S16Sample
+{
+    typedef int16_t Type;
+    enum { SIZE = 2 };
+    static int16_t Read(uint8_t const *p) { int16_t s; memcpy(&s, p, 2); return s; }
+    static void Write(uint8_t *p, int16_t s) { memcpy(p, &s, 2); }
+};
+
+struct S24Sample
+{
+    typedef int32_t Type;
+    enum { SIZE = 3 };
+    static int32_t Read(uint8_t const *p) { return (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24); }
+    static void Write(uint8_t *p, int32_t s) { p[0] = s >> 8; p[1] = s >> 16; p[2] = s >> 24; }
+};
+
+struct S32Sample
+{
+    typedef int32_t Type;
+    enum { SIZE = 4 };
+    static int32_t Read(uint8_t const *p) { int32_t s; memcpy(&s, p, 4); return s; }
+    static void Write(uint8_t *p, int32_t s) { memcpy(p, &s, 4); }
+};
+
+struct F32Sample
+{
+    typedef float Type;
+    enum { SIZE = 4 };
+    static float Read(uint8_t const *p) { float s; memcpy(&s, p, 4); return s; }
+    static void Write(uint8_t *p, float s) { memcpy(p, &s, 4); }
+};
+
+
+template <typename F>
+static void DecodeChannelT(void *dst, uint8_t const *src, unsigned numChannels, unsigned numSamples)
+{
+    typename F::Type *d = (typename F::Type *)dst;
+    unsigned const stride = numChannels * F::SIZE;
+    for (unsigned i = 0; i < numSamples; i++)
+        d[i] = F::Read(src + i * stride);
+}
+
+
+template <typename F>
+static void DecodeT(void * const *dsts, uint8_t const *src, unsigned numChannels, unsigned numGroups)
+{
+    for (unsigned chanIdx = 0; chanIdx < numChannels; chanIdx++)
+        DecodeChannelT<F>(dsts[chanIdx], src + chanIdx * F::SIZE, numChannels, numGroups);
+}
+
+
+template <typename F>
+static void EncodeT(uint8_t *dst, void const * const *srcs, unsigned numChannels, unsigned numGroups)
+{
+    unsigned const stride = numChannels * F::SIZE;
+    for (unsigned chanIdx = 0; chanIdx < numChannels; chanIdx++)
+    {
+        typename F::Type const *s = (typename F::Type const *)srcs[chanIdx];
+        uint8_t *d = dst + chanIdx * F::SIZE;
+        for (unsigned i = 0; i < numGroups; i++)
+            F::Write(d + i * stride, s[i]);
+    }
+}
+
+
+// 16 bit files are the common case, and have SIMD kernels.
+
+static void DecodeS16(void * const *dsts, uint8_t const *src, unsigned numChannels, unsigned numGroups)
+{
+    g_sampleKernels.Deinterleave((int16_t * const *)dsts, (int16_t const *)src, numChannels, numGroups);
+}
+
+
+static void EncodeS16(uint8_t *dst, void const * const *srcs, unsigned numChannels, unsigned numGroups)
+{
+    g_sampleKernels.Interleave((int16_t *)dst, (int16_t const * const *)srcs, numChannels, numGroups);
+}
+
+
+static SampleCodec const s_sampleCodecs[SAMPLE_FORMAT_NUM_FORMATS] = {
+    { SAMPLE_TYPE_INT16, 8, 1, false, DecodeT<U8Sample>, EncodeT<U8Sample>, DecodeChannelT<U8Sample> },
+    { SAMPLE_TYPE_INT16, 16, 2, false, DecodeS16, EncodeS16, DecodeChannelT<S16Sample> },
+    { SAMPLE_TYPE_INT32, 24, 3, false, DecodeT<S24Sample>, EncodeT<S24Sample>, DecodeChannelT<S24Sample> },
+    { SAMPLE_TYPE_INT32, 32, 4, false, DecodeT<S32Sample>, EncodeT<S32Sample>, DecodeChannelT<S32Sample> },
+    { SAMPLE_TYPE_FLOAT, 32, 4, true, DecodeT<F32Sample>, EncodeT<F32Sample>, DecodeChannelT<F32Sample> }
+};
+
+
+// ****************************************************************************
+// Public Functions
+// ****************************************************************************
+
+SampleTypeKernels const *GetSampleTypeKernels(int sampleType)
+{
+    DebugAssert(sampleType >= 0 && sampleType < SAMPLE_TYPE_NUM_TYPES);
+    return &s_sampleTypeKernels[sampleType];
+}
+
+
+SampleCodec const *GetSampleCodec(int sampleFormat)
+{
+    DebugAssert(sampleFormat >= 0 && sampleFormat < SAMPLE_FORMAT_NUM_FORMATS);
+    return &s_sampleCodecs[sampleFormat];
+}
+
+
+int FindSampleFormat(unsigned bitsPerSample, bool isFloat)
+{
+    for (int i = 0; i < SAMPLE_FORMAT_NUM_FORMATS; i++)
+    {
+        if (s_sampleCodecs[i].m_bitsPerSample == bitsPerSample && s_sampleCodecs[i].m_isFloat == isFloat)
+            return i;
+    }
+
+    return -1;
+}
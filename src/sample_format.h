@@ -0,0 +1,74 @@
+#pragma once
+
+
+#include <stdint.h>
+
+
+// How samples are held in memory. Each format a file can use is held in the
+// smallest of these that represents it exactly.
+enum
+{
+    SAMPLE_TYPE_INT16,      // 8 and 16 bit files
+    SAMPLE_TYPE_INT32,      // 24 and 32 bit files. 24 bit samples are shifted up by 8 bits.
+    SAMPLE_TYPE_FLOAT,      // 32 bit float files
+    SAMPLE_TYPE_NUM_TYPES
+};
+
+
+// How samples are held in a WAV file.
+enum
+{
+    SAMPLE_FORMAT_U8,
+    SAMPLE_FORMAT_S16,
+    SAMPLE_FORMAT_S24,
+    SAMPLE_FORMAT_S32,
+    SAMPLE_FORMAT_F32,
+    SAMPLE_FORMAT_NUM_FORMATS
+};
+
+
+// The operations whose inner loops depend on the sample type. Each table is
+// built from templates specialised for its type, so there is a switch on the
+// type per block rather than per sample. The int16 table uses g_sampleKernels.
+struct SampleTypeKernels
+{
+    unsigned m_size;        // Bytes per sample
+    double m_maxValue;      // The largest positive sample value
+
+    // Like the SampleKernels functions of the same names, except that the
+    // results are scaled to the int16 range, which is what the LUTs and the
+    // display use. MinMaxLut() summarizes samples into level 0 LUT items.
+    void (*MinMax)(void const *samples, unsigned numSamples, int16_t *resultMin, int16_t *resultMax, double *resultSumSq);
+    void (*MinMaxLut)(void const *samples, unsigned numDstItems, int16_t *dstMins, int16_t *dstMaxes, uint32_t *dstPowers);
+
+    double (*AbsMax)(void const *samples, unsigned numSamples);
+    void (*Gain)(void *samples, unsigned numSamples, double startVol, double volIncrement);
+
+    // Scales samples to int16 for playback. Writes every dstStride'th item
+    // of dst.
+    void (*ToInt16)(int16_t *dst, unsigned dstStride, void const *samples, unsigned numSamples);
+};
+
+
+// Converts between the way samples are held in a file and in memory.
+struct SampleCodec
+{
+    int m_sampleType;
+    unsigned m_bitsPerSample;   // In the file
+    unsigned m_bytesPerSample;  // In the file
+    bool m_isFloat;
+
+    // Interleaved file samples to one array per channel, and back.
+    void (*Decode)(void * const *dsts, uint8_t const *src, unsigned numChannels, unsigned numGroups);
+    void (*Encode)(uint8_t *dst, void const * const *srcs, unsigned numChannels, unsigned numGroups);
+
+    // Decodes one channel. src points at that channel's first sample.
+    void (*DecodeChannel)(void *dst, uint8_t const *src, unsigned numChannels, unsigned numSamples);
+};
+
+
+SampleTypeKernels const *GetSampleTypeKernels(int sampleType);
+SampleCodec const *GetSampleCodec(int sampleFormat);
+
+// Returns -1 if there isn't a format with that description.
+int FindSampleFormat(unsigned bitsPerSample, bool isFloat);
@@ -0,0 +1,766 @@
+// Own header
+#include "sample_kernels.h"
+
+// Project headers
+#include "sample_block.h"
+
+// Contrib headers
+#include "df_common.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define SAMPLE_KERNELS_X86
+#endif
+
+#ifdef SAMPLE_KERNELS_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+// MSVC lets us use any intrinsic in any function. GCC and Clang need to be
+// told which functions may use instructions beyond the baseline.
+#if defined(_MSC_VER)
+#define TARGET_SSE2
+#define TARGET_AVX2
+#else
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+
+// ****************************************************************************
+// Scalar
+// ****************************************************************************
+
+static void MinMaxScalar(int16_t const *samples, unsigned numSamples, int16_t *resultMin, int16_t *resultMax, uint64_t *resultSumSq)
+{
+    int16_t _min = *resultMin;
+    int16_t _max = *resultMax;
+    uint64_t sumSq = *resultSumSq;
+    for (unsigned i = 0; i < numSamples; i++)
+    {
+        _min = SAMPLE_MIN(samples[i], _min);
+        _max = SAMPLE_MAX(samples[i], _max);
+        sumSq += (uint32_t)(samples[i] * samples[i]);
+    }
+
+    *resultMin = _min;
+    *resultMax = _max;
+    *resultSumSq = sumSq;
+}
+
+
+static void MinMaxLutScalar(int16_t const *srcMins, int16_t const *srcMaxes, uint32_t const *srcPowers, unsigned numDstItems,
+                            int16_t *dstMins, int16_t *dstMaxes, uint32_t *dstPowers)
+{
+    for (unsigned i = 0; i < numDstItems; i++)
+    {
+        int16_t _min = INT16_MAX;
+        int16_t _max = INT16_MIN;
+        uint32_t power = 0;
+        for (unsigned j = 0; j < 16; j++)
+        {
+            _min = SAMPLE_MIN(srcMins[j], _min);
+            _max = SAMPLE_MAX(srcMaxes[j], _max);
+        }
+
+        if (srcPowers)
+        {
+            for (unsigned j = 0; j < 16; j++)
+                power += srcPowers[j] >> 4;
+            srcPowers += 16;
+        }
+        else
+        {
+            // Two squares can add up to 2^31, which only fits unsigned.
+            for (unsigned j = 0; j < 16; j += 2)
+                power += ((uint32_t)(srcMins[j] * srcMins[j]) + (uint32_t)(srcMins[j + 1] * srcMins[j + 1])) >> 4;
+        }
+
+        srcMins += 16;
+        srcMaxes += 16;
+        dstMins[i] = _min;
+        dstMaxes[i] = _max;
+        dstPowers[i] = power;
+    }
+}
+
+
+static int AbsMaxScalar(int16_t const *samples, unsigned numSamples)
+{
+    int16_t _min = 0;
+    int16_t _max = 0;
+    uint64_t sumSq = 0;
+    MinMaxScalar(samples, numSamples, &_min, &_max, &sumSq);
+    return SAMPLE_MAX((int)_max, -(int)_min);
+}
+
+
+static void InterleaveScalar(int16_t *dst, int16_t const * const *srcs, unsigned numChannels, unsigned numSamples)
+{
+    for (unsigned chanIdx = 0; chanIdx < numChannels; chanIdx++)
+    {
+        int16_t const *src = srcs[chanIdx];
+        for (unsigned i = 0; i < numSamples; i++)
+            dst[i * numChannels + chanIdx] = src[i];
+    }
+}
+
+
+static void DeinterleaveScalar(int16_t * const *dsts, int16_t const *src, unsigned numChannels, unsigned numSamples)
+{
+    for (unsigned chanIdx = 0; chanIdx < numChannels; chanIdx++)
+    {
+        int16_t *dst = dsts[chanIdx];
+        for (unsigned i = 0; i < numSamples; i++)
+            dst[i] = src[i * numChannels + chanIdx];
+    }
+}
+
+
+static void GainScalar(int16_t *samples, unsigned numSamples, double startVol, double volIncrement)
+{
+    for (unsigned i = 0; i < numSamples; i++)
+    {
+        double vol = startVol + (double)i * volIncrement;
+        double newSampleValue = samples[i] * vol;
+        newSampleValue = ClampDouble(newSampleValue, INT16_MIN, INT16_MAX);
+        samples[i] = (int16_t)newSampleValue;
+    }
+}
+
+
+static void StereoFirScalar(float const *frames, float const *coefs, unsigned numTaps, float *left, float *right)
+{
+    float sums[4][2] = { { 0.0f } };
+    for (unsigned i = 0; i < numTaps; i += 4)
+    {
+        for (unsigned j = 0; j < 4; j++)
+        {
+            sums[j][0] += coefs[i + j] * frames[(i + j) * 2];
+            sums[j][1] += coefs[i + j] * frames[(i + j) * 2 + 1];
+        }
+    }
+
+    *left = (sums[0][0] + sums[2][0]) + (sums[1][0] + sums[3][0]);
+    *right = (sums[0][1] + sums[2][1]) + (sums[1][1] + sums[3][1]);
+}
+
+
+static SampleKernels const s_scalarKernels = {
+    "scalar",
+    MinMaxScalar,
+    MinMaxLutScalar,
+    AbsMaxScalar,
+    InterleaveScalar,
+    DeinterleaveScalar,
+    GainScalar,
+    StereoFirScalar
+};
+
+
+#ifdef SAMPLE_KERNELS_X86
+
+// ****************************************************************************
+// SSE2
+// ****************************************************************************
+
+TARGET_SSE2 static inline int16_t HorizontalMin8(__m128i v)
+{
+    v = _mm_min_epi16(v, _mm_srli_si128(v, 8));
+    v = _mm_min_epi16(v, _mm_srli_si128(v, 4));
+    v = _mm_min_epi16(v, _mm_srli_si128(v, 2));
+    return (int16_t)_mm_cvtsi128_si32(v);
+}
+
+
+TARGET_SSE2 static inline int16_t HorizontalMax8(__m128i v)
+{
+    v = _mm_max_epi16(v, _mm_srli_si128(v, 8));
+    v = _mm_max_epi16(v, _mm_srli_si128(v, 4));
+    v = _mm_max_epi16(v, _mm_srli_si128(v, 2));
+    return (int16_t)_mm_cvtsi128_si32(v);
+}
+
+
+// Takes eight vectors, one per LUT item, each holding 8 partial results, and
+// returns one vector holding the final result for each of the 8 items, in
+// order. It works by interleaving pairs of vectors and combining the halves,
+// which halves the number of partial results per item at each step.
+#define REDUCE_8X8(OP, v) \
+    do { \
+        __m128i r01 = OP(_mm_unpacklo_epi16(v[0], v[1]), _mm_unpackhi_epi16(v[0], v[1])); \
+        __m128i r23 = OP(_mm_unpacklo_epi16(v[2], v[3]), _mm_unpackhi_epi16(v[2], v[3])); \
+        __m128i r45 = OP(_mm_unpacklo_epi16(v[4], v[5]), _mm_unpackhi_epi16(v[4], v[5])); \
+        __m128i r67 = OP(_mm_unpacklo_epi16(v[6], v[7]), _mm_unpackhi_epi16(v[6], v[7])); \
+        __m128i s0123 = OP(_mm_unpacklo_epi32(r01, r23), _mm_unpackhi_epi32(r01, r23)); \
+        __m128i s4567 = OP(_mm_unpacklo_epi32(r45, r67), _mm_unpackhi_epi32(r45, r67)); \
+        v[0] = OP(_mm_unpacklo_epi64(s0123, s4567), _mm_unpackhi_epi64(s0123, s4567)); \
+    } while (0)
+
+
+// Takes four vectors of 32 bit partial sums, one per LUT item, and returns
+// one vector holding the total for each of the 4 items, in order.
+TARGET_SSE2 static inline __m128i Sum4x4(__m128i const *v)
+{
+    __m128i r01 = _mm_add_epi32(_mm_unpacklo_epi32(v[0], v[1]), _mm_unpackhi_epi32(v[0], v[1]));
+    __m128i r23 = _mm_add_epi32(_mm_unpacklo_epi32(v[2], v[3]), _mm_unpackhi_epi32(v[2], v[3]));
+    return _mm_add_epi32(_mm_unpacklo_epi64(r01, r23), _mm_unpackhi_epi64(r01, r23));
+}
+
+
+// The sum of the squares of each pair of samples, rounded down to a multiple
+// of 16 and divided by 16. madd's signed result can only overflow to 2^31,
+// which a logical shift treats as unsigned.
+TARGET_SSE2 static inline __m128i PairSquares(__m128i v)
+{
+    return _mm_srli_epi32(_mm_madd_epi16(v, v), 4);
+}
+
+
+TARGET_SSE2 static void MinMaxSse2(int16_t const *samples, unsigned numSamples, int16_t *resultMin, int16_t *resultMax, uint64_t *resultSumSq)
+{
+    __m128i vmin = _mm_set1_epi16(*resultMin);
+    __m128i vmax = _mm_set1_epi16(*resultMax);
+    __m128i zero = _mm_setzero_si128();
+    __m128i vsumSq = zero;
+
+    unsigned i = 0;
+    for (; i + 8 <= numSamples; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((__m128i const *)(samples + i));
+        vmin = _mm_min_epi16(vmin, v);
+        vmax = _mm_max_epi16(vmax, v);
+        __m128i sq = _mm_madd_epi16(v, v);
+        vsumSq = _mm_add_epi64(vsumSq, _mm_unpacklo_epi32(sq, zero));
+        vsumSq = _mm_add_epi64(vsumSq, _mm_unpackhi_epi32(sq, zero));
+    }
+
+    uint64_t sumSqs[2];
+    _mm_storeu_si128((__m128i *)sumSqs, vsumSq);
+    *resultMin = HorizontalMin8(vmin);
+    *resultMax = HorizontalMax8(vmax);
+    *resultSumSq += sumSqs[0] + sumSqs[1];
+    MinMaxScalar(samples + i, numSamples - i, resultMin, resultMax, resultSumSq);
+}
+
+
+TARGET_SSE2 static void MinMaxLutSse2(int16_t const *srcMins, int16_t const *srcMaxes, uint32_t const *srcPowers, unsigned numDstItems,
+                                      int16_t *dstMins, int16_t *dstMaxes, uint32_t *dstPowers)
+{
+    unsigned i = 0;
+    for (; i + 8 <= numDstItems; i += 8)
+    {
+        __m128i mins[8];
+        __m128i maxes[8];
+        __m128i powers[8];
+        for (unsigned j = 0; j < 8; j++)
+        {
+            __m128i const *mn = (__m128i const *)(srcMins + (i + j) * 16);
+            __m128i const *mx = (__m128i const *)(srcMaxes + (i + j) * 16);
+            __m128i mn0 = _mm_loadu_si128(mn);
+            __m128i mn1 = _mm_loadu_si128(mn + 1);
+            mins[j] = _mm_min_epi16(mn0, mn1);
+            maxes[j] = _mm_max_epi16(_mm_loadu_si128(mx), _mm_loadu_si128(mx + 1));
+
+            if (srcPowers)
+            {
+                __m128i const *p = (__m128i const *)(srcPowers + (i + j) * 16);
+                __m128i p01 = _mm_add_epi32(_mm_srli_epi32(_mm_loadu_si128(p), 4), _mm_srli_epi32(_mm_loadu_si128(p + 1), 4));
+                __m128i p23 = _mm_add_epi32(_mm_srli_epi32(_mm_loadu_si128(p + 2), 4), _mm_srli_epi32(_mm_loadu_si128(p + 3), 4));
+                powers[j] = _mm_add_epi32(p01, p23);
+            }
+            else
+            {
+                powers[j] = _mm_add_epi32(PairSquares(mn0), PairSquares(mn1));
+            }
+        }
+
+        REDUCE_8X8(_mm_min_epi16, mins);
+        REDUCE_8X8(_mm_max_epi16, maxes);
+        _mm_storeu_si128((__m128i *)(dstMins + i), mins[0]);
+        _mm_storeu_si128((__m128i *)(dstMaxes + i), maxes[0]);
+        _mm_storeu_si128((__m128i *)(dstPowers + i), Sum4x4(powers));
+        _mm_storeu_si128((__m128i *)(dstPowers + i + 4), Sum4x4(powers + 4));
+    }
+
+    MinMaxLutScalar(srcMins + i * 16, srcMaxes + i * 16, srcPowers ? srcPowers + i * 16 : NULL, numDstItems - i,
+                    dstMins + i, dstMaxes + i, dstPowers + i);
+}
+
+
+TARGET_SSE2 static int AbsMaxSse2(int16_t const *samples, unsigned numSamples)
+{
+    int16_t _min = 0;
+    int16_t _max = 0;
+    uint64_t sumSq = 0;
+    MinMaxSse2(samples, numSamples, &_min, &_max, &sumSq);
+    return SAMPLE_MAX((int)_max, -(int)_min);
+}
+
+
+TARGET_SSE2 static void InterleaveSse2(int16_t *dst, int16_t const * const *srcs, unsigned numChannels, unsigned numSamples)
+{
+    if (numChannels != 2)
+    {
+        InterleaveScalar(dst, srcs, numChannels, numSamples);
+        return;
+    }
+
+    int16_t const *left = srcs[0];
+    int16_t const *right = srcs[1];
+    unsigned i = 0;
+    for (; i + 8 <= numSamples; i += 8)
+    {
+        __m128i l = _mm_loadu_si128((__m128i const *)(left + i));
+        __m128i r = _mm_loadu_si128((__m128i const *)(right + i));
+        _mm_storeu_si128((__m128i *)(dst + i * 2), _mm_unpacklo_epi16(l, r));
+        _mm_storeu_si128((__m128i *)(dst + i * 2 + 8), _mm_unpackhi_epi16(l, r));
+    }
+
+    int16_t const *tailSrcs[2] = { left + i, right + i };
+    InterleaveScalar(dst + i * 2, tailSrcs, 2, numSamples - i);
+}
+
+
+TARGET_SSE2 static void DeinterleaveSse2(int16_t * const *dsts, int16_t const *src, unsigned numChannels, unsigned numSamples)
+{
+    if (numChannels != 2)
+    {
+        DeinterleaveScalar(dsts, src, numChannels, numSamples);
+        return;
+    }
+
+    int16_t *left = dsts[0];
+    int16_t *right = dsts[1];
+    unsigned i = 0;
+    for (; i + 8 <= numSamples; i += 8)
+    {
+        __m128i a = _mm_loadu_si128((__m128i const *)(src + i * 2));
+        __m128i b = _mm_loadu_si128((__m128i const *)(src + i * 2 + 8));
+
+        // Sign extend the even (left) and odd (right) items to 32 bits, then
+        // pack them back down. The pack saturates, but nothing is out of range.
+        __m128i la = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+        __m128i lb = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+        __m128i ra = _mm_srai_epi32(a, 16);
+        __m128i rb = _mm_srai_epi32(b, 16);
+        _mm_storeu_si128((__m128i *)(left + i), _mm_packs_epi32(la, lb));
+        _mm_storeu_si128((__m128i *)(right + i), _mm_packs_epi32(ra, rb));
+    }
+
+    int16_t *tailDsts[2] = { left + i, right + i };
+    DeinterleaveScalar(tailDsts, src + i * 2, 2, numSamples - i);
+}
+
+
+TARGET_SSE2 static void GainSse2(int16_t *samples, unsigned numSamples, double startVol, double volIncrement)
+{
+    __m128d const vStartVol = _mm_set1_pd(startVol);
+    __m128d const vVolIncrement = _mm_set1_pd(volIncrement);
+    __m128d const vLow = _mm_set1_pd(INT16_MIN);
+    __m128d const vHigh = _mm_set1_pd(INT16_MAX);
+    __m128d const vFour = _mm_set1_pd(4.0);
+    __m128d idx0 = _mm_set_pd(1.0, 0.0);
+    __m128d idx1 = _mm_set_pd(3.0, 2.0);
+
+    unsigned i = 0;
+    for (; i + 4 <= numSamples; i += 4)
+    {
+        __m128i s = _mm_loadl_epi64((__m128i const *)(samples + i));
+        s = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+
+        // Same operations in the same order as the scalar version, so the
+        // results are identical.
+        __m128d vol0 = _mm_add_pd(vStartVol, _mm_mul_pd(idx0, vVolIncrement));
+        __m128d vol1 = _mm_add_pd(vStartVol, _mm_mul_pd(idx1, vVolIncrement));
+        __m128d v0 = _mm_mul_pd(_mm_cvtepi32_pd(s), vol0);
+        __m128d v1 = _mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(s, 8)), vol1);
+        v0 = _mm_max_pd(_mm_min_pd(v0, vHigh), vLow);
+        v1 = _mm_max_pd(_mm_min_pd(v1, vHigh), vLow);
+
+        __m128i r = _mm_unpacklo_epi64(_mm_cvttpd_epi32(v0), _mm_cvttpd_epi32(v1));
+        _mm_storel_epi64((__m128i *)(samples + i), _mm_packs_epi32(r, r));
+
+        idx0 = _mm_add_pd(idx0, vFour);
+        idx1 = _mm_add_pd(idx1, vFour);
+    }
+
+    for (; i < numSamples; i++)
+    {
+        double vol = startVol + (double)i * volIncrement;
+        double newSampleValue = samples[i] * vol;
+        newSampleValue = ClampDouble(newSampleValue, INT16_MIN, INT16_MAX);
+        samples[i] = (int16_t)newSampleValue;
+    }
+}
+
+
+// Both channels of two frames per multiply. sum01 holds partial sums 0 and
+// 1, and sum23 holds 2 and 3, each as a left, right pair.
+TARGET_SSE2 static void StereoFirSse2(float const *frames, float const *coefs, unsigned numTaps, float *left, float *right)
+{
+    __m128 sum01 = _mm_setzero_ps();
+    __m128 sum23 = _mm_setzero_ps();
+    for (unsigned i = 0; i < numTaps; i += 4)
+    {
+        __m128 c = _mm_loadu_ps(coefs + i);
+        sum01 = _mm_add_ps(sum01, _mm_mul_ps(_mm_unpacklo_ps(c, c), _mm_loadu_ps(frames + i * 2)));
+        sum23 = _mm_add_ps(sum23, _mm_mul_ps(_mm_unpackhi_ps(c, c), _mm_loadu_ps(frames + i * 2 + 4)));
+    }
+
+    __m128 s = _mm_add_ps(sum01, sum23);
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    float result[4];
+    _mm_storeu_ps(result, s);
+    *left = result[0];
+    *right = result[1];
+}
+
+
+static SampleKernels const s_sse2Kernels = {
+    "SSE2",
+    MinMaxSse2,
+    MinMaxLutSse2,
+    AbsMaxSse2,
+    InterleaveSse2,
+    DeinterleaveSse2,
+    GainSse2,
+    StereoFirSse2
+};
+
+
+// ****************************************************************************
+// AVX2
+// ****************************************************************************
+
+TARGET_AVX2 static void MinMaxAvx2(int16_t const *samples, unsigned numSamples, int16_t *resultMin, int16_t *resultMax, uint64_t *resultSumSq)
+{
+    __m256i vmin = _mm256_set1_epi16(*resultMin);
+    __m256i vmax = _mm256_set1_epi16(*resultMax);
+    __m256i zero = _mm256_setzero_si256();
+    __m256i vsumSq = zero;
+
+    unsigned i = 0;
+    for (; i + 16 <= numSamples; i += 16)
+    {
+        __m256i v = _mm256_loadu_si256((__m256i const *)(samples + i));
+        vmin = _mm256_min_epi16(vmin, v);
+        vmax = _mm256_max_epi16(vmax, v);
+        __m256i sq = _mm256_madd_epi16(v, v);
+        vsumSq = _mm256_add_epi64(vsumSq, _mm256_unpacklo_epi32(sq, zero));
+        vsumSq = _mm256_add_epi64(vsumSq, _mm256_unpackhi_epi32(sq, zero));
+    }
+
+    uint64_t sumSqs[4];
+    _mm256_storeu_si256((__m256i *)sumSqs, vsumSq);
+    __m128i min128 = _mm_min_epi16(_mm256_castsi256_si128(vmin), _mm256_extracti128_si256(vmin, 1));
+    __m128i max128 = _mm_max_epi16(_mm256_castsi256_si128(vmax), _mm256_extracti128_si256(vmax, 1));
+    *resultMin = HorizontalMin8(min128);
+    *resultMax = HorizontalMax8(max128);
+    *resultSumSq += sumSqs[0] + sumSqs[1] + sumSqs[2] + sumSqs[3];
+    MinMaxScalar(samples + i, numSamples - i, resultMin, resultMax, resultSumSq);
+}
+
+
+// Same as REDUCE_8X8, but on sixteen 256-bit vectors. The unpacks work within
+// each 128-bit lane, so after three steps each lane holds one partial result
+// for each of 8 items. The final step combines the two lanes.
+#define REDUCE_16X16(OP, v, result) \
+    do { \
+        __m256i s[4]; \
+        for (unsigned k = 0; k < 4; k++) \
+        { \
+            __m256i const *q = v + k * 4; \
+            __m256i r01 = OP(_mm256_unpacklo_epi16(q[0], q[1]), _mm256_unpackhi_epi16(q[0], q[1])); \
+            __m256i r23 = OP(_mm256_unpacklo_epi16(q[2], q[3]), _mm256_unpackhi_epi16(q[2], q[3])); \
+            s[k] = OP(_mm256_unpacklo_epi32(r01, r23), _mm256_unpackhi_epi32(r01, r23)); \
+        } \
+        __m256i t0 = OP(_mm256_unpacklo_epi64(s[0], s[1]), _mm256_unpackhi_epi64(s[0], s[1])); \
+        __m256i t1 = OP(_mm256_unpacklo_epi64(s[2], s[3]), _mm256_unpackhi_epi64(s[2], s[3])); \
+        result = OP(_mm256_permute2x128_si256(t0, t1, 0x20), _mm256_permute2x128_si256(t0, t1, 0x31)); \
+    } while (0)
+
+
+TARGET_AVX2 static void MinMaxLutAvx2(int16_t const *srcMins, int16_t const *srcMaxes, uint32_t const *srcPowers, unsigned numDstItems,
+                                      int16_t *dstMins, int16_t *dstMaxes, uint32_t *dstPowers)
+{
+    unsigned i = 0;
+    for (; i + 16 <= numDstItems; i += 16)
+    {
+        __m256i mins[16];
+        __m256i maxes[16];
+        __m128i powers[16];
+        for (unsigned j = 0; j < 16; j++)
+        {
+            mins[j] = _mm256_loadu_si256((__m256i const *)(srcMins + (i + j) * 16));
+            maxes[j] = _mm256_loadu_si256((__m256i const *)(srcMaxes + (i + j) * 16));
+
+            __m256i power;
+            if (srcPowers)
+            {
+                __m256i const *p = (__m256i const *)(srcPowers + (i + j) * 16);
+                power = _mm256_add_epi32(_mm256_srli_epi32(_mm256_loadu_si256(p), 4),
+                                         _mm256_srli_epi32(_mm256_loadu_si256(p + 1), 4));
+            }
+            else
+            {
+                power = _mm256_srli_epi32(_mm256_madd_epi16(mins[j], mins[j]), 4);
+            }
+            powers[j] = _mm_add_epi32(_mm256_castsi256_si128(power), _mm256_extracti128_si256(power, 1));
+        }
+
+        __m256i resultMins, resultMaxes;
+        REDUCE_16X16(_mm256_min_epi16, mins, resultMins);
+        REDUCE_16X16(_mm256_max_epi16, maxes, resultMaxes);
+        _mm256_storeu_si256((__m256i *)(dstMins + i), resultMins);
+        _mm256_storeu_si256((__m256i *)(dstMaxes + i), resultMaxes);
+        for (unsigned j = 0; j < 16; j += 4)
+            _mm_storeu_si128((__m128i *)(dstPowers + i + j), Sum4x4(powers + j));
+    }
+
+    MinMaxLutSse2(srcMins + i * 16, srcMaxes + i * 16, srcPowers ? srcPowers + i * 16 : NULL, numDstItems - i,
+                  dstMins + i, dstMaxes + i, dstPowers + i);
+}
+
+
+TARGET_AVX2 static int AbsMaxAvx2(int16_t const *samples, unsigned numSamples)
+{
+    int16_t _min = 0;
+    int16_t _max = 0;
+    uint64_t sumSq = 0;
+    MinMaxAvx2(samples, numSamples, &_min, &_max, &sumSq);
+    return SAMPLE_MAX((int)_max, -(int)_min);
+}
+
+
+TARGET_AVX2 static void InterleaveAvx2(int16_t *dst, int16_t const * const *srcs, unsigned numChannels, unsigned numSamples)
+{
+    if (numChannels != 2)
+    {
+        InterleaveScalar(dst, srcs, numChannels, numSamples);
+        return;
+    }
+
+    int16_t const *left = srcs[0];
+    int16_t const *right = srcs[1];
+    unsigned i = 0;
+    for (; i + 16 <= numSamples; i += 16)
+    {
+        __m256i l = _mm256_loadu_si256((__m256i const *)(left + i));
+        __m256i r = _mm256_loadu_si256((__m256i const *)(right + i));
+        __m256i lo = _mm256_unpacklo_epi16(l, r);   // Groups 0-3 and 8-11
+        __m256i hi = _mm256_unpackhi_epi16(l, r);   // Groups 4-7 and 12-15
+        _mm256_storeu_si256((__m256i *)(dst + i * 2), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + i * 2 + 16), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+
+    int16_t const *tailSrcs[2] = { left + i, right + i };
+    InterleaveSse2(dst + i * 2, tailSrcs, 2, numSamples - i);
+}
+
+
+TARGET_AVX2 static void DeinterleaveAvx2(int16_t * const *dsts, int16_t const *src, unsigned numChannels, unsigned numSamples)
+{
+    if (numChannels != 2)
+    {
+        DeinterleaveScalar(dsts, src, numChannels, numSamples);
+        return;
+    }
+
+    int16_t *left = dsts[0];
+    int16_t *right = dsts[1];
+    unsigned i = 0;
+    for (; i + 16 <= numSamples; i += 16)
+    {
+        __m256i a = _mm256_loadu_si256((__m256i const *)(src + i * 2));
+        __m256i b = _mm256_loadu_si256((__m256i const *)(src + i * 2 + 16));
+        __m256i la = _mm256_srai_epi32(_mm256_slli_epi32(a, 16), 16);
+        __m256i lb = _mm256_srai_epi32(_mm256_slli_epi32(b, 16), 16);
+        __m256i ra = _mm256_srai_epi32(a, 16);
+        __m256i rb = _mm256_srai_epi32(b, 16);
+
+        // The pack works within each 128-bit lane, which leaves the groups in
+        // the order 0-3, 8-11, 4-7, 12-15. The permute fixes that.
+        __m256i l = _mm256_permute4x64_epi64(_mm256_packs_epi32(la, lb), 0xd8);
+        __m256i r = _mm256_permute4x64_epi64(_mm256_packs_epi32(ra, rb), 0xd8);
+        _mm256_storeu_si256((__m256i *)(left + i), l);
+        _mm256_storeu_si256((__m256i *)(right + i), r);
+    }
+
+    int16_t *tailDsts[2] = { left + i, right + i };
+    DeinterleaveSse2(tailDsts, src + i * 2, 2, numSamples - i);
+}
+
+
+TARGET_AVX2 static void GainAvx2(int16_t *samples, unsigned numSamples, double startVol, double volIncrement)
+{
+    __m256d const vStartVol = _mm256_set1_pd(startVol);
+    __m256d const vVolIncrement = _mm256_set1_pd(volIncrement);
+    __m256d const vLow = _mm256_set1_pd(INT16_MIN);
+    __m256d const vHigh = _mm256_set1_pd(INT16_MAX);
+    __m256d const vFour = _mm256_set1_pd(4.0);
+    __m256d idx = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+
+    unsigned i = 0;
+    for (; i + 4 <= numSamples; i += 4)
+    {
+        __m128i s = _mm_cvtepi16_epi32(_mm_loadl_epi64((__m128i const *)(samples + i)));
+
+        // Separate multiply and add (rather than FMA) to match the scalar
+        // version exactly.
+        __m256d vol = _mm256_add_pd(vStartVol, _mm256_mul_pd(idx, vVolIncrement));
+        __m256d v = _mm256_mul_pd(_mm256_cvtepi32_pd(s), vol);
+        v = _mm256_max_pd(_mm256_min_pd(v, vHigh), vLow);
+
+        __m128i r = _mm256_cvttpd_epi32(v);
+        _mm_storel_epi64((__m128i *)(samples + i), _mm_packs_epi32(r, r));
+
+        idx = _mm256_add_pd(idx, vFour);
+    }
+
+    // GainSse2 would restart its volume ramp from zero, so finish off here.
+    for (; i < numSamples; i++)
+    {
+        double vol = startVol + (double)i * volIncrement;
+        double newSampleValue = samples[i] * vol;
+        newSampleValue = ClampDouble(newSampleValue, INT16_MIN, INT16_MAX);
+        samples[i] = (int16_t)newSampleValue;
+    }
+}
+
+
+// Four frames per multiply. The low half of sum holds partial sums 0 and 1,
+// and the high half 2 and 3, as in StereoFirSse2().
+TARGET_AVX2 static void StereoFirAvx2(float const *frames, float const *coefs, unsigned numTaps, float *left, float *right)
+{
+    __m256 sum = _mm256_setzero_ps();
+    for (unsigned i = 0; i < numTaps; i += 4)
+    {
+        __m128 c = _mm_loadu_ps(coefs + i);
+        __m256 cc = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_unpacklo_ps(c, c)), _mm_unpackhi_ps(c, c), 1);
+
+        // Separate multiply and add, as in GainAvx2().
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(cc, _mm256_loadu_ps(frames + i * 2)));
+    }
+
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    float result[4];
+    _mm_storeu_ps(result, s);
+    *left = result[0];
+    *right = result[1];
+}
+
+
+static SampleKernels const s_avx2Kernels = {
+    "AVX2",
+    MinMaxAvx2,
+    MinMaxLutAvx2,
+    AbsMaxAvx2,
+    InterleaveAvx2,
+    DeinterleaveAvx2,
+    GainAvx2,
+    StereoFirAvx2
+};
+
+
+// ****************************************************************************
+// CPU feature detection
+// ****************************************************************************
+
+static void Cpuid(unsigned leaf, unsigned subLeaf, unsigned regs[4])
+{
+#ifdef _MSC_VER
+    __cpuidex((int *)regs, leaf, subLeaf);
+#else
+    __cpuid_count(leaf, subLeaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+
+static uint64_t GetXcr0()
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    unsigned lo, hi;
+    __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((uint64_t)hi << 32) | lo;
+#endif
+}
+
+
+static bool CpuHasSse2()
+{
+    unsigned regs[4];
+    Cpuid(1, 0, regs);
+    return (regs[3] & (1 << 26)) != 0;
+}
+
+
+static bool CpuHasAvx2()
+{
+    unsigned regs[4];
+    Cpuid(0, 0, regs);
+    if (regs[0] < 7)
+        return false;
+
+    // The OS must save the YMM registers on a context switch, as well as the
+    // CPU supporting the instructions.
+    Cpuid(1, 0, regs);
+    bool osxsave = (regs[2] & (1 << 27)) != 0;
+    bool avx = (regs[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (GetXcr0() & 6) != 6)
+        return false;
+
+    Cpuid(7, 0, regs);
+    return (regs[1] & (1 << 5)) != 0;
+}
+
+#endif // SAMPLE_KERNELS_X86
+
+
+// ****************************************************************************
+// Public Functions
+// ****************************************************************************
+
+// Start with the scalar kernels so that everything works before
+// SampleKernelsInit() is called.
+SampleKernels g_sampleKernels = s_scalarKernels;
+
+
+SampleKernels const *GetSampleKernels(int type)
+{
+    switch (type)
+    {
+    case SAMPLE_KERNELS_SCALAR:
+        return &s_scalarKernels;
+#ifdef SAMPLE_KERNELS_X86
+    case SAMPLE_KERNELS_SSE2:
+        return CpuHasSse2() ? &s_sse2Kernels : NULL;
+    case SAMPLE_KERNELS_AVX2:
+        return CpuHasSse2() && CpuHasAvx2() ? &s_avx2Kernels : NULL;
+#endif
+    }
+
+    return NULL;
+}
+
+
+void SampleKernelsInit()
+{
+    for (int type = SAMPLE_KERNELS_NUM_TYPES - 1; type >= 0; type--)
+    {
+        SampleKernels const *kernels = GetSampleKernels(type);
+        if (kernels)
+        {
+            g_sampleKernels = *kernels;
+            break;
+        }
+    }
+}
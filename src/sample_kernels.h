@@ -0,0 +1,67 @@
+#pragma once
+
+
+#include <stdint.h>
+
+
+// The inner loops that touch every sample. There is a scalar, an SSE2 and an
+// AVX2 implementation of each. SampleKernelsInit() picks the best set the CPU
+// supports and stores it in g_sampleKernels. All the implementations produce
+// bit-identical results.
+struct SampleKernels
+{
+    char const *m_name;
+
+    // Combines the min and max of the samples with the values already in
+    // *resultMin and *resultMax, and adds the sum of their squares to
+    // *resultSumSq.
+    void (*MinMax)(int16_t const *samples, unsigned numSamples, int16_t *resultMin, int16_t *resultMax, uint64_t *resultSumSq);
+
+    // Produces one output item per 16 input items. dstMins[i] is the min of
+    // srcMins[i*16 .. i*16+15] and dstMaxes[i] is the max of the corresponding
+    // srcMaxes. dstPowers[i] is the mean of the corresponding srcPowers, each
+    // rounded down to a multiple of 16 first.
+    //
+    // To summarize samples, pass them as both srcMins and srcMaxes, and NULL
+    // as srcPowers. dstPowers[i] is then the mean square of the 16 samples,
+    // with each pair's sum of squares rounded down to a multiple of 16 first.
+    // The rounding keeps the sums in 32 bits.
+    void (*MinMaxLut)(int16_t const *srcMins, int16_t const *srcMaxes, uint32_t const *srcPowers, unsigned numDstItems,
+                      int16_t *dstMins, int16_t *dstMaxes, uint32_t *dstPowers);
+
+    // Returns the largest absolute sample value. Can return 32768.
+    int (*AbsMax)(int16_t const *samples, unsigned numSamples);
+
+    // dst gets numSamples groups of numChannels samples.
+    void (*Interleave)(int16_t *dst, int16_t const * const *srcs, unsigned numChannels, unsigned numSamples);
+    void (*Deinterleave)(int16_t * const *dsts, int16_t const *src, unsigned numChannels, unsigned numSamples);
+
+    // Multiplies sample i by (startVol + i * volIncrement), clamping the
+    // result to the int16 range and truncating towards zero.
+    void (*Gain)(int16_t *samples, unsigned numSamples, double startVol, double volIncrement);
+
+    // Sets *left and *right to the sums of coefs[i] times the left and right
+    // samples of frames[i], for numTaps interleaved stereo frames. numTaps
+    // must be a multiple of 4. Tap i is added to partial sum i % 4, and the
+    // result is (sum0 + sum2) + (sum1 + sum3), so that every implementation
+    // rounds the same way.
+    void (*StereoFir)(float const *frames, float const *coefs, unsigned numTaps, float *left, float *right);
+};
+
+
+enum
+{
+    SAMPLE_KERNELS_SCALAR,
+    SAMPLE_KERNELS_SSE2,
+    SAMPLE_KERNELS_AVX2,
+    SAMPLE_KERNELS_NUM_TYPES
+};
+
+
+extern SampleKernels g_sampleKernels;
+
+
+void SampleKernelsInit();
+
+// Returns NULL if the CPU doesn't support the requested type.
+SampleKernels const *GetSampleKernels(int type);
@@ -4,23 +4,41 @@
 #include "sound.h"
 
 // Project headers
+#include "block_loader.h"
+#include "peak_file.h"
+#include "sample_format.h"
 #include "sound_channel.h"
+#include "undo_history.h"
 #include "df_lib_plus_plus/binary_stream_readers.h"
 #include "df_lib_plus_plus/binary_stream_writers.h"
+#include "df_lib_plus_plus/mapped_file.h"
 #include "df_lib_plus_plus/string_utils.h"
 
 // Contrib headers
+#include "df_common.h"
 #include "df_time.h"
 
 // Standard headers
+#include <limits.h>
 #include <math.h>
 #include <memory.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 
-int const MAX_SAMPLE_VALUE = 32767;
-int const MIN_SAMPLE_VALUE = -32768;
+// Sony Wave64 identifies chunks by GUID. The GUIDs of the chunks inside the
+// riff chunk start with the same four characters as the equivalent RIFF
+// chunk IDs, and all end in W64_GUID_TAIL.
+static unsigned char const W64_RIFF_GUID[16] = { 'r', 'i', 'f', 'f', 0x2e, 0x91, 0xcf, 0x11, 0xa5, 0xd6, 0x28, 0xdb, 0x04, 0xc1, 0x00, 0x00 };
+static unsigned char const W64_GUID_TAIL[12] = { 0xf3, 0xac, 0xd3, 0x11, 0x8c, 0xd1, 0x00, 0xc0, 0x4f, 0x8e, 0xdb, 0x8a };
+static unsigned const W64_CHUNK_HEADER_SIZE = 24;
+
+// Format tags for the fmt chunk. WAVE_FORMAT_EXTENSIBLE's sub-format GUIDs are
+// the other tags followed by KSDATAFORMAT_GUID_TAIL.
+static unsigned const FORMAT_TAG_PCM = 1;
+static unsigned const FORMAT_TAG_IEEE_FLOAT = 3;
+static unsigned const FORMAT_TAG_EXTENSIBLE = 0xfffe;
+static unsigned char const KSDATAFORMAT_GUID_TAIL[14] = { 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71 };
 
 
 // ****************************************************************************
@@ -35,27 +53,227 @@ void Sound::SetVolumeHelper(int64_t startIdx, int64_t endIdx, double startVol, d
     int64_t len = endIdx - startIdx + 1;
     double volIncrement = (endVol - startVol) / (double)len;
 
+    m_undoHistory->BeginStep(m_channels, m_numChannels, startIdx, endIdx);
+
     for (int j = 0; j < m_numChannels; j++)
     {
         SoundChannel *chan = m_channels[j];
         SoundChannel::SoundPos pos = chan->GetSoundPosFromSampleIdx(startIdx);
-        SampleBlock *block = chan->m_blocks[pos.m_blockIdx];
-        for (int64_t i = 0; i < len; i++)
+        int64_t numSamplesDone = 0;
+        while (numSamplesDone < len && pos.m_blockIdx < chan->m_blocks.Size())
+        {
+            SampleBlock *block = chan->m_blocks.GetWritableBlock(pos.m_blockIdx);
+            int64_t numSamplesThisBlock = block->m_len - pos.m_sampleIdx;
+            if (numSamplesThisBlock > len - numSamplesDone)
+                numSamplesThisBlock = len - numSamplesDone;
+
+            double vol = startVol + (double)numSamplesDone * volIncrement;
+            block->GetKernels()->Gain(block->GetSamples(pos.m_sampleIdx), numSamplesThisBlock, vol, volIncrement);
+            block->InvalidateLuts(pos.m_sampleIdx, pos.m_sampleIdx + numSamplesThisBlock);
+
+            // Compressing as we go means a whole-file edit never has every
+            // block decoded at once.
+            if (g_compressBlocks)
+                block->Compress();
+            chan->m_blocks.BlockChanged(pos.m_blockIdx);
+
+            numSamplesDone += numSamplesThisBlock;
+            pos.m_blockIdx++;
+            pos.m_sampleIdx = 0;
+        }
+    }
+
+    m_undoHistory->EndStep(m_channels);
+    m_lutsDirty = true;
+    NoteEdit(startIdx, endIdx);
+}
+
+
+void Sound::NoteEdit(int64_t startIdx, int64_t endIdx)
+{
+    m_editGeneration++;
+    m_lastEditStartIdx = startIdx;
+    m_lastEditEndIdx = endIdx;
+}
+
+
+static void WriteW64Guid(BinaryStreamWriter *f, char const *name)
+{
+    f->WriteBytes(name, 4);
+    f->WriteBytes((char const *)W64_GUID_TAIL, 12);
+}
+
+
+static int64_t RoundUpToMultipleOf8(int64_t val)
+{
+    return (val + 7) & ~(int64_t)7;
+}
+
+
+// Reads a fmt chunk. Sets m_numChannels, m_sampleFormat, m_sampleRate and
+// m_channelMask.
+void Sound::ReadFmtChunk(BinaryStreamReader *f, int64_t chunkSize)
+{
+    unsigned formatTag = f->ReadU16();
+    m_numChannels = f->ReadU16();
+    m_sampleRate = f->ReadU32();
+    f->ReadU32();   // Byte rate
+    unsigned bytesPerGroup = f->ReadU16();
+    unsigned bitsPerSample = f->ReadU16();
+    m_channelMask = 0;
+
+    // WAVE_FORMAT_EXTENSIBLE puts the real format tag at the start of a GUID.
+    if (formatTag == FORMAT_TAG_EXTENSIBLE && chunkSize >= 40)
+    {
+        f->ReadU16();   // Size of the extension
+        f->ReadU16();   // Valid bits per sample
+        m_channelMask = f->ReadU32();
+        unsigned char subFormat[16];
+        f->ReadBytes(16, subFormat);
+        formatTag = subFormat[0] | (subFormat[1] << 8);
+        if (memcmp(subFormat + 2, KSDATAFORMAT_GUID_TAIL, 14) != 0)
+            formatTag = 0;
+    }
+
+    bool isFloat = formatTag == FORMAT_TAG_IEEE_FLOAT;
+    m_sampleFormat = FindSampleFormat(bitsPerSample, isFloat);
+
+    ReleaseAssert(formatTag == FORMAT_TAG_PCM || isFloat, "File '%s' unsupported format", f->m_filename);
+    ReleaseAssert(m_numChannels > 0, "File '%s' has no channels", f->m_filename);
+    ReleaseAssert(m_sampleFormat >= 0, "File '%s' unsupported sample depth", f->m_filename);
+    ReleaseAssert(bytesPerGroup == GetBytesPerGroup(), "File '%s' unsupported block alignment", f->m_filename);
+}
+
+
+// Anything other than 8 or 16 bit PCM in one or two channels is supposed to
+// use WAVE_FORMAT_EXTENSIBLE, which needs the longer fmt chunk.
+unsigned Sound::GetFmtChunkSize()
+{
+    SampleCodec const *codec = GetCodec();
+    if (m_numChannels <= 2 && codec->m_bitsPerSample <= 16 && !codec->m_isFloat && m_channelMask == 0)
+        return 16;
+    return 40;
+}
+
+
+void Sound::WriteFmtChunk(BinaryStreamWriter *f)
+{
+    SampleCodec const *codec = GetCodec();
+    unsigned const BYTES_PER_GROUP = GetBytesPerGroup();
+    unsigned formatTag = codec->m_isFloat ? FORMAT_TAG_IEEE_FLOAT : FORMAT_TAG_PCM;
+    bool isExtensible = GetFmtChunkSize() > 16;
+
+    f->WriteU16(isExtensible ? FORMAT_TAG_EXTENSIBLE : formatTag);
+    f->WriteU16(m_numChannels);
+    f->WriteU32(m_sampleRate);
+    f->WriteU32(m_sampleRate * BYTES_PER_GROUP);    // Byte rate
+    f->WriteU16(BYTES_PER_GROUP);
+    f->WriteU16(codec->m_bitsPerSample);
+
+    if (isExtensible)
+    {
+        f->WriteU16(22);                        // Size of the extension
+        f->WriteU16(codec->m_bitsPerSample);    // Valid bits per sample
+        f->WriteU32(m_channelMask);
+        f->WriteU16(formatTag);                 // The sub-format GUID
+        f->WriteBytes((char const *)KSDATAFORMAT_GUID_TAIL, 14);
+    }
+}
+
+
+// Reads everything up to the start of the sample data. Sets m_numChannels,
+// m_fileFormat and *numGroups. Understands RIFF, RF64 and Sony Wave64, and
+// skips any chunks it doesn't need.
+bool Sound::ReadWavHeader(BinaryStreamReader *f, int64_t *numGroups)
+{
+    //
+    // Read header
+
+    unsigned char id[16];
+    if (f->ReadBytes(4, id) != 4)
+        return false;
+
+    bool isW64 = memcmp(id, W64_RIFF_GUID, 4) == 0;
+    bool isRf64 = memcmp(id, "RF64", 4) == 0;
+    if (isW64)
+    {
+        if (f->ReadBytes(12, id + 4) != 12 || memcmp(id, W64_RIFF_GUID, 16) != 0)
+            return false;
+        f->ReadU64();   // Riff chunk size
+        if (f->ReadBytes(16, id) != 16 || memcmp(id, "wave", 4) != 0 || memcmp(id + 4, W64_GUID_TAIL, 12) != 0)
+            return false;
+    }
+    else
+    {
+        if (!isRf64 && memcmp(id, "RIFF", 4) != 0)
+            return false;
+        f->ReadU32();   // Chunk size. In RF64 it is in the ds64 chunk instead.
+        if (f->ReadBytes(4, id) != 4 || memcmp(id, "WAVE", 4) != 0)
+            return false;
+    }
+
+    m_fileFormat = isW64 ? FILE_FORMAT_W64 : FILE_FORMAT_WAV;
+
+
+    //
+    // Read chunks up to the data chunk
+
+    int64_t rf64DataSize = -1;
+    bool foundFmt = false;
+    while (1)
+    {
+        int64_t chunkSize;
+        int64_t chunkEnd;
+        if (isW64)
         {
-            double vol = startVol + (double)i * volIncrement;
-            double newSampleValue = block->m_samples[pos.m_sampleIdx] * vol;
-            ClampDouble(newSampleValue, MIN_SAMPLE_VALUE, MAX_SAMPLE_VALUE);
-            block->m_samples[pos.m_sampleIdx] = newSampleValue;
-
-            SampleBlock *nextBlock = chan->IncrementSoundPos(&pos, 1);
-            if (nextBlock != block)
-                block->RecalcLuts();
-            if (!nextBlock)
-                break;
-            block = nextBlock;
+            // The size includes the GUID and the size itself. Chunks start
+            // on 8 byte boundaries.
+            if (f->ReadBytes(16, id) != 16)
+                return false;
+            if (memcmp(id + 4, W64_GUID_TAIL, 12) != 0)
+                memset(id, 0, 4);
+            chunkSize = f->ReadU64() - W64_CHUNK_HEADER_SIZE;
+            chunkEnd = f->Tell() + RoundUpToMultipleOf8(chunkSize);
+        }
+        else
+        {
+            // Chunks are padded to an even number of bytes.
+            if (f->ReadBytes(4, id) != 4)
+                return false;
+            chunkSize = f->ReadU32();
+            chunkEnd = f->Tell() + chunkSize + (chunkSize & 1);
+        }
+
+        if (isRf64 && memcmp(id, "ds64", 4) == 0)
+        {
+            f->ReadU64();   // RIFF chunk size
+            rf64DataSize = f->ReadU64();
+        }
+        else if (memcmp(id, "fmt ", 4) == 0)
+        {
+            ReadFmtChunk(f, chunkSize);
+            foundFmt = true;
+        }
+        else if (memcmp(id, "data", 4) == 0)
+        {
+            if (!foundFmt)
+                return false;
+
+            if (isRf64)
+            {
+                if (rf64DataSize < 0)
+                    return false;
+                chunkSize = rf64DataSize;
+            }
+
+            unsigned bytesPerGroup = GetBytesPerGroup();
+            ReleaseAssert(chunkSize % bytesPerGroup == 0, "File '%s' ends with half a sample", f->m_filename);
+            *numGroups = chunkSize / bytesPerGroup;
+            return true;
         }
 
-        block->RecalcLuts();
+        if (chunkSize < 0 || f->Seek(chunkEnd, SEEK_SET) != 0)
+            return false;
     }
 }
 
@@ -69,45 +287,123 @@ Sound::Sound()
     m_channels = NULL;
     m_numChannels = 0;
     m_cachedLength = -1;
-    m_filename = "";
+    m_lutsDirty = false;
+    m_filename = NULL;
+    m_fileFormat = FILE_FORMAT_WAV;
+    m_sampleFormat = SAMPLE_FORMAT_S16;
+    m_sampleRate = 44100;
+    m_channelMask = 0;
+    m_undoHistory = new UndoHistory;
+    m_loader = NULL;
+    m_editGeneration = 0;
+    m_lastEditStartIdx = 0;
+    m_lastEditEndIdx = -1;
 }
 
 
 Sound::~Sound()
 {
+    CancelLoading();
     for (int i = 0; i < m_numChannels; i++)
         delete m_channels[i];
     delete[] m_channels;
     delete[] m_filename;
+    delete m_undoHistory;
 }
 
 
 void Sound::Delete(int64_t startIdx, int64_t endIdx)
 {
+    m_undoHistory->BeginStep(m_channels, m_numChannels, startIdx, endIdx);
     for (int i = 0; i < m_numChannels; i++)
         m_channels[i]->Delete(startIdx, endIdx);
+    m_undoHistory->EndStep(m_channels);
 
     m_cachedLength = -1;
+    m_lutsDirty = true;
+    NoteEdit(startIdx, INT64_MAX);
 }
 
 
 int Sound::Insert(int64_t startIdx, Sound *sound)
 {
     if (sound->m_numChannels != m_numChannels)
+    {
+        delete sound;
         return ERROR_WRONG_NUMBER_OF_CHANNELS;
+    }
+
+    if (sound->GetCodec()->m_sampleType != GetCodec()->m_sampleType)
+    {
+        delete sound;
+        return ERROR_WRONG_SAMPLE_TYPE;
+    }
     
+    m_undoHistory->BeginStep(m_channels, m_numChannels, startIdx, startIdx);
     for (int i = 0; i < m_numChannels; i++) {
         SoundChannel *srcChan = sound->m_channels[i];
         SoundChannel *dstChan = m_channels[i];
         dstChan->Insert(startIdx, srcChan);
     }
 
+    // Before EndStep(), so that the budget it enforces counts any blocks the
+    // step only shared with the pasted Sound.
+    delete sound;
+    m_undoHistory->EndStep(m_channels);
+
     m_cachedLength = -1;
+    m_lutsDirty = true;
+    NoteEdit(startIdx, INT64_MAX);
 
     return ERROR_NO_ERROR;
 }
 
 
+bool Sound::Undo()
+{
+    int64_t changeStartIdx;
+    if (!m_undoHistory->Undo(m_channels, &changeStartIdx))
+        return false;
+
+    m_cachedLength = -1;
+    m_lutsDirty = true;
+    NoteEdit(changeStartIdx, INT64_MAX);
+    return true;
+}
+
+
+bool Sound::Redo()
+{
+    int64_t changeStartIdx;
+    if (!m_undoHistory->Redo(m_channels, &changeStartIdx))
+        return false;
+
+    m_cachedLength = -1;
+    m_lutsDirty = true;
+    NoteEdit(changeStartIdx, INT64_MAX);
+    return true;
+}
+
+
+// Returns a new Sound containing samples startIdx to endIdx inclusive. It
+// shares blocks with this Sound, so the cost is proportional to the number of
+// blocks rather than the number of samples.
+Sound *Sound::Copy(int64_t startIdx, int64_t endIdx)
+{
+    Sound *copy = new Sound;
+    copy->m_numChannels = m_numChannels;
+    copy->m_channels = new SoundChannel *[m_numChannels];
+    for (int i = 0; i < m_numChannels; i++)
+        copy->m_channels[i] = m_channels[i]->Copy(startIdx, endIdx);
+    copy->m_lutsDirty = m_lutsDirty;
+    copy->m_sampleFormat = m_sampleFormat;
+    copy->m_sampleRate = m_sampleRate;
+    copy->m_channelMask = m_channelMask;
+
+    return copy;
+}
+
+
 void Sound::FadeIn(int64_t startIdx, int64_t endIdx)
 {
     SetVolumeHelper(startIdx, endIdx, 0.0, 1.0);
@@ -126,30 +422,35 @@ void Sound::Normalize(int64_t startIdx, int64_t endIdx)
         return;
 
     int64_t len = endIdx - startIdx + 1;
-    int64_t maxAbsSample = 0;
+    double maxAbsSample = 0.0;
 
     for (int j = 0; j < m_numChannels; j++)
     {
         SoundChannel *chan = m_channels[j];
         SoundChannel::SoundPos pos = chan->GetSoundPosFromSampleIdx(startIdx);
-        SampleBlock *block = chan->m_blocks[pos.m_blockIdx];
-        
-        for (int64_t i = 0; i < len; i++)
+        int64_t numSamplesDone = 0;
+        while (numSamplesDone < len && pos.m_blockIdx < chan->m_blocks.Size())
         {
-            int64_t sample = block->m_samples[pos.m_sampleIdx];
-            sample = abs(sample);
+            SampleBlock *block = chan->m_blocks[pos.m_blockIdx];
+            int64_t numSamplesThisBlock = block->m_len - pos.m_sampleIdx;
+            if (numSamplesThisBlock > len - numSamplesDone)
+                numSamplesThisBlock = len - numSamplesDone;
+
+            double sample = block->GetKernels()->AbsMax(block->GetSamples(pos.m_sampleIdx), numSamplesThisBlock);
             if (sample > maxAbsSample)
                 maxAbsSample = sample;
 
-            block = chan->IncrementSoundPos(&pos, 1);
-            if (!block)
-                break;
+            numSamplesDone += numSamplesThisBlock;
+            pos.m_blockIdx++;
+            pos.m_sampleIdx = 0;
         }
-
-        block->RecalcLuts();
     }
 
-    double volChange = (double)MAX_SAMPLE_VALUE / (double)maxAbsSample;
+    if (maxAbsSample == 0.0)
+        return;
+
+    double maxValue = GetSampleTypeKernels(GetCodec()->m_sampleType)->m_maxValue;
+    double volChange = maxValue / maxAbsSample;
     SetVolumeHelper(startIdx, endIdx, volChange, volChange);
 }
 
@@ -162,49 +463,13 @@ bool Sound::LoadWav(BinaryStreamReader *f)
     m_filename = StringDuplicate(f->m_filename);
 
 
-    // 
-    // Read header
-
-    unsigned char buf1[4];
-    if (f->ReadBytes(4, buf1) != 4 || memcmp(buf1, "RIFF", 4) != 0)
-        return false;
-
-    unsigned chunkSize = f->ReadU32();
-
-    if (f->ReadBytes(4, buf1) != 4 || memcmp(buf1, "WAVE", 4) != 0)
+    int64_t numGroups;
+    if (!ReadWavHeader(f, &numGroups))
         return false;
 
-    //
-    // Read fmt chunk
-
-    if (f->ReadBytes(4, buf1) != 4 || memcmp(buf1, "fmt ", 4) != 0)
-        return false;
-    unsigned fmtChunkSize = f->ReadU32();
-    unsigned audioFormat = f->ReadU16();
-    m_numChannels = f->ReadU16();
-    unsigned sampleRate = f->ReadU32();
-    unsigned byteRate = f->ReadU32();
-    unsigned bytesPerGroup = f->ReadU16();
-    unsigned bitsPerSample = f->ReadU16();
-
-    ReleaseAssert(audioFormat == 1, "File '%s' unsupported format", m_filename);
-    ReleaseAssert(m_numChannels == 2, "File '%s' is not stereo", m_filename);
-    ReleaseAssert(bytesPerGroup == 4, "File '%s' unsupported block alignment", m_filename);
-    ReleaseAssert(bitsPerSample == 16, "File '%s' is not 16 bits sample depth", m_filename);
-
-    if (fmtChunkSize == 20)
-        f->ReadU32(); // Skip extra 4 bytes of data that isn't normally present and isn't useful.
-
-
-    //
-    // Read data chunk
-
-    if (f->ReadBytes(4, buf1) != 4 || memcmp(buf1, "data", 4) != 0)
-        return false;
-    unsigned dataChunkSize = f->ReadU32();
-    ReleaseAssert(dataChunkSize % bytesPerGroup == 0, "File '%s' ends with half a sample", m_filename);
-    unsigned numGroups = dataChunkSize / bytesPerGroup;
-    unsigned numBlocks = numGroups / SampleBlock::MAX_SAMPLES;
+    SampleCodec const *codec = GetCodec();
+    unsigned bytesPerGroup = GetBytesPerGroup();
+    int64_t numBlocks = numGroups / SampleBlock::MAX_SAMPLES;
     if (numGroups % SampleBlock::MAX_SAMPLES != 0)
         numBlocks++;
 
@@ -212,26 +477,37 @@ bool Sound::LoadWav(BinaryStreamReader *f)
     for (int i = 0; i < m_numChannels; i++)
         m_channels[i] = new SoundChannel;
 
-    int16_t *buf = new int16_t [SampleBlock::MAX_SAMPLES * m_numChannels];
+    uint8_t *buf = new uint8_t [SampleBlock::MAX_SAMPLES * bytesPerGroup];
+    SampleBlock **blocks = new SampleBlock *[m_numChannels];
+    void **dsts = new void *[m_numChannels];
 
-    for (int blockCount = 0; blockCount < numBlocks; blockCount++)
+    for (int64_t blockCount = 0; blockCount < numBlocks; blockCount++)
     {
-        unsigned bytesToRead = bytesPerGroup * SampleBlock::MAX_SAMPLES;
-        if (blockCount + 1 == numBlocks)
-            bytesToRead = (numGroups % SampleBlock::MAX_SAMPLES) * bytesPerGroup;
-        size_t bytesRead = f->ReadBytes(bytesToRead, (unsigned char *)buf);
+        int64_t groupsToRead = numGroups - blockCount * SampleBlock::MAX_SAMPLES;
+        if (groupsToRead > SampleBlock::MAX_SAMPLES)
+            groupsToRead = SampleBlock::MAX_SAMPLES;
+        size_t bytesRead = f->ReadBytes(groupsToRead * bytesPerGroup, buf);
         size_t groupsRead = bytesRead / bytesPerGroup;
+        if (groupsRead == 0)
+            break;  // The file is shorter than its header says
 
         for (int chan_idx = 0; chan_idx < m_numChannels; chan_idx++)
         {
-            SoundChannel *chan = m_channels[chan_idx];
-            SampleBlock *block = new SampleBlock;
+            blocks[chan_idx] = new SampleBlock(codec->m_sampleType);
+            dsts[chan_idx] = blocks[chan_idx]->GetSamples();
+        }
 
-            for (size_t i = 0; i < groupsRead; i++)
-                block->m_samples[i] = buf[i * m_numChannels + chan_idx];
+        codec->Decode(dsts, buf, m_numChannels, groupsRead);
+
+        for (int chan_idx = 0; chan_idx < m_numChannels; chan_idx++)
+        {
+            SoundChannel *chan = m_channels[chan_idx];
+            SampleBlock *block = blocks[chan_idx];
 
             block->m_len = groupsRead;
             block->RecalcLuts();
+            if (g_compressBlocks)
+                block->Compress();
 
             DebugAssert(block->m_len > 0);
             chan->m_blocks.Push(block);
@@ -241,90 +517,281 @@ bool Sound::LoadWav(BinaryStreamReader *f)
     }
 
     delete[] buf;
+    delete[] blocks;
+    delete[] dsts;
 
     return true;
 }
 
 
-bool Sound::SaveWav()
+// Maps the file rather than reading it. Each block copies its samples out of
+// the mapping the first time something needs them, so opening a big file
+// costs little more than opening a small one. BlockLoader's workers load the
+// blocks from the start of the file onwards in the meantime, on
+// numLoaderThreads threads, or one per core but one if it is 0. If the file has
+// an up to date peak file, the whole waveform can be drawn from that straight
+// away. If not, one is written as the blocks load.
+bool Sound::MapWav(char const *filename, int numLoaderThreads)
 {
-    BinaryFileWriter f(m_filename);
-    if (!f.m_file)
+    MappedFile *file = new MappedFile(filename);
+    if (!file->m_data)
+    {
+        delete file;
+        return false;
+    }
+
+    BinaryDataReader f(file->m_data, file->m_size, filename);
+    int64_t numGroups;
+    if (!ReadWavHeader(&f, &numGroups))
+    {
+        delete file;
         return false;
+    }
+
+    // Don't trust the header if the file has been truncated.
+    int64_t dataOffset = f.Tell();
+    int64_t bytesPerGroup = GetBytesPerGroup();
+    int64_t numGroupsInFile = (file->m_size - dataOffset) / bytesPerGroup;
+    if (numGroups > numGroupsInFile)
+        numGroups = numGroupsInFile;
+
+    m_filename = StringDuplicate(filename);
+    m_channels = new SoundChannel* [m_numChannels];
+    for (int i = 0; i < m_numChannels; i++)
+        m_channels[i] = new SoundChannel;
+
+    PeakFile *peaks = PeakFile::Open(filename, file, dataOffset, numGroups, m_numChannels, m_sampleFormat);
+    SampleSource *source = new SampleSource(file, file->m_data + dataOffset, GetCodec(), m_numChannels, peaks);
+    m_loader = new BlockLoader;
+    for (int64_t firstGroup = 0; firstGroup < numGroups; firstGroup += SampleBlock::MAX_SAMPLES)
+    {
+        unsigned len = SampleBlock::MAX_SAMPLES;
+        if (firstGroup + len > numGroups)
+            len = numGroups - firstGroup;
+
+        for (int chan_idx = 0; chan_idx < m_numChannels; chan_idx++)
+        {
+            SampleBlock *block = new SampleBlock(source, firstGroup, chan_idx, len);
+            m_channels[chan_idx]->m_blocks.Push(block);
+            m_loader->AddBlock(block);
+        }
+    }
+
+    // The blocks have their own references.
+    source->Release();
+
+    m_loader->Start(numLoaderThreads);
 
-    return SaveWav(&f, 0, -1);
+    return true;
 }
 
 
-bool Sound::SaveWav(BinaryStreamWriter *f, int64_t startIdx, int64_t endIdx)
+// Writes everything up to the start of the sample data. FILE_FORMAT_WAV
+// becomes RF64 if the data is too big for RIFF's 32-bit sizes.
+void Sound::WriteWavHeader(BinaryStreamWriter *f, int64_t numGroups, int fileFormat)
 {
-    if (endIdx < 0)
-        endIdx = GetLength() - 1;
-	
-    unsigned const SIZE_OF_HEADERS = 36;
-    unsigned const BYTES_PER_GROUP = m_numChannels * 2;
-    unsigned const NUM_SAMPLES_TO_OUTPUT = (endIdx - startIdx + 1);
-    unsigned const SIZE_OF_DATA = NUM_SAMPLES_TO_OUTPUT * BYTES_PER_GROUP;
-    f->Reserve(SIZE_OF_HEADERS + SIZE_OF_DATA + 8);
+    int64_t const BYTES_PER_GROUP = GetBytesPerGroup();
+    int64_t const SIZE_OF_DATA = numGroups * BYTES_PER_GROUP;
+    unsigned const SIZE_OF_FMT = GetFmtChunkSize();
+
+    if (fileFormat == FILE_FORMAT_W64)
+    {
+        // riff GUID, size and wave GUID, then the fmt chunk, then the data
+        // chunk's GUID and size.
+        int64_t const SIZE_OF_HEADERS = 16 + 8 + 16 + (W64_CHUNK_HEADER_SIZE + SIZE_OF_FMT) + W64_CHUNK_HEADER_SIZE;
+        f->Reserve(SIZE_OF_HEADERS + RoundUpToMultipleOf8(SIZE_OF_DATA));
+
+        f->WriteBytes((char const *)W64_RIFF_GUID, 16);
+        f->WriteU64(SIZE_OF_HEADERS + RoundUpToMultipleOf8(SIZE_OF_DATA));
+        WriteW64Guid(f, "wave");
+
+        WriteW64Guid(f, "fmt ");
+        f->WriteU64(W64_CHUNK_HEADER_SIZE + SIZE_OF_FMT);
+        WriteFmtChunk(f);
+
+        WriteW64Guid(f, "data");
+        f->WriteU64(W64_CHUNK_HEADER_SIZE + SIZE_OF_DATA);
+        return;
+    }
+
+    // "WAVE", then the fmt and data chunk headers. The data chunk is padded
+    // to an even size.
+    int64_t const SIZE_OF_HEADERS = 4 + (8 + SIZE_OF_FMT) + 8;
+    int64_t const SIZE_OF_DS64_CHUNK = 36;
+    int64_t riffSize = SIZE_OF_HEADERS + SIZE_OF_DATA + (SIZE_OF_DATA & 1);
+    bool isRf64 = riffSize > UINT32_MAX;
+    if (isRf64)
+        riffSize += SIZE_OF_DS64_CHUNK;
+    f->Reserve(riffSize + 8);
 
 
     // 
     // Write header
 
-    f->WriteBytes("RIFF", 4);
-    f->WriteU32(SIZE_OF_HEADERS + SIZE_OF_DATA);    // Chunk size
+    f->WriteBytes(isRf64 ? "RF64" : "RIFF", 4);
+    f->WriteU32(isRf64 ? UINT32_MAX : riffSize);    // Chunk size
     f->WriteBytes("WAVE", 4);
 
 
+    //
+    // Write ds64 chunk. RF64 puts the sizes that don't fit in 32 bits here.
+
+    if (isRf64)
+    {
+        f->WriteBytes("ds64", 4);
+        f->WriteU32(SIZE_OF_DS64_CHUNK - 8);
+        f->WriteU64(riffSize);
+        f->WriteU64(SIZE_OF_DATA);
+        f->WriteU64(numGroups);             // Sample count
+        f->WriteU32(0);                     // Table length
+    }
+
+
     //
     // Write fmt chunk
 
     f->WriteBytes("fmt ", 4);
-
-    f->WriteU32(16);                         // fmtChunkSize
-    f->WriteU16(1);                          // Audio format. 1=PCM.
-    f->WriteU16(m_numChannels);
-    f->WriteU32(44100);                      // Sample rate
-    f->WriteU32(44100 * BYTES_PER_GROUP);    // Byte rate
-    f->WriteU16(BYTES_PER_GROUP);
-    f->WriteU16(16);                         // Bits per sample
+    f->WriteU32(SIZE_OF_FMT);               // fmtChunkSize
+    WriteFmtChunk(f);
 
 
     //
     // Write data chunk
 
     f->WriteBytes("data", 4);
-    f->WriteU32(SIZE_OF_DATA);               // Data chunk size
+    f->WriteU32(isRf64 ? UINT32_MAX : SIZE_OF_DATA);    // Data chunk size
+}
 
-    int16_t *buf = new int16_t[SampleBlock::MAX_SAMPLES * m_numChannels];
 
-    SoundChannel::SoundPos pos = m_channels[0]->GetSoundPosFromSampleIdx(startIdx);
-    int64_t samplesLeftToOutput = NUM_SAMPLES_TO_OUTPUT;
-    while (samplesLeftToOutput > 0)
-    {
-        int len = m_channels[0]->m_blocks[pos.m_blockIdx]->m_len;
-        len -= pos.m_sampleIdx;
-        if (len > samplesLeftToOutput)
-            len = samplesLeftToOutput;
+// Writes whatever has to follow the sample data. RIFF pads the data chunk to
+// an even size and W64 to a multiple of 8 bytes.
+void Sound::WriteWavTrailer(BinaryStreamWriter *f, int64_t numGroups, int fileFormat)
+{
+    int64_t const SIZE_OF_DATA = numGroups * GetBytesPerGroup();
+    char const padding[8] = { 0 };
+    if (fileFormat == FILE_FORMAT_W64)
+        f->WriteBytes(padding, RoundUpToMultipleOf8(SIZE_OF_DATA) - SIZE_OF_DATA);
+    else
+        f->WriteBytes(padding, SIZE_OF_DATA & 1);
+}
 
+
+// Writes numGroups groups of samples, starting at startIdx, to buf. Doesn't
+// modify the Sound, so several threads can call it at once. Compressed blocks
+// are decoded to scratch buffers rather than through g_decodedBlockCache for
+// the same reason.
+void Sound::InterleaveRange(void *buf, int64_t startIdx, unsigned numGroups)
+{
+    SampleCodec const *codec = GetCodec();
+    uint8_t *dst = (uint8_t *)buf;
+
+    unsigned const MAX_DECODE_LEN = 16384;
+    unsigned const SAMPLE_SIZE = GetSampleTypeKernels(codec->m_sampleType)->m_size;
+    uint8_t *scratch = new uint8_t [m_numChannels * MAX_DECODE_LEN * SAMPLE_SIZE];
+
+    // Each channel is walked separately, because their block boundaries
+    // don't have to line up.
+    void const **srcs = new void const *[m_numChannels];
+    SoundChannel::SoundPos *positions = new SoundChannel::SoundPos[m_numChannels];
+    for (int chan_idx = 0; chan_idx < m_numChannels; chan_idx++)
+        positions[chan_idx] = m_channels[chan_idx]->GetSoundPosFromSampleIdx(startIdx);
+
+    while (numGroups > 0)
+    {
+        // Do up to the nearest block boundary in any channel.
+        unsigned len = SAMPLE_MIN(numGroups, MAX_DECODE_LEN);
         for (int chan_idx = 0; chan_idx < m_numChannels; chan_idx++)
         {
-            SoundChannel *chan = m_channels[chan_idx];
-            SampleBlock *block = chan->m_blocks[pos.m_blockIdx];
+            SoundChannel::SoundPos *pos = &positions[chan_idx];
+            SampleBlock *block = m_channels[chan_idx]->m_blocks[pos->m_blockIdx];
+            if (block->m_len - pos->m_sampleIdx < len)
+                len = block->m_len - pos->m_sampleIdx;
+        }
 
-            for (size_t i = 0; i < len; i++)
-                buf[i * m_numChannels + chan_idx] = block->m_samples[pos.m_sampleIdx + i];
+        for (int chan_idx = 0; chan_idx < m_numChannels; chan_idx++)
+        {
+            SoundChannel::SoundPos *pos = &positions[chan_idx];
+            SampleBlock *block = m_channels[chan_idx]->m_blocks[pos->m_blockIdx];
+            void *chanScratch = scratch + chan_idx * MAX_DECODE_LEN * SAMPLE_SIZE;
+            srcs[chan_idx] = block->ReadSamples(pos->m_sampleIdx, len, chanScratch);
         }
 
-        f->WriteBytes((char *)buf, len * BYTES_PER_GROUP);
-        samplesLeftToOutput -= len;
-        pos.m_blockIdx++;
-        pos.m_sampleIdx = 0;
+        codec->Encode(dst, srcs, m_numChannels, len);
+        dst += len * codec->m_bytesPerSample * m_numChannels;
+        numGroups -= len;
+
+        for (int chan_idx = 0; chan_idx < m_numChannels; chan_idx++)
+        {
+            SoundChannel::SoundPos *pos = &positions[chan_idx];
+            pos->m_sampleIdx += len;
+            if (pos->m_sampleIdx >= (int)m_channels[chan_idx]->m_blocks[pos->m_blockIdx]->m_len)
+            {
+                pos->m_blockIdx++;
+                pos->m_sampleIdx = 0;
+            }
+        }
     }
 
-    delete[] buf;
+    delete[] scratch;
+    delete[] srcs;
+    delete[] positions;
+}
 
-    return true;
+
+// Appends the blocks that are still waiting to be copied out of a mapped
+// file, including the ones the undo history refers to. Blocks can be listed
+// more than once.
+void Sound::ListUnloadedBlocks(DArray <SampleBlock *> *blocks)
+{
+    for (int i = 0; i < m_numChannels; i++)
+        m_channels[i]->m_blocks.ListUnloadedBlocks(blocks);
+    m_undoHistory->ListUnloadedBlocks(blocks);
+}
+
+
+bool Sound::IsLoading()
+{
+    return m_loader && !m_loader->IsFinished();
+}
+
+
+float Sound::GetLoadProgress()
+{
+    return m_loader ? m_loader->GetProgress() : 1.0f;
+}
+
+
+// Stops the worker thread loading any more blocks. The rest will be loaded
+// when they are needed.
+void Sound::CancelLoading()
+{
+    if (!m_loader)
+        return;
+
+    m_loader->Cancel();
+    m_loader->Release();
+    m_loader = NULL;
+}
+
+
+// Returns the number of samples from the start of the Sound that have been
+// loaded in every channel.
+int64_t Sound::GetLoadedLength()
+{
+    int64_t loadedLength = GetLength();
+    for (int i = 0; i < m_numChannels; i++)
+    {
+        BlockDirectory *blocks = &m_channels[i]->m_blocks;
+        int blockIdx = blocks->FindFirstUnloadedBlock();
+        if (blockIdx < blocks->Size())
+        {
+            int64_t startIdx = blocks->GetStartIdx(blockIdx);
+            if (startIdx < loadedLength)
+                loadedLength = startIdx;
+        }
+    }
+
+    return loadedLength;
 }
 
 
@@ -338,3 +805,64 @@ int64_t Sound::GetLength()
 
     return m_cachedLength;
 }
+
+
+SampleCodec const *Sound::GetCodec()
+{
+    return GetSampleCodec(m_sampleFormat);
+}
+
+
+unsigned Sound::GetBytesPerGroup()
+{
+    return m_numChannels * GetCodec()->m_bytesPerSample;
+}
+
+
+bool Sound::UpdateDirtyLuts()
+{
+    if (!m_lutsDirty)
+        return false;
+
+    // A few blocks per frame keeps the frame time down while still getting
+    // through a whole-file edit in a second or two.
+    int const MAX_BLOCKS_PER_CALL = 8;
+
+    bool moreToDo = false;
+    for (int i = 0; i < m_numChannels; i++)
+    {
+        if (m_channels[i]->UpdateDirtyLuts(MAX_BLOCKS_PER_CALL))
+            moreToDo = true;
+    }
+
+    m_lutsDirty = moreToDo;
+    return moreToDo;
+}
+
+
+// Compresses a few of the blocks that edits have left uncompressed. The caller
+// must make sure no other thread is reading the blocks. See SampleBlock.
+bool Sound::CompressBlocks()
+{
+    if (!g_compressBlocks)
+        return false;
+
+    // Compressing a block takes about as long as building its LUTs.
+    int const MAX_BLOCKS_PER_CALL = 4;
+
+    bool moreToDo = false;
+    for (int i = 0; i < m_numChannels; i++)
+    {
+        if (m_channels[i]->CompressBlocks(MAX_BLOCKS_PER_CALL))
+            moreToDo = true;
+    }
+
+    return moreToDo;
+}
+
+
+void Sound::GetLastEdit(int64_t *startIdx, int64_t *endIdx)
+{
+    *startIdx = m_lastEditStartIdx;
+    *endIdx = m_lastEditEndIdx;
+}
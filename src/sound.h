@@ -1,44 +1,102 @@
 #pragma once
 
 
+#include "containers/darray.h"
+
 #include <stdint.h>
 
 
 class BinaryStreamReader;
+class BlockLoader;
 class BinaryStreamWriter;
 class SoundChannel;
+class UndoHistory;
+struct SampleBlock;
+struct SampleCodec;
 
 
 class Sound
 {
 private:
     int64_t m_cachedLength;
+    bool m_lutsDirty;       // True if an edit might have left LUT updates for UpdateDirtyLuts() to do.
+    BlockLoader *m_loader;  // NULL unless MapWav() started one
+    unsigned m_editGeneration;
+    int64_t m_lastEditStartIdx;
+    int64_t m_lastEditEndIdx;
+    bool ReadWavHeader(BinaryStreamReader *stream, int64_t *numGroups);
+    void ReadFmtChunk(BinaryStreamReader *stream, int64_t chunkSize);
+    unsigned GetFmtChunkSize();
+    void WriteFmtChunk(BinaryStreamWriter *stream);
     void SetVolumeHelper(int64_t startIdx, int64_t endIdx, double startVol, double endVol);
+    void NoteEdit(int64_t startIdx, int64_t endIdx);
 
 public:
     enum
     {
         ERROR_NO_ERROR,
-        ERROR_WRONG_NUMBER_OF_CHANNELS
+        ERROR_WRONG_NUMBER_OF_CHANNELS,
+        ERROR_WRONG_SAMPLE_TYPE
+    };
+
+    enum
+    {
+        FILE_FORMAT_WAV,    // RIFF, or RF64 if the data doesn't fit in 4 GB
+        FILE_FORMAT_W64     // Sony Wave64
     };
 
     SoundChannel **m_channels;  // All the channels contain the same number of samples.
     int m_numChannels;
     char *m_filename;
+    int m_fileFormat;       // The format the file was in. Saving keeps it.
+    int m_sampleFormat;     // One of SAMPLE_FORMAT_*. Determines the blocks' sample type.
+    unsigned m_sampleRate;
+    uint32_t m_channelMask; // Speaker positions from WAVE_FORMAT_EXTENSIBLE. 0 if the file didn't say.
+    UndoHistory *m_undoHistory;
 
     Sound();
     ~Sound();
 
     void Delete(int64_t startIdx, int64_t endIdx);
-    int Insert(int64_t startIdx, Sound *sound);
+    int Insert(int64_t startIdx, Sound *sound);    // Takes ownership of sound.
+    Sound *Copy(int64_t startIdx, int64_t endIdx);
 
     void FadeIn(int64_t startIdx, int64_t endIdx);
     void FadeOut(int64_t startIdx, int64_t endIdx);
     void Normalize(int64_t startIdx, int64_t endIdx);
 
+    // Return false if there was nothing to undo or redo.
+    bool Undo();
+    bool Redo();
+
     bool LoadWav(BinaryStreamReader *stream);
-    bool SaveWav(); // Wrapper of BinaryStreamWriter overload. Saves to file called m_filename.
-    bool SaveWav(BinaryStreamWriter *stream, int64_t startIdx, int64_t endIdx);
+    bool MapWav(char const *filename, int numLoaderThreads = 0);
+    void WriteWavHeader(BinaryStreamWriter *stream, int64_t numGroups, int fileFormat);
+    void WriteWavTrailer(BinaryStreamWriter *stream, int64_t numGroups, int fileFormat);
+    void InterleaveRange(void *buf, int64_t startIdx, unsigned numGroups);
+
+    void ListUnloadedBlocks(DArray <SampleBlock *> *blocks);
+
+    // For the worker thread MapWav() starts.
+    BlockLoader *GetLoader() { return m_loader; }
+    bool IsLoading();
+    float GetLoadProgress();
+    void CancelLoading();
+    int64_t GetLoadedLength();
 
     int64_t GetLength();
+    SampleCodec const *GetCodec();
+    unsigned GetBytesPerGroup();    // In the file
+
+    // Call once per frame. Finishes a bounded amount of the LUT updates left
+    // behind by big edits. Returns true if there is more to do.
+    bool UpdateDirtyLuts();
+    bool CompressBlocks();
+
+    // Goes up by one with every edit, so that things derived from the samples
+    // can tell when to update. GetLastEdit() gives the range of samples the
+    // most recent edit changed. Edits that change the length count as
+    // changing everything after where they start, with endIdx INT64_MAX.
+    unsigned GetEditGeneration() { return m_editGeneration; }
+    void GetLastEdit(int64_t *startIdx, int64_t *endIdx);
 };
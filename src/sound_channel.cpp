@@ -10,140 +10,227 @@
 #include <stdlib.h>
 
 
-unsigned SoundChannel::GetLength()
+// ****************************************************************************
+// Private Functions
+// ****************************************************************************
+
+// Merges block blockIdx with the block after it, if they fit in one block.
+void SoundChannel::TryMergeBlocks(int blockIdx)
+{
+    if (blockIdx < 0 || blockIdx + 1 >= m_blocks.Size())
+        return;
+
+    SampleBlock *block = m_blocks[blockIdx];
+    SampleBlock *nextBlock = m_blocks[blockIdx + 1];
+    if (block->m_len + nextBlock->m_len > SampleBlock::MAX_SAMPLES)
+        return;
+
+    block = m_blocks.GetWritableBlock(blockIdx);
+
+    unsigned oldLen = block->m_len;
+    nextBlock->CopySamples(block->GetSamples(oldLen), 0, nextBlock->m_len);
+    block->m_len += nextBlock->m_len;
+    block->InvalidateLuts(oldLen, block->m_len);
+    m_blocks.BlockChanged(blockIdx);
+    m_blocks.Remove(blockIdx + 1, 1);
+}
+
+
+// Call after changing the length of block blockIdx, or the blocks either side
+// of it. Any two adjacent blocks that were too big to merge before the change
+// still are, unless one of them is near blockIdx.
+void SoundChannel::MergeAround(int blockIdx)
 {
-    unsigned len = 0;
-    for (int i = 0; i < m_blocks.Size(); i++)
-        len += m_blocks[i]->m_len;
-    return len;
+    // Work backwards so that merges don't change the indices we have yet to do.
+    for (int i = blockIdx + 1; i >= blockIdx - 1; i--)
+        TryMergeBlocks(i);
+}
+
+
+// ****************************************************************************
+// Public Functions
+// ****************************************************************************
+
+int64_t SoundChannel::GetLength()
+{
+    return m_blocks.GetLength();
 }
 
 
 void SoundChannel::Delete(int64_t startIdx, int64_t endIdx)
 {
-    int64_t numSamplesToDelete = endIdx - startIdx + 1;
-    SoundPos pos = GetSoundPosFromSampleIdx(startIdx);
-    while (pos.m_blockIdx < m_blocks.Size())
-    {
-        SampleBlock *block = m_blocks[pos.m_blockIdx];
-        int64_t numSamplesToDeleteFromThisBlock = numSamplesToDelete;
-        int numSamplesLeftInThisBlock = block->m_len - pos.m_sampleIdx;
-        if (numSamplesToDeleteFromThisBlock > numSamplesLeftInThisBlock)
-        {
-            // Delete up to the end of the block
-            block->m_len = pos.m_sampleIdx;
-            pos.m_sampleIdx = 0;
+    if (startIdx < 0)
+        startIdx = 0;
+    if (endIdx >= GetLength())
+        endIdx = GetLength() - 1;
+    if (endIdx < startIdx)
+        return;
 
-            numSamplesToDelete -= numSamplesLeftInThisBlock;
+    SoundPos startPos = GetSoundPosFromSampleIdx(startIdx);
+    SoundPos endPos = GetSoundPosFromSampleIdx(endIdx + 1);   // First sample we keep after the range
 
-            block->RecalcLuts();
-        }
-        else
+    if (startPos.m_blockIdx == endPos.m_blockIdx)
+    {
+        // Delete a bit from the middle (or maybe the start) of the block
+        SampleBlock *block = m_blocks.GetWritableBlock(startPos.m_blockIdx);
+        unsigned oldLen = block->m_len;
+        memmove(block->GetSamples(startPos.m_sampleIdx),
+            block->GetSamples(endPos.m_sampleIdx),
+            (oldLen - endPos.m_sampleIdx) * block->GetSampleSize());
+        block->m_len -= endPos.m_sampleIdx - startPos.m_sampleIdx;
+        block->InvalidateLuts(startPos.m_sampleIdx, oldLen);
+        m_blocks.BlockChanged(startPos.m_blockIdx);
+    }
+    else
+    {
+        int firstBlockToRemove = startPos.m_blockIdx;
+        if (startPos.m_sampleIdx > 0)
         {
-            // Delete a bit from the middle (or maybe the start) of the block
-            int numSamplesToCopy = block->m_len - (pos.m_sampleIdx + numSamplesToDeleteFromThisBlock);
-            int16_t *whereToCopyFrom = block->m_samples + pos.m_sampleIdx + numSamplesToDeleteFromThisBlock;
-            memcpy(block->m_samples + pos.m_sampleIdx,
-                whereToCopyFrom,
-                numSamplesToCopy);
-            block->m_len -= numSamplesToDeleteFromThisBlock;
-
-            block->RecalcLuts();
+            // Delete up to the end of the first block
+            SampleBlock *block = m_blocks.GetWritableBlock(startPos.m_blockIdx);
+            unsigned oldLen = block->m_len;
+            block->m_len = startPos.m_sampleIdx;
+            block->InvalidateLuts(startPos.m_sampleIdx, oldLen);
+            m_blocks.BlockChanged(startPos.m_blockIdx);
+            firstBlockToRemove++;
+        }
 
-            break;
+        if (endPos.m_sampleIdx > 0)
+        {
+            // Delete the start of the last block
+            SampleBlock *block = m_blocks.GetWritableBlock(endPos.m_blockIdx);
+            unsigned oldLen = block->m_len;
+            memmove(block->GetSamples(), block->GetSamples(endPos.m_sampleIdx),
+                (oldLen - endPos.m_sampleIdx) * block->GetSampleSize());
+            block->m_len -= endPos.m_sampleIdx;
+            block->InvalidateLuts(0, oldLen);
+            m_blocks.BlockChanged(endPos.m_blockIdx);
         }
 
-        pos.m_blockIdx++;
+        // Remove the blocks in between
+        m_blocks.Remove(firstBlockToRemove, endPos.m_blockIdx - firstBlockToRemove);
     }
 
-    // Now remove any empty blocks
+    MergeAround(startPos.m_blockIdx);
+}
+
+
+// Does at most maxBlocks blocks worth of the LUT updates that were too big to
+// do immediately when the samples were modified. Returns true if there is
+// more to do.
+bool SoundChannel::UpdateDirtyLuts(int maxBlocks)
+{
+    for (; maxBlocks > 0; maxBlocks--)
     {
-        int i = 0;
-        int j = 0;
+        int blockIdx = m_blocks.FindFirstDirtyBlock();
+        if (blockIdx >= m_blocks.Size())
+            return false;
+
+        // Shared blocks are fine here. See SampleBlock.
+        m_blocks[blockIdx]->UpdateLuts();
+        m_blocks.BlockChanged(blockIdx);
+    }
 
-        // i keeps track of the position in the input array (m_blocks)
-        // j keeps track of the position in the output array (also m_blocks)
-        // Each time when find a block to be deleted, i increments, while j stays the same.
+    return m_blocks.FindFirstDirtyBlock() < m_blocks.Size();
+}
 
-        for (i = 0; i < m_blocks.Size(); i++)
-        {
-            if (m_blocks[i]->m_len > 0)
-            {
-                m_blocks[j] = m_blocks[i];
-                j++;
-            }
-        }
 
-        while (i > j)
-        {
-            m_blocks.Pop();
-            j++;
-        }
+bool SoundChannel::CompressBlocks(int maxBlocks)
+{
+    for (; maxBlocks > 0; maxBlocks--)
+    {
+        int blockIdx = m_blocks.FindFirstUncompressedBlock();
+        if (blockIdx >= m_blocks.Size())
+            return false;
+
+        // Shared blocks are fine here too, since compressing a block doesn't
+        // change its samples.
+        m_blocks[blockIdx]->Compress();
+        m_blocks.BlockChanged(blockIdx);
     }
+
+    return m_blocks.FindFirstUncompressedBlock() < m_blocks.Size();
 }
 
 
 void SoundChannel::Insert(int64_t dstIdx, SoundChannel *src)
 {
     SoundPos dstPos = GetSoundPosFromSampleIdx(dstIdx);
-    
-    int numBlocksToMove = m_blocks.Size() - dstPos.m_blockIdx - 1;
+    int insertIdx = dstPos.m_blockIdx;
 
-    int numExtraBlocksNeeded = src->m_blocks.Size();
-    numExtraBlocksNeeded++; // We probably need to split a block where we 
-                            // insert, so we need an extra block.
+    // Split the block we are inserting into, unless we are inserting on a
+    // block boundary or off the end of the channel.
+    if (dstPos.m_sampleIdx > 0)
+    {
+        SampleBlock *blockToSplit = m_blocks.GetWritableBlock(dstPos.m_blockIdx);
+        SampleBlock *newBlock = new SampleBlock(blockToSplit->m_sampleType);
+        newBlock->m_len = blockToSplit->m_len - dstPos.m_sampleIdx;
+        memcpy(newBlock->GetSamples(), blockToSplit->GetSamples(dstPos.m_sampleIdx), 
+            newBlock->m_len * blockToSplit->GetSampleSize());
+        newBlock->InvalidateLuts(0, SampleBlock::MAX_SAMPLES);
+
+        unsigned oldLen = blockToSplit->m_len;
+        blockToSplit->m_len = dstPos.m_sampleIdx;
+        blockToSplit->InvalidateLuts(blockToSplit->m_len, oldLen);
+        m_blocks.BlockChanged(dstPos.m_blockIdx);
+
+        insertIdx++;
+        m_blocks.Insert(insertIdx, newBlock);
+    }
 
-    m_blocks.Resize(m_blocks.Size() + numExtraBlocksNeeded);
+    // Insert blocks from src. Their LUTs are already up to date.
+    int numSrcBlocks = src->m_blocks.Size();
+    m_blocks.Insert(insertIdx, &src->m_blocks);
 
-    // We are going to start by pretending we are inserting on a block 
-    // boundary.
+    // Merge any blocks we can, at the join after the inserted blocks first, so
+    // that insertIdx stays valid.
+    MergeAround(insertIdx + numSrcBlocks);
+    MergeAround(insertIdx - 1);
+}
 
-    // Make a gap.
-    int firstBlockToMoveIdx = dstPos.m_blockIdx + 1;
-    int firstIndexAfterMove = firstBlockToMoveIdx + src->m_blocks.Size() + 1;
-    for (int i = numBlocksToMove - 1; i > -1; i--)
-        m_blocks[firstIndexAfterMove + i] = m_blocks[firstBlockToMoveIdx + i];
 
-    // Insert blocks from src into the gap.
-    for (int i = 0; i < src->m_blocks.Size(); i++)
+// Returns a new channel containing samples startIdx to endIdx inclusive. Whole
+// blocks are shared with this channel rather than copied, so only the partial
+// blocks at each end cost anything proportional to their length.
+SoundChannel *SoundChannel::Copy(int64_t startIdx, int64_t endIdx)
+{
+    SoundChannel *copy = new SoundChannel;
+    int64_t numSamplesLeft = endIdx - startIdx + 1;
+    SoundPos pos = GetSoundPosFromSampleIdx(startIdx);
+    while (numSamplesLeft > 0 && pos.m_blockIdx < m_blocks.Size())
     {
-        src->m_blocks[i]->RecalcLuts();
-        m_blocks[firstBlockToMoveIdx + i] = src->m_blocks[i];
-    }
-
-    // Split the block we inserted into.
-    SampleBlock *blockToSplit = m_blocks[dstPos.m_blockIdx];
-    SampleBlock *newBlock = new SampleBlock;
-    newBlock->m_len = blockToSplit->m_len - dstPos.m_sampleIdx;
-    memcpy(newBlock->m_samples, blockToSplit->m_samples + dstPos.m_sampleIdx, 
-        newBlock->m_len * sizeof(int16_t));
-    m_blocks[firstIndexAfterMove - 1] = newBlock;
-    newBlock->RecalcLuts();
+        SampleBlock *block = m_blocks[pos.m_blockIdx];
+        int64_t numSamplesThisBlock = block->m_len - pos.m_sampleIdx;
+        if (numSamplesThisBlock > numSamplesLeft)
+            numSamplesThisBlock = numSamplesLeft;
 
-    blockToSplit->m_len = dstPos.m_sampleIdx + 1;
-    blockToSplit->RecalcLuts();
+        if (numSamplesThisBlock == block->m_len)
+        {
+            block->AddRef();
+            copy->m_blocks.Push(block);
+        }
+        else
+        {
+            copy->m_blocks.Push(block->CopyRange(pos.m_sampleIdx, numSamplesThisBlock));
+        }
 
-    // Merge any blocks we can.
-	// TODO
+        numSamplesLeft -= numSamplesThisBlock;
+        pos.m_blockIdx++;
+        pos.m_sampleIdx = 0;
+    }
 
-    // Free the parts of src that we don't need.
-    delete src;
+    return copy;
 }
 
 
 SoundChannel::SoundPos SoundChannel::GetSoundPosFromSampleIdx(int64_t sampleIdx)
 {
-    int blockIdx = 0;
-
-    while (sampleIdx >= m_blocks[blockIdx]->m_len)
-    {
-        sampleIdx -= m_blocks[blockIdx]->m_len;
-        blockIdx++;
-        if (blockIdx > m_blocks.Size())
-            return SoundPos(-1, -1);
-    }
+    int64_t blockStartIdx;
+    int blockIdx = m_blocks.FindBlock(sampleIdx, &blockStartIdx);
+    if (blockIdx >= m_blocks.Size())
+        return SoundPos(blockIdx, 0);
 
-    return SoundPos(blockIdx, sampleIdx);
+    return SoundPos(blockIdx, sampleIdx - blockStartIdx);
 }
 
 
@@ -187,148 +274,64 @@ SampleBlock *SoundChannel::IncrementSoundPos(SoundPos *pos, int64_t numSamples)
 }
 
 
-void SoundChannel::CalcMinMaxForRange(SoundPos *pos, unsigned numSamples, int16_t *resultMin, int16_t *resultMax)
+// Turns the sum of squares in *rms into the RMS of the column's samples.
+// Where CalcMinMax() rounded the column's edges out, the sum can be a little
+// too big, so the result is kept inside the min and max.
+static void FinishDisplayColumn(int64_t startIdx, int64_t endIdx, int16_t *_min, int16_t *_max, double *rms)
 {
-    // If pos is entirely outside the bounds of the sample, then we set resultMin and resultMax to zero.
-    if (pos->m_blockIdx >= m_blocks.Size())
+    if (*_min > *_max)
     {
-        *resultMax = 0;
-        *resultMin = 0;
+        *_min = 0;
+        *_max = 0;
+        *rms = 0.0;
         return;
     }
 
-    SampleBlock *block = m_blocks[pos->m_blockIdx];
-
-    int16_t _min = INT16_MAX;
-    int16_t _max = INT16_MIN;
-
-    // Do the slow bit at the start of the range.
-    {
-        const unsigned lutItemBoundaryMask = SampleBlock::SAMPLES_PER_LUT_ITEM - 1;
-        unsigned numSamplesToNextLutItemBoundary = (SampleBlock::SAMPLES_PER_LUT_ITEM - pos->m_sampleIdx) & lutItemBoundaryMask;
-        unsigned numSlowSamples = numSamplesToNextLutItemBoundary;
-        if (numSlowSamples > numSamples)
-            numSlowSamples = numSamples;
-        if (numSlowSamples > block->m_len)
-            numSlowSamples = block->m_len;
-
-        unsigned idx = pos->m_sampleIdx;
-        unsigned end_idx = idx + numSlowSamples;
-        if (end_idx > block->m_len)
-            end_idx = block->m_len;
-
-        while (idx < end_idx)
-        {
-            _min = SAMPLE_MIN(block->m_samples[idx], _min);
-            _max = SAMPLE_MAX(block->m_samples[idx], _max);
-            idx++;
-        }
+    double peak = SAMPLE_MAX(-(double)*_min, (double)*_max);
+    *rms = sqrt(*rms / (double)(endIdx - startIdx));
+    if (*rms > peak)
+        *rms = peak;
+}
 
-        numSamples -= numSlowSamples;
-        block = IncrementSoundPos(pos, numSlowSamples);
-    }
 
-    // Do the fast bit - one block per iteration.
-    while (block && numSamples > SampleBlock::SAMPLES_PER_LUT_ITEM)
+// Column i covers samples columnStarts[i] to columnStarts[i + 1] - 1. Columns
+// with no samples in them are left at zero. rmses[i] gets the RMS of column i.
+// isComplete[i] is set to false if column i needs blocks that haven't been
+// loaded yet. Doesn't load anything, so it is safe to call from several
+// threads at once while nothing is editing the channel.
+void SoundChannel::CalcDisplayColumns(int64_t const *columnStarts, unsigned numColumns,
+                                      int16_t *mins, int16_t *maxes, double *rmses, bool *isComplete)
+{
+    for (unsigned i = 0; i < numColumns; i++)
     {
-        // Cases here:
-        // 1. There is one or more LUT items in this block that we can use.
-        // 2. There is one or more LUT items left, but the pixel doesn't span entirely over it/them.
-
-        unsigned numLutItemsWeNeed = numSamples / SampleBlock::SAMPLES_PER_LUT_ITEM;
-        unsigned currentLutItemIdx = pos->m_sampleIdx / SampleBlock::SAMPLES_PER_LUT_ITEM;
-        unsigned numLutItemsInThisBlock = ((block->m_len - 1) / SampleBlock::SAMPLES_PER_LUT_ITEM) + 1;
-        unsigned numLutItemsLeftInThisBlock = numLutItemsInThisBlock - currentLutItemIdx;
-
-        unsigned numLutItemsToUse = numLutItemsWeNeed;
-        if (numLutItemsLeftInThisBlock < numLutItemsToUse)
-            numLutItemsToUse = numLutItemsLeftInThisBlock;
-
-        unsigned endLutItemIdx = currentLutItemIdx + numLutItemsToUse;
-        while (currentLutItemIdx < endLutItemIdx)
-        {
-            _min = SAMPLE_MIN(block->m_minLut[currentLutItemIdx], _min);
-            _max = SAMPLE_MAX(block->m_maxLut[currentLutItemIdx], _max);
-            currentLutItemIdx++;
-        }
-
-        // Calculate how many samples we processed. It's a little complex because the
-        // LUT items we used might not have been "full", if the block has been part of
-        // and insert or delete operation previously.
-        unsigned numSamplesLeftInThisBlockBeforeWeDidTheFastBit = block->m_len - pos->m_sampleIdx;
-        unsigned numSamplesProcessedThisIteration = numLutItemsToUse * SampleBlock::SAMPLES_PER_LUT_ITEM;
-        if (numSamples > numSamplesLeftInThisBlockBeforeWeDidTheFastBit)
-            numSamplesProcessedThisIteration = numSamplesLeftInThisBlockBeforeWeDidTheFastBit;
-
-        numSamples -= numSamplesProcessedThisIteration;
-        block = IncrementSoundPos(pos, numSamplesProcessedThisIteration);
+        mins[i] = INT16_MAX;
+        maxes[i] = INT16_MIN;
+        rmses[i] = 0.0;
+        isComplete[i] = true;
     }
 
-    // Do the slow bit at the end of the range.
-    while (block && numSamples)
-    {
-        // We are not at end of block and numSamples is less than next LUT item boundary.
-        // Cases:
-        // 1 - There are enough samples in the current block to cover the current pixel.
-        // 2 - There aren't.
-
-        unsigned idx = pos->m_sampleIdx;
-        unsigned end_idx = pos->m_sampleIdx + numSamples;
-        if (end_idx > block->m_len)
-            end_idx = block->m_len;
-
-        unsigned numSamplesThisIteration = end_idx - idx;
-        
-        while (idx < end_idx)
-        {
-            _min = SAMPLE_MIN(block->m_samples[idx], _min);
-            _max = SAMPLE_MAX(block->m_samples[idx], _max);
-            idx++;
-        }
+    // rmses holds the sums of squares until the walk is done.
+    m_blocks.CalcColumnMinMaxes(columnStarts, numColumns, mins, maxes, rmses, isComplete);
 
-        block = IncrementSoundPos(pos, numSamplesThisIteration);
-        numSamples -= numSamplesThisIteration;
-    }
-
-    *resultMin = _min;
-    *resultMax = _max;
+    for (unsigned i = 0; i < numColumns; i++)
+        FinishDisplayColumn(columnStarts[i], columnStarts[i + 1], mins + i, maxes + i, rmses + i);
 }
 
 
-void SoundChannel::CalcDisplayData(int start_sample_idx, int16_t *mins, int16_t *maxes, unsigned widthInPixels, double samplesPerPixel)
+// Calculates the columns CalcDisplayColumns() couldn't, loading at most
+// *numBlocksToLoad blocks to do it. Only for the GUI thread.
+void SoundChannel::CompleteDisplayColumns(int64_t const *columnStarts, unsigned numColumns,
+                                          int16_t *mins, int16_t *maxes, double *rmses, bool *isComplete, int *numBlocksToLoad)
 {
-    SoundPos pos = GetSoundPosFromSampleIdx(start_sample_idx);
-
-    double widthErrorPerPixel = samplesPerPixel - floorf(samplesPerPixel);
-    double error = 0;
-    for (unsigned x = 0; x < widthInPixels; x++)
+    for (unsigned i = 0; i < numColumns; i++)
     {
-        if (pos.m_blockIdx < m_blocks.Size())
-        {
-            int samplesThisPixel = samplesPerPixel;
-            if (error > 1.0)
-            {
-                samplesThisPixel++;
-                error -= 1.0;
-            }
-            error += widthErrorPerPixel;
-
-            CalcMinMaxForRange(&pos, samplesThisPixel, mins + x, maxes + x);
-
-            // On all but the first iteration of the loop, make vline join onto
-            // the previous, so no gaps are visible.
-            if (x > 0)
-            {
-                if (mins[x] > maxes[x - 1])
-                    mins[x] = maxes[x - 1] + 1;
-                if (maxes[x] < mins[x - 1])
-                    maxes[x] = mins[x - 1] - 1;
-            }
-        }
-        else
-        {
-            mins[x] = 0;
-            maxes[x] = 0;
-        }
+        if (isComplete[i])
+            continue;
+
+        mins[i] = INT16_MAX;
+        maxes[i] = INT16_MIN;
+        rmses[i] = 0.0;
+        isComplete[i] = m_blocks.CalcMinMax(columnStarts[i], columnStarts[i + 1], mins + i, maxes + i, rmses + i, numBlocksToLoad);
+        FinishDisplayColumn(columnStarts[i], columnStarts[i + 1], mins + i, maxes + i, rmses + i);
     }
 }
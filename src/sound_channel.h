@@ -1,11 +1,9 @@
 #pragma once
 
 // Project headers
+#include "block_directory.h"
 #include "sample_block.h"
 
-// Contrib headers
-#include "containers/darray.h"
-
 // Standard headers
 #include <stdint.h>
 
@@ -32,19 +30,29 @@ public:
     };
 
 private:
-    void CalcMinMaxForRange(SoundPos *pos, unsigned numSamples, int16_t *resultMin, int16_t *resultMax);
+    void TryMergeBlocks(int blockIdx);
+    void MergeAround(int blockIdx);
 
 public:
+    // Returns SoundPos(m_blocks.Size(), 0) if sampleIdx is outside the channel.
     SoundPos GetSoundPosFromSampleIdx(int64_t sampleIdx);
     SampleBlock *IncrementSoundPos(SoundPos *pos, int64_t numSamples);
 
-    // Each block has at most N samples (where N is probably 2^17). Any two adjacent blocks that total <= N samples will be merged.
-    DArray <SampleBlock *> m_blocks;
+    // Each block has at most N samples (where N is probably 2^17). Delete() and Insert() merge the blocks around the edit
+    // (see MergeAround()) when two adjacent ones total <= N samples. Blocks elsewhere are never merged, so small ones can remain.
+    BlockDirectory m_blocks;
 
-    unsigned GetLength();
+    int64_t GetLength();
 
     void Delete(int64_t startIdx, int64_t endIdx);
-    void Insert(int64_t dstIdx, SoundChannel *src); // Takes ownership of src.
+    void Insert(int64_t dstIdx, SoundChannel *src); // Moves all of src's blocks in, leaving src empty.
+    SoundChannel *Copy(int64_t startIdx, int64_t endIdx);
+
+    bool UpdateDirtyLuts(int maxBlocks);
+    bool CompressBlocks(int maxBlocks);
 
-    void CalcDisplayData(int startSampleIdx, int16_t *mins, int16_t *maxes, unsigned widthInPixels, double samplesPerPixel);
+    void CalcDisplayColumns(int64_t const *columnStarts, unsigned numColumns,
+                            int16_t *mins, int16_t *maxes, double *rmses, bool *isComplete);
+    void CompleteDisplayColumns(int64_t const *columnStarts, unsigned numColumns,
+                                int16_t *mins, int16_t *maxes, double *rmses, bool *isComplete, int *numBlocksToLoad);
 };
@@ -0,0 +1,41 @@
+// Own header
+#include "sound_snapshot.h"
+
+// Project headers
+#include "sound.h"
+#include "sound_channel.h"
+
+
+SoundSnapshot::SoundSnapshot(Sound *sound)
+{
+    static unsigned s_nextId = 1;
+    m_id = s_nextId++;
+
+    m_numChannels = sound->m_numChannels;
+    m_sampleRate = sound->m_sampleRate;
+    m_channels = new Channel [m_numChannels];
+    for (int i = 0; i < m_numChannels; i++)
+        sound->m_channels[i]->m_blocks.Share(&m_channels[i].m_blocks);
+}
+
+
+SoundSnapshot::~SoundSnapshot()
+{
+    delete[] m_channels;
+}
+
+
+SampleBlock *SoundSnapshot::FindBlock(int channelIdx, int64_t sampleIdx, int64_t *blockStartIdx, int *blockIdx)
+{
+    *blockIdx = m_channels[channelIdx].m_blocks.FindBlock(sampleIdx, blockStartIdx);
+    return GetBlock(channelIdx, *blockIdx);
+}
+
+
+SampleBlock *SoundSnapshot::GetBlock(int channelIdx, int blockIdx)
+{
+    BlockDirectory *blocks = &m_channels[channelIdx].m_blocks;
+    if (blockIdx < 0 || blockIdx >= blocks->Size())
+        return NULL;
+    return (*blocks)[blockIdx];
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+// Project headers
+#include "block_directory.h"
+
+// Standard headers
+#include <stdint.h>
+
+
+class Sound;
+struct SampleBlock;
+
+
+// An unchanging copy of a Sound's block lists, for threads that read the
+// sound while the GUI thread edits it. Each channel's BlockDirectory shares
+// the Sound's tree, so making one is O(1), however long the sound is. The
+// Sound copies the nodes it shares before changing them, and copies a shared
+// block before changing its samples, so nothing here ever changes. That costs
+// the next edit O(log n) copies. The GUI thread creates and deletes
+// snapshots. Other threads get them through g_epochReclaimer.
+class SoundSnapshot
+{
+public:
+    struct Channel
+    {
+        BlockDirectory m_blocks;
+    };
+
+    unsigned    m_id;               // Different for every snapshot, so a reader can tell a new one from an old one at the same address
+    int         m_numChannels;
+    unsigned    m_sampleRate;
+    Channel     *m_channels;
+
+    SoundSnapshot(Sound *sound);
+    ~SoundSnapshot();
+
+    int64_t GetLength() { return m_channels[0].m_blocks.GetLength(); }
+
+    // Returns the block that holds sample sampleIdx of the channel, and sets
+    // *blockStartIdx to the index of its first sample and *blockIdx to the
+    // block's index. Returns NULL if sampleIdx is outside the channel.
+    SampleBlock *FindBlock(int channelIdx, int64_t sampleIdx, int64_t *blockStartIdx, int *blockIdx);
+
+    // Returns NULL past the last block of the channel.
+    SampleBlock *GetBlock(int channelIdx, int blockIdx);
+};
@@ -1,16 +1,21 @@
 #include "sound_system.h"
 
 // Project includes
+#include "epoch_reclaimer.h"
 #include "sound.h"
 #include "sample_block.h"
-#include "sound_channel.h"
-#include "gui/sound_widget.h"
+#include "sample_format.h"
+#include "sound_snapshot.h"
+#include "df_lib_plus_plus/threading.h"
 #include "sound/sound_device.h"
+#include "sound/stereo_sample_ring.h"
 
 // Contrib includes
+#include "df_common.h"
 #include "df_time.h"
 
 // Standard headers
+#include <math.h>
 #include <memory.h>
 
 
@@ -19,7 +24,7 @@ SoundSystem *g_soundSystem = NULL;
 
 
 // ***************************************************************************
-// SoundSystem
+// Private Functions
 // ***************************************************************************
 
 static void SoundCallback(StereoSample *buf, unsigned int numSamples)
@@ -28,72 +33,535 @@ static void SoundCallback(StereoSample *buf, unsigned int numSamples)
 }
 
 
-SoundSystem::SoundSystem()
+// Points cursor at the block of snapshot that holds sampleIdx. Playing and
+// slow scrubbing mostly ask for the block the cursor is already in, so it
+// only searches the directory for a new snapshot or after a jump.
+void SoundSystem::MoveCursor(Cursor *cursor, SoundSnapshot *snapshot, int channelIdx, int64_t sampleIdx)
 {
-    m_soundWidget = NULL;
+    if (cursor->m_snapshotId == snapshot->m_id && cursor->m_block &&
+        sampleIdx >= cursor->m_startIdx && sampleIdx < cursor->m_startIdx + cursor->m_block->m_len)
+        return;
 
-	g_soundDevice = new SoundDevice;
-	g_soundDevice->SetCallback(SoundCallback);
+    cursor->m_snapshotId = snapshot->m_id;
+    cursor->m_block = snapshot->FindBlock(channelIdx, sampleIdx, &cursor->m_startIdx, &cursor->m_blockIdx);
 }
 
 
-void SoundSystem::Advance()
+// Writes numSamples stereo pairs to dst, from sampleIdx on, with silence
+// before the start of the sound and after the end. Mono sounds play on both
+// sides. Sounds with more than two channels play their first two. Each side
+// is read separately, with its own cursor, because the channels' block
+// boundaries don't have to line up.
+void SoundSystem::Decode(SoundSnapshot *snapshot, int64_t sampleIdx, unsigned numSamples, int16_t *dst)
 {
-	g_soundDevice->TopupBuffer();
+    for (int side = 0; side < 2; side++)
+    {
+        int channelIdx = SAMPLE_MIN(side, snapshot->m_numChannels - 1);
+        Cursor *cursor = &m_cursors[side];
+
+        unsigned i = 0;
+        for (; i < numSamples && sampleIdx + i < 0; i++)
+            dst[i * 2 + side] = 0;
+
+        if (i < numSamples)
+            MoveCursor(cursor, snapshot, channelIdx, sampleIdx + i);
+
+        // Copy a run of samples per iteration, up to the end of the current
+        // block or the end of dst. The cursor steps on to the next block by
+        // index, without searching.
+        while (i < numSamples && cursor->m_block)
+        {
+            SampleBlock *block = cursor->m_block;
+            unsigned offset = (unsigned)(sampleIdx + i - cursor->m_startIdx);
+            unsigned len = block->m_len - offset;
+            if (len > numSamples - i)
+                len = numSamples - i;
+            if (len > MIX_CHUNK_SIZE)
+                len = MIX_CHUNK_SIZE;
+
+            void const *samples = block->ReadSamples(offset, len, m_scratch);
+            block->GetKernels()->ToInt16(dst + i * 2 + side, 2, samples, len);
+
+            i += len;
+            if (offset + len >= block->m_len)
+            {
+                cursor->m_startIdx += block->m_len;
+                cursor->m_blockIdx++;
+                cursor->m_block = snapshot->GetBlock(channelIdx, cursor->m_blockIdx);
+            }
+        }
+
+        for (; i < numSamples; i++)
+            dst[i * 2 + side] = 0;
+    }
 }
 
 
-void SoundSystem::DeviceCallback(StereoSample *buf, unsigned int numSamples)
+// Fills buf from m_mixPos on, and moves m_mixPos on. The step through the
+// sound ramps from m_mixStep towards targetStep over the chunk, by no more
+// than MAX_STEP_CHANGE. Returns the number of samples it filled, which is
+// less than numSamples at the end of the sound, unless scrubbing. Scrubbing
+// stops just past either end instead, far enough out for m_resampler to read
+// only silence.
+unsigned SoundSystem::Mix(SoundSnapshot *snapshot, StereoSample *buf, unsigned numSamples, double targetStep)
 {
-    if (!m_soundWidget || !m_soundWidget->m_sound || !m_soundWidget->m_isPlaying)
+    double const MAX_STEP_CHANGE = 0.5;
+
+    double startTime = GetRealTime();
+    double length = (double)snapshot->GetLength();
+    double minAllowedPos = -Resampler::MAX_TAPS;
+    double maxAllowedPos = length + Resampler::MAX_TAPS;
+
+    double startStep = m_mixStep;
+    double endStep = targetStep;
+    if (endStep > startStep + MAX_STEP_CHANGE)
+        endStep = startStep + MAX_STEP_CHANGE;
+    else if (endStep < startStep - MAX_STEP_CHANGE)
+        endStep = startStep - MAX_STEP_CHANGE;
+    double stepIncrement = (endStep - startStep) / numSamples;
+
+    // Back to normal speed after scrubbing, which can leave m_mixPos between
+    // samples. Half a sample out isn't audible, and copying is cheaper.
+    bool isCopy = startStep == 1.0 && endStep == 1.0;
+    if (isCopy)
+        m_mixPos = floor(m_mixPos + 0.5);
+
+    // Work out where in the sound each sample comes from.
+    double minPos = m_mixPos;
+    double maxPos = m_mixPos;
+    double maxStep = fabs(startStep) > fabs(endStep) ? fabs(startStep) : fabs(endStep);
+    unsigned numSamplesDone = 0;
+    for (; numSamplesDone < numSamples; numSamplesDone++)
     {
-        memset(buf, 0, numSamples * sizeof(StereoSample));
-        return;
+        if (!m_mixIsScrubbing && m_mixPos >= length)
+            break;
+
+        m_mixPositions[numSamplesDone] = m_mixPos;
+        if (m_mixPos < minPos)
+            minPos = m_mixPos;
+        if (m_mixPos > maxPos)
+            maxPos = m_mixPos;
+        m_mixPos = ClampDouble(m_mixPos + startStep + numSamplesDone * stepIncrement, minAllowedPos, maxAllowedPos);
     }
+    m_mixStep = endStep;
 
-    Sound *sound = m_soundWidget->m_sound;
-    ReleaseAssert(sound->m_numChannels == 2, "Write more code");
+    if (isCopy)
+    {
+        Decode(snapshot, (int64_t)minPos, numSamplesDone, (int16_t *)buf);
+    }
+    else if (numSamplesDone > 0)
+    {
+        int halfWidth = Resampler::GetHalfWidth(maxStep);
+        int64_t framesStartIdx = (int64_t)floor(minPos) - halfWidth + 1;
+        unsigned numFrames = (unsigned)((int64_t)floor(maxPos) + halfWidth - framesStartIdx + 1);
+        DebugAssert(numFrames <= MAX_MIX_FRAMES);
+
+        Decode(snapshot, framesStartIdx, numFrames, m_mixSamples);
+        for (unsigned i = 0; i < numFrames * 2; i++)
+            m_mixFrames[i] = m_mixSamples[i];
+        m_resampler.Resample((int16_t *)buf, m_mixPositions, numSamplesDone, maxStep, m_mixFrames, framesStartIdx);
+        m_numSamplesResampled += numSamplesDone;
+    }
+
+    m_numSamplesMixed += numSamplesDone;
+    m_mixNanosec += (int64_t)((GetRealTime() - startTime) * 1e9);
+    return numSamplesDone;
+}
+
+
+// Makes snapshot the one the mixer reads, and deletes the old one once the
+// mixer can't be reading it any more.
+void SoundSystem::SetSnapshot(SoundSnapshot *snapshot)
+{
+    SoundSnapshot *oldSnapshot = m_snapshot.exchange(snapshot);
+    if (oldSnapshot)
+        g_epochReclaimer.Retire(DeleteSnapshot, oldSnapshot);
+}
+
+
+void SoundSystem::DeleteSnapshot(void *snapshot)
+{
+    delete (SoundSnapshot *)snapshot;
+}
+
+
+unsigned long __stdcall SoundSystem::MixerThreadProc(void *data)
+{
+    SoundSystem *soundSystem = (SoundSystem *)data;
+    soundSystem->RunMixer();
+    return 0;
+}
+
+
+unsigned long __stdcall SoundSystem::DeviceThreadProc(void *data)
+{
+    SoundSystem *soundSystem = (SoundSystem *)data;
+    soundSystem->RunDevice();
+    return 0;
+}
 
-    SoundChannel::SoundPos poses[2];
-    poses[0] = sound->m_channels[0]->GetSoundPosFromSampleIdx(m_soundWidget->m_playbackIdx);
-    poses[1] = sound->m_channels[1]->GetSoundPosFromSampleIdx(m_soundWidget->m_playbackIdx);
 
-    int64_t idx = poses[0].m_sampleIdx;
+void SoundSystem::RunMixer()
+{
+    StereoSample buf[MIX_CHUNK_SIZE];
 
-    for (int i = 0; i < numSamples; i++)
+    while (1)
     {
-        SampleBlock *blocks[2];
-        blocks[0] = sound->m_channels[0]->m_blocks[poses[0].m_blockIdx];
-        blocks[1] = sound->m_channels[1]->m_blocks[poses[1].m_blockIdx];
+        // Wait for the device thread to empty the ring.
+        if (m_flushIdx >= 0)
+        {
+            SleepMillisec(1);
+            continue;
+        }
 
-        buf[i].m_left = blocks[0]->m_samples[idx];
-        buf[i].m_right = blocks[1]->m_samples[idx];
+        // Fails while the GUI thread is compressing or paging out blocks.
+        if (!g_epochReclaimer.BeginRead(m_readerIdx))
+        {
+            SleepMillisec(1);
+            continue;
+        }
 
-        idx++;
-        if (idx >= blocks[0]->m_len)
+        unsigned numSamples = 0;
+        SoundSnapshot *snapshot = m_snapshot;
+        if (snapshot && snapshot->m_numChannels > 0)
         {
-            idx = 0;
-            poses[0].m_blockIdx++;
-            poses[1].m_blockIdx++;
+            int64_t seekIdx = m_seekIdx;
+            bool isScrubbing = m_isScrubbing;
 
-            if (poses[0].m_blockIdx >= sound->m_channels[0]->m_blocks.Size())
+            double targetStep = snapshot->m_sampleRate / (double)m_device->GetFreq();
+            if (isScrubbing)
+                targetStep *= m_scrubSpeed;
+            targetStep = ClampDouble(targetStep, -Resampler::MAX_STEP, Resampler::MAX_STEP);
+
+            // While scrubbing, only queue enough to keep the device going, so
+            // that changes of speed are heard straight away. Starting to
+            // scrub throws away what was queued before.
+            unsigned maxQueued = RING_SIZE;
+            if (isScrubbing)
+                maxQueued = m_device->GetSamplesPerChunk() + MIX_CHUNK_SIZE;
+
+            if (seekIdx >= 0 || snapshot->m_id != m_mixSnapshotId || (isScrubbing && !m_mixIsScrubbing))
+            {
+                // After an edit, carry on from where the device has got to.
+                int64_t startIdx = seekIdx >= 0 ? seekIdx : m_playedIdx.load();
+                m_mixSnapshotId = snapshot->m_id;
+                m_mixPos = (double)startIdx;
+                m_mixStep = targetStep;
+                m_mixOutIdx = 0;
+                m_endOutIdx = INT64_MAX;
+                m_flushIdx = startIdx;
+
+                // Leave any seek the GUI asked for since for next time.
+                m_seekIdx.compare_exchange_strong(seekIdx, -1);
+            }
+            else if (m_mixOutIdx < m_endOutIdx && m_ring->GetNumFree() >= MIX_CHUNK_SIZE &&
+                     m_ring->GetNumQueued() < maxQueued)
             {
-                memset(buf + i + 1, 0, (numSamples - (i + 1)) * sizeof(StereoSample));
-                m_soundWidget->m_playbackIdx = -1;
-                m_soundWidget->Pause();
-                return;
+                double startPos = m_mixPos;
+                numSamples = Mix(snapshot, buf, MIX_CHUNK_SIZE, targetStep);
+
+                // Before the chunk is queued, so that it's there by the time
+                // the device thread takes the chunk out.
+                ChunkPos *chunkPos = &m_chunkPoss[(m_mixOutIdx / MIX_CHUNK_SIZE) % NUM_CHUNK_POSS];
+                double length = (double)snapshot->GetLength();
+                chunkPos->m_startIdx = (int64_t)floor(ClampDouble(startPos, 0.0, length) + 0.5);
+                chunkPos->m_endIdx = (int64_t)floor(ClampDouble(m_mixPos, 0.0, length) + 0.5);
+                chunkPos->m_numSamples = numSamples;
+
+                m_mixOutIdx += numSamples;
+                if (numSamples < MIX_CHUNK_SIZE)
+                    m_endOutIdx = m_mixOutIdx;
             }
 
-            blocks[0] = sound->m_channels[0]->m_blocks[poses[0].m_blockIdx];
-            blocks[1] = sound->m_channels[0]->m_blocks[poses[1].m_blockIdx];
+            m_mixIsScrubbing = isScrubbing;
+        }
+
+        g_epochReclaimer.EndRead(m_readerIdx);
+
+        if (numSamples > 0)
+            m_ring->Write(buf, numSamples);
+        else
+            SleepMillisec(1);
+    }
+}
+
+
+void SoundSystem::RunDevice()
+{
+    // The device has a few buffers queued, so it can wait a while for the
+    // mixer to refill the ring after a flush, rather than play a gap. Up to
+    // this long, or half of what the device has left, whichever is less.
+    int const MAX_STARVED_POLLS = 20;
+
+    int numStarvedPolls = 0;
+    while (1)
+    {
+        HandleFlush();
+
+        int maxStarvedPolls = (m_device->GetNumBuffers() - 1) * m_device->GetSamplesPerChunk() * 500 / m_device->GetFreq();
+        if (maxStarvedPolls > MAX_STARVED_POLLS)
+            maxStarvedPolls = MAX_STARVED_POLLS;
+
+        // A device without a clock plays as fast as the mixer can keep up,
+        // but only while it's told to. DeviceCallback() waits for the mixer.
+        if (!m_device->HasClock())
+        {
+            if (m_isPlaying)
+            {
+                m_device->TopupBuffer();
+                continue;
+            }
+        }
+        else if (m_isPlaying && IsStarved(m_device->GetSamplesPerChunk()) && numStarvedPolls < maxStarvedPolls)
+        {
+            numStarvedPolls++;
+        }
+        else
+        {
+            numStarvedPolls = 0;
+            m_device->TopupBuffer();
+        }
+
+        SleepMillisec(1);
+    }
+}
+
+
+// Called on the device thread, which is the only one that can empty m_ring.
+void SoundSystem::HandleFlush()
+{
+    int64_t flushIdx = m_flushIdx;
+    if (flushIdx >= 0)
+    {
+        m_ring->Discard();
+        m_playedIdx = flushIdx;
+        m_playedOutIdx = 0;
+        m_flushIdx = -1;
+    }
+}
+
+
+// Returns true if the mixer hasn't queued numSamples yet, and has more to
+// queue, or hasn't caught up with a seek.
+bool SoundSystem::IsStarved(unsigned numSamples)
+{
+    if (m_seekIdx >= 0 || m_flushIdx >= 0)
+        return true;
+
+    unsigned numQueued = m_ring->GetNumQueued();
+    return numQueued < numSamples && m_playedOutIdx + numQueued < m_endOutIdx;
+}
+
+
+// Called on the device thread after taking samples from m_ring. Sets
+// m_playedIdx from where the chunk that the last of them is in came from.
+void SoundSystem::UpdatePlayedIdx()
+{
+    if (m_playedOutIdx == 0)
+        return;
+
+    int64_t lastIdx = m_playedOutIdx - 1;
+    ChunkPos *chunkPos = &m_chunkPoss[(lastIdx / MIX_CHUNK_SIZE) % NUM_CHUNK_POSS];
+    int64_t startIdx = chunkPos->m_startIdx;
+    int64_t endIdx = chunkPos->m_endIdx;
+    unsigned numSamples = chunkPos->m_numSamples;
+    int64_t numDone = lastIdx % MIX_CHUNK_SIZE + 1;
+    DebugAssert(numDone <= numSamples);
+    m_playedIdx = startIdx + (endIdx - startIdx) * numDone / numSamples;
+}
+
+
+// ***************************************************************************
+// Public Functions
+// ***************************************************************************
+
+SoundSystem::SoundSystem(SoundDevice *device)
+{
+    m_sound = NULL;
+    m_device = device;
+    m_ring = new StereoSampleRing(RING_SIZE);
+    m_snapshot = NULL;
+    m_snapshotSound = NULL;
+    m_snapshotEditGeneration = 0;
+    m_readerIdx = g_epochReclaimer.AddReader();
+    m_wasPlayingBeforeScrub = false;
+    m_mixSnapshotId = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        m_cursors[i].m_snapshotId = 0;
+        m_cursors[i].m_block = NULL;
+        m_cursors[i].m_blockIdx = 0;
+        m_cursors[i].m_startIdx = 0;
+    }
+    m_mixIsScrubbing = false;
+    m_mixPos = 0.0;
+    m_mixStep = 1.0;
+    m_mixOutIdx = 0;
+    m_playedOutIdx = 0;
+    m_isPlaying = false;
+    m_isScrubbing = false;
+    m_scrubSpeed = 0.0;
+    m_seekIdx = -1;
+    m_flushIdx = -1;
+    m_endOutIdx = INT64_MAX;
+    m_playedIdx = 0;
+    m_numSamplesMixed = 0;
+    m_numSamplesResampled = 0;
+    m_mixNanosec = 0;
+
+    for (int i = 0; i < NUM_CHUNK_POSS; i++)
+    {
+        m_chunkPoss[i].m_startIdx = 0;
+        m_chunkPoss[i].m_endIdx = 0;
+        m_chunkPoss[i].m_numSamples = 0;
+    }
+
+	m_device->SetCallback(SoundCallback);
+}
+
+
+// Gives the mixer a new snapshot if the sound has changed since the last one.
+void SoundSystem::Advance()
+{
+    Sound *sound = m_sound ? *m_sound : NULL;
+    if (sound != m_snapshotSound || (sound && sound->GetEditGeneration() != m_snapshotEditGeneration))
+    {
+        SetSnapshot(sound ? new SoundSnapshot(sound) : NULL);
+        m_snapshotSound = sound;
+        m_snapshotEditGeneration = sound ? sound->GetEditGeneration() : 0;
+    }
+
+    g_epochReclaimer.Reclaim();
+}
+
+
+// Called on the device thread. Never plays samples the mixer has asked to be
+// discarded. A device without a clock can't run dry, so that waits until the
+// mixer has queued the whole buffer.
+void SoundSystem::DeviceCallback(StereoSample *buf, unsigned int numSamples)
+{
+    HandleFlush();
+    if (!m_device->HasClock())
+    {
+        while (m_isPlaying && IsStarved(numSamples))
+        {
+            SleepMillisec(1);
+            HandleFlush();
         }
     }
 
-    m_soundWidget->m_playbackIdx += numSamples;
+    unsigned numSamplesDone = 0;
+    if (m_isPlaying)
+        numSamplesDone = m_ring->Read(buf, numSamples);
+    if (numSamplesDone > 0)
+    {
+        m_playedOutIdx += numSamplesDone;
+        UpdatePlayedIdx();
+    }
+
+    if (numSamplesDone == numSamples)
+        return;
+
+    memset(buf + numSamplesDone, 0, (numSamples - numSamplesDone) * sizeof(StereoSample));
+
+    // Once the last sample has gone, stop and go back to the start. Unless
+    // the GUI has just asked to play from somewhere else.
+    if (m_isPlaying && m_seekIdx < 0 && m_flushIdx < 0 && m_playedOutIdx >= m_endOutIdx)
+    {
+        m_isPlaying = false;
+        int64_t noSeek = -1;
+        m_seekIdx.compare_exchange_strong(noSeek, 0);
+    }
+}
+
+
+// The threads start the first time this is called, when g_soundSystem is
+// there for SoundCallback() to use.
+void SoundSystem::PlaySound(Sound * const *sound)
+{
+    bool threadsStarted = m_sound != NULL;
+    m_sound = sound;
+    if (threadsStarted)
+        return;
+
+    // Feeding the device is only copying, so it can take priority over
+    // everything. Mixing reads blocks, which can mean reading the file.
+    MyRaiseThreadPriority(StartThread(DeviceThreadProc, this), true);
+    MyRaiseThreadPriority(StartThread(MixerThreadProc, this), false);
+}
+
+
+void SoundSystem::ForgetSound()
+{
+    SetSnapshot(NULL);
+    m_snapshotSound = NULL;
+}
+
+
+void SoundSystem::Play()
+{
+    m_isPlaying = true;
+}
+
+
+void SoundSystem::Pause()
+{
+    m_isPlaying = false;
+}
+
+
+void SoundSystem::Seek(int64_t sampleIdx)
+{
+    m_seekIdx = sampleIdx;
+}
+
+
+// Returns where a seek the mixer or device thread hasn't got to yet will
+// start, so that the GUI never sees the position before it.
+int64_t SoundSystem::GetPlaybackIdx()
+{
+    int64_t seekIdx = m_seekIdx;
+    if (seekIdx >= 0)
+        return seekIdx;
+
+    int64_t flushIdx = m_flushIdx;
+    if (flushIdx >= 0)
+        return flushIdx;
+
+    return m_playedIdx;
+}
+
+
+void SoundSystem::Scrub(double speed)
+{
+    if (!m_isScrubbing)
+        m_wasPlayingBeforeScrub = m_isPlaying;
+
+    m_scrubSpeed = ClampDouble(speed, -MAX_SCRUB_SPEED, MAX_SCRUB_SPEED);
+    m_isScrubbing = true;
+    m_isPlaying = true;
+}
+
+
+// Carries on at normal speed from where scrubbing got to, if it was playing
+// before. Otherwise pauses there, and throws away what's queued.
+void SoundSystem::StopScrubbing()
+{
+    if (!m_isScrubbing)
+        return;
+
+    m_isScrubbing = false;
+    if (!m_wasPlayingBeforeScrub)
+    {
+        m_isPlaying = false;
+        Seek(GetPlaybackIdx());
+    }
 }
 
 
-void SoundSystem::PlaySound(SoundWidget *soundWidget)
+void SoundSystem::GetStats(Stats *stats)
 {
-    m_soundWidget = soundWidget;
+    stats->m_numSamplesMixed = m_numSamplesMixed;
+    stats->m_numSamplesResampled = m_numSamplesResampled;
+    stats->m_mixSeconds = m_mixNanosec * 1e-9;
 }
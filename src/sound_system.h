@@ -1,24 +1,170 @@
 #pragma once
 
 
+// Project headers
+#include "df_lib_plus_plus/threading.h"
+#include "resampler.h"
+
+// Standard headers
+#include <atomic>
 #include <stdint.h>
 
 
-class SoundWidget;
+class Sound;
+struct SampleBlock;
+class SoundDevice;
+class SoundSnapshot;
 class StereoSample;
+class StereoSampleRing;
 
 
+// Plays the Sound that PlaySound() was given a pointer to, which is the
+// SoundWidget's. Two threads of its own do the work, so that playback carries
+// on while the GUI thread is busy.
+//
+// The mixer thread turns the sound into StereoSamples a chunk at a time and
+// queues them in m_ring, keeping it as full as it can. It reads the sound
+// from m_snapshot, which Advance() replaces after each edit, and never
+// touches the Sound itself, so it never waits for an edit. If the sound's
+// sample rate is the device's and it is playing at normal speed, it copies
+// the samples. Otherwise m_resampler interpolates between them. The step
+// through the sound per sample queued ramps from chunk to chunk, so changes
+// of speed while scrubbing are smooth.
+//
+// The device thread tops up the sound device from m_ring. It never waits for
+// the mixer or the GUI, so if the mixer is held up, what's queued keeps the
+// sound going for as long as m_ring lasts. The exception is a device without
+// a clock, such as a NullSoundDevice rendering faster than real time. That
+// waits for the mixer instead, so it never gets a gap. Once samples aren't
+// copied one for one, where the device has got to in the sound can't be
+// worked out by counting, so the mixer notes where each chunk came from in
+// m_chunkPoss for the device thread to look up.
+//
+// The mixer reads each chunk between g_epochReclaimer.BeginRead() and
+// EndRead(), which keeps the snapshot from being deleted under it, and keeps
+// the GUI from compressing or paging out blocks at the same time. When the
+// mixer jumps to somewhere else in the sound, the samples already queued are
+// from the wrong place. It sets m_flushIdx to have the device thread discard
+// them, and waits until it has. Everything else the threads share is an
+// atomic.
 class SoundSystem
 {
 public:
-    SoundWidget *m_soundWidget;
+    enum { MAX_SCRUB_SPEED = 4 };       // Times normal speed
+
+    struct Stats
+    {
+        int64_t     m_numSamplesMixed;
+        int64_t     m_numSamplesResampled;  // Those that weren't copied one for one
+        double      m_mixSeconds;           // Time spent mixing them all
+    };
+
+private:
+    enum { RING_SIZE = 65536 };         // About 1.5 seconds at 44.1 kHz. Must be a power of two.
+    enum { MIX_CHUNK_SIZE = 1024 };
+    enum { NUM_CHUNK_POSS = RING_SIZE / MIX_CHUNK_SIZE * 2 };   // Twice what m_ring holds, so that the device thread can still look up a chunk it has just taken out after the mixer has queued the next
+    enum { MAX_MIX_FRAMES = MIX_CHUNK_SIZE * Resampler::MAX_STEP + Resampler::MAX_TAPS + 1 };  // Most of the sound that one chunk can need
+
+    // Where a chunk in m_ring came from. The mixer fills it in before
+    // queueing the chunk. Every chunk but the last before the end of the
+    // sound is MIX_CHUNK_SIZE samples, so chunk n starts at sample n *
+    // MIX_CHUNK_SIZE since the last flush.
+    struct ChunkPos
+    {
+        std::atomic<int64_t> m_startIdx;        // Sample index in the sound of the chunk's first sample
+        std::atomic<int64_t> m_endIdx;          // Sample index of the one after its last
+        std::atomic<unsigned> m_numSamples;
+    };
+
+    // Where Decode() got to in one side's blocks, so that the next chunk
+    // carries on from there instead of searching the snapshot's directory.
+    struct Cursor
+    {
+        unsigned    m_snapshotId;       // The snapshot m_block is in. 0 if none.
+        SampleBlock *m_block;           // NULL once past the end of the channel
+        int         m_blockIdx;
+        int64_t     m_startIdx;         // Sample index in the sound of m_block's first sample
+    };
+
+    SoundDevice *m_device;
+    StereoSampleRing *m_ring;
+    std::atomic<SoundSnapshot *> m_snapshot;    // NULL if there's no sound
+    ChunkPos    m_chunkPoss[NUM_CHUNK_POSS];
+
+    // Only the GUI thread uses these.
+    Sound       *m_snapshotSound;       // The sound m_snapshot is of
+    unsigned    m_snapshotEditGeneration;
+    bool        m_wasPlayingBeforeScrub;
+
+    // Only the mixer thread uses these.
+    int         m_readerIdx;            // For g_epochReclaimer
+    unsigned    m_mixSnapshotId;        // The snapshot m_mixPos is in. 0 if none.
+    bool        m_mixIsScrubbing;
+    double      m_mixPos;               // Sample index of the next sample to queue. Has a fraction unless copying.
+    double      m_mixStep;              // How far m_mixPos moves per sample queued. Negative when scrubbing backwards.
+    int64_t     m_mixOutIdx;            // Samples queued since the last flush
+    Cursor      m_cursors[2];           // Left then right
+    Resampler   m_resampler;
+    double      m_mixPositions[MIX_CHUNK_SIZE];     // Of each sample in the chunk being mixed
+    int16_t     m_mixSamples[MAX_MIX_FRAMES * 2];   // The part of the sound a chunk needs, as stereo pairs
+    float       m_mixFrames[MAX_MIX_FRAMES * 2];    // The same as floats, for m_resampler
+    int32_t     m_scratch[MIX_CHUNK_SIZE];          // Big enough for a chunk of any sample type
+
+    // Only the device thread uses this.
+    int64_t     m_playedOutIdx;         // Samples taken from m_ring since the last flush
+
+    std::atomic<bool>    m_isPlaying;
+    std::atomic<bool>    m_isScrubbing;
+    std::atomic<double>  m_scrubSpeed;  // Times normal speed. Negative plays backwards.
+    std::atomic<int64_t> m_seekIdx;     // Set by the GUI to play from somewhere else. -1 if it hasn't.
+    std::atomic<int64_t> m_flushIdx;    // Set by the mixer to have m_ring emptied. -1 if it hasn't.
+    std::atomic<int64_t> m_endOutIdx;   // Set by the mixer to m_mixOutIdx once it has queued the last sample. INT64_MAX until then.
+    std::atomic<int64_t> m_playedIdx;   // Sample index of the next sample to go to the device
+
+    std::atomic<int64_t> m_numSamplesMixed;
+    std::atomic<int64_t> m_numSamplesResampled;
+    std::atomic<int64_t> m_mixNanosec;
+
+    void MoveCursor(Cursor *cursor, SoundSnapshot *snapshot, int channelIdx, int64_t sampleIdx);
+    void Decode(SoundSnapshot *snapshot, int64_t sampleIdx, unsigned numSamples, int16_t *dst);
+    unsigned Mix(SoundSnapshot *snapshot, StereoSample *buf, unsigned numSamples, double targetStep);
+    void SetSnapshot(SoundSnapshot *snapshot);
+    static void DeleteSnapshot(void *snapshot);
+
+    static unsigned long __stdcall MixerThreadProc(void *data);
+    static unsigned long __stdcall DeviceThreadProc(void *data);
+    void RunMixer();
+    void RunDevice();
+    void HandleFlush();
+    bool IsStarved(unsigned numSamples);
+    void UpdatePlayedIdx();
+
+public:
+    Sound * const *m_sound;     // Where the GUI keeps the sound to play. NULL until PlaySound().
+
+    SoundSystem(SoundDevice *device);  // Takes ownership of device
+    SoundDevice *GetDevice() { return m_device; }
+
+    void DeviceCallback(StereoSample *buf, unsigned int numSamples);
 
-	SoundSystem();
+    // These are for the GUI thread. Call ForgetSound() when *sound is
+    // deleted or replaced, even by one at the same address.
+    void Advance();
+    void PlaySound(Sound * const *sound);
+    void ForgetSound();
+    void Play();
+    void Pause();
+    bool IsPlaying() { return m_isPlaying; }
+    void Seek(int64_t sampleIdx);
+    int64_t GetPlaybackIdx();
 
-	void Advance();
-	void DeviceCallback(StereoSample *buf, unsigned int numSamples);
+    // Plays from where playback has got to, at speed times normal, until
+    // StopScrubbing(). Call it again to change the speed.
+    void Scrub(double speed);
+    void StopScrubbing();
+    bool IsScrubbing() { return m_isScrubbing; }
 
-    void PlaySound(SoundWidget *SoundWidget);
+    void GetStats(Stats *stats);   // Any thread
 };
 
 
@@ -0,0 +1,469 @@
+// Own header
+#include "undo_history.h"
+
+// Project headers
+#include "block_directory.h"
+#include "sample_block.h"
+#include "sample_format.h"
+#include "sound_channel.h"
+
+// Contrib headers
+#include "df_common.h"
+
+
+size_t g_undoMemoryBudget = UndoHistory::DEFAULT_MEMORY_BUDGET;
+
+
+struct UndoStep
+{
+    struct ChannelChange
+    {
+        int m_firstBlockIdx;
+        int m_numBlocksToReplace;
+        int m_numBlocksAfter;       // Only used between BeginStep() and EndStep()
+        int m_numSameFirst;         // Blocks at the start of m_blocks that the Sound still has in the same place
+        int m_numSameLast;          // The same at the end
+        BlockDirectory *m_blocks;   // The blocks to put back. NULL while the step is in the journal.
+    };
+
+    int m_numChannels;
+    ChannelChange *m_changes;
+    int64_t m_journalOffset;        // -1 if the step isn't in the journal
+    size_t m_memoryUsed;            // 0 while the step is in the journal
+};
+
+
+// ****************************************************************************
+// Private Functions
+// ****************************************************************************
+
+static void JournalSeek(FILE *f, int64_t offset)
+{
+#ifdef _MSC_VER
+    _fseeki64(f, offset, SEEK_SET);
+#else
+    fseeko(f, offset, SEEK_SET);
+#endif
+}
+
+
+// Swaps the blocks in the step with the ones in the channels, which turns the
+// step into its own inverse. Returns the index of the first sample it
+// replaced.
+int64_t UndoHistory::ApplyStep(UndoStep *step, SoundChannel **channels)
+{
+    int64_t changeStartIdx = INT64_MAX;
+    for (int i = 0; i < step->m_numChannels; i++)
+    {
+        UndoStep::ChannelChange *change = &step->m_changes[i];
+        BlockDirectory *blocks = &channels[i]->m_blocks;
+
+        int64_t startIdx = blocks->GetLength();
+        if (change->m_firstBlockIdx < blocks->Size())
+            startIdx = blocks->GetStartIdx(change->m_firstBlockIdx);
+        if (startIdx < changeStartIdx)
+            changeStartIdx = startIdx;
+
+        BlockDirectory *removedBlocks = new BlockDirectory;
+        blocks->Extract(change->m_firstBlockIdx, change->m_numBlocksToReplace, removedBlocks);
+
+        int numBlocksInserted = change->m_blocks->Size();
+        blocks->Insert(change->m_firstBlockIdx, change->m_blocks);
+        delete change->m_blocks;
+
+        change->m_blocks = removedBlocks;
+        change->m_numBlocksToReplace = numBlocksInserted;
+    }
+
+    return changeStartIdx;
+}
+
+
+void UndoHistory::DeleteStep(UndoStep *step)
+{
+    for (int i = 0; i < step->m_numChannels; i++)
+        delete step->m_changes[i].m_blocks;
+    delete[] step->m_changes;
+    delete step;
+}
+
+
+// Notes which of the blocks the step would put back are ones the edit
+// didn't change, because they were only kept in case it merged them.
+void UndoHistory::FindSameBlocks(UndoStep *step, SoundChannel **channels)
+{
+    for (int i = 0; i < step->m_numChannels; i++)
+    {
+        UndoStep::ChannelChange *change = &step->m_changes[i];
+        BlockDirectory *blocks = &channels[i]->m_blocks;
+        int numOld = change->m_blocks->Size();
+        int numNew = change->m_numBlocksToReplace;
+        int firstIdx = change->m_firstBlockIdx;
+
+        int numFirst = 0;
+        while (numFirst < numOld && numFirst < numNew &&
+               (*change->m_blocks)[numFirst] == (*blocks)[firstIdx + numFirst])
+            numFirst++;
+
+        int numLast = 0;
+        while (numFirst + numLast < numOld && numFirst + numLast < numNew &&
+               (*change->m_blocks)[numOld - 1 - numLast] == (*blocks)[firstIdx + numNew - 1 - numLast])
+            numLast++;
+
+        change->m_numSameFirst = numFirst;
+        change->m_numSameLast = numLast;
+    }
+}
+
+
+// Counts the blocks the Sound let go of. Looking at reference counts instead
+// would miss the ones that a SoundSnapshot still has, or that another step
+// shares, until they let go. Counting a block the Sound still has somewhere
+// else, because it was pasted there, only sends steps to the journal sooner.
+size_t UndoHistory::CalcMemoryUsed(UndoStep *step)
+{
+    size_t numBytes = 0;
+    for (int i = 0; i < step->m_numChannels; i++)
+    {
+        UndoStep::ChannelChange *change = &step->m_changes[i];
+        BlockDirectory *blocks = change->m_blocks;
+        if (!blocks)
+            continue;
+
+        for (int j = change->m_numSameFirst; j < blocks->Size() - change->m_numSameLast; j++)
+            numBytes += (*blocks)[j]->GetMemoryUsed();
+    }
+
+    return numBytes;
+}
+
+
+void UndoHistory::InitStack(StepStack *stack)
+{
+    stack->m_numStepsInJournal = 0;
+    stack->m_journal = NULL;
+    stack->m_journalSize = 0;
+    stack->m_memoryUsed = 0;
+}
+
+
+void UndoHistory::ClearStack(StepStack *stack)
+{
+    for (unsigned i = 0; i < stack->m_steps.Size(); i++)
+        DeleteStep(stack->m_steps[i]);
+    stack->m_steps.Empty();
+
+    stack->m_numStepsInJournal = 0;
+    stack->m_journalSize = 0;
+    stack->m_memoryUsed = 0;
+}
+
+
+// The step is measured once, here. Compressing or paging out its blocks later
+// doesn't make the total go down until RecalcMemoryUsed().
+void UndoHistory::PushStep(StepStack *stack, UndoStep *step, SoundChannel **channels)
+{
+    FindSameBlocks(step, channels);
+    step->m_memoryUsed = CalcMemoryUsed(step);
+    stack->m_memoryUsed += step->m_memoryUsed;
+    stack->m_steps.Push(step);
+}
+
+
+UndoStep *UndoHistory::PopStep(StepStack *stack)
+{
+    if (stack->m_steps.Size() == 0)
+        return NULL;
+
+    UndoStep *step = stack->m_steps.Pop();
+    if (step->m_journalOffset >= 0)
+        ReadFromJournal(stack, step);
+    stack->m_memoryUsed -= step->m_memoryUsed;
+
+    return step;
+}
+
+
+void UndoHistory::RecalcMemoryUsed(StepStack *stack)
+{
+    stack->m_memoryUsed = 0;
+    for (unsigned i = stack->m_numStepsInJournal; i < stack->m_steps.Size(); i++)
+    {
+        UndoStep *step = stack->m_steps[i];
+        step->m_memoryUsed = CalcMemoryUsed(step);
+        stack->m_memoryUsed += step->m_memoryUsed;
+    }
+}
+
+
+void UndoHistory::WriteToJournal(StepStack *stack, UndoStep *step)
+{
+    if (!stack->m_journal)
+    {
+        stack->m_journal = tmpfile();
+        ReleaseAssert(stack->m_journal, "Couldn't create undo journal");
+    }
+
+    FILE *f = stack->m_journal;
+    JournalSeek(f, stack->m_journalSize);
+    step->m_journalOffset = stack->m_journalSize;
+
+    // For blocks that are compressed or paged out. Reading them through
+    // scratch means they don't have to be decoded into the cache or paged in.
+    uint8_t *scratch = new uint8_t [SampleBlock::GetSamplesStorageSize(sizeof(int32_t))];
+
+    for (int i = 0; i < step->m_numChannels; i++)
+    {
+        UndoStep::ChannelChange *change = &step->m_changes[i];
+        BlockDirectory *blocks = change->m_blocks;
+
+        uint32_t numBlocks = blocks->Size();
+        fwrite(&numBlocks, sizeof(numBlocks), 1, f);
+        stack->m_journalSize += sizeof(numBlocks);
+
+        for (unsigned j = 0; j < numBlocks; j++)
+        {
+            SampleBlock *block = (*blocks)[j];
+            uint32_t sampleType = block->m_sampleType;
+            uint32_t len = block->m_len;
+            unsigned sampleSize = block->GetSampleSize();
+            fwrite(&sampleType, sizeof(sampleType), 1, f);
+            fwrite(&len, sizeof(len), 1, f);
+            fwrite(block->ReadSamples(0, len, scratch), sampleSize, len, f);
+            stack->m_journalSize += sizeof(sampleType) + sizeof(len) + len * sampleSize;
+        }
+
+        delete blocks;
+        change->m_blocks = NULL;
+    }
+
+    delete[] scratch;
+    ReleaseAssert(!ferror(f), "Couldn't write undo journal");
+}
+
+
+// Only works on the most recent step in the journal.
+void UndoHistory::ReadFromJournal(StepStack *stack, UndoStep *step)
+{
+    FILE *f = stack->m_journal;
+    JournalSeek(f, step->m_journalOffset);
+
+    bool ok = true;
+    for (int i = 0; i < step->m_numChannels; i++)
+    {
+        UndoStep::ChannelChange *change = &step->m_changes[i];
+        change->m_blocks = new BlockDirectory;
+
+        uint32_t numBlocks = 0;
+        ok = ok && fread(&numBlocks, sizeof(numBlocks), 1, f) == 1;
+        for (unsigned j = 0; ok && j < numBlocks; j++)
+        {
+            uint32_t sampleType = 0;
+            uint32_t len = 0;
+            ok = fread(&sampleType, sizeof(sampleType), 1, f) == 1 && sampleType < SAMPLE_TYPE_NUM_TYPES &&
+                 fread(&len, sizeof(len), 1, f) == 1 && len <= SampleBlock::MAX_SAMPLES;
+            if (!ok)
+                break;
+
+            SampleBlock *block = new SampleBlock(sampleType);
+            block->m_len = len;
+            ok = fread(block->GetSamples(), block->GetSampleSize(), len, f) == len;
+            block->RecalcLuts();
+            change->m_blocks->Push(block);
+        }
+    }
+
+    ReleaseAssert(ok, "Couldn't read undo journal");
+
+    stack->m_journalSize = step->m_journalOffset;
+    stack->m_numStepsInJournal--;
+    step->m_journalOffset = -1;
+}
+
+
+// Moves the oldest steps to the journal until at least numBytesToFree have
+// been freed, or there is nothing left to move. Returns the number of bytes
+// freed.
+size_t UndoHistory::MoveToJournal(StepStack *stack, size_t numBytesToFree)
+{
+    size_t numBytesFreed = 0;
+    while (numBytesFreed < numBytesToFree && stack->m_numStepsInJournal < (int)stack->m_steps.Size())
+    {
+        UndoStep *step = stack->m_steps[stack->m_numStepsInJournal];
+        numBytesFreed += step->m_memoryUsed;
+        stack->m_memoryUsed -= step->m_memoryUsed;
+        step->m_memoryUsed = 0;
+        WriteToJournal(stack, step);
+        stack->m_numStepsInJournal++;
+    }
+
+    return numBytesFreed;
+}
+
+
+void UndoHistory::EnforceMemoryBudget()
+{
+    StepStack *stacks[2] = { &m_undoStack, &m_redoStack };
+    for (int i = 0; i < 2; i++)
+    {
+        size_t memoryUsed = GetMemoryUsed();
+        if (memoryUsed > m_memoryBudget)
+            MoveToJournal(stacks[i], memoryUsed - m_memoryBudget);
+    }
+}
+
+
+// ****************************************************************************
+// Public Functions
+// ****************************************************************************
+
+UndoHistory::UndoHistory()
+{
+    InitStack(&m_undoStack);
+    InitStack(&m_redoStack);
+    m_pendingStep = NULL;
+    m_memoryBudget = g_undoMemoryBudget;
+}
+
+
+UndoHistory::~UndoHistory()
+{
+    Clear();
+    if (m_undoStack.m_journal)
+        fclose(m_undoStack.m_journal);
+    if (m_redoStack.m_journal)
+        fclose(m_redoStack.m_journal);
+}
+
+
+void UndoHistory::BeginStep(SoundChannel **channels, int numChannels, int64_t startIdx, int64_t endIdx)
+{
+    DebugAssert(!m_pendingStep);
+
+    if (startIdx < 0)
+        startIdx = 0;
+
+    UndoStep *step = new UndoStep;
+    step->m_numChannels = numChannels;
+    step->m_changes = new UndoStep::ChannelChange[numChannels];
+    step->m_journalOffset = -1;
+    step->m_memoryUsed = 0;
+
+    for (int i = 0; i < numChannels; i++)
+    {
+        UndoStep::ChannelChange *change = &step->m_changes[i];
+        BlockDirectory *blocks = &channels[i]->m_blocks;
+
+        int64_t blockStartIdx;
+        int firstBlockIdx = blocks->FindBlock(startIdx, &blockStartIdx) - NUM_NEIGHBOUR_BLOCKS;
+        int lastBlockIdx = blocks->FindBlock(endIdx, &blockStartIdx) + NUM_NEIGHBOUR_BLOCKS;
+        if (firstBlockIdx < 0)
+            firstBlockIdx = 0;
+        if (lastBlockIdx >= blocks->Size())
+            lastBlockIdx = blocks->Size() - 1;
+        int numBlocks = lastBlockIdx - firstBlockIdx + 1;
+        if (numBlocks < 0)
+            numBlocks = 0;
+
+        change->m_firstBlockIdx = firstBlockIdx;
+        change->m_numBlocksAfter = blocks->Size() - firstBlockIdx - numBlocks;
+        change->m_blocks = new BlockDirectory;
+        blocks->CopyTo(firstBlockIdx, numBlocks, change->m_blocks);
+    }
+
+    m_pendingStep = step;
+}
+
+
+void UndoHistory::EndStep(SoundChannel **channels)
+{
+    DebugAssert(m_pendingStep);
+
+    UndoStep *step = m_pendingStep;
+    for (int i = 0; i < step->m_numChannels; i++)
+    {
+        UndoStep::ChannelChange *change = &step->m_changes[i];
+        change->m_numBlocksToReplace = channels[i]->m_blocks.Size() -
+            change->m_firstBlockIdx - change->m_numBlocksAfter;
+    }
+
+    m_pendingStep = NULL;
+
+    ClearStack(&m_redoStack);
+    PushStep(&m_undoStack, step, channels);
+    EnforceMemoryBudget();
+}
+
+
+bool UndoHistory::Undo(SoundChannel **channels, int64_t *changeStartIdx)
+{
+    UndoStep *step = PopStep(&m_undoStack);
+    if (!step)
+        return false;
+
+    *changeStartIdx = ApplyStep(step, channels);
+    PushStep(&m_redoStack, step, channels);
+    EnforceMemoryBudget();
+
+    return true;
+}
+
+
+bool UndoHistory::Redo(SoundChannel **channels, int64_t *changeStartIdx)
+{
+    UndoStep *step = PopStep(&m_redoStack);
+    if (!step)
+        return false;
+
+    *changeStartIdx = ApplyStep(step, channels);
+    PushStep(&m_undoStack, step, channels);
+    EnforceMemoryBudget();
+
+    return true;
+}
+
+
+void UndoHistory::Clear()
+{
+    ClearStack(&m_undoStack);
+    ClearStack(&m_redoStack);
+}
+
+
+// Steps in the journal don't have any, because they were loaded to write
+// them there.
+void UndoHistory::ListUnloadedBlocks(DArray <SampleBlock *> *blocks)
+{
+    StepStack *stacks[2] = { &m_undoStack, &m_redoStack };
+    for (int i = 0; i < 2; i++)
+    {
+        StepStack *stack = stacks[i];
+        for (unsigned j = stack->m_numStepsInJournal; j < stack->m_steps.Size(); j++)
+        {
+            UndoStep *step = stack->m_steps[j];
+            for (int k = 0; k < step->m_numChannels; k++)
+                step->m_changes[k].m_blocks->ListUnloadedBlocks(blocks);
+        }
+    }
+}
+
+
+void UndoHistory::BlocksLoaded()
+{
+    RecalcMemoryUsed(&m_undoStack);
+    RecalcMemoryUsed(&m_redoStack);
+    EnforceMemoryBudget();
+}
+
+
+void UndoHistory::SetMemoryBudget(size_t numBytes)
+{
+    m_memoryBudget = numBytes;
+    EnforceMemoryBudget();
+}
+
+
+size_t UndoHistory::GetMemoryUsed()
+{
+    return m_undoStack.m_memoryUsed + m_redoStack.m_memoryUsed;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+// Contrib headers
+#include "containers/darray.h"
+
+// Standard headers
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+
+struct SampleBlock;
+class SoundChannel;
+struct UndoStep;
+
+
+// Records edits to a Sound as changes to its channels' block lists. Each step
+// holds references to the blocks the edit replaced, plus a couple of
+// neighbours either side in case the edit merged them. Because blocks are
+// copy-on-write, holding those references is enough to keep their original
+// contents. Undoing a step swaps the blocks back in. That costs time
+// proportional to the number of blocks the edit touched, not the length of
+// the Sound.
+//
+// Blocks that edits took out of the Sound count towards the memory budget.
+// When the history goes over the budget, the oldest undo steps are written to
+// a journal in a temporary file, and read back if they are undone. If that
+// isn't enough, the redo steps furthest from the present go the same way.
+class UndoHistory
+{
+private:
+    struct StepStack
+    {
+        DArray <UndoStep *> m_steps;    // Oldest first
+        int     m_numStepsInJournal;    // The oldest m_numStepsInJournal steps are in m_journal
+        FILE    *m_journal;
+        int64_t m_journalSize;
+        size_t  m_memoryUsed;           // By the steps that aren't in m_journal
+    };
+
+    StepStack m_undoStack;
+    StepStack m_redoStack;              // Most recently undone last
+    UndoStep *m_pendingStep;            // Between BeginStep() and EndStep()
+    size_t  m_memoryBudget;
+
+    static int64_t ApplyStep(UndoStep *step, SoundChannel **channels);
+    static void DeleteStep(UndoStep *step);
+    static void FindSameBlocks(UndoStep *step, SoundChannel **channels);
+    static size_t CalcMemoryUsed(UndoStep *step);
+
+    static void InitStack(StepStack *stack);
+    static void ClearStack(StepStack *stack);
+    static void PushStep(StepStack *stack, UndoStep *step, SoundChannel **channels);
+    static UndoStep *PopStep(StepStack *stack);
+    static void RecalcMemoryUsed(StepStack *stack);
+    static void WriteToJournal(StepStack *stack, UndoStep *step);
+    static void ReadFromJournal(StepStack *stack, UndoStep *step);
+    static size_t MoveToJournal(StepStack *stack, size_t numBytesToFree);
+
+    void EnforceMemoryBudget();
+
+public:
+    enum { DEFAULT_MEMORY_BUDGET = 512 * 1024 * 1024 };
+
+    // SoundChannel::MergeAround() can change blocks up to this far either
+    // side of the ones an edit covers, so each step keeps them too.
+    enum { NUM_NEIGHBOUR_BLOCKS = 2 };
+
+    UndoHistory();
+    ~UndoHistory();
+
+    // Call either side of an edit that only changes samples in [startIdx, endIdx].
+    void BeginStep(SoundChannel **channels, int numChannels, int64_t startIdx, int64_t endIdx);
+    void EndStep(SoundChannel **channels);
+
+    // Return false if there is nothing to undo or redo. Otherwise set
+    // *changeStartIdx to the first sample the step could have changed.
+    bool Undo(SoundChannel **channels, int64_t *changeStartIdx);
+    bool Redo(SoundChannel **channels, int64_t *changeStartIdx);
+
+    void Clear();
+    void ListUnloadedBlocks(DArray <SampleBlock *> *blocks);
+
+    // Call after loading blocks the steps refer to. Loading makes them
+    // bigger, so the steps are measured again.
+    void BlocksLoaded();
+    void SetMemoryBudget(size_t numBytes);
+    size_t GetMemoryUsed();     // A running total, so it doesn't walk the blocks.
+};
+
+
+// The budget that new UndoHistorys start with.
+extern size_t g_undoMemoryBudget;
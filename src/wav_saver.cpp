@@ -0,0 +1,281 @@
+// Own header
+#include "wav_saver.h"
+
+// Project headers
+#include "block_store.h"
+#include "epoch_reclaimer.h"
+#include "sample_block.h"
+#include "sound.h"
+#include "df_lib_plus_plus/binary_stream_writers.h"
+#include "df_lib_plus_plus/filesys_utils.h"
+#include "df_lib_plus_plus/string_utils.h"
+#include "df_lib_plus_plus/threading.h"
+
+// Contrib headers
+#include "df_time.h"
+
+// Standard headers
+#include <stdio.h>
+#include <string.h>
+
+
+// ****************************************************************************
+// Private Functions
+// ****************************************************************************
+
+unsigned long __stdcall WavSaver::InterleaverThreadProc(void *data)
+{
+    WavSaver *saver = (WavSaver *)data;
+    int readerIdx = g_epochReclaimer.AddReader();
+    saver->InterleaveChunks(readerIdx);
+    saver->LoadBlocks(readerIdx);
+    g_epochReclaimer.RemoveReader(readerIdx);
+    saver->m_numThreadsRunning--;
+    return 0;
+}
+
+
+unsigned long __stdcall WavSaver::WriterThreadProc(void *data)
+{
+    WavSaver *saver = (WavSaver *)data;
+    saver->WriteChunks();
+    saver->m_numThreadsRunning--;
+    return 0;
+}
+
+
+// Waits until g_blockStore is within its budget and the GUI thread isn't
+// paging blocks out or compressing them. Returns false if the save failed
+// meanwhile.
+bool WavSaver::BeginRead(int readerIdx)
+{
+    while (!m_failed)
+    {
+        if (!g_blockStore.IsOverBudget() && g_epochReclaimer.BeginRead(readerIdx))
+            return true;
+        SleepMillisec(1);
+    }
+
+    return false;
+}
+
+
+void WavSaver::InterleaveChunks(int readerIdx)
+{
+    while (!m_failed)
+    {
+        int chunkIdx = m_nextChunkIdx++;
+        if (chunkIdx >= m_numChunks)
+            break;
+
+        // Wait for the writer to finish with the chunk that was in this
+        // buffer before.
+        Buffer *buf = &m_buffers[chunkIdx % m_numBuffers];
+        while (m_numChunksWritten <= chunkIdx - m_numBuffers && !m_failed)
+            SleepMillisec(1);
+
+        int64_t startIdx = (int64_t)chunkIdx * CHUNK_NUM_GROUPS;
+        unsigned numGroups = CHUNK_NUM_GROUPS;
+        if (startIdx + numGroups > m_length)
+            numGroups = m_length - startIdx;
+
+        if (!BeginRead(readerIdx))
+            break;
+        m_sound->InterleaveRange(buf->m_samples, startIdx, numGroups);
+        g_epochReclaimer.EndRead(readerIdx);
+        buf->m_chunkIdx = chunkIdx;
+    }
+}
+
+
+// Keeps going after a failure, to release the rest of the blocks.
+void WavSaver::LoadBlocks(int readerIdx)
+{
+    while (1)
+    {
+        unsigned i = m_nextBlockIdx++;
+        if (i >= m_blocksToLoad.Size())
+            break;
+
+        if (BeginRead(readerIdx))
+        {
+            m_blocksToLoad[i]->Load();
+            g_epochReclaimer.EndRead(readerIdx);
+        }
+
+        m_blocksToLoad[i]->Release();
+        m_numBlocksLoaded++;
+    }
+}
+
+
+void WavSaver::WriteChunks()
+{
+    m_sound->WriteWavHeader(m_file, m_length, m_fileFormat);
+
+    unsigned const bytesPerGroup = m_sound->GetBytesPerGroup();
+    for (int chunkIdx = 0; chunkIdx < m_numChunks && !m_failed; chunkIdx++)
+    {
+        Buffer *buf = &m_buffers[chunkIdx % m_numBuffers];
+        while (buf->m_chunkIdx != chunkIdx && !m_failed)
+            SleepMillisec(1);
+
+        int64_t startIdx = (int64_t)chunkIdx * CHUNK_NUM_GROUPS;
+        int64_t numGroups = CHUNK_NUM_GROUPS;
+        if (startIdx + numGroups > m_length)
+            numGroups = m_length - startIdx;
+
+        if (!m_file->WriteBytes((char *)buf->m_samples, numGroups * bytesPerGroup))
+            m_failed = true;
+
+        buf->m_chunkIdx = -1;
+        m_numChunksWritten = chunkIdx + 1;
+    }
+
+    if (!m_failed)
+        m_sound->WriteWavTrailer(m_file, m_length, m_fileFormat);
+    if (ferror(m_file->m_file))
+        m_failed = true;
+}
+
+
+// ****************************************************************************
+// Public Functions
+// ****************************************************************************
+
+WavSaver::WavSaver(Sound *snapshot, char const *filename, int fileFormat)
+{
+    m_sound = snapshot;
+    m_filename = StringDuplicate(filename);
+    m_tempFilename = new char[strlen(filename) + 8];
+    sprintf(m_tempFilename, "%s.saving", filename);
+    m_file = NULL;
+
+    m_bufferMem = NULL;
+    m_buffers = NULL;
+    m_numBuffers = 0;
+
+    m_fileFormat = fileFormat;
+    m_length = snapshot->GetLength();
+    m_numChunks = (m_length + CHUNK_NUM_GROUPS - 1) / CHUNK_NUM_GROUPS;
+    m_nextChunkIdx = 0;
+    m_numChunksWritten = 0;
+    m_nextBlockIdx = 0;
+    m_numBlocksLoaded = 0;
+    m_numThreadsRunning = 0;
+    m_failed = false;
+}
+
+
+WavSaver::~WavSaver()
+{
+    DebugAssert(IsFinished());
+
+    // Only does anything if no interleaver was started.
+    for (unsigned i = m_nextBlockIdx; i < m_blocksToLoad.Size(); i++)
+        m_blocksToLoad[i]->Release();
+
+    delete m_sound;
+    delete m_file;
+    delete[] m_filename;
+    delete[] m_tempFilename;
+    delete[] m_bufferMem;
+    delete[] m_buffers;
+}
+
+
+void WavSaver::AddBlockToLoad(SampleBlock *block)
+{
+    block->AddRef();
+    m_blocksToLoad.Push(block);
+}
+
+
+// Returns false if the file couldn't be created or the threads couldn't be
+// started. Call Finish() either way.
+bool WavSaver::Start()
+{
+    m_file = new BinaryFileWriter(m_tempFilename);
+    if (!m_file->m_file)
+    {
+        m_failed = true;
+        return false;
+    }
+
+    // Leave a core for the GUI thread. The writer spends most of its time
+    // waiting for the disk, so it doesn't count.
+    int numInterleavers = GetNumCores() - 1;
+    if (numInterleavers < 1)
+        numInterleavers = 1;
+    if (numInterleavers > MAX_INTERLEAVERS)
+        numInterleavers = MAX_INTERLEAVERS;
+
+    // Two buffers per interleaver, so that each can fill one while the writer
+    // writes the other.
+    m_numBuffers = numInterleavers * 2;
+    size_t bufferSize = CHUNK_NUM_GROUPS * m_sound->GetBytesPerGroup();
+    m_bufferMem = new char[bufferSize * m_numBuffers + ALIGNMENT - 1];
+    char *alignedMem = (char *)(((uintptr_t)m_bufferMem + ALIGNMENT - 1) & ~(uintptr_t)(ALIGNMENT - 1));
+    m_buffers = new Buffer[m_numBuffers];
+    for (int i = 0; i < m_numBuffers; i++)
+    {
+        m_buffers[i].m_samples = (uint8_t *)(alignedMem + i * bufferSize);
+        m_buffers[i].m_chunkIdx = -1;
+    }
+
+    m_numThreadsRunning = numInterleavers + 1;
+    if (!StartThread(WriterThreadProc, this))
+    {
+        m_failed = true;
+        m_numThreadsRunning = 0;
+        return false;
+    }
+
+    int numInterleaversStarted = 0;
+    for (int i = 0; i < numInterleavers; i++)
+    {
+        if (StartThread(InterleaverThreadProc, this))
+            numInterleaversStarted++;
+        else
+            m_numThreadsRunning--;
+    }
+
+    // Without any interleavers, the writer would wait forever.
+    if (numInterleaversStarted == 0)
+    {
+        m_failed = true;
+        return false;
+    }
+
+    return true;
+}
+
+
+// Loading a block counts as much as writing a chunk.
+float WavSaver::GetProgress()
+{
+    int total = m_numChunks + (int)m_blocksToLoad.Size();
+    if (total == 0)
+        return 1.0f;
+    return (float)(m_numChunksWritten + m_numBlocksLoaded) / (float)total;
+}
+
+
+bool WavSaver::Finish()
+{
+    DebugAssert(IsFinished());
+
+    // Close the file, and let go of the snapshot's blocks.
+    delete m_file;
+    m_file = NULL;
+    delete m_sound;
+    m_sound = NULL;
+
+    if (m_failed)
+    {
+        RemoveFile(m_tempFilename);
+        return false;
+    }
+
+    return MoveFile_(m_tempFilename, m_filename);
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+// Project headers
+#include "df_lib_plus_plus/threading.h"
+
+// Contrib headers
+#include "containers/darray.h"
+
+// Standard headers
+#include <atomic>
+#include <stdint.h>
+
+
+class BinaryFileWriter;
+struct SampleBlock;
+class Sound;
+
+
+// Saves a Sound as a WAV without holding up the GUI thread. Interleaver
+// threads each take the next chunk of the Sound and interleave it into one of
+// a ring of buffers. A writer thread writes the buffers to the file in order,
+// and hands each one back once it is written.
+//
+// It works on a snapshot of the Sound, made with Sound::Copy(). The snapshot
+// shares its blocks with the Sound, so making it is cheap, and edits made
+// during the save get private copies of the blocks instead of changing the
+// ones being saved.
+//
+// The data goes to a temporary file, which Finish() moves over the real one.
+// Blocks that haven't been loaded yet keep the real file mapped, so once the
+// chunks run out, the interleavers load the blocks passed to AddBlockToLoad().
+// Anything else that might hold such blocks must let go of them before
+// Finish().
+//
+// The interleavers are g_epochReclaimer readers, and wait while g_blockStore
+// is over budget, so the GUI thread can go on paging blocks out and
+// compressing them during the save.
+class WavSaver
+{
+private:
+    struct Buffer
+    {
+        uint8_t     *m_samples;
+        std::atomic<int> m_chunkIdx;    // The chunk in m_samples, ready to write. -1 if none.
+    };
+
+    Sound           *m_sound;           // The snapshot
+    char            *m_filename;
+    char            *m_tempFilename;
+    BinaryFileWriter *m_file;
+
+    char            *m_bufferMem;       // As returned by new[]
+    Buffer          *m_buffers;
+    int             m_numBuffers;
+
+    int             m_fileFormat;   // One of Sound::FILE_FORMAT_*
+    int64_t         m_length;
+    int             m_numChunks;
+    std::atomic<int> m_nextChunkIdx;        // The next chunk for an interleaver to take
+    std::atomic<int> m_numChunksWritten;
+
+    DArray <SampleBlock *> m_blocksToLoad;  // Holds a reference to each block no interleaver has finished with
+    std::atomic<int> m_nextBlockIdx;        // The next block for an interleaver to take
+    std::atomic<int> m_numBlocksLoaded;
+
+    std::atomic<int> m_numThreadsRunning;
+    std::atomic<bool> m_failed;
+
+    static unsigned long __stdcall InterleaverThreadProc(void *data);
+    static unsigned long __stdcall WriterThreadProc(void *data);
+    bool BeginRead(int readerIdx);
+    void InterleaveChunks(int readerIdx);
+    void LoadBlocks(int readerIdx);
+    void WriteChunks();
+
+public:
+    enum { CHUNK_NUM_GROUPS = 131072 };
+    enum { ALIGNMENT = 64 };
+    enum { MAX_INTERLEAVERS = 16 };     // Each takes one of g_epochReclaimer's reader slots
+
+    WavSaver(Sound *snapshot, char const *filename, int fileFormat);   // Takes ownership of snapshot
+    ~WavSaver();
+
+    void AddBlockToLoad(SampleBlock *block);    // Call before Start()
+    bool Start();
+
+    bool IsFinished() { return m_numThreadsRunning == 0; }
+    float GetProgress();    // 0 to 1
+    char const *GetFilename() { return m_filename; }
+
+    // Call once IsFinished() returns true. Replaces the file with the one
+    // that was written. Returns false if the save failed.
+    bool Finish();
+};
@@ -0,0 +1,281 @@
+// Checks that a peak file holds the same LUTs as loading the WAV would
+// build, and that it is rejected once the WAV's modification time, size or
+// hashed samples change, or once it is from an older version. A rejected
+// peak file has to be rewritten by the next open.
+//
+// Writes peak_file_test.wav and its peak file to the current folder, and
+// removes them at the end.
+
+// Project headers
+#include "peak_file.h"
+#include "sample_block.h"
+#include "sample_format.h"
+#include "sample_kernels.h"
+#include "sound.h"
+#include "sound_channel.h"
+#include "test_utils.h"
+#include "df_lib_plus_plus/mapped_file.h"
+
+// Contrib headers
+#include "df_time.h"
+
+// Platform headers
+#ifdef _MSC_VER
+#include <sys/utime.h>
+#else
+#include <utime.h>
+#endif
+
+// Standard headers
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+
+static char const *WAV_FILENAME = "peak_file_test.wav";
+static char const *PEAKS_FILENAME = "peak_file_test.wav.peaks";
+static int const WAV_HEADER_SIZE = 44;  // What WriteTestWavHeader() writes
+static int const NUM_CHANNELS = 2;
+static int64_t const NUM_GROUPS = SampleBlock::MAX_SAMPLES * 3 + 1000;
+
+static int16_t *s_samples;
+
+
+// ****************************************************************************
+// Files
+// ****************************************************************************
+
+static time_t GetModificationTime(char const *filename)
+{
+    struct stat fileStat;
+    if (stat(filename, &fileStat) != 0)
+        return 0;
+    return fileStat.st_mtime;
+}
+
+
+static bool SetModificationTime(char const *filename, time_t modificationTime)
+{
+#ifdef _MSC_VER
+    struct _utimbuf times;
+    times.actime = modificationTime;
+    times.modtime = modificationTime;
+    return _utime(filename, &times) == 0;
+#else
+    struct utimbuf times;
+    times.actime = modificationTime;
+    times.modtime = modificationTime;
+    return utime(filename, &times) == 0;
+#endif
+}
+
+
+static bool OverwriteBytes(char const *filename, int64_t offset, void const *data, size_t numBytes)
+{
+    FILE *f = fopen(filename, "r+b");
+    if (!f)
+        return false;
+
+    bool ok = fseek(f, (long)offset, SEEK_SET) == 0 && fwrite(data, 1, numBytes, f) == numBytes;
+    return fclose(f) == 0 && ok;
+}
+
+
+static bool AppendBytes(char const *filename, void const *data, size_t numBytes)
+{
+    FILE *f = fopen(filename, "ab");
+    if (!f)
+        return false;
+
+    bool ok = fwrite(data, 1, numBytes, f) == numBytes;
+    return fclose(f) == 0 && ok;
+}
+
+
+// ****************************************************************************
+// Peak files
+// ****************************************************************************
+
+// Opens the WAV the way the GUI does and waits for it to load, which writes
+// its peak file if it doesn't have an up to date one.
+static void OpenWav()
+{
+    Sound *sound = new Sound;
+    CHECK(sound->MapWav(WAV_FILENAME));
+    while (sound->IsLoading())
+        SleepMillisec(1);
+
+    // The peak file gets its name when the Sound lets go of it.
+    delete sound;
+}
+
+
+static bool IsPeakFileUpToDate()
+{
+    MappedFile wav(WAV_FILENAME);
+    if (!wav.m_data)
+        return false;
+
+    PeakFile *peaks = PeakFile::Open(WAV_FILENAME, &wav, WAV_HEADER_SIZE, NUM_GROUPS,
+                                     NUM_CHANNELS, SAMPLE_FORMAT_S16);
+    bool isUpToDate = peaks && !peaks->IsWriting();
+    delete peaks;
+    return isUpToDate;
+}
+
+
+// Starts each case from a fresh WAV with a peak file that matches it.
+static void WriteWavAndPeakFile()
+{
+    remove(PEAKS_FILENAME);
+    CHECK(WriteTestWavFile(WAV_FILENAME, s_samples, NUM_CHANNELS, NUM_GROUPS));
+    CHECK(!IsPeakFileUpToDate());
+    OpenWav();
+    CHECK(IsPeakFileUpToDate());
+}
+
+
+// After a change that makes the peak file stale, the next open has to write
+// a new one.
+static void CheckRejectedAndRewritten()
+{
+    CHECK(!IsPeakFileUpToDate());
+    OpenWav();
+    CHECK(IsPeakFileUpToDate());
+}
+
+
+// Compares the LUT items that cover the block's samples. The rest of the
+// storage, such as the padding after each LUT, isn't defined.
+static bool LutsMatch(int16_t const *luts, SampleBlock *block)
+{
+    int16_t const *maxLut = luts;
+    int16_t const *minLut = maxLut + SampleBlock::LUT_STRIDE;
+    uint32_t const *powerLut = (uint32_t const *)(minLut + SampleBlock::LUT_STRIDE);
+
+    for (int level = 0; level < SampleBlock::NUM_LUT_LEVELS; level++)
+    {
+        unsigned offset = SampleBlock::GetLutLevelOffset(level);
+        unsigned shift = SampleBlock::GetLutItemShift(level);
+        unsigned numItems = (block->m_len + (1 << shift) - 1) >> shift;
+        if (memcmp(maxLut + offset, block->m_maxLut + offset, numItems * sizeof(int16_t)) != 0 ||
+            memcmp(minLut + offset, block->m_minLut + offset, numItems * sizeof(int16_t)) != 0 ||
+            memcmp(powerLut + offset, block->m_powerLut + offset, numItems * sizeof(uint32_t)) != 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+// ****************************************************************************
+// Tests
+// ****************************************************************************
+
+static void TestLutsMatch()
+{
+    printf("Testing the LUTs match loading the WAV\n");
+
+    WriteWavAndPeakFile();
+
+    Sound *sound = MakeTestSound(s_samples, NUM_CHANNELS, NUM_GROUPS);
+    MappedFile wav(WAV_FILENAME);
+    PeakFile *peaks = PeakFile::Open(WAV_FILENAME, &wav, WAV_HEADER_SIZE, NUM_GROUPS,
+                                     NUM_CHANNELS, SAMPLE_FORMAT_S16);
+    CHECK(peaks && !peaks->IsWriting());
+
+    for (int i = 0; peaks && i < NUM_CHANNELS; i++)
+    {
+        BlockDirectory *blocks = &sound->m_channels[i]->m_blocks;
+        int64_t firstGroup = 0;
+        for (int j = 0; j < blocks->Size(); j++)
+        {
+            SampleBlock *block = (*blocks)[j];
+            int16_t const *luts = peaks->GetLuts(firstGroup, i, block->m_len);
+            CHECK(luts && LutsMatch(luts, block));
+            firstGroup += block->m_len;
+        }
+    }
+
+    delete peaks;
+    delete sound;
+}
+
+
+static void TestModificationTimeChanged()
+{
+    printf("Testing a changed modification time\n");
+
+    WriteWavAndPeakFile();
+    CHECK(SetModificationTime(WAV_FILENAME, GetModificationTime(WAV_FILENAME) + 10));
+    CheckRejectedAndRewritten();
+}
+
+
+// The modification time is put back after each of these, so that only the
+// change being tested can give it away.
+static void TestSizeChanged()
+{
+    printf("Testing a changed size\n");
+
+    WriteWavAndPeakFile();
+    time_t modificationTime = GetModificationTime(WAV_FILENAME);
+    int16_t const padding[2] = { 0, 0 };
+    CHECK(AppendBytes(WAV_FILENAME, padding, sizeof(padding)));
+    CHECK(SetModificationTime(WAV_FILENAME, modificationTime));
+    CheckRejectedAndRewritten();
+}
+
+
+static void TestSampleChanged(char const *where, int64_t groupIdx)
+{
+    printf("Testing a changed sample at the %s\n", where);
+
+    WriteWavAndPeakFile();
+    time_t modificationTime = GetModificationTime(WAV_FILENAME);
+    int16_t sample = ~s_samples[groupIdx * NUM_CHANNELS];
+    int64_t offset = WAV_HEADER_SIZE + groupIdx * NUM_CHANNELS * sizeof(int16_t);
+    CHECK(OverwriteBytes(WAV_FILENAME, offset, &sample, sizeof(sample)));
+    CHECK(SetModificationTime(WAV_FILENAME, modificationTime));
+    CheckRejectedAndRewritten();
+}
+
+
+static void TestOlderVersion()
+{
+    printf("Testing a peak file from an older version\n");
+
+    WriteWavAndPeakFile();
+    time_t modificationTime = GetModificationTime(WAV_FILENAME);
+    uint32_t olderVersion = PeakFile::VERSION - 1;
+    int const VERSION_OFFSET = 8;   // After the magic
+    CHECK(OverwriteBytes(PEAKS_FILENAME, VERSION_OFFSET, &olderVersion, sizeof(olderVersion)));
+    CHECK(GetModificationTime(WAV_FILENAME) == modificationTime);
+    CheckRejectedAndRewritten();
+}
+
+
+int main()
+{
+    SampleKernelsInit();
+
+    s_samples = new int16_t[NUM_GROUPS * NUM_CHANNELS];
+    TestRandom random(1);
+    for (int64_t i = 0; i < NUM_GROUPS * NUM_CHANNELS; i++)
+        s_samples[i] = random.Sample();
+
+    TestLutsMatch();
+    TestModificationTimeChanged();
+    TestSizeChanged();
+    TestSampleChanged("start", 0);
+    TestSampleChanged("end", NUM_GROUPS - 1);
+    TestOlderVersion();
+
+    delete[] s_samples;
+    remove(WAV_FILENAME);
+    remove(PEAKS_FILENAME);
+
+    return ReportChecks("peak_file_test");
+}
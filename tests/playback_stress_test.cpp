@@ -0,0 +1,212 @@
+// Plays a Sound through SoundSystem on a NullSoundDevice with no clock, while
+// the GUI thread deletes, pastes, undoes, redoes, seeks, compresses and pages
+// out as fast as it can. Checks that every sample the device is given came
+// from the Sound, and that g_epochReclaimer deletes every snapshot once
+// playback stops.
+//
+// Every sample in the Sound has a positive odd left and the negation of it
+// on the right, and the edits only move samples around, never change them.
+// Debug builds fill blocks' storage with BlockAllocator::FREED_ITEM_FILL as
+// it is freed, which can't look like that, so reading a block after it was
+// freed shows up in what is played. Build this one with /D_DEBUG for that.
+
+// Project headers
+#include "block_store.h"
+#include "epoch_reclaimer.h"
+#include "sample_block.h"
+#include "sample_kernels.h"
+#include "sound.h"
+#include "sound_system.h"
+#include "undo_history.h"
+#include "test_utils.h"
+#include "sound/null_sound_device.h"
+
+// Contrib headers
+#include "df_time.h"
+
+// Standard headers
+#include <atomic>
+#include <stdio.h>
+
+
+static int const NUM_ITERATIONS = 3000;
+static int64_t const START_LENGTH = SampleBlock::MAX_SAMPLES * 6 + 999;
+static int64_t const MIN_LENGTH = SampleBlock::MAX_SAMPLES;
+static int64_t const MAX_LENGTH = SampleBlock::MAX_SAMPLES * 16;
+static double const MAX_RECLAIM_SECONDS = 5.0;
+
+
+// ****************************************************************************
+// The device
+// ****************************************************************************
+
+class CheckingSoundDevice: public NullSoundDevice
+{
+public:
+    std::atomic<int64_t> m_numSamplesPlayed;    // Those that weren't silence
+    std::atomic<int64_t> m_numBadSamples;
+
+    CheckingSoundDevice()
+    :   NullSoundDevice(0.0)
+    {
+        m_numSamplesPlayed = 0;
+        m_numBadSamples = 0;
+    }
+
+protected:
+    // On the device thread.
+    void Consume(StereoSample const *buf, unsigned int numSamples)
+    {
+        int64_t numPlayed = 0;
+        int64_t numBad = 0;
+        for (unsigned i = 0; i < numSamples; i++)
+        {
+            int left = buf[i].m_left;
+            int right = buf[i].m_right;
+            if (left == 0 && right == 0)
+                continue;
+
+            numPlayed++;
+            if (left <= 0 || (left & 1) == 0 || right != -left)
+                numBad++;
+        }
+
+        m_numSamplesPlayed += numPlayed;
+        m_numBadSamples += numBad;
+    }
+};
+
+
+// ****************************************************************************
+// The GUI thread
+// ****************************************************************************
+
+static Sound *MakeStartingSound(unsigned sampleRate)
+{
+    int16_t *samples = new int16_t[START_LENGTH * 2];
+    for (int64_t i = 0; i < START_LENGTH; i++)
+    {
+        samples[i * 2] = (int16_t)(1 + 2 * (i % 16000));
+        samples[i * 2 + 1] = -samples[i * 2];
+    }
+
+    Sound *sound = MakeTestSound(samples, 2, START_LENGTH, sampleRate);
+    delete[] samples;
+    return sound;
+}
+
+
+static void DoRandomEdit(Sound *sound, TestRandom *random)
+{
+    int64_t len = sound->GetLength();
+    int64_t startIdx = random->Below((unsigned)len);
+    int64_t editLen = 1 + random->Below(SampleBlock::MAX_SAMPLES * 2);
+    int64_t endIdx = startIdx + editLen - 1;
+    if (endIdx >= len)
+        endIdx = len - 1;
+    editLen = endIdx - startIdx + 1;
+
+    switch (random->Below(6))
+    {
+    case 0:
+        if (len - editLen >= MIN_LENGTH)
+            sound->Delete(startIdx, endIdx);
+        break;
+    case 1:
+        if (len + editLen <= MAX_LENGTH)
+            sound->Insert(random->Below((unsigned)len + 1), sound->Copy(startIdx, endIdx));
+        break;
+    case 2:
+    case 3:
+        sound->Undo();
+        break;
+    case 4:
+        sound->Redo();
+        break;
+    case 5:
+        g_soundSystem->Seek(random->Below((unsigned)len));
+        break;
+    }
+}
+
+
+// What SoundWidget::Advance() does with the blocks each frame.
+static void CompressAndPageOut(Sound *sound)
+{
+    if (!g_epochReclaimer.TryExcludeReaders())
+        return;
+
+    while (g_blockStore.EnforceBudget())
+        ;
+    while (sound->CompressBlocks())
+        ;
+
+    g_epochReclaimer.AllowReaders();
+}
+
+
+int main()
+{
+    SampleKernelsInit();
+
+    CheckingSoundDevice *device = new CheckingSoundDevice;
+    g_soundSystem = new SoundSystem(device);
+
+    // At the device's rate, so the mixer copies samples rather than
+    // resampling them, which would change their values.
+    Sound *sound = MakeStartingSound(device->GetFreq());
+    g_soundSystem->PlaySound(&sound);
+
+    // Small enough that edits, undo and playback all page blocks out and
+    // back in, and send steps to the journal and back.
+    g_blockStore.SetBudget(4 * SampleBlock::GetSamplesStorageSize(sizeof(int16_t)));
+    sound->m_undoHistory->SetMemoryBudget(4 * SampleBlock::GetSamplesStorageSize(sizeof(int16_t)));
+
+    printf("Doing %d edits while playing\n", NUM_ITERATIONS);
+    TestRandom random(1);
+    for (int i = 0; i < NUM_ITERATIONS; i++)
+    {
+        DoRandomEdit(sound, &random);
+        g_soundSystem->Advance();
+        if (!g_soundSystem->IsPlaying())
+            g_soundSystem->Play();
+
+        CompressAndPageOut(sound);
+
+        // Give the mixer a chance to read the snapshot before it's replaced.
+        if (random.Below(4) == 0)
+            SleepMillisec(1);
+    }
+
+    BlockStore::Stats stats;
+    g_blockStore.GetStats(&stats);
+    printf("Played %lld samples, %lld of them bad\n",
+           (long long)device->m_numSamplesPlayed, (long long)device->m_numBadSamples);
+    printf("Paged out %lld blocks\n", (long long)stats.m_numPageOuts);
+    CHECK(device->m_numSamplesPlayed > START_LENGTH);
+    CHECK(device->m_numBadSamples == 0);
+    CHECK(stats.m_numPageOuts > 0);
+
+    // Once the mixer has finished with the last snapshot, there is nothing
+    // left to reclaim. The sound has to be gone from where PlaySound() was
+    // told to look first, or Advance() would take a new snapshot of it.
+    Sound *oldSound = sound;
+    sound = NULL;
+    g_soundSystem->Pause();
+    g_soundSystem->ForgetSound();
+    g_soundSystem->Advance();
+    double startTime = GetRealTime();
+    bool isDrained = false;
+    while (!isDrained && GetRealTime() - startTime < MAX_RECLAIM_SECONDS)
+    {
+        isDrained = !g_epochReclaimer.Reclaim();
+        if (!isDrained)
+            SleepMillisec(1);
+    }
+    CHECK(isDrained);
+
+    // The mixer can't be reading the sound's blocks now it has no snapshot.
+    delete oldSound;
+
+    return ReportChecks("playback_stress_test");
+}
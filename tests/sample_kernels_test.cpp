@@ -0,0 +1,348 @@
+// Checks every SampleKernels implementation the CPU supports against plain
+// loops written from the descriptions in sample_kernels.h. The data comes
+// from fixed seeds, and covers odd lengths, unaligned pointers and runs of
+// INT16_MIN and INT16_MAX.
+
+// Project headers
+#include "sample_kernels.h"
+#include "test_utils.h"
+
+// Standard headers
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+
+// Enough for several 32 byte vectors plus a tail, on top of the largest
+// misalignment.
+static unsigned const MAX_LEN = 16 * 16 * 9 + 13;
+static unsigned const MAX_OFFSET = 15;
+static unsigned const MAX_CHANNELS = 8;     // 7.1
+static unsigned const MAX_TAPS = 64;
+
+// Lengths from 0 up to past a few vectors, one at a time, then sparser.
+static unsigned NextLen(unsigned len) { return len < 80 ? len + 1 : len + len / 3 + 1; }
+
+
+// ****************************************************************************
+// Test data
+// ****************************************************************************
+
+enum
+{
+    PATTERN_RANDOM,
+    PATTERN_ALL_MIN,
+    PATTERN_ALL_MAX,
+    PATTERN_ALTERNATING,    // INT16_MIN, INT16_MAX, ...
+    PATTERN_RUNS,           // Random, with runs of INT16_MIN and INT16_MAX in it
+    NUM_PATTERNS
+};
+
+static char const *const s_patternNames[NUM_PATTERNS] = { "random", "all min", "all max", "alternating", "runs" };
+
+
+static void FillPattern(int16_t *samples, unsigned numSamples, int pattern, TestRandom *random)
+{
+    for (unsigned i = 0; i < numSamples; i++)
+    {
+        switch (pattern)
+        {
+        case PATTERN_ALL_MIN: samples[i] = INT16_MIN; break;
+        case PATTERN_ALL_MAX: samples[i] = INT16_MAX; break;
+        case PATTERN_ALTERNATING: samples[i] = i & 1 ? INT16_MAX : INT16_MIN; break;
+        default: samples[i] = random->Sample(); break;
+        }
+    }
+
+    if (pattern == PATTERN_RUNS)
+    {
+        for (unsigned i = 0; i + 64 < numSamples; i += 64 + random->Below(200))
+        {
+            int16_t val = random->Below(2) ? INT16_MIN : INT16_MAX;
+            unsigned runLen = 1 + random->Below(63);
+            for (unsigned j = 0; j < runLen; j++)
+                samples[i + j] = val;
+        }
+    }
+}
+
+
+// ****************************************************************************
+// Reference implementations
+// ****************************************************************************
+
+static void RefMinMax(int16_t const *samples, unsigned numSamples, int16_t *resultMin, int16_t *resultMax, uint64_t *resultSumSq)
+{
+    for (unsigned i = 0; i < numSamples; i++)
+    {
+        if (samples[i] < *resultMin) *resultMin = samples[i];
+        if (samples[i] > *resultMax) *resultMax = samples[i];
+        *resultSumSq += (uint64_t)((int64_t)samples[i] * samples[i]);
+    }
+}
+
+
+static int RefAbsMax(int16_t const *samples, unsigned numSamples)
+{
+    int result = 0;
+    for (unsigned i = 0; i < numSamples; i++)
+    {
+        int a = samples[i] < 0 ? -(int)samples[i] : samples[i];
+        if (a > result)
+            result = a;
+    }
+
+    return result;
+}
+
+
+static void RefMinMaxLut(int16_t const *srcMins, int16_t const *srcMaxes, uint32_t const *srcPowers, unsigned numDstItems,
+                         int16_t *dstMins, int16_t *dstMaxes, uint32_t *dstPowers)
+{
+    for (unsigned i = 0; i < numDstItems; i++)
+    {
+        int16_t _min = INT16_MAX;
+        int16_t _max = INT16_MIN;
+        uint64_t power = 0;
+        for (unsigned j = i * 16; j < i * 16 + 16; j++)
+        {
+            if (srcMins[j] < _min) _min = srcMins[j];
+            if (srcMaxes[j] > _max) _max = srcMaxes[j];
+            if (srcPowers)
+                power += srcPowers[j] / 16;
+            else if (j % 2 == 0)
+                power += ((int64_t)srcMins[j] * srcMins[j] + (int64_t)srcMins[j + 1] * srcMins[j + 1]) / 16;
+        }
+
+        dstMins[i] = _min;
+        dstMaxes[i] = _max;
+        dstPowers[i] = (uint32_t)power;
+    }
+}
+
+
+static void RefGain(int16_t *samples, unsigned numSamples, double startVol, double volIncrement)
+{
+    for (unsigned i = 0; i < numSamples; i++)
+    {
+        double val = samples[i] * (startVol + (double)i * volIncrement);
+        if (val < INT16_MIN) val = INT16_MIN;
+        if (val > INT16_MAX) val = INT16_MAX;
+        samples[i] = (int16_t)val;
+    }
+}
+
+
+static void RefStereoFir(float const *frames, float const *coefs, unsigned numTaps, float *left, float *right)
+{
+    float sums[4][2] = { { 0.0f } };
+    for (unsigned i = 0; i < numTaps; i++)
+    {
+        sums[i % 4][0] += coefs[i] * frames[i * 2];
+        sums[i % 4][1] += coefs[i] * frames[i * 2 + 1];
+    }
+
+    *left = (sums[0][0] + sums[2][0]) + (sums[1][0] + sums[3][0]);
+    *right = (sums[0][1] + sums[2][1]) + (sums[1][1] + sums[3][1]);
+}
+
+
+// ****************************************************************************
+// Tests
+// ****************************************************************************
+
+// Every test gets the same buffers, with room for the offsets.
+static int16_t s_src[MAX_LEN * MAX_CHANNELS + MAX_OFFSET + 32];
+static int16_t s_expected[MAX_LEN * MAX_CHANNELS + MAX_OFFSET + 32];
+static int16_t s_actual[MAX_LEN * MAX_CHANNELS + MAX_OFFSET + 32];
+
+
+static void TestMinMax(SampleKernels const *k)
+{
+    for (unsigned offset = 0; offset <= MAX_OFFSET; offset++)
+    {
+        for (unsigned len = 0; len <= MAX_LEN; len = NextLen(len))
+        {
+            int16_t const *samples = s_src + offset;
+
+            // Start from values that some samples beat and some don't, to
+            // check the results are combined with them.
+            int16_t expectedMin = -100, expectedMax = 100, actualMin = -100, actualMax = 100;
+            uint64_t expectedSumSq = 5, actualSumSq = 5;
+            RefMinMax(samples, len, &expectedMin, &expectedMax, &expectedSumSq);
+            k->MinMax(samples, len, &actualMin, &actualMax, &actualSumSq);
+            CHECK(actualMin == expectedMin);
+            CHECK(actualMax == expectedMax);
+            CHECK(actualSumSq == expectedSumSq);
+
+            CHECK(k->AbsMax(samples, len) == RefAbsMax(samples, len));
+        }
+    }
+}
+
+
+static void TestMinMaxLut(SampleKernels const *k, TestRandom *random)
+{
+    unsigned const maxItems = MAX_LEN / 16 - 1;
+    for (unsigned offset = 0; offset <= MAX_OFFSET; offset++)
+    {
+        for (unsigned numItems = 0; numItems <= maxItems; numItems = NextLen(numItems))
+        {
+            // From samples, as both the mins and maxes.
+            int16_t *expectedMins = s_expected + offset;
+            int16_t *actualMins = s_actual + offset;
+            uint32_t expectedPowers[MAX_LEN / 16];
+            uint32_t actualPowers[MAX_LEN / 16];
+            int16_t expectedMaxes[MAX_LEN / 16];
+            int16_t actualMaxes[MAX_LEN / 16];
+            int16_t const *samples = s_src + offset;
+            RefMinMaxLut(samples, samples, NULL, numItems, expectedMins, expectedMaxes, expectedPowers);
+            k->MinMaxLut(samples, samples, NULL, numItems, actualMins, actualMaxes, actualPowers);
+            CHECK(memcmp(actualMins, expectedMins, numItems * sizeof(int16_t)) == 0);
+            CHECK(memcmp(actualMaxes, expectedMaxes, numItems * sizeof(int16_t)) == 0);
+            CHECK(memcmp(actualPowers, expectedPowers, numItems * sizeof(uint32_t)) == 0);
+
+            // From a level below, with separate mins and maxes, and powers
+            // up to the largest a level of samples can produce.
+            uint32_t srcPowers[MAX_LEN];
+            for (unsigned i = 0; i < numItems * 16; i++)
+                srcPowers[i] = random->Next() % (1u << 30) + (random->Below(8) == 0 ? (1u << 30) : 0);
+            int16_t const *srcMaxes = s_src + MAX_LEN + (MAX_OFFSET - offset);
+            RefMinMaxLut(samples, srcMaxes, srcPowers, numItems, expectedMins, expectedMaxes, expectedPowers);
+            k->MinMaxLut(samples, srcMaxes, srcPowers, numItems, actualMins, actualMaxes, actualPowers);
+            CHECK(memcmp(actualMins, expectedMins, numItems * sizeof(int16_t)) == 0);
+            CHECK(memcmp(actualMaxes, expectedMaxes, numItems * sizeof(int16_t)) == 0);
+            CHECK(memcmp(actualPowers, expectedPowers, numItems * sizeof(uint32_t)) == 0);
+        }
+    }
+}
+
+
+static void TestInterleave(SampleKernels const *k)
+{
+    for (unsigned numChannels = 1; numChannels <= MAX_CHANNELS; numChannels++)
+    {
+        for (unsigned offset = 0; offset <= MAX_OFFSET; offset += 3)
+        {
+            for (unsigned len = 0; len <= MAX_LEN; len = NextLen(len))
+            {
+                // Each channel at a different misalignment.
+                int16_t const *srcs[MAX_CHANNELS];
+                int16_t *expectedDsts[MAX_CHANNELS];
+                int16_t *actualDsts[MAX_CHANNELS];
+                for (unsigned i = 0; i < numChannels; i++)
+                {
+                    unsigned channelOffset = i * MAX_LEN + (offset + i) % (MAX_OFFSET + 1);
+                    srcs[i] = s_src + channelOffset;
+                    expectedDsts[i] = s_expected + channelOffset;
+                    actualDsts[i] = s_actual + channelOffset;
+                }
+
+                memset(s_expected, 0x55, sizeof(s_expected));
+                memset(s_actual, 0x55, sizeof(s_actual));
+                for (unsigned i = 0; i < len; i++)
+                {
+                    for (unsigned j = 0; j < numChannels; j++)
+                        s_expected[offset + i * numChannels + j] = srcs[j][i];
+                }
+                k->Interleave(s_actual + offset, srcs, numChannels, len);
+                CHECK(memcmp(s_actual, s_expected, sizeof(s_actual)) == 0);
+
+                // And back, from the interleaved samples in s_src. Comparing
+                // the whole buffers also checks nothing past the end changed.
+                memset(s_expected, 0x55, sizeof(s_expected));
+                memset(s_actual, 0x55, sizeof(s_actual));
+                int16_t const *interleaved = s_src + offset;
+                for (unsigned i = 0; i < len; i++)
+                {
+                    for (unsigned j = 0; j < numChannels; j++)
+                        expectedDsts[j][i] = interleaved[i * numChannels + j];
+                }
+                k->Deinterleave(actualDsts, interleaved, numChannels, len);
+                CHECK(memcmp(s_actual, s_expected, sizeof(s_actual)) == 0);
+            }
+        }
+    }
+}
+
+
+static void TestGain(SampleKernels const *k)
+{
+    // Fades, silence, boosts that clip, and a negative start that crosses
+    // zero.
+    double const vols[][2] = { { 0.0, 1.0 }, { 1.0, 0.0 }, { 0.0, 0.0 }, { 3.7, 3.7 }, { 1.0, 40.0 }, { -1.5, 0.25 } };
+    unsigned const numVols = sizeof(vols) / sizeof(vols[0]);
+    for (unsigned v = 0; v < numVols; v++)
+    {
+        for (unsigned offset = 0; offset <= MAX_OFFSET; offset++)
+        {
+            for (unsigned len = 0; len <= MAX_LEN; len = NextLen(len))
+            {
+                double volIncrement = len ? (vols[v][1] - vols[v][0]) / (double)len : 0.0;
+                memcpy(s_expected, s_src, sizeof(s_src));
+                memcpy(s_actual, s_src, sizeof(s_src));
+                RefGain(s_expected + offset, len, vols[v][0], volIncrement);
+                k->Gain(s_actual + offset, len, vols[v][0], volIncrement);
+                CHECK(memcmp(s_actual, s_expected, sizeof(s_actual)) == 0);
+            }
+        }
+    }
+}
+
+
+static void TestStereoFir(SampleKernels const *k)
+{
+    // The frames are the samples as floats, and the coefs are scaled down
+    // as a filter's would be. One extra float lets the frames start off
+    // the alignment of the array.
+    float frames[MAX_TAPS * 2 + 1];
+    float coefs[MAX_TAPS + 1];
+    for (unsigned offset = 0; offset < 2; offset++)
+    {
+        for (unsigned i = 0; i < MAX_TAPS * 2 + 1; i++)
+            frames[i] = s_src[i];
+        for (unsigned i = 0; i < MAX_TAPS + 1; i++)
+            coefs[i] = s_src[MAX_TAPS * 2 + 1 + i] / 1048576.0f;
+
+        for (unsigned numTaps = 0; numTaps <= MAX_TAPS; numTaps += 4)
+        {
+            float expected[2];
+            float actual[2];
+            RefStereoFir(frames + offset, coefs + offset, numTaps, &expected[0], &expected[1]);
+            k->StereoFir(frames + offset, coefs + offset, numTaps, &actual[0], &actual[1]);
+            CHECK(memcmp(actual, expected, sizeof(actual)) == 0);
+        }
+    }
+}
+
+
+int main()
+{
+    for (int type = 0; type < SAMPLE_KERNELS_NUM_TYPES; type++)
+    {
+        SampleKernels const *k = GetSampleKernels(type);
+        if (!k)
+        {
+            printf("Skipping kernel set %d, which this CPU doesn't support\n", type);
+            continue;
+        }
+
+        for (int pattern = 0; pattern < NUM_PATTERNS; pattern++)
+        {
+            printf("Testing %s kernels on %s samples\n", k->m_name, s_patternNames[pattern]);
+
+            // The same seed for every kernel set, so they all see the same
+            // data.
+            TestRandom random(1000 + pattern);
+            FillPattern(s_src, sizeof(s_src) / sizeof(s_src[0]), pattern, &random);
+
+            TestMinMax(k);
+            TestMinMaxLut(k, &random);
+            TestInterleave(k);
+            TestGain(k);
+            TestStereoFir(k);
+        }
+    }
+
+    return ReportChecks("sample_kernels_test");
+}
@@ -0,0 +1,142 @@
+// Checks that a SoundSnapshot goes on reading exactly what the Sound held when
+// it was made, however the Sound is edited, undone and redone afterwards, and
+// that a new snapshot reads what the Sound holds now. The snapshots share
+// the Sound's tree of blocks, so every edit has to copy what it changes
+// rather than change what they see.
+
+// Project headers
+#include "sample_block.h"
+#include "sample_format.h"
+#include "sample_kernels.h"
+#include "sound.h"
+#include "sound_snapshot.h"
+#include "test_utils.h"
+
+// Standard headers
+#include <stdint.h>
+#include <stdio.h>
+
+
+static int const NUM_EDITS = 40;
+static int64_t const MIN_LENGTH = SampleBlock::MAX_SAMPLES * 2;
+static int64_t const MAX_LENGTH = SampleBlock::MAX_SAMPLES * 24;
+
+static uint8_t s_scratch[SampleBlock::MAX_SAMPLES * sizeof(int32_t)];
+static int16_t s_samples[SampleBlock::MAX_SAMPLES];
+
+
+static uint64_t HashInt16s(uint64_t hash, int16_t const *samples, unsigned numSamples)
+{
+    for (unsigned i = 0; i < numSamples; i++)
+    {
+        hash ^= (uint16_t)samples[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+
+// Walks each channel a block at a time, the way the mixer does.
+static uint64_t HashSnapshot(SoundSnapshot *snapshot)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (int i = 0; i < snapshot->m_numChannels; i++)
+    {
+        int64_t blockStartIdx;
+        int blockIdx;
+        SampleBlock *block = snapshot->FindBlock(i, 0, &blockStartIdx, &blockIdx);
+        int64_t len = 0;
+        for (; block; block = snapshot->GetBlock(i, ++blockIdx))
+        {
+            void const *samples = block->ReadSamples(0, block->m_len, s_scratch);
+            block->GetKernels()->ToInt16(s_samples, 1, samples, block->m_len);
+            hash = HashInt16s(hash, s_samples, block->m_len);
+            len += block->m_len;
+        }
+
+        CHECK(len == snapshot->GetLength());
+    }
+
+    return hash;
+}
+
+
+static void DoRandomEdit(Sound *sound, TestRandom *random)
+{
+    int64_t len = sound->GetLength();
+    int64_t startIdx = random->Below((unsigned)len);
+    int64_t endIdx = startIdx + random->Below(SampleBlock::MAX_SAMPLES * 3);
+    if (endIdx >= len)
+        endIdx = len - 1;
+
+    int op = random->Below(5);
+    if (op == 0 && len - (endIdx - startIdx + 1) < MIN_LENGTH)
+        op = 1;
+    if (op == 1 && len + (endIdx - startIdx + 1) > MAX_LENGTH)
+        op = 0;
+
+    switch (op)
+    {
+    case 0: sound->Delete(startIdx, endIdx); break;
+    case 1: sound->Insert(random->Below((unsigned)len + 1), sound->Copy(startIdx, endIdx)); break;
+    case 2: sound->FadeIn(startIdx, endIdx); break;
+    case 3: sound->Undo(); break;
+    case 4: sound->Redo(); break;
+    }
+
+    // Brings the summaries up to date in place, which snapshots share.
+    while (sound->UpdateDirtyLuts())
+        ;
+}
+
+
+int main()
+{
+    SampleKernelsInit();
+
+    printf("Testing %d snapshots of an edited sound\n", NUM_EDITS);
+
+    TestRandom random(1);
+    int64_t const numGroups = SampleBlock::MAX_SAMPLES * 8 + 777;
+    int16_t *samples = new int16_t[numGroups * 2];
+    for (int64_t i = 0; i < numGroups * 2; i++)
+        samples[i] = random.Sample() / 8;
+    Sound *sound = MakeTestSound(samples, 2, numGroups);
+    delete[] samples;
+
+    SoundSnapshot *snapshots[NUM_EDITS];
+    uint64_t hashes[NUM_EDITS];
+    for (int i = 0; i < NUM_EDITS; i++)
+    {
+        snapshots[i] = new SoundSnapshot(sound);
+        hashes[i] = HashSnapshot(snapshots[i]);
+        CHECK(snapshots[i]->GetLength() == sound->GetLength());
+        if (i > 0)
+            CHECK(snapshots[i]->m_id != snapshots[i - 1]->m_id);
+
+        DoRandomEdit(sound, &random);
+
+        for (int j = 0; j <= i; j++)
+            CHECK(HashSnapshot(snapshots[j]) == hashes[j]);
+    }
+
+    // Deleting them in a different order from the one they were made in
+    // leaves the Sound's tree alone.
+    SoundSnapshot *current = new SoundSnapshot(sound);
+    uint64_t currentHash = HashSnapshot(current);
+    for (int i = 0; i < NUM_EDITS; i += 2)
+        delete snapshots[i];
+    for (int i = 1; i < NUM_EDITS; i += 2)
+        delete snapshots[i];
+    CHECK(HashSnapshot(current) == currentHash);
+
+    // The Sound outlives the snapshot here, and the other way round below.
+    delete current;
+    current = new SoundSnapshot(sound);
+    delete sound;
+    CHECK(HashSnapshot(current) == currentHash);
+    delete current;
+
+    return ReportChecks("sound_snapshot_test");
+}
@@ -0,0 +1,175 @@
+#pragma once
+
+// Project headers
+#include "sound.h"
+#include "df_lib_plus_plus/binary_stream_readers.h"
+#include "df_lib_plus_plus/binary_stream_writers.h"
+
+// Standard headers
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+
+
+// Helpers for the tests and the benchmarks. Each of those is a program of its
+// own, built from this header, its own .cpp and the files in src that it
+// needs.
+
+
+// ****************************************************************************
+// Checks
+// ****************************************************************************
+
+static int g_numFailedChecks = 0;
+
+// Unlike ReleaseAssert(), carries on, so that one run reports every failure.
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) \
+        { \
+            printf("%s(%d): CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            g_numFailedChecks++; \
+        } \
+    } while (0)
+
+// Returns the exit code for main().
+inline int ReportChecks(char const *programName)
+{
+    if (g_numFailedChecks)
+    {
+        printf("%s: %d checks failed\n", programName, g_numFailedChecks);
+        return 1;
+    }
+
+    printf("%s: passed\n", programName);
+    return 0;
+}
+
+
+// ****************************************************************************
+// Random numbers
+// ****************************************************************************
+
+// A xorshift generator, so that every run and every platform sees the same
+// numbers for the same seed, unlike with rand().
+class TestRandom
+{
+private:
+    uint32_t m_state;
+
+public:
+    TestRandom(uint32_t seed) { m_state = seed ? seed : 1; }
+
+    uint32_t Next()
+    {
+        m_state ^= m_state << 13;
+        m_state ^= m_state >> 17;
+        m_state ^= m_state << 5;
+        return m_state;
+    }
+
+    // In [0, n)
+    unsigned Below(unsigned n) { return Next() % n; }
+    int16_t Sample() { return (int16_t)(Next() >> 16); }
+};
+
+
+// ****************************************************************************
+// WAV files
+// ****************************************************************************
+
+// Writes the header of a 16 bit PCM WAV. The data has to be under 4 GB.
+inline void WriteTestWavHeader(BinaryStreamWriter *stream, unsigned numChannels,
+                               int64_t numGroups, unsigned sampleRate = 44100)
+{
+    uint32_t dataSize = (uint32_t)(numGroups * numChannels * sizeof(int16_t));
+    stream->WriteBytes("RIFF", 4);
+    stream->WriteU32(36 + dataSize);
+    stream->WriteBytes("WAVEfmt ", 8);
+    stream->WriteU32(16);
+    stream->WriteU16(1);            // PCM
+    stream->WriteU16(numChannels);
+    stream->WriteU32(sampleRate);
+    stream->WriteU32(sampleRate * numChannels * sizeof(int16_t));
+    stream->WriteU16(numChannels * sizeof(int16_t));
+    stream->WriteU16(16);
+    stream->WriteBytes("data", 4);
+    stream->WriteU32(dataSize);
+}
+
+
+// Writes a 16 bit PCM WAV of interleaved samples.
+inline void WriteTestWav(BinaryStreamWriter *stream, int16_t const *samples,
+                         unsigned numChannels, int64_t numGroups, unsigned sampleRate = 44100)
+{
+    uint32_t dataSize = (uint32_t)(numGroups * numChannels * sizeof(int16_t));
+    stream->Reserve(44 + dataSize);
+    WriteTestWavHeader(stream, numChannels, numGroups, sampleRate);
+    stream->WriteBytes((char const *)samples, dataSize);
+}
+
+
+inline bool WriteTestWavFile(char const *filename, int16_t const *samples,
+                             unsigned numChannels, int64_t numGroups, unsigned sampleRate = 44100)
+{
+    BinaryFileWriter file(filename);
+    if (!file.m_file)
+        return false;
+    WriteTestWav(&file, samples, numChannels, numGroups, sampleRate);
+    return true;
+}
+
+
+// Writes a 16 bit stereo WAV of a quiet tone with some noise on it, a chunk at
+// a time, so that it can be bigger than memory. Every call with the same
+// numGroups writes the same samples. The data has to be under 4 GB.
+inline bool WriteTestToneWavFile(char const *filename, int64_t numGroups, unsigned sampleRate = 44100)
+{
+    BinaryFileWriter file(filename);
+    if (!file.m_file)
+        return false;
+
+    WriteTestWavHeader(&file, 2, numGroups, sampleRate);
+
+    int const CHUNK_NUM_GROUPS = 1024 * 1024;
+    int16_t *chunk = new int16_t[CHUNK_NUM_GROUPS * 2];
+    TestRandom random(1);
+    bool ok = true;
+    for (int64_t firstGroup = 0; ok && firstGroup < numGroups; firstGroup += CHUNK_NUM_GROUPS)
+    {
+        int chunkNumGroups = CHUNK_NUM_GROUPS;
+        if (firstGroup + chunkNumGroups > numGroups)
+            chunkNumGroups = (int)(numGroups - firstGroup);
+
+        for (int i = 0; i < chunkNumGroups; i++)
+        {
+            double tone = 8000.0 * sin((firstGroup + i) * 0.01);
+            chunk[i * 2] = (int16_t)(tone + random.Below(256));
+            chunk[i * 2 + 1] = (int16_t)(-tone + random.Below(256));
+        }
+
+        ok = file.WriteBytes((char const *)chunk, chunkNumGroups * 2 * sizeof(int16_t));
+    }
+
+    delete[] chunk;
+    return ok;
+}
+
+
+// Returns a Sound loaded from interleaved samples, without a file.
+inline Sound *MakeTestSound(int16_t const *samples, unsigned numChannels,
+                            int64_t numGroups, unsigned sampleRate = 44100)
+{
+    BinaryDataWriter wav;
+    WriteTestWav(&wav, samples, numChannels, numGroups, sampleRate);
+
+    BinaryDataReader reader(wav.m_data, wav.m_pos, "test.wav");
+    Sound *sound = new Sound;
+    if (!sound->LoadWav(&reader))
+    {
+        delete sound;
+        return NULL;
+    }
+
+    return sound;
+}
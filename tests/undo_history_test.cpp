@@ -0,0 +1,298 @@
+// Checks that undo and redo put a Sound back exactly as it was, through
+// random edits, with the history held in memory, partly in the journal, and
+// wholly in the journal. Also checks that no edit changes a block outside
+// the window UndoHistory::BeginStep() saves, which is what
+// NUM_NEIGHBOUR_BLOCKS has to cover.
+
+// Project headers
+#include "block_directory.h"
+#include "sample_block.h"
+#include "sample_kernels.h"
+#include "sound.h"
+#include "sound_channel.h"
+#include "undo_history.h"
+#include "test_utils.h"
+
+// Contrib headers
+#include "containers/darray.h"
+
+// Standard headers
+#include <stdint.h>
+#include <stdio.h>
+
+
+static int const NUM_EDITS = 80;
+static int64_t const MIN_LENGTH = SampleBlock::MAX_SAMPLES * 2;
+static int64_t const MAX_LENGTH = SampleBlock::MAX_SAMPLES * 24;
+
+static uint8_t s_scratch[SampleBlock::MAX_SAMPLES * sizeof(int32_t)];
+
+
+// ****************************************************************************
+// Fingerprints
+// ****************************************************************************
+
+static uint64_t HashBytes(uint64_t hash, void const *data, size_t numBytes)
+{
+    uint8_t const *bytes = (uint8_t const *)data;
+    for (size_t i = 0; i < numBytes; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+
+static uint64_t HashBlock(SampleBlock *block)
+{
+    uint64_t hash = HashBytes(0xcbf29ce484222325ull, &block->m_len, sizeof(block->m_len));
+    void const *samples = block->ReadSamples(0, block->m_len, s_scratch);
+    return HashBytes(hash, samples, block->m_len * block->GetSampleSize());
+}
+
+
+// Covers every sample of every channel, and where the block boundaries are.
+static uint64_t HashSound(Sound *sound)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (int i = 0; i < sound->m_numChannels; i++)
+    {
+        BlockDirectory *blocks = &sound->m_channels[i]->m_blocks;
+        for (int j = 0; j < blocks->Size(); j++)
+        {
+            uint64_t blockHash = HashBlock((*blocks)[j]);
+            hash = HashBytes(hash, &blockHash, sizeof(blockHash));
+        }
+    }
+
+    return hash;
+}
+
+
+// ****************************************************************************
+// The window of blocks a step saves
+// ****************************************************************************
+
+// The hashes of the blocks before and after the window BeginStep() saves for
+// an edit of [startIdx, endIdx], in one channel.
+struct OutsideBlocks
+{
+    DArray <uint64_t> m_before;
+    DArray <uint64_t> m_after;     // Last block first
+};
+
+
+static void RecordOutsideBlocks(BlockDirectory *blocks, int64_t startIdx, int64_t endIdx, OutsideBlocks *outside)
+{
+    int64_t blockStartIdx;
+    int firstBlockIdx = blocks->FindBlock(startIdx, &blockStartIdx) - UndoHistory::NUM_NEIGHBOUR_BLOCKS;
+    int lastBlockIdx = blocks->FindBlock(endIdx, &blockStartIdx) + UndoHistory::NUM_NEIGHBOUR_BLOCKS;
+
+    for (int i = 0; i < firstBlockIdx; i++)
+        outside->m_before.Push(HashBlock((*blocks)[i]));
+    for (int i = blocks->Size() - 1; i > lastBlockIdx; i--)
+        outside->m_after.Push(HashBlock((*blocks)[i]));
+}
+
+
+static bool OutsideBlocksUnchanged(BlockDirectory *blocks, OutsideBlocks *outside)
+{
+    int numBlocks = blocks->Size();
+    if ((int)(outside->m_before.Size() + outside->m_after.Size()) > numBlocks)
+        return false;
+
+    for (unsigned i = 0; i < outside->m_before.Size(); i++)
+    {
+        if (HashBlock((*blocks)[i]) != outside->m_before[i])
+            return false;
+    }
+
+    for (unsigned i = 0; i < outside->m_after.Size(); i++)
+    {
+        if (HashBlock((*blocks)[numBlocks - 1 - i]) != outside->m_after[i])
+            return false;
+    }
+
+    return true;
+}
+
+
+// ****************************************************************************
+// Edits
+// ****************************************************************************
+
+// Mostly short, so that edits leave small blocks for later ones to merge,
+// with some longer than a block.
+static int64_t RandomEditLen(TestRandom *random)
+{
+    switch (random->Below(4))
+    {
+    case 0: return 1 + random->Below(100);
+    case 1: return 1 + random->Below(SampleBlock::MAX_SAMPLES / 2);
+    case 2: return SampleBlock::MAX_SAMPLES - 50 + random->Below(100);
+    default: return 1 + random->Below(SampleBlock::MAX_SAMPLES * 3);
+    }
+}
+
+
+// Does a random edit, and checks it left the blocks outside its window
+// alone.
+static void DoRandomEdit(Sound *sound, TestRandom *random)
+{
+    int64_t len = sound->GetLength();
+    int64_t startIdx = random->Below((unsigned)len);
+    int64_t endIdx = startIdx + RandomEditLen(random) - 1;
+    if (endIdx >= len)
+        endIdx = len - 1;
+
+    int op = random->Below(5);
+    if (op == 0 && len - (endIdx - startIdx + 1) < MIN_LENGTH)
+        op = 1;
+    if (op == 1 && len + (endIdx - startIdx + 1) > MAX_LENGTH)
+        op = 0;
+
+    int64_t dstIdx = random->Below((unsigned)len + 1);
+    int64_t windowStartIdx = op == 1 ? dstIdx : startIdx;
+    int64_t windowEndIdx = op == 1 ? dstIdx : endIdx;
+
+    OutsideBlocks outside[2];
+    for (int i = 0; i < sound->m_numChannels; i++)
+        RecordOutsideBlocks(&sound->m_channels[i]->m_blocks, windowStartIdx, windowEndIdx, &outside[i]);
+
+    switch (op)
+    {
+    case 0: sound->Delete(startIdx, endIdx); break;
+    case 1: sound->Insert(dstIdx, sound->Copy(startIdx, endIdx)); break;
+    case 2: sound->FadeIn(startIdx, endIdx); break;
+    case 3: sound->FadeOut(startIdx, endIdx); break;
+    case 4: sound->Normalize(startIdx, endIdx); break;
+    }
+
+    for (int i = 0; i < sound->m_numChannels; i++)
+        CHECK(OutsideBlocksUnchanged(&sound->m_channels[i]->m_blocks, &outside[i]));
+}
+
+
+static Sound *MakeStartingSound(TestRandom *random)
+{
+    int64_t const numGroups = SampleBlock::MAX_SAMPLES * 8 + 777;
+    int16_t *samples = new int16_t[numGroups * 2];
+
+    // Quiet, so that Normalize() has something to do.
+    for (int64_t i = 0; i < numGroups * 2; i++)
+        samples[i] = random->Sample() / 8;
+
+    Sound *sound = MakeTestSound(samples, 2, numGroups);
+    delete[] samples;
+    return sound;
+}
+
+
+// ****************************************************************************
+// Tests
+// ****************************************************************************
+
+static void TestUndoRedo(size_t memoryBudget, uint32_t seed)
+{
+    printf("Testing %d edits with a budget of %u bytes\n", NUM_EDITS, (unsigned)memoryBudget);
+
+    TestRandom random(seed);
+    Sound *sound = MakeStartingSound(&random);
+    sound->m_undoHistory->SetMemoryBudget(memoryBudget);
+
+    uint64_t hashes[NUM_EDITS + 1];
+    hashes[0] = HashSound(sound);
+    for (int i = 1; i <= NUM_EDITS; i++)
+    {
+        DoRandomEdit(sound, &random);
+        hashes[i] = HashSound(sound);
+        CHECK(sound->m_undoHistory->GetMemoryUsed() <= memoryBudget);
+    }
+
+    // All the way back, with the journal being read back...
+    for (int i = NUM_EDITS; i > 0; i--)
+    {
+        CHECK(sound->Undo());
+        CHECK(HashSound(sound) == hashes[i - 1]);
+        CHECK(sound->m_undoHistory->GetMemoryUsed() <= memoryBudget);
+    }
+    CHECK(!sound->Undo());
+
+    // ...and all the way forward again, with redo steps going to theirs.
+    for (int i = 1; i <= NUM_EDITS; i++)
+    {
+        CHECK(sound->Redo());
+        CHECK(HashSound(sound) == hashes[i]);
+        CHECK(sound->m_undoHistory->GetMemoryUsed() <= memoryBudget);
+    }
+    CHECK(!sound->Redo());
+
+    // An edit after some undos throws away what could have been redone.
+    int const numUndos = NUM_EDITS / 4;
+    for (int i = 0; i < numUndos; i++)
+        CHECK(sound->Undo());
+    DoRandomEdit(sound, &random);
+    CHECK(!sound->Redo());
+    CHECK(sound->Undo());
+    CHECK(HashSound(sound) == hashes[NUM_EDITS - numUndos]);
+
+    delete sound;
+}
+
+
+// Steps that share all their blocks with the Sound cost nothing, so the
+// budget has to count the ones that don't, and start counting a block once
+// the Sound lets go of it.
+static void TestMemoryAccounting()
+{
+    printf("Testing memory accounting\n");
+
+    TestRandom random(7);
+    Sound *sound = MakeStartingSound(&random);
+    UndoHistory *history = sound->m_undoHistory;
+    CHECK(history->GetMemoryUsed() == 0);
+
+    // A fade clones the blocks it covers, so the history keeps the only
+    // references to the originals.
+    int const numFadeBlocks = 3;
+    size_t originalsUsed = 0;
+    for (int i = 0; i < sound->m_numChannels; i++)
+    {
+        for (int j = 0; j < numFadeBlocks; j++)
+            originalsUsed += sound->m_channels[i]->m_blocks[j]->GetMemoryUsed();
+    }
+
+    sound->FadeIn(0, SampleBlock::MAX_SAMPLES * numFadeBlocks - 1);
+    size_t used = history->GetMemoryUsed();
+    CHECK(used == originalsUsed);
+
+    // Undoing swaps them back, so the redo step now holds the faded copies
+    // alone. They compress to a different size, so only check they count.
+    CHECK(sound->Undo());
+    size_t redoUsed = history->GetMemoryUsed();
+    CHECK(redoUsed > 0);
+
+    // A budget below that sends the redo step to the journal, and redoing
+    // reads it back and sends the originals the other way.
+    history->SetMemoryBudget(redoUsed - 1);
+    CHECK(history->GetMemoryUsed() == 0);
+    CHECK(sound->Redo());
+    CHECK(history->GetMemoryUsed() <= redoUsed - 1);
+
+    delete sound;
+}
+
+
+int main()
+{
+    SampleKernelsInit();
+
+    TestMemoryAccounting();
+    TestUndoRedo(UndoHistory::DEFAULT_MEMORY_BUDGET, 1);
+    TestUndoRedo(4 * SampleBlock::GetSamplesStorageSize(sizeof(int16_t)), 2);
+    TestUndoRedo(0, 3);
+
+    return ReportChecks("undo_history_test");
+}
@@ -0,0 +1,203 @@
+// Plays a Sound through SoundSystem into a WavFileSoundDevice with no clock,
+// so it renders as fast as it can, and checks that the WAV it writes holds
+// exactly the Sound's samples. Then plays again from part way through, and
+// checks what that adds to the end of the WAV.
+//
+// Writes wav_device_test_out.wav to the current folder. It stays open until
+// the program exits, so it is left there.
+
+// Project headers
+#include "epoch_reclaimer.h"
+#include "sample_kernels.h"
+#include "sound.h"
+#include "sound_system.h"
+#include "test_utils.h"
+#include "sound/null_sound_device.h"
+
+// Contrib headers
+#include "df_time.h"
+
+// Standard headers
+#include <stdio.h>
+#include <string.h>
+
+
+static char const *OUT_FILENAME = "wav_device_test_out.wav";
+static int64_t const NUM_GROUPS = 44100 * 6 + 123;
+static int const WAV_HEADER_SIZE = 44;
+static double const MAX_PLAY_SECONDS = 60.0;
+
+static int16_t *s_samples;
+
+
+static int16_t GetTestSample(int64_t groupIdx, int side)
+{
+    return (int16_t)((groupIdx * 7 + side * 1000) % 30000 + 1);
+}
+
+
+// Runs the GUI thread's side of playback until it stops, and returns false
+// if it didn't.
+static bool PlayToEnd()
+{
+    g_soundSystem->Play();
+    double startTime = GetRealTime();
+    while (g_soundSystem->IsPlaying() && GetRealTime() - startTime < MAX_PLAY_SECONDS)
+    {
+        g_soundSystem->Advance();
+        SleepMillisec(1);
+    }
+
+    return !g_soundSystem->IsPlaying();
+}
+
+
+// Returns the interleaved samples of the device's WAV, or NULL if its header
+// is wrong. Sets *numGroups to how many there are.
+static int16_t *ReadOutput(int64_t *numGroups)
+{
+    FILE *f = fopen(OUT_FILENAME, "rb");
+    if (!f)
+        return NULL;
+
+    fseek(f, 0, SEEK_END);
+    long fileSize = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    uint8_t *data = new uint8_t [fileSize];
+    bool ok = fileSize >= WAV_HEADER_SIZE && fread(data, 1, fileSize, f) == (size_t)fileSize;
+    fclose(f);
+
+    uint32_t riffSize = 0;
+    uint32_t dataSize = 0;
+    if (ok)
+    {
+        memcpy(&riffSize, data + 4, sizeof(riffSize));
+        memcpy(&dataSize, data + 40, sizeof(dataSize));
+        ok = memcmp(data, "RIFF", 4) == 0 && memcmp(data + 8, "WAVEfmt ", 8) == 0 &&
+             memcmp(data + 36, "data", 4) == 0 && riffSize == 36 + dataSize &&
+             WAV_HEADER_SIZE + dataSize == (uint32_t)fileSize;
+    }
+
+    if (!ok)
+    {
+        delete[] data;
+        return NULL;
+    }
+
+    *numGroups = dataSize / (2 * sizeof(int16_t));
+    int16_t *samples = new int16_t [*numGroups * 2];
+    memcpy(samples, data + WAV_HEADER_SIZE, dataSize);
+    delete[] data;
+    return samples;
+}
+
+
+// Checks that output groups [outIdx, outIdx + numGroups) are the Sound's
+// from startIdx on, and returns how many weren't.
+static int64_t CountWrongGroups(int16_t const *out, int64_t outIdx, int64_t startIdx, int64_t numGroups)
+{
+    int64_t numWrong = 0;
+    for (int64_t i = 0; i < numGroups; i++)
+    {
+        int16_t const *group = out + (outIdx + i) * 2;
+        if (group[0] != s_samples[(startIdx + i) * 2] || group[1] != s_samples[(startIdx + i) * 2 + 1])
+            numWrong++;
+    }
+
+    return numWrong;
+}
+
+
+// Anything after the Sound's samples has to be the silence that fills the
+// rest of the last buffer.
+static bool IsSilentTail(int16_t const *out, int64_t startIdx, int64_t endIdx)
+{
+    if (endIdx - startIdx >= SoundDevice::MAX_SAMPLES_PER_BUFFER)
+        return false;
+
+    for (int64_t i = startIdx * 2; i < endIdx * 2; i++)
+    {
+        if (out[i] != 0)
+            return false;
+    }
+
+    return true;
+}
+
+
+int main()
+{
+    SampleKernelsInit();
+
+    WavFileSoundDevice *device = new WavFileSoundDevice(OUT_FILENAME, 0.0);
+    CHECK(device->IsOpen());
+    g_soundSystem = new SoundSystem(device);
+
+    // At the device's rate, so the samples are copied, not resampled.
+    s_samples = new int16_t[NUM_GROUPS * 2];
+    for (int64_t i = 0; i < NUM_GROUPS; i++)
+    {
+        s_samples[i * 2] = GetTestSample(i, 0);
+        s_samples[i * 2 + 1] = GetTestSample(i, 1);
+    }
+    Sound *sound = MakeTestSound(s_samples, 2, NUM_GROUPS, device->GetFreq());
+    g_soundSystem->PlaySound(&sound);
+
+    // A device without a clock pulls nothing until told to play.
+    for (int i = 0; i < 20; i++)
+    {
+        g_soundSystem->Advance();
+        SleepMillisec(1);
+    }
+    CHECK(device->GetNumSamplesPulled() == 0);
+
+    printf("Playing it all\n");
+    CHECK(PlayToEnd());
+    int64_t numOutGroups = 0;
+    int16_t *out = ReadOutput(&numOutGroups);
+    CHECK(out != NULL);
+    if (out)
+    {
+        CHECK(device->GetNumSamplesPulled() == numOutGroups);
+        CHECK(numOutGroups >= NUM_GROUPS);
+        if (numOutGroups >= NUM_GROUPS)
+        {
+            CHECK(CountWrongGroups(out, 0, 0, NUM_GROUPS) == 0);
+            CHECK(IsSilentTail(out, NUM_GROUPS, numOutGroups));
+        }
+        delete[] out;
+    }
+
+    printf("Playing from half way\n");
+    int64_t const seekIdx = NUM_GROUPS / 2;
+    int64_t numGroupsBefore = numOutGroups;
+    g_soundSystem->Seek(seekIdx);
+    CHECK(PlayToEnd());
+    out = ReadOutput(&numOutGroups);
+    CHECK(out != NULL);
+    if (out)
+    {
+        int64_t numExpected = NUM_GROUPS - seekIdx;
+        CHECK(numOutGroups >= numGroupsBefore + numExpected);
+        if (numOutGroups >= numGroupsBefore + numExpected)
+        {
+            CHECK(CountWrongGroups(out, numGroupsBefore, seekIdx, numExpected) == 0);
+            CHECK(IsSilentTail(out, numGroupsBefore + numExpected, numOutGroups));
+        }
+        delete[] out;
+    }
+
+    // Nothing reads the sound once the mixer has finished with its last
+    // snapshot of it.
+    g_soundSystem->ForgetSound();
+    double startTime = GetRealTime();
+    while (g_epochReclaimer.Reclaim() && GetRealTime() - startTime < MAX_PLAY_SECONDS)
+        SleepMillisec(1);
+    Sound *oldSound = sound;
+    sound = NULL;
+    delete oldSound;
+    delete[] s_samples;
+
+    return ReportChecks("wav_device_test");
+}